@@ -12,8 +12,17 @@
 extern "C" {
 #endif
 
+#if !defined(__KERNEL__) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define WALB_CHECKSUM_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /**
- * Calculate checksum incrementally.
+ * Calculate checksum incrementally (generic version).
+ *
+ * This is the reference implementation.
+ * All the other versions must return the same value.
  *
  * @sum previous checksum. specify 0 for first call.
  * @data pointer to u8 array to calculate
@@ -21,7 +30,7 @@ extern "C" {
  *
  * @return current checksum.
  */
-static inline u32 checksum_partial(u32 sum, const void *data, u32 size)
+static inline u32 checksum_partial_generic(u32 sum, const void *data, u32 size)
 {
 	u32 n = size / sizeof(u32);
 	u32 i;
@@ -39,6 +48,184 @@ static inline u32 checksum_partial(u32 sum, const void *data, u32 size)
 	return sum;
 }
 
+/**
+ * Calculate checksum incrementally (unrolled u64 version).
+ *
+ * The sum is modulo 2^32 so the lower and upper halves of
+ * each u64 word can be accumulated separately and folded at the end.
+ * Each accumulator is u64 and can not overflow for size < 4GiB.
+ */
+static inline u32 checksum_partial_u64(u32 sum, const void *data, u32 size)
+{
+	const u8 *p = (const u8 *)data;
+	u64 acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+	u32 n = size / (sizeof(u64) * 4);
+	u32 i;
+
+	ASSERT(size % sizeof(u32) == 0);
+
+	for (i = 0; i < n; i++) {
+		u64 buf[4];
+		memcpy(buf, p, sizeof(buf));
+		acc0 += (u32)buf[0];
+		acc1 += buf[0] >> 32;
+		acc2 += (u32)buf[1];
+		acc3 += buf[1] >> 32;
+		acc0 += (u32)buf[2];
+		acc1 += buf[2] >> 32;
+		acc2 += (u32)buf[3];
+		acc3 += buf[3] >> 32;
+		p += sizeof(buf);
+	}
+	sum += (u32)(acc0 + acc1 + acc2 + acc3);
+	return checksum_partial_generic(sum, p, size % (sizeof(u64) * 4));
+}
+
+/**
+ * Copy data and calculate its checksum incrementally in one pass.
+ *
+ * This returns the same value as checksum_partial(sum, src, size)
+ * and the data is read only once.
+ *
+ * @sum previous checksum. specify 0 for first call.
+ * @dst destination buffer. This must not overlap src.
+ * @src source buffer.
+ * @size data size in bytes. This must be dividable by sizeof(u32).
+ *
+ * @return current checksum.
+ */
+static inline u32 checksum_copy_partial(
+	u32 sum, void *dst, const void *src, u32 size)
+{
+	u8 *q = (u8 *)dst;
+	const u8 *p = (const u8 *)src;
+	u64 acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+	u32 n = size / (sizeof(u64) * 4);
+	u32 rem = size % (sizeof(u64) * 4);
+	u32 i;
+
+	ASSERT(size % sizeof(u32) == 0);
+
+	for (i = 0; i < n; i++) {
+		u64 buf[4];
+		memcpy(buf, p, sizeof(buf));
+		memcpy(q, buf, sizeof(buf));
+		acc0 += (u32)buf[0];
+		acc1 += buf[0] >> 32;
+		acc2 += (u32)buf[1];
+		acc3 += buf[1] >> 32;
+		acc0 += (u32)buf[2];
+		acc1 += buf[2] >> 32;
+		acc2 += (u32)buf[3];
+		acc3 += buf[3] >> 32;
+		p += sizeof(buf);
+		q += sizeof(buf);
+	}
+	sum += (u32)(acc0 + acc1 + acc2 + acc3);
+	memcpy(q, p, rem);
+	return checksum_partial_generic(sum, p, rem);
+}
+
+#ifdef WALB_CHECKSUM_X86_SIMD
+
+/**
+ * Calculate checksum incrementally (SSE2 version).
+ *
+ * Each 32bit lane is summed modulo 2^32 so
+ * the total of the lanes equals to the generic version.
+ */
+__attribute__((target("sse2")))
+static inline u32 checksum_partial_sse2(u32 sum, const void *data, u32 size)
+{
+	const u8 *p = (const u8 *)data;
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	u32 n = size / 32;
+	u32 lane[4];
+	u32 i;
+
+	ASSERT(size % sizeof(u32) == 0);
+
+	for (i = 0; i < n; i++) {
+		acc0 = _mm_add_epi32(acc0, _mm_loadu_si128((const __m128i *)p));
+		acc1 = _mm_add_epi32(acc1, _mm_loadu_si128((const __m128i *)(p + 16)));
+		p += 32;
+	}
+	_mm_storeu_si128((__m128i *)lane, _mm_add_epi32(acc0, acc1));
+	sum += lane[0] + lane[1] + lane[2] + lane[3];
+	return checksum_partial_generic(sum, p, size % 32);
+}
+
+/**
+ * Calculate checksum incrementally (AVX2 version).
+ */
+__attribute__((target("avx2")))
+static inline u32 checksum_partial_avx2(u32 sum, const void *data, u32 size)
+{
+	const u8 *p = (const u8 *)data;
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	u32 n = size / 64;
+	u32 lane[8];
+	u32 i;
+
+	ASSERT(size % sizeof(u32) == 0);
+
+	for (i = 0; i < n; i++) {
+		acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *)p));
+		acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+		p += 64;
+	}
+	_mm256_storeu_si256((__m256i *)lane, _mm256_add_epi32(acc0, acc1));
+	for (i = 0; i < 8; i++)
+		sum += lane[i];
+	return checksum_partial_generic(sum, p, size % 64);
+}
+
+#endif /* WALB_CHECKSUM_X86_SIMD */
+
+typedef u32 (*checksum_partial_fn_t)(u32, const void *, u32);
+
+/**
+ * Select the fastest checksum_partial implementation for the running cpu.
+ *
+ * The module uses checksum_partial_u64() always
+ * because it does not want to save/restore fpu context for each bio.
+ */
+static inline checksum_partial_fn_t checksum_partial_select(void)
+{
+#ifdef WALB_CHECKSUM_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return checksum_partial_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return checksum_partial_sse2;
+#endif
+	return checksum_partial_u64;
+}
+
+/**
+ * Calculate checksum incrementally.
+ *
+ * @sum previous checksum. specify 0 for first call.
+ * @data pointer to u8 array to calculate
+ * @size data size in bytes. This must be dividable by sizeof(u32).
+ *
+ * @return current checksum.
+ */
+static inline u32 checksum_partial(u32 sum, const void *data, u32 size)
+{
+#ifdef WALB_CHECKSUM_X86_SIMD
+	static checksum_partial_fn_t fn = NULL;
+
+	if (!fn)
+		fn = checksum_partial_select();
+	return fn(sum, data, size);
+#else
+	return checksum_partial_u64(sum, data, size);
+#endif
+}
+
 /**
  * Finish checksum.
  *
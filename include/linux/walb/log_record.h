@@ -15,6 +15,7 @@ extern "C" {
 #include "util.h"
 #include "u32bits.h"
 #include "checksum.h"
+#include "block_size.h"
 #if 0
 #include "logger.h"
 #endif
@@ -27,6 +28,8 @@ enum {
 	LOG_RECORD_EXIST = 0,
 	LOG_RECORD_PADDING, /* Non-zero if this is padding log */
 	LOG_RECORD_DISCARD, /* Discard IO */
+	LOG_RECORD_ZERO, /* Write IO of all-zero data without data area */
+	LOG_RECORD_WRITE_SAME, /* Write same IO with a logical block data area */
 };
 
 /**
@@ -50,14 +53,19 @@ struct walb_log_record {
 
 	/* IO size [logical sector].
 	 * A discard IO size can be UINT32_MAX,
-	 * while normal IO size must be less than UINT16_MAX. */
+	 * while normal IO size must be less than UINT16_MAX.
+	 * A write same record stores only its payload, one logical block,
+	 * which is repeated over io_size logical blocks. */
 	u32 io_size;
 
 	/* Local sequence id as the data offset in the log record.
 	   lsid - lsid_local is logpack lsid. */
 	u16 lsid_local;
 
-	u16 reserved1;
+	/* Data offset inside the physical block of lsid [logical block].
+	   Non-zero only in the packed log format,
+	   where the record shares the physical block with the previous record. */
+	u16 sub_offset;
 
 	/* Log sequence id of the record. */
 	u64 lsid;
@@ -65,9 +73,11 @@ struct walb_log_record {
 } __attribute__((packed));
 
 /**
- * Logpack header data inside sector.
+ * Logpack header data inside sector(s).
  *
  * sizeof(struct walb_logpack_header) <= walb_super_sector.sector_size.
+ * The header occupies n_header_pb physical blocks from logpack_lsid
+ * and the log data follows it.
  */
 struct walb_logpack_header {
 
@@ -79,7 +89,7 @@ struct walb_logpack_header {
 	u16 sector_type;
 
 	/* Total io size in the log pack [physical sector].
-	   Log pack size is total_io_size + 1.
+	   Log pack size is total_io_size + n_header_pb.
 	   Discard request's size is not included. */
 	u16 total_io_size;
 
@@ -93,7 +103,13 @@ struct walb_logpack_header {
 	/* Number of padding record. 0 or 1. */
 	u16 n_padding;
 
-	u32 reserved1;
+	/* Number of physical blocks of the logpack header [physical sector].
+	   0 means 1 for compatibility.
+	   Only WALB_LOG_VERSION_PACKED devices use more than 1
+	   (see WALB_LOGPACK_HEADER_MAX_SIZE). */
+	u16 n_header_pb;
+
+	u16 reserved1;
 
 	struct walb_log_record record[0];
 	/* continuous records */
@@ -107,6 +123,13 @@ struct walb_logpack_header {
 
 #define MAX_TOTAL_IO_SIZE_IN_LOGPACK_HEADER ((1U << 16) - 1)
 
+/**
+ * Maximum size of a multi-sector logpack header [byte].
+ * A header larger than a physical block never exceeds this,
+ * so it fits in a page and holds up to 127 records.
+ */
+#define WALB_LOGPACK_HEADER_MAX_SIZE 4096
+
 #define ASSERT_LOG_RECORD(rec) ASSERT(is_valid_log_record(rec))
 
 /**
@@ -126,9 +149,19 @@ struct walb_logpack_header {
  *******************************************************************************/
 
 static inline unsigned int max_n_log_record_in_sector(unsigned int pbs);
+static inline unsigned int max_n_log_record_in_header(
+	unsigned int pbs, unsigned int n_header_pb);
+static inline unsigned int max_logpack_header_size(unsigned int pbs);
+static inline unsigned int max_n_logpack_header_pb(unsigned int pbs);
+static inline unsigned int get_logpack_header_pb(
+	const struct walb_logpack_header *lhead);
 static inline void log_record_init(struct walb_log_record *rec);
 static inline int is_valid_log_record(struct walb_log_record *rec);
 static inline int is_valid_log_record_const(const struct walb_log_record *rec);
+static inline int log_record_has_data(const struct walb_log_record *rec);
+static inline unsigned int log_record_data_lb(const struct walb_log_record *rec);
+static inline unsigned int log_record_n_pb(
+	const struct walb_log_record *rec, unsigned int pbs);
 static inline int is_valid_logpack_header(const struct walb_logpack_header *lhead);
 static inline int is_valid_logpack_header_with_checksum(
 	const struct walb_logpack_header* lhead, unsigned int pbs, u32 salt);
@@ -148,11 +181,52 @@ static inline u64 get_next_lsid(const struct walb_logpack_header *lhead);
  */
 static inline unsigned int max_n_log_record_in_sector(unsigned int pbs)
 {
-	ASSERT(pbs > sizeof(struct walb_logpack_header));
-	return (pbs - sizeof(struct walb_logpack_header)) /
+	return max_n_log_record_in_header(pbs, 1);
+}
+
+/**
+ * Get number of log records that a multi-sector logpack header can store.
+ * @pbs physical block size.
+ * @n_header_pb number of physical blocks of the header.
+ */
+static inline unsigned int max_n_log_record_in_header(
+	unsigned int pbs, unsigned int n_header_pb)
+{
+	const unsigned int size = pbs * n_header_pb;
+
+	ASSERT(size > sizeof(struct walb_logpack_header));
+	return (size - sizeof(struct walb_logpack_header)) /
 		sizeof(struct walb_log_record);
 }
 
+/**
+ * Get buffer size to store any logpack header [byte].
+ * @pbs physical block size.
+ */
+static inline unsigned int max_logpack_header_size(unsigned int pbs)
+{
+	return pbs < WALB_LOGPACK_HEADER_MAX_SIZE ?
+		WALB_LOGPACK_HEADER_MAX_SIZE : pbs;
+}
+
+/**
+ * Get maximum number of physical blocks of a logpack header.
+ * @pbs physical block size.
+ */
+static inline unsigned int max_n_logpack_header_pb(unsigned int pbs)
+{
+	return max_logpack_header_size(pbs) / pbs;
+}
+
+/**
+ * Get number of physical blocks of a logpack header.
+ */
+static inline unsigned int get_logpack_header_pb(
+	const struct walb_logpack_header *lhead)
+{
+	return lhead->n_header_pb == 0 ? 1 : lhead->n_header_pb;
+}
+
 /**
  * Initialize a log record.
  */
@@ -169,16 +243,34 @@ static inline void log_record_init(struct walb_log_record *rec)
  */
 static inline int is_valid_log_record(struct walb_log_record *rec)
 {
+	u32 flags;
+
 	CHECKd(rec);
-	CHECKd(test_bit_u32(LOG_RECORD_EXIST, &rec->flags));
-	if (!test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
+	/* Copy it to avoid taking the address of a packed member. */
+	flags = rec->flags;
+	CHECKd(test_bit_u32(LOG_RECORD_EXIST, &flags));
+	if (!test_bit_u32(LOG_RECORD_PADDING, &flags)) {
 		CHECKd(rec->io_size > 0);
 	}
-	if (!test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
+	if (!test_bit_u32(LOG_RECORD_DISCARD, &flags)) {
 		CHECKd(rec->io_size <= WALB_MAX_NORMAL_IO_SECTORS);
 	}
 	CHECKd(rec->lsid_local > 0);
 	CHECKd(rec->lsid <= MAX_LSID);
+	if (rec->sub_offset > 0) {
+		CHECKd(!test_bit_u32(LOG_RECORD_PADDING, &flags));
+		CHECKd(!test_bit_u32(LOG_RECORD_DISCARD, &flags));
+		CHECKd(!test_bit_u32(LOG_RECORD_ZERO, &flags));
+	}
+	if (test_bit_u32(LOG_RECORD_ZERO, &flags)) {
+		CHECKd(!test_bit_u32(LOG_RECORD_PADDING, &flags));
+		CHECKd(!test_bit_u32(LOG_RECORD_DISCARD, &flags));
+	}
+	if (test_bit_u32(LOG_RECORD_WRITE_SAME, &flags)) {
+		CHECKd(!test_bit_u32(LOG_RECORD_PADDING, &flags));
+		CHECKd(!test_bit_u32(LOG_RECORD_DISCARD, &flags));
+		CHECKd(!test_bit_u32(LOG_RECORD_ZERO, &flags));
+	}
 
 	return 1; /* valid */
 error:
@@ -191,6 +283,66 @@ static inline int is_valid_log_record_const(
 	return is_valid_log_record((struct walb_log_record *)rec);
 }
 
+/**
+ * Check a log record has its data area in the logpack.
+ * Discard and zero records have no data.
+ *
+ * @return Non-zero if the record has data, or 0.
+ */
+static inline int log_record_has_data(const struct walb_log_record *rec)
+{
+	const u32 flags = rec->flags;
+
+	return !test_bit_u32(LOG_RECORD_DISCARD, &flags) &&
+		!test_bit_u32(LOG_RECORD_ZERO, &flags);
+}
+
+/**
+ * Get size of the data area of a log record [logical block].
+ *
+ * RETURN:
+ *   0 for discard and zero records, 1 for write same records,
+ *   or rec->io_size.
+ */
+static inline unsigned int log_record_data_lb(const struct walb_log_record *rec)
+{
+	const u32 flags = rec->flags;
+
+	if (!log_record_has_data(rec))
+		return 0;
+	if (test_bit_u32(LOG_RECORD_WRITE_SAME, &flags))
+		return 1;
+	return rec->io_size;
+}
+
+/**
+ * Get number of physical blocks a log record adds to the logpack data.
+ *
+ * A record with non-zero sub_offset starts inside
+ * the last physical block of the previous record,
+ * which is not counted again.
+ *
+ * @rec log record.
+ * @pbs physical block size [byte].
+ *
+ * RETURN:
+ *   number of physical blocks. 0 for discard and zero records.
+ */
+static inline unsigned int log_record_n_pb(
+	const struct walb_log_record *rec, unsigned int pbs)
+{
+	unsigned int n_pb;
+
+	if (!log_record_has_data(rec))
+		return 0;
+
+	n_pb = (unsigned int)capacity_pb(
+		pbs, rec->sub_offset + log_record_data_lb(rec));
+	if (rec->sub_offset > 0)
+		n_pb--;
+	return n_pb;
+}
+
 /**
  * Check a logpack header block is end.
  *
@@ -229,7 +381,8 @@ static inline int is_valid_logpack_header(
 
 		/* logpack_lsid overflow check. */
 		CHECKd(lhead->logpack_lsid <
-			lhead->logpack_lsid + 1 + lhead->total_io_size);
+			lhead->logpack_lsid + get_logpack_header_pb(lhead)
+			+ lhead->total_io_size);
 	}
 	return 1;
 error:
@@ -246,17 +399,22 @@ error:
  * Check validness of a logpack header.
  *
  * @logpack logpack to be checked.
+ *   All the get_logpack_header_pb(lhead) blocks must have been read.
  * @pbs physical block size.
- *   (This is logpack header size.)
  *
  * @return Non-zero in success, or 0.
  */
 static inline int is_valid_logpack_header_with_checksum(
 	const struct walb_logpack_header* lhead, unsigned int pbs, u32 salt)
 {
+	const unsigned int n_pb = get_logpack_header_pb(lhead);
+
 	CHECKld(error0, is_valid_logpack_header(lhead));
+	CHECKld(error0, n_pb <= max_n_logpack_header_pb(pbs));
 	if (lhead->n_records > 0) {
-		CHECKld(error1, checksum((const u8 *)lhead, pbs, salt) == 0);
+		CHECKld(error0, lhead->n_records
+			<= max_n_log_record_in_header(pbs, n_pb));
+		CHECKld(error1, checksum((const u8 *)lhead, pbs * n_pb, salt) == 0);
 	}
 	return 1;
 error0:
@@ -306,10 +464,8 @@ static inline int is_valid_logpack_header_and_records(
 static inline int is_valid_logpack_header_and_records_with_checksum(
 	const struct walb_logpack_header* lhead, unsigned int pbs, u32 salt)
 {
-	if (lhead->n_records > 0) {
-		if (checksum((const u8 *)lhead, pbs, salt) != 0) {
-			return 0;
-		}
+	if (!is_valid_logpack_header_with_checksum(lhead, pbs, salt)) {
+		return 0;
 	}
 	return is_valid_logpack_header_and_records(lhead);
 }
@@ -324,7 +480,8 @@ static inline u64 get_next_lsid_unsafe(const struct walb_logpack_header *lhead)
 		/* Zero-flush only. */
 		return lhead->logpack_lsid;
 	}
-	return lhead->logpack_lsid + 1 + lhead->total_io_size;
+	return lhead->logpack_lsid + get_logpack_header_pb(lhead)
+		+ lhead->total_io_size;
 }
 
 /**
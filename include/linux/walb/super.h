@@ -131,7 +131,7 @@ static inline int is_valid_super_sector_raw(
 	/* sector type */
 	CHECKd(sect->sector_type == SECTOR_TYPE_SUPER);
 	/* version */
-	CHECKd(sect->version == WALB_LOG_VERSION);
+	CHECKd(is_valid_log_version(sect->version));
 	/* block size */
 	CHECKd(sect->physical_bs == pbs);
 	CHECKd(sect->physical_bs >= sect->logical_bs);
@@ -20,8 +20,29 @@ extern "C" {
  * ver2
  *   enlarge max IO size to 32bit from 16bit unsigned int.
  *   Still max IO size with data is limited to 16bit due to other reasons.
+ * ver3
+ *   log records smaller than a physical block can be packed
+ *   inside a physical block shared with the previous record
+ *   (see walb_log_record.sub_offset).
+ *   a logpack header can occupy multiple physical blocks
+ *   up to WALB_LOGPACK_HEADER_MAX_SIZE bytes
+ *   (see walb_logpack_header.n_header_pb).
+ *   all-zero writes are logged as records without data area
+ *   (see LOG_RECORD_ZERO).
+ *   write same IOs are logged with their one logical block payload
+ *   (see LOG_RECORD_WRITE_SAME).
+ *   Devices formatted with ver2 keep the unpacked layout.
  */
 #define WALB_LOG_VERSION 2
+#define WALB_LOG_VERSION_PACKED 3
+
+/**
+ * Check a log device format version is supported.
+ */
+static inline int is_valid_log_version(unsigned int version)
+{
+	return version == WALB_LOG_VERSION || version == WALB_LOG_VERSION_PACKED;
+}
 
 /**
  * Maximum IO size [logical block or sector].
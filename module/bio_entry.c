@@ -7,6 +7,8 @@
 #include "check_kernel.h"
 #include <linux/module.h>
 #include <linux/list.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
 #include "bio_entry.h"
 #include "bio_util.h"
 #include "linux/walb/common.h"
@@ -48,18 +50,57 @@ static atomic_t shared_cnt_ = ATOMIC_INIT(0);
 static atomic_t n_allocated_pages_ = ATOMIC_INIT(0);
 #endif
 
+/*
+ * Page pool for bio_alloc_with_pages().
+ *
+ * Freed pages are kept in a small per-cpu cache first.
+ * Pages that overflow the cache go back to page_pool_,
+ * which keeps at least page_pool_reserve_ pages
+ * so that GFP_NOIO allocations always make forward progress.
+ */
+#define PAGE_POOL_PCPU_SIZE 64
+
+struct page_pool_pcpu
+{
+	unsigned int n_pages;
+	struct page *pages[PAGE_POOL_PCPU_SIZE];
+	u64 n_hit; /* allocated from the per-cpu cache. */
+	u64 n_miss; /* allocated from page_pool_. */
+};
+
+static struct page_pool_pcpu __percpu *page_pool_pcpu_ = NULL;
+static mempool_t *page_pool_ = NULL;
+
+static unsigned int page_pool_reserve_ = 256;
+module_param_named(page_pool_reserve, page_pool_reserve_, uint, S_IRUGO);
+
 /*******************************************************************************
  * Static functions definition.
  *******************************************************************************/
 
 /**
  * Page allocator with counter.
+ *
+ * This never fails if gfp_mask allows blocking.
  */
 static inline struct page* alloc_page_inc(gfp_t gfp_mask)
 {
-	struct page *p;
+	struct page_pool_pcpu *pcpu;
+	struct page *p = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pcpu = this_cpu_ptr(page_pool_pcpu_);
+	if (pcpu->n_pages > 0) {
+		p = pcpu->pages[--pcpu->n_pages];
+		pcpu->n_hit++;
+	} else {
+		pcpu->n_miss++;
+	}
+	local_irq_restore(flags);
 
-	p = alloc_page(gfp_mask);
+	if (!p)
+		p = mempool_alloc(page_pool_, gfp_mask);
 #ifdef WALB_DEBUG
 	if (p)
 		atomic_inc(&n_allocated_pages_);
@@ -72,14 +113,76 @@ static inline struct page* alloc_page_inc(gfp_t gfp_mask)
  */
 static inline void free_page_dec(struct page *page)
 {
+	struct page_pool_pcpu *pcpu;
+	bool cached = false;
+	unsigned long flags;
+
 	ASSERT(page);
-	__free_page(page);
+	local_irq_save(flags);
+	pcpu = this_cpu_ptr(page_pool_pcpu_);
+	if (pcpu->n_pages < PAGE_POOL_PCPU_SIZE) {
+		pcpu->pages[pcpu->n_pages++] = page;
+		cached = true;
+	}
+	local_irq_restore(flags);
+
+	if (!cached)
+		mempool_free(page, page_pool_);
 #ifdef WALB_DEBUG
 	atomic_dec(&n_allocated_pages_);
 #endif
 }
 
+/**
+ * Create the page pool.
+ */
+static bool page_pool_init(void)
+{
+	int cpu;
+
+	page_pool_pcpu_ = alloc_percpu(struct page_pool_pcpu);
+	if (!page_pool_pcpu_)
+		goto error0;
+	for_each_possible_cpu(cpu) {
+		struct page_pool_pcpu *pcpu = per_cpu_ptr(page_pool_pcpu_, cpu);
+		pcpu->n_pages = 0;
+		pcpu->n_hit = 0;
+		pcpu->n_miss = 0;
+	}
+
+	page_pool_ = mempool_create_page_pool(max_t(int, page_pool_reserve_, 1), 0);
+	if (!page_pool_)
+		goto error1;
+	return true;
+
+error1:
+	free_percpu(page_pool_pcpu_);
+	page_pool_pcpu_ = NULL;
+error0:
+	return false;
+}
+
+/**
+ * Release all pages in the page pool and destroy it.
+ */
+static void page_pool_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct page_pool_pcpu *pcpu = per_cpu_ptr(page_pool_pcpu_, cpu);
+		while (pcpu->n_pages > 0)
+			mempool_free(pcpu->pages[--pcpu->n_pages], page_pool_);
+	}
+	mempool_destroy(page_pool_);
+	page_pool_ = NULL;
+	free_percpu(page_pool_pcpu_);
+	page_pool_pcpu_ = NULL;
+}
+
 static void bio_entry_end_io(struct bio *bio);
+static void bio_copy_write_same_payload(
+	struct bio *dst, struct bio *src, u32 salt, u32 *csump);
 
 /*******************************************************************************
  * Global functions definition.
@@ -257,10 +360,45 @@ void bio_put_with_pages(struct bio *bio)
 	bio_put(bio);
 }
 
+/**
+ * Copy the payload of a write same bio.
+ *
+ * @dst destination bio with a page for the payload.
+ * @src write same bio.
+ * @salt checksum salt.
+ * @csump if not NULL, checksum of the payload will be set.
+ */
+static void bio_copy_write_same_payload(
+	struct bio *dst, struct bio *src, u32 salt, u32 *csump)
+{
+	const struct bio_vec sv = bio_iovec(src);
+	const struct bio_vec *dv = &dst->bi_io_vec[0];
+	u8 *src_p, *dst_p;
+
+	ASSERT(dst->bi_vcnt == 1);
+	ASSERT(dv->bv_len == sv.bv_len);
+
+	src_p = (u8 *)kmap_atomic(sv.bv_page);
+	dst_p = (u8 *)kmap_atomic(dv->bv_page);
+	memcpy(dst_p + dv->bv_offset, src_p + sv.bv_offset, sv.bv_len);
+	if (csump)
+		*csump = checksum(dst_p + dv->bv_offset, sv.bv_len, salt);
+	kunmap_atomic(dst_p);
+	kunmap_atomic(src_p);
+}
+
 /**
  * Create a copy of a write bio.
+ * Only the payload of a write same bio is copied.
+ *
+ * @bio original bio.
+ * @salt checksum salt.
+ * @csump if not NULL, checksum of the data will be set,
+ *   which is calculated while copying.
+ * @gfp_mask for memory allocation.
  */
-struct bio* bio_deep_clone(struct bio *bio, gfp_t gfp_mask)
+struct bio* bio_deep_clone(
+	struct bio *bio, u32 salt, u32 *csump, gfp_t gfp_mask)
 {
 	uint size;
 	struct bio *clone;
@@ -269,10 +407,12 @@ struct bio* bio_deep_clone(struct bio *bio, gfp_t gfp_mask)
 	ASSERT(bio->bi_rw & REQ_WRITE);
 	ASSERT(!bio->bi_next);
 
-	if (bio_has_data(bio))
-		size = bio->bi_iter.bi_size;
-	else
+	if (!bio_has_data(bio))
 		size = 0;
+	else if (bio->bi_rw & REQ_WRITE_SAME)
+		size = bio_iovec(bio).bv_len; /* payload only. */
+	else
+		size = bio->bi_iter.bi_size;
 
 	clone = bio_alloc_with_pages(size, bio->bi_bdev, gfp_mask);
 	if (!clone)
@@ -284,12 +424,87 @@ struct bio* bio_deep_clone(struct bio *bio, gfp_t gfp_mask)
 	if (size == 0) {
 		/* This is for discard IOs. */
 		clone->bi_iter.bi_size = bio->bi_iter.bi_size;
+		if (csump)
+			*csump = 0;
+	} else if (bio->bi_rw & REQ_WRITE_SAME) {
+		/* The payload covers the whole range as the original. */
+		bio_copy_write_same_payload(clone, bio, salt, csump);
+		clone->bi_iter.bi_size = bio->bi_iter.bi_size;
+	} else if (csump) {
+		*csump = bio_copy_data_and_checksum(clone, bio, salt);
 	} else {
 		bio_copy_data(clone, bio);
 	}
 	return clone;
 }
 
+/**
+ * Create a copy of a write bio whose data are all zero.
+ * The copy shares ZERO_PAGE instead of having its own pages,
+ * so it must be put with bio_put(), not bio_put_with_pages().
+ * Only the payload of a write same bio is kept as bio_deep_clone().
+ *
+ * @bio original bio. It must have data.
+ * @gfp_mask for memory allocation.
+ */
+struct bio* bio_zero_clone(struct bio *bio, gfp_t gfp_mask)
+{
+	uint size, rest;
+	struct bio *clone;
+
+	ASSERT(bio);
+	ASSERT(bio->bi_rw & REQ_WRITE);
+	ASSERT(bio_has_data(bio));
+	ASSERT(!(bio->bi_rw & REQ_DISCARD));
+
+	if (bio->bi_rw & REQ_WRITE_SAME)
+		size = bio_iovec(bio).bv_len; /* payload only. */
+	else
+		size = bio->bi_iter.bi_size;
+
+	clone = bio_alloc(gfp_mask, DIV_ROUND_UP(size, PAGE_SIZE));
+	if (!clone)
+		return NULL;
+
+	clone->bi_bdev = bio->bi_bdev;
+	clone->bi_rw = bio->bi_rw;
+	clone->bi_iter.bi_sector = bio->bi_iter.bi_sector;
+	rest = size;
+	while (rest > 0) {
+		const uint len = min_t(uint, rest, PAGE_SIZE);
+		UNUSED int ret = bio_add_page(clone, ZERO_PAGE(0), len, 0);
+		ASSERT(ret == len);
+		rest -= len;
+	}
+	/* The payload of a write same bio covers the whole range. */
+	clone->bi_iter.bi_size = bio->bi_iter.bi_size;
+	return clone;
+}
+
+/**
+ * Get statistics of the page pool.
+ * The values are not strictly consistent with each other.
+ */
+void bio_entry_get_page_pool_stat(struct page_pool_stat *stat)
+{
+	int cpu;
+
+	ASSERT(stat);
+	memset(stat, 0, sizeof(*stat));
+	if (atomic_read(&shared_cnt_) <= 0)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		const struct page_pool_pcpu *pcpu =
+			per_cpu_ptr(page_pool_pcpu_, cpu);
+		stat->n_hit += READ_ONCE(pcpu->n_hit);
+		stat->n_miss += READ_ONCE(pcpu->n_miss);
+		stat->n_cached += READ_ONCE(pcpu->n_pages);
+	}
+	stat->n_reserved = READ_ONCE(page_pool_->curr_nr);
+	stat->min_reserved = page_pool_->min_nr;
+}
+
 /**
  * Initilaize bio_entry cache.
  */
@@ -297,6 +512,11 @@ bool bio_entry_init(void)
 {
 	int cnt;
 	cnt = atomic_inc_return(&shared_cnt_);
+	if (cnt == 1 && !page_pool_init()) {
+		LOGe("page pool initialization failed.\n");
+		atomic_dec(&shared_cnt_);
+		return false;
+	}
 	return true;
 }
 
@@ -320,6 +540,8 @@ void bio_entry_exit(void)
 			LOGw("n_allocated_pages %u\n", nr);
 	}
 #endif
+	if (cnt == 0)
+		page_pool_exit();
 }
 
 MODULE_LICENSE("Dual BSD/GPL");
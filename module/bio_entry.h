@@ -55,7 +55,23 @@ void wait_for_bio_entry(struct bio_entry *bioe, ulong timeoutMs);
 struct bio* bio_alloc_with_pages(
 	uint sectors, struct block_device *bdev, gfp_t gfp_mask);
 void bio_put_with_pages(struct bio *bio);
-struct bio* bio_deep_clone(struct bio *bio, gfp_t gfp_mask);
+struct bio* bio_deep_clone(
+	struct bio *bio, u32 salt, u32 *csump, gfp_t gfp_mask);
+struct bio* bio_zero_clone(struct bio *bio, gfp_t gfp_mask);
+
+/*
+ * Statistics of the page pool used by bio_alloc_with_pages().
+ */
+struct page_pool_stat
+{
+	u64 n_hit; /* number of allocations from per-cpu caches. */
+	u64 n_miss; /* number of allocations from the mempool. */
+	unsigned int n_cached; /* number of pages in per-cpu caches. */
+	unsigned int n_reserved; /* number of pages reserved in the mempool. */
+	unsigned int min_reserved; /* minimum number of reserved pages. */
+};
+
+void bio_entry_get_page_pool_stat(struct page_pool_stat *stat);
 
 /********************************************************************************
  * Init/exit.
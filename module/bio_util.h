@@ -77,6 +77,9 @@ static inline u32 bio_calc_checksum_iter(const struct bio *bio, struct bvec_iter
 
 	if (iter.bi_size == 0 || (biox->bi_rw & REQ_DISCARD))
 		return 0;
+	/* Only the payload of a write same bio is logged. */
+	if (biox->bi_rw & REQ_WRITE_SAME)
+		iter.bi_size = bio_iter_len(bio, iter);
 
 	__bio_for_each_segment(bvec, biox, iterx, iter) {
 		const uint len = bio_iter_len(bio, iterx);
@@ -95,6 +98,47 @@ static inline u32 bio_calc_checksum(const struct bio *bio, u32 salt)
 	return bio_calc_checksum_iter(bio, bio->bi_iter, salt);
 }
 
+/**
+ * Check whether all the data of a bio_vec are zero.
+ */
+static inline bool bvec_is_zero(const struct bio_vec *bvec)
+{
+	u8 *buf = (u8 *)kmap_atomic(bvec->bv_page);
+	const bool is_zero = !memchr_inv(buf + bvec->bv_offset, 0, bvec->bv_len);
+
+	kunmap_atomic(buf);
+	return is_zero;
+}
+
+/**
+ * Check whether all the data of a bio are zero.
+ * memchr_inv() compares word by word and
+ * returns at the first non-zero word, so non-zero data are cheap.
+ *
+ * RETURN:
+ *   true if the bio has data and they are all zero.
+ */
+static inline bool bio_is_zero(const struct bio *bio)
+{
+	struct bio *biox = (struct bio *)bio;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	if (!bio_has_data(biox) || (biox->bi_rw & REQ_DISCARD))
+		return false;
+	/* The payload of a write same bio is repeated. */
+	if (biox->bi_rw & REQ_WRITE_SAME) {
+		bvec = bio_iovec(biox);
+		return bvec_is_zero(&bvec);
+	}
+
+	bio_for_each_segment(bvec, biox, iter) {
+		if (!bvec_is_zero(&bvec))
+			return false;
+	}
+	return true;
+}
+
 #define SNPRINT_BIO_PROCEED(buf, size, w, s) do {			\
 		if (s < 0) {						\
 			pr_warning("snprint_bio: snprintf failed\n");	\
@@ -431,6 +475,56 @@ static inline uint bio_copy_data_partial(
 	return sectors - (remaining >> 9);
 }
 
+/**
+ * Copy whole bio data and calculate its checksum in one pass.
+ *
+ * @dst_bio written bio.
+ * @src_bio read bio. It must not be a discard bio.
+ * @salt checksum salt.
+ *
+ * RETURN:
+ *   checksum of the copied data, which is the same as
+ *   bio_calc_checksum(src_bio, salt).
+ */
+static inline u32 bio_copy_data_and_checksum(
+	struct bio *dst_bio, struct bio *src_bio, u32 salt)
+{
+	struct bvec_iter src_iter = src_bio->bi_iter;
+	struct bvec_iter dst_iter = dst_bio->bi_iter;
+	u32 sum = salt;
+
+	ASSERT(!(src_bio->bi_rw & REQ_DISCARD));
+	ASSERT(src_iter.bi_size == dst_iter.bi_size);
+
+	if (src_iter.bi_size == 0)
+		return 0;
+
+	while (src_iter.bi_size && dst_iter.bi_size) {
+		struct page *src_page, *dst_page;
+		u8 *src_p, *dst_p;
+		uint src_off, dst_off, bytes;
+
+		src_off = bio_iter_offset(src_bio, src_iter);
+		dst_off = bio_iter_offset(dst_bio, dst_iter);
+		src_page = bio_iter_page(src_bio, src_iter);
+		dst_page = bio_iter_page(dst_bio, dst_iter);
+		bytes = min(bio_iter_len(src_bio, src_iter),
+			bio_iter_len(dst_bio, dst_iter));
+
+		src_p = (u8 *)kmap_atomic(src_page);
+		dst_p = (u8 *)kmap_atomic(dst_page);
+		sum = checksum_copy_partial(
+			sum, dst_p + dst_off, src_p + src_off, bytes);
+		kunmap_atomic(dst_p);
+		kunmap_atomic(src_p);
+
+		bio_advance_iter(src_bio, &src_iter, bytes);
+		bio_advance_iter(dst_bio, &dst_iter, bytes);
+	}
+
+	return checksum_finish(sum);
+}
+
 #define bio_list_for_each_safe(bio, n, bl)				\
 	for (bio = (bl)->head, n = (bio ? bio->bi_next : NULL);		\
 	     bio; bio = n, n = (n ? n->bi_next : NULL))
@@ -152,10 +152,17 @@ void init_bio_wrapper(struct bio_wrapper *biow, struct bio *bio)
 	biow->error = 0;
 	biow->csum = 0;
 	biow->private_data = NULL;
+	biow->pack = NULL;
 	init_completion(&biow->done);
 	biow->flags = 0;
 	biow->lsid = 0;
+	biow->sub_offset = 0;
 	biow->copied_bio = NULL;
+	biow->spilled_pos = 0;
+	biow->lat_begin_ns = 0;
+	biow->lat_prev_ns = 0;
+	biow->orig_end_io = NULL;
+	biow->orig_private = NULL;
 
 	if (bio) {
 		biow->bio = bio;
@@ -164,6 +171,9 @@ void init_bio_wrapper(struct bio_wrapper *biow, struct bio *bio)
 		if (bio->bi_rw & REQ_DISCARD) {
 			set_bit(BIO_WRAPPER_DISCARD, &biow->flags);
 		}
+		if (bio->bi_rw & REQ_WRITE_SAME) {
+			set_bit(BIO_WRAPPER_WRITE_SAME, &biow->flags);
+		}
 	} else {
 		biow->bio = NULL;
 		biow->pos = 0;
@@ -203,16 +213,105 @@ void destroy_bio_wrapper(struct bio_wrapper *biow)
 	if (bio_entry_exists(&biow->cloned_bioe))
 		fin_bio_entry(&biow->cloned_bioe);
 
-	if (biow->copied_bio)
-		bio_put_with_pages(biow->copied_bio);
+	if (biow->copied_bio) {
+		if (bio_wrapper_state_is_zero_copy(biow) ||
+			bio_wrapper_state_is_zero(biow))
+			bio_put(biow->copied_bio);
+		else
+			bio_put_with_pages(biow->copied_bio);
+	}
 
 	kmem_cache_free(bio_wrapper_cache_, biow);
 }
 
+/**
+ * Prepare biow->copied_bio from biow->bio
+ * and calculate biow->csum for its log record.
+ *
+ * @biow bio wrapper of a write IO. biow->bio must be set.
+ * @zero_copy
+ *   if true, the copied bio shares pages with the original bio
+ *   and BIO_WRAPPER_ZERO_COPY will be set.
+ *   The caller must then keep the original bio alive
+ *   until IOs for both the log and data devices have completed.
+ *   Discard IOs are always deep-cloned because they have no pages.
+ *   Write same IOs are also deep-cloned because only the payload is kept.
+ *   If BIO_WRAPPER_ZERO has been set, the copied bio shares ZERO_PAGE
+ *   and neither copy nor checksum is done
+ *   because zero records have no data in the log.
+ * @salt log checksum salt.
+ *   The checksum is calculated while copying the data
+ *   so the data are read only once.
+ * @gfp_mask for memory allocation.
+ *
+ * RETURN:
+ *   true in success, false in failure due to memory allocation.
+ */
+bool bio_wrapper_prepare_copied_bio(
+	struct bio_wrapper *biow, bool zero_copy, u32 salt, gfp_t gfp_mask)
+{
+	struct bio *bio = biow->bio;
+
+	ASSERT(bio);
+	ASSERT(bio->bi_rw & REQ_WRITE);
+	ASSERT(!biow->copied_bio);
+
+	if (bio_wrapper_state_is_zero(biow)) {
+		biow->copied_bio = bio_zero_clone(bio, gfp_mask);
+		biow->csum = 0;
+		return biow->copied_bio != NULL;
+	}
+	if (zero_copy && bio_has_data(bio) &&
+		!(bio->bi_rw & (REQ_DISCARD | REQ_WRITE_SAME))) {
+		biow->copied_bio = bio_clone(bio, gfp_mask);
+		if (!biow->copied_bio)
+			return false;
+		set_bit(BIO_WRAPPER_ZERO_COPY, &biow->flags);
+		biow->csum = bio_calc_checksum(bio, salt);
+		return true;
+	}
+	biow->copied_bio = bio_deep_clone(bio, salt, &biow->csum, gfp_mask);
+	return biow->copied_bio != NULL;
+}
+
+/**
+ * Whether a bio of a read bio_wrapper has been filled by
+ * bio_wrapper_copy_overlapped() or redirected to the log device by it.
+ */
+static bool is_overlapped_bio_claimed(
+	const struct bio *bio, const struct block_device *ldev)
+{
+	return bio_private_lsb_get(bio) || (ldev && bio->bi_bdev == ldev);
+}
+
+/**
+ * Claim a bio of a read bio_wrapper for a source bio_wrapper.
+ *
+ * If the source is spilled, the bio is redirected to its data
+ * in the log device. Otherwise the data has been copied already,
+ * and the least significant bit (LSB) of bio->bi_private will be set.
+ */
+static void claim_overlapped_bio(
+	struct bio *bio, const struct bio_wrapper *src,
+	struct block_device *ldev)
+{
+	if (bio_wrapper_state_is_spilled(src)) {
+		ASSERT(src->pos <= bio->bi_iter.bi_sector);
+		bio->bi_iter.bi_sector =
+			src->spilled_pos + (bio->bi_iter.bi_sector - src->pos);
+		bio->bi_bdev = ldev;
+	} else {
+		bio_private_lsb_set(bio);
+	}
+}
+
 /**
  * Copy data from a source bio_wrapper to a destination bio_wrapper.
  * Do not call this function if they are not overlapped.
  *
+ * Call this for newer sources first.
+ * Ranges that have been claimed by a newer source are skipped.
+ *
  * @dst destination bio_wrapper.
  *     This function modifies dst->cloned_bio_list
  *     and may split bios in the list at overlapped borders.
@@ -223,6 +322,11 @@ void destroy_bio_wrapper(struct bio_wrapper *biow)
  * @src source bio_wrapper.
  *     This uses src->cloned_bioe.bio and src->cloned_bioe.iter.
  *     This function does not modify them.
+ *     If src is spilled, overlapped bio(s) of dst are redirected
+ *     to the log device instead of copying, and they must be submitted.
+ *     A write same source repeats its payload while copying
+ *     because bio_advance_iter() does not advance its bio_vec.
+ * @ldev log device.
  * @gfp_mask for memory allocation in bio split.
  *
  * RETURN:
@@ -230,38 +334,62 @@ void destroy_bio_wrapper(struct bio_wrapper *biow)
  *   or false (due to memory allocation failure).
  */
 bool bio_wrapper_copy_overlapped(
-	struct bio_wrapper *dst, struct bio_wrapper *src, gfp_t gfp_mask)
+	struct bio_wrapper *dst, struct bio_wrapper *src,
+	struct block_device *ldev, gfp_t gfp_mask)
 {
+	const bool is_spilled = bio_wrapper_state_is_spilled(src);
 	struct bio *src_bio = src->cloned_bioe.bio;
 	struct bio_list *dst_list = &dst->cloned_bio_list;
 	struct bio *dst_bio, *prev_bio = NULL, *next_bio;
+	struct bvec_iter src_iter0;
 
-	ASSERT(src_bio);
+	ASSERT(is_spilled || src_bio);
 	ASSERT(bio_wrapper_is_overlap(dst, src));
 	ASSERT(!bio_list_empty(dst_list));
 
+	if (is_spilled) {
+		memset(&src_iter0, 0, sizeof(src_iter0));
+		src_iter0.bi_sector = src->pos;
+		src_iter0.bi_size = src->len << 9;
+	} else {
+		src_iter0 = src->cloned_bioe.iter;
+	}
+
 	bio_list_for_each_safe(dst_bio, next_bio, dst_list) {
 		struct bvec_iter dst_iter = dst_bio->bi_iter;
-		struct bvec_iter src_iter = src->cloned_bioe.iter;
-		uint sectors, written;
+		struct bvec_iter src_iter = src_iter0;
+		uint sectors;
 		struct bio *split0 = NULL, *split1 = NULL;
 
-		if (!bvec_iter_is_overlap(&dst_iter, &src_iter)) {
+		if (is_overlapped_bio_claimed(dst_bio, ldev) ||
+			!bvec_iter_is_overlap(&dst_iter, &src_iter)) {
 			prev_bio = dst_bio;
 			continue;
 		}
 
-		bio_get_overlapped(
-			dst_bio, &dst_iter,
-			src_bio, &src_iter, &sectors);
+		if (is_spilled) {
+			/* There is no data to copy. */
+			const sector_t begin =
+				max(dst_iter.bi_sector, src_iter.bi_sector);
+			const sector_t end = min(
+				dst_iter.bi_sector + (dst_iter.bi_size >> 9),
+				src_iter.bi_sector + (src_iter.bi_size >> 9));
+			bio_advance_iter(dst_bio, &dst_iter,
+					(begin - dst_iter.bi_sector) << 9);
+			sectors = end - begin;
+		} else {
+			UNUSED uint written;
+			bio_get_overlapped(
+				dst_bio, &dst_iter,
+				src_bio, &src_iter, &sectors);
+			ASSERT((src_iter.bi_size >> 9) >= sectors);
+			written = bio_copy_data_partial(
+				dst_bio, dst_iter,
+				src_bio, src_iter, sectors);
+			ASSERT(written == sectors);
+		}
 		ASSERT(sectors > 0);
 		ASSERT((dst_iter.bi_size >> 9) >= sectors);
-		ASSERT((src_iter.bi_size >> 9) >= sectors);
-
-		written = bio_copy_data_partial(
-			dst_bio, dst_iter,
-			src_bio, src_iter, sectors);
-		ASSERT(written == sectors);
 
 		/* Split top */
 		if (dst_bio->bi_iter.bi_sector < dst_iter.bi_sector) {
@@ -292,7 +420,7 @@ bool bio_wrapper_copy_overlapped(
 			 * split1    |--|    (copied)
 			 * dst'         |--|
 			 */
-			bio_private_lsb_set(split1);
+			claim_overlapped_bio(split1, src, ldev);
 			bio_list_insert(dst_list, split0, prev_bio);
 			bio_list_insert(dst_list, split1, split0);
 		} else if (split0 && !split1) {
@@ -302,7 +430,7 @@ bool bio_wrapper_copy_overlapped(
 			 * split0 |--|
 			 * dst'      |--|    (copied)
 			 */
-			bio_private_lsb_set(dst_bio);
+			claim_overlapped_bio(dst_bio, src, ldev);
 			bio_list_insert(dst_list, split0, prev_bio);
 		} else if (!split0 && split1) {
 			/*
@@ -311,14 +439,14 @@ bool bio_wrapper_copy_overlapped(
 			 * split1    |--|    (copied)
 			 * dst'         |--|
 			 */
-			bio_private_lsb_set(split1);
+			claim_overlapped_bio(split1, src, ldev);
 			bio_list_insert(dst_list, split1, prev_bio);
 		} else {
 			/*
 			 * src |--------|
 			 * dst    |--|    (copied)
 			 */
-			bio_private_lsb_set(dst_bio);
+			claim_overlapped_bio(dst_bio, src, ldev);
 		}
 		prev_bio = dst_bio;
 	}
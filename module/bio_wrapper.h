@@ -14,8 +14,11 @@
 #include <linux/time.h>
 
 #include "bio_entry.h"
+#include "treemap.h"
 #include "linux/walb/common.h"
 
+struct pack;
+
 /**
  * Bio wrapper.
  */
@@ -43,12 +46,26 @@ struct bio_wrapper
 	   (2) comparison with permanent_lsid. */
 	u64 lsid;
 
+	/* Offset of the log data inside the physical block of lsid
+	   [logical block]. Non-zero only for packed log records.
+	   Records sharing a physical block have the same lsid
+	   so this orders them. */
+	u16 sub_offset;
+
 	/* Original bio's buffer will be updated during IO.
 	   Walb requires a fixed snapshot of data during IO.
 	   So submitted bio will be copied to here at first.
-	   For discard IOs, this is NULL. */
+	   In zero-copy mode, this shares pages with the original bio
+	   (see BIO_WRAPPER_ZERO_COPY).
+	   For discard IOs, this is NULL.
+	   This is also NULL while the biow is spilled
+	   (see BIO_WRAPPER_SPILLED). */
 	struct bio *copied_bio;
 
+	/* Position of the data in the log device [logical block].
+	   This is valid while the biow is spilled. */
+	u64 spilled_pos;
+
 	/* for temporary use for IOs for log/data devices. */
 	struct bio_entry cloned_bioe;
 
@@ -57,8 +74,29 @@ struct bio_wrapper
 
 	unsigned long start_time; /* for diskstats. */
 
+	/* The original bi_end_io and bi_private of a read bio
+	   while it is remapped to the data device directly. */
+	bio_end_io_t *orig_end_io;
+	void *orig_private;
+
+	/* For latency histograms [nsec].
+	   lat_prev_ns is the end time of the previous stage. */
+	u64 lat_begin_ns;
+	u64 lat_prev_ns;
+
 	void *private_data;
 
+	/* Logpack containing this write bio wrapper (see io.c).
+	   Its data IO completion is counted by the logpack. */
+	struct pack *pack;
+
+	/* Nodes of the intrusive interval multimaps
+	   so that insertion never allocates memory. */
+	struct interval_node pending_node; /* for the pending data. */
+#ifdef WALB_OVERLAPPED_SERIALIZE
+	struct interval_node ol_node; /* for the overlapped data. */
+#endif
+
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	int n_overlapped; /* initial value is -1. */
 #ifdef WALB_DEBUG
@@ -102,6 +140,21 @@ enum
 	BIO_WRAPPER_DISCARD,
 	/* Set if the biow data will be fully overwritten by newer IO(s). */
 	BIO_WRAPPER_OVERWRITTEN,
+	/* Set if copied_bio shares pages with the original bio.
+	   The original bio must not be ended until the data IO completes. */
+	BIO_WRAPPER_ZERO_COPY,
+	/* Set if the biow holds write admission sectors.
+	   See iocore_data.inflight_sectors. */
+	BIO_WRAPPER_ADMITTED,
+	/* Set if copied_bio has been freed after its log became permanent.
+	   Its data must be read from the log device again. */
+	BIO_WRAPPER_SPILLED,
+	/* Set if the write data are all zero.
+	   Its log record has no data area (see LOG_RECORD_ZERO). */
+	BIO_WRAPPER_ZERO,
+	/* Set if the bio is REQ_WRITE_SAME.
+	   Its copied_bio has only the payload (see LOG_RECORD_WRITE_SAME). */
+	BIO_WRAPPER_WRITE_SAME,
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	/* Set if the biow submission for data device is delayed
 	   due to overlapped. */
@@ -124,6 +177,14 @@ enum
 	test_bit(BIO_WRAPPER_DISCARD, &(biow)->flags)
 #define bio_wrapper_state_is_overwritten(biow) \
 	test_bit(BIO_WRAPPER_OVERWRITTEN, &(biow)->flags)
+#define bio_wrapper_state_is_zero_copy(biow) \
+	test_bit(BIO_WRAPPER_ZERO_COPY, &(biow)->flags)
+#define bio_wrapper_state_is_spilled(biow) \
+	test_bit(BIO_WRAPPER_SPILLED, &(biow)->flags)
+#define bio_wrapper_state_is_zero(biow) \
+	test_bit(BIO_WRAPPER_ZERO, &(biow)->flags)
+#define bio_wrapper_state_is_write_same(biow) \
+	test_bit(BIO_WRAPPER_WRITE_SAME, &(biow)->flags)
 #ifdef WALB_OVERLAPPED_SERIALIZE
 #define bio_wrapper_state_is_delayed(biow) \
 	test_bit(BIO_WRAPPER_DELAYED, &(biow)->flags)
@@ -157,6 +218,20 @@ static inline void bio_wrapper_state_set(struct bio_wrapper *biow, uint flag)
 #define bio_wrapper_state_set_completed(biow)
 #endif
 
+/**
+ * Size of the data of a write bio wrapper in the log device [logical block].
+ */
+static inline unsigned int bio_wrapper_log_data_lb(
+	const struct bio_wrapper *biow)
+{
+	if (bio_wrapper_state_is_discard(biow) ||
+		bio_wrapper_state_is_zero(biow))
+		return 0;
+	if (bio_wrapper_state_is_write_same(biow))
+		return 1;
+	return biow->len;
+}
+
 #ifdef WALB_PERFORMANCE_ANALYSIS
 void print_bio_wrapper_performance(const char *level, struct bio_wrapper *biow);
 #endif
@@ -168,9 +243,12 @@ UNUSED void print_bio_wrapper_short(
 void init_bio_wrapper(struct bio_wrapper *biow, struct bio *bio);
 struct bio_wrapper* alloc_bio_wrapper(gfp_t gfp_mask);
 void destroy_bio_wrapper(struct bio_wrapper *biow);
+bool bio_wrapper_prepare_copied_bio(
+	struct bio_wrapper *biow, bool zero_copy, u32 salt, gfp_t gfp_mask);
 
 bool bio_wrapper_copy_overlapped(
-	struct bio_wrapper *dst, struct bio_wrapper *src, gfp_t gfp_mask);
+	struct bio_wrapper *dst, struct bio_wrapper *src,
+	struct block_device *ldev, gfp_t gfp_mask);
 void bio_wrapper_endio_copied(struct bio_wrapper *biow);
 void wait_for_bio_wrapper(struct bio_wrapper *biow, ulong timeo_ms);
 
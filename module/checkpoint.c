@@ -35,15 +35,15 @@ bool take_checkpoint(struct checkpoint_data *cpd)
 {
 	bool skip;
 	struct walb_dev *wdev;
+	struct lsid_set lsids;
 
 	ASSERT(cpd);
 	wdev = get_wdev_from_checkpoint_data(cpd);
 	ASSERT(wdev);
 
 	/* Check the need of writing superblock. */
-	spin_lock(&wdev->lsid_lock);
-	skip = wdev->lsids.written == wdev->lsids.prev_written;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
+	skip = lsids.written == lsids.prev_written;
 	if (skip) {
 		WLOG_(wdev, "skip superblock sync.\n");
 		return true;
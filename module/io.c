@@ -10,6 +10,8 @@
 #include <linux/printk.h>
 #include <linux/time.h>
 #include <linux/kmod.h>
+#include <linux/percpu.h>
+#include <linux/list_sort.h>
 #include "linux/walb/logger.h"
 #include "kern.h"
 #include "io.h"
@@ -58,19 +60,56 @@ struct pack
 
 	/* true if submittion failed. */
 	bool is_logpack_failed;
+
+	/* Time when the logpack was submitted [ns]. */
+	u64 submit_ns;
+
+	/* Owner device. Valid after submitted. */
+	struct walb_dev *wdev;
+
+	/* Sequence number in the submission order.
+	   The wait log task and the gc task process packs in this order. */
+	u64 seq;
+
+	/*
+	 * Completion counters of the stages.
+	 * Each counter has one extra reference held by the stage owner
+	 * until it finishes dispatching IOs of the pack.
+	 *
+	 * n_log_pending: log IOs in flight.
+	 *   The last one dispatches the wait log task.
+	 * n_data_pending: bio wrappers in the data stage.
+	 *   The last one wakes up the gc task.
+	 */
+	atomic_t n_log_pending;
+	atomic_t n_data_pending;
+
+	/* Entry of iocored->fua_wait_list.
+	   The pack holds an n_data_pending reference while it is there. */
+	struct list_head fua_list;
+};
+
+/**
+ * Per-request data of the blk-mq frontend.
+ * Each bio of a request is cloned and processed as a bio-based IO.
+ */
+struct walb_mq_cmd
+{
+	struct request *rq;
+	atomic_t n_pending; /* number of clones not ended yet plus one. */
+	int error;
 };
 
 static atomic_t n_users_of_pack_cache_ = ATOMIC_INIT(0);
 #define KMEM_CACHE_PACK_NAME "pack_cache"
 struct kmem_cache *pack_cache_ = NULL;
 
-/* All treemap(s) in this module will share a treemap memory manager. */
-static atomic_t n_users_of_memory_manager_ = ATOMIC_INIT(0);
-static struct treemap_memory_manager mmgr_;
-#define TREE_NODE_CACHE_NAME "walb_iocore_bio_node_cache"
-#define TREE_CELL_HEAD_CACHE_NAME "walb_iocore_bio_cell_head_cache"
-#define TREE_CELL_CACHE_NAME "walb_iocore_bio_cell_cache"
-#define N_ITEMS_IN_MEMPOOL (128 * 2) /* for pending data and overlapped data. */
+/* Reserved packs shared by all devices. */
+static mempool_t *pack_pool_ = NULL;
+#define PACK_POOL_MIN_NR 16
+
+/* Number of reserved logpack headers for each device. */
+#define LOGPACK_HEADER_POOL_MIN_NR 16
 
 /*******************************************************************************
  * Macros definition.
@@ -84,8 +123,13 @@ static struct treemap_memory_manager mmgr_;
 
 /* pack related. */
 static struct pack* create_pack(gfp_t gfp_mask);
-static struct pack* create_writepack(gfp_t gfp_mask, unsigned int pbs, u64 logpack_lsid);
-static void destroy_pack(struct pack *pack);
+static struct pack* create_writepack(
+	struct iocore_data *iocored, gfp_t gfp_mask,
+	unsigned int pbs, u64 logpack_lsid, unsigned int n_header_pb);
+static unsigned int decide_n_header_pb(
+	struct walb_dev *wdev, u64 logpack_lsid, unsigned int max_logpack_pb,
+	struct bio_wrapper *biow, struct list_head *rest_list);
+static void destroy_pack(struct walb_dev *wdev, struct pack *pack);
 static bool is_zero_flush_only(const struct pack *pack);
 static bool is_pack_size_too_large(
 	struct walb_logpack_header *lhead,
@@ -105,7 +149,14 @@ static void task_submit_logpack_list(struct work_struct *work);
 static void task_wait_for_logpack_list(struct work_struct *work);
 static void task_wait_and_gc_read_bio_wrapper(struct work_struct *work);
 static void task_submit_bio_wrapper_list(struct work_struct *work);
-static void task_wait_for_bio_wrapper_list(struct work_struct *work);
+static void task_end_write_bio_wrapper(struct work_struct *work);
+static void bio_end_io_for_data(struct bio *bio);
+static void bio_end_io_for_merged_data(struct bio *bio);
+static void end_write_data_io(struct bio_wrapper *biow, int error);
+static void end_datapack_bio_wrapper(struct bio_wrapper *biow);
+static void bio_end_io_for_logpack_header(struct bio *bio);
+static void bio_end_io_for_logpack_data(struct bio *bio);
+static void end_logpack_io(struct pack *wpack, struct bio_entry *bioe, int error);
 
 /* Logpack GC */
 static void run_gc_logpack_list(void *data);
@@ -131,10 +182,17 @@ static void logpack_submit_header(
 	u64 ring_buffer_off, u64 ring_buffer_size,
 	unsigned int chunk_sectors);
 static void logpack_submit_bio_wrapper(
-	struct bio_wrapper *biow, u64 lsid,
+	struct bio_wrapper *biow, struct list_head *biow_list, u64 lsid,
 	unsigned int pbs, struct block_device *ldev,
 	u64 ring_buffer_off, u64 ring_buffer_size,
 	unsigned int chunk_sectors);
+static struct bio* logpack_create_shared_bio(
+	struct bio_wrapper *biow, struct list_head *biow_list,
+	unsigned int pbs, struct block_device *ldev, u64 ldev_off_pb,
+	unsigned int *front_lbp);
+static unsigned int add_log_data_pages(
+	struct bio *bio, struct bio *src, unsigned int off_lb, unsigned int n_lb);
+static unsigned int get_log_data_lb(const struct bio_wrapper *biow);
 static struct bio* logpack_create_bio(
 	struct bio *bio, uint pbs, struct block_device *ldev,
 	u64 ldev_off_pb, uint bio_off_lb);
@@ -143,45 +201,83 @@ static void logpack_init_bio_entry(
 	unsigned int pbs, struct block_device *ldev,
 	u64 ldev_off_pb, unsigned int bio_off_lb);
 static void logpack_submit_flush(struct block_device *bdev, struct pack *pack);
+static void start_logpack_io(
+	struct pack *wpack, struct bio_entry *bioe, bio_end_io_t *end_io);
+static bool is_logpack_log_io_done(struct pack *wpack);
+static bool is_logpack_data_io_done(struct pack *wpack);
+static bool is_logpack_wait_queue_head_done(struct iocore_data *iocored);
 static void gc_logpack_list(struct walb_dev *wdev, struct list_head *wpack_list);
 static void dequeue_and_gc_logpack_list(struct walb_dev *wdev);
 
 /* Validator for debug. */
-static bool is_prepared_pack_valid(struct pack *pack);
-UNUSED static bool is_pack_list_valid(struct list_head *pack_list);
+static bool is_prepared_pack_valid(struct pack *pack, unsigned int pbs);
+UNUSED static bool is_pack_list_valid(
+	struct list_head *pack_list, unsigned int pbs);
 
 /* IOcore data related. */
-static struct iocore_data* create_iocore_data(gfp_t gfp_mask);
+static struct iocore_data* create_iocore_data(gfp_t gfp_mask, unsigned int pbs);
 static void destroy_iocore_data(struct iocore_data *iocored);
 
 /* Other helper functions. */
 static bool push_into_lpack_submit_queue(struct bio_wrapper *biow);
-static bool writepack_add_bio_wrapper(
+static void move_submit_stage_to_queue(struct iocore_data *iocored);
+static bool is_submit_stage_empty(struct iocore_data *iocored);
+static void writepack_add_bio_wrapper(
 	struct list_head *wpack_list, struct pack **wpackp,
-	struct bio_wrapper *biow,
+	struct bio_wrapper *biow, struct list_head *rest_list,
 	u64 ring_buffer_size, unsigned int max_logpack_pb,
 	u64 *latest_lsidp, struct walb_dev *wdev, gfp_t gfp_mask, bool *is_flushp);
-static void insert_to_sorted_bio_wrapper_list_by_pos(
-	struct bio_wrapper *biow, struct list_head *biow_list);
+static int cmp_bio_wrapper_by_pos(
+	void *priv, struct list_head *a, struct list_head *b);
+static void sort_bio_wrapper_list_cscan(
+	struct list_head *biow_list, struct list_head *deferred_list,
+	u64 *head_posp, bool is_wrap);
 static void writepack_check_and_set_zeroflush(struct pack *wpack, bool *is_flushp);
 static bool wait_for_logpack_header(struct pack *wpack);
 static void wait_for_logpack_and_submit_datapack(
-	struct walb_dev *wdev, struct pack *wpack);
+	struct walb_dev *wdev, struct pack *wpack, struct list_head *biow_list);
+static void queue_fua_pack_list(
+	struct walb_dev *wdev, struct list_head *wpack_list);
+static void start_fua_flush_if_necessary(struct walb_dev *wdev);
+static void bio_end_io_for_fua_flush(struct bio *bio);
+static void task_end_fua_flush(struct work_struct *work);
+static void end_fua_pack(struct walb_dev *wdev, struct pack *wpack, bool is_failed);
+static void wait_for_absorb_delay(struct walb_dev *wdev);
 static void wait_for_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
 static void wait_for_bio_wrapper_io(
 	struct bio_wrapper *biow, bool is_endio, bool is_delete);
 static void submit_write_bio_wrapper(
 	struct bio_wrapper *biow, bool is_plugging);
+static bool begin_write_data_io(struct bio_wrapper *biow);
+static void submit_write_data_io(struct bio_wrapper *biow);
+static bool is_mergeable_write_bio_wrapper(struct bio_wrapper *biow);
+static bool is_in_a_chunk(u64 pos, unsigned int len, unsigned int chunk_sectors);
+static void submit_write_bio_wrapper_list(
+	struct walb_dev *wdev, struct list_head *biow_list);
+static void submit_merged_write_data_io(
+	struct walb_dev *wdev, struct list_head *run, unsigned int nr_vecs);
+static void absorb_write_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow);
+static bool should_spill_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow);
+static void spill_bio_wrapper(struct walb_dev *wdev, struct bio_wrapper *biow);
+static bool should_reload_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow);
+static void reload_spilled_bio_wrapper_list(
+	struct walb_dev *wdev, struct list_head *biow_list);
 static void cancel_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
+static void end_zero_copy_bio_wrapper(struct bio_wrapper *biow);
+static void bio_end_io_for_remapped_read(struct bio *bio);
+static bool try_remap_read_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow);
 static void submit_read_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
 static bool submit_flush(struct bio_entry *bioe, struct block_device *bdev);
 static void dispatch_submit_log_task(struct walb_dev *wdev);
 static void dispatch_wait_log_task(struct walb_dev *wdev);
 static void dispatch_submit_data_task(struct walb_dev *wdev);
-static void dispatch_wait_data_task(struct walb_dev *wdev);
 static void start_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
 static void wait_for_logpack_submit_queue_empty(struct walb_dev *wdev);
@@ -189,24 +285,31 @@ static void wait_for_all_started_write_io_done(struct walb_dev *wdev);
 static void wait_for_all_pending_gc_done(struct walb_dev *wdev);
 static void force_flush_ldev(struct walb_dev *wdev);
 static bool wait_for_log_permanent(struct walb_dev *wdev, u64 lsid);
+static bool is_lsid_set_changed(
+	struct walb_dev *wdev, const struct lsid_set *lsids);
+static void wakeup_log_permanent_waiters(struct walb_dev *wdev);
 static void flush_all_wq(void);
 static void clear_working_flag(int working_bit, unsigned long *flag_p);
 static void invoke_userland_exec(struct walb_dev *wdev, const char *event);
 static void fail_and_destroy_bio_wrapper_list(
 	struct walb_dev *wdev, struct list_head *biow_list);
 static void update_flush_lsid_if_necessary(struct walb_dev *wdev, u64 lsid);
-static bool delete_bio_wrapper_from_pending_data(
+static void delete_bio_wrapper_from_pending_data(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
 
-/* Stop/start queue for fast algorithm. */
-static bool should_stop_queue(
+/* Write admission control for fast algorithm. */
+static unsigned int get_bio_admission_sectors(struct bio *bio);
+static unsigned int get_admission_sectors(struct bio_wrapper *biow);
+static bool try_admit_write(
+	struct iocore_data *iocored, unsigned int sectors, unsigned int limit);
+static void admit_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
-static bool should_start_queue(
+static void release_write_admission(
 	struct walb_dev *wdev, struct bio_wrapper *biow);
+static void give_back_admission_sectors(
+	struct walb_dev *wdev, unsigned int sectors);
 
 /* For treemap memory manager. */
-static bool treemap_memory_manager_get(void);
-static void treemap_memory_manager_put(void);
 
 /* For pack_cache. */
 static bool pack_cache_get(void);
@@ -216,36 +319,82 @@ static void pack_cache_put(void);
 static void io_acct_start(struct bio_wrapper *biow);
 static void io_acct_end(struct bio_wrapper *biow);
 
+/* For latency histograms. */
+static void latency_begin(struct bio_wrapper *biow);
+static void latency_stage(struct bio_wrapper *biow, unsigned int stage);
+static void latency_end(struct bio_wrapper *biow);
+static unsigned int get_logpack_io_bulk(struct walb_dev *wdev);
+static unsigned int get_logpack_max_pb(struct walb_dev *wdev);
+static void adapt_logpack_batch(
+	struct walb_dev *wdev, unsigned int n_io, bool is_cut);
+static void update_log_latency(
+	struct iocore_data *iocored, struct pack *wpack);
+
+/* For make request. */
+static void make_request_detail(
+	struct walb_dev *wdev, struct bio *bio, bool is_admitted);
+
+/* For blk-mq frontend. */
+static bool admit_walb_mq_request(
+	struct walb_dev *wdev, struct blk_mq_hw_ctx *hctx, struct request *rq);
+static void walb_mq_put_cmd(struct walb_mq_cmd *cmd);
+static void bio_end_io_for_walb_mq(struct bio *clone);
+static int walb_mq_queue_rq(
+	struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd);
+
 /* For freeze/melt. */
-static bool is_frozen(struct iocore_data *iocored);
-static void set_frozen(struct iocore_data *iocored, bool is_usr, bool value);
-static void freeze_detail(struct iocore_data *iocored, bool is_usr);
-static bool melt_detail(struct iocore_data *iocored, bool is_usr);
+static void freeze_detail(struct iocore_data *iocored);
+static void melt_detail(struct iocore_data *iocored);
 
 /*******************************************************************************
  * Static functions implementation.
  *******************************************************************************/
 
+/**
+ * Allocator and deallocator for iocored->logpack_header_pool.
+ * pool_data is the physical block size.
+ * Each buffer can store the largest logpack header.
+ */
+static void* logpack_header_pool_alloc(gfp_t gfp_mask, void *pool_data)
+{
+	return sector_alloc(
+		max_logpack_header_size((unsigned int)(unsigned long)pool_data),
+		gfp_mask);
+}
+
+static void logpack_header_pool_free(void *element, void *pool_data)
+{
+	sector_free((struct sector_data *)element);
+}
+
 /**
  * Create a pack.
+ *
+ * This never fails if gfp_mask allows blocking
+ * because packs are allocated from pack_pool_.
  */
 static struct pack* create_pack(gfp_t gfp_mask)
 {
 	struct pack *pack;
 
-	pack = kmem_cache_alloc(pack_cache_, gfp_mask);
+	pack = mempool_alloc(pack_pool_, gfp_mask);
 	if (!pack) {
-		LOGd("kmem_cache_alloc() failed.");
+		LOGd("mempool_alloc() failed.");
 		goto error0;
 	}
 	INIT_LIST_HEAD(&pack->list);
 	INIT_LIST_HEAD(&pack->biow_list);
+	INIT_LIST_HEAD(&pack->fua_list);
 	bio_entry_clear(&pack->header_bioe);
 	pack->is_zero_flush_only = false;
 	pack->is_flush_header = false;
 	pack->is_fua_contained = false;
 	pack->is_logpack_failed = false;
 	pack->new_permanent_lsid = INVALID_LSID;
+	pack->wdev = NULL;
+	pack->seq = 0;
+	atomic_set(&pack->n_log_pending, 1);
+	atomic_set(&pack->n_data_pending, 1);
 
 	return pack;
 #if 0
@@ -259,35 +408,45 @@ error0:
 /**
  * Create a writepack.
  *
+ * @iocored iocore data that has the logpack header pool.
  * @gfp_mask allocation mask.
  * @pbs physical block size in bytes.
  * @logpack_lsid logpack lsid.
+ * @n_header_pb number of physical blocks of the logpack header.
  *
  * RETURN:
  *   Allocated and initialized writepack in success, or NULL.
+ *   This never returns NULL if gfp_mask allows blocking.
  */
 static struct pack* create_writepack(
-	gfp_t gfp_mask, unsigned int pbs, u64 logpack_lsid)
+	struct iocore_data *iocored, gfp_t gfp_mask,
+	unsigned int pbs, u64 logpack_lsid, unsigned int n_header_pb)
 {
 	struct pack *pack;
 	struct walb_logpack_header *lhead;
 
 	ASSERT(logpack_lsid != INVALID_LSID);
+	ASSERT(0 < n_header_pb);
+	ASSERT(n_header_pb <= max_n_logpack_header_pb(pbs));
 	pack = create_pack(gfp_mask);
 	if (!pack) { goto error0; }
-	pack->logpack_header_sector = sector_alloc(pbs, gfp_mask | __GFP_ZERO);
+	pack->logpack_header_sector =
+		mempool_alloc(iocored->logpack_header_pool, gfp_mask);
 	if (!pack->logpack_header_sector) { goto error1; }
+	ASSERT(pack->logpack_header_sector->size == max_logpack_header_size(pbs));
+	sector_zeroclear(pack->logpack_header_sector);
 
 	lhead = get_logpack_header(pack->logpack_header_sector);
 	lhead->sector_type = SECTOR_TYPE_LOGPACK;
 	lhead->logpack_lsid = logpack_lsid;
+	lhead->n_header_pb = n_header_pb;
 	/* lhead->total_io_size = 0; */
 	/* lhead->n_records = 0; */
 	/* lhead->n_padding = 0; */
 
 	return pack;
 error1:
-	destroy_pack(pack);
+	mempool_free(pack, pack_pool_);
 error0:
 	return NULL;
 }
@@ -295,7 +454,7 @@ error0:
 /**
  * Destory a pack.
  */
-static void destroy_pack(struct pack *pack)
+static void destroy_pack(struct walb_dev *wdev, struct pack *pack)
 {
 	struct bio_wrapper *biow, *biow_next;
 
@@ -307,7 +466,8 @@ static void destroy_pack(struct pack *pack)
 		destroy_bio_wrapper_dec((struct walb_dev *)biow->private_data, biow);
 	}
 	if (pack->logpack_header_sector) {
-		sector_free(pack->logpack_header_sector);
+		mempool_free(pack->logpack_header_sector,
+			get_iocored_from_wdev(wdev)->logpack_header_pool);
 		pack->logpack_header_sector = NULL;
 	}
 	fin_bio_entry(&pack->header_bioe);
@@ -315,7 +475,7 @@ static void destroy_pack(struct pack *pack)
 #ifdef WALB_DEBUG
 	INIT_LIST_HEAD(&pack->biow_list);
 #endif
-	kmem_cache_free(pack_cache_, pack);
+	mempool_free(pack, pack_pool_);
 }
 
 /**
@@ -351,6 +511,69 @@ static bool is_zero_flush_only(const struct pack *pack)
 	return ret;
 }
 
+/**
+ * Decide the number of physical blocks of a new logpack header.
+ *
+ * Only packed log devices use multi-block headers.
+ * The header is large enough to store records for the bio wrappers
+ * that will be added to the new pack: the rest ones in the batch
+ * until a flush request or max_logpack_pb closes the pack
+ * as writepack_add_bio_wrapper() does.
+ * It never exceeds the maximum header size
+ * nor crosses the end of the ring buffer.
+ * Packed records may let more ones fit, which go to the next pack.
+ *
+ * @wdev wrapper block device.
+ * @logpack_lsid lsid of the new logpack.
+ * @max_logpack_pb maximum logpack size [physical block]. 0 means unlimited.
+ * @biow the first bio wrapper of the new pack.
+ * @rest_list bio wrappers in the batch not added yet after the biow,
+ *   linked with list.
+ *
+ * RETURN:
+ *   number of physical blocks of the new logpack header.
+ */
+static unsigned int decide_n_header_pb(
+	struct walb_dev *wdev, u64 logpack_lsid, unsigned int max_logpack_pb,
+	struct bio_wrapper *biow, struct list_head *rest_list)
+{
+	const unsigned int pbs = wdev->physical_bs;
+	const unsigned int max_n_rec =
+		max_n_log_record_in_header(pbs, max_n_logpack_header_pb(pbs));
+	const u64 rest_pb =
+		wdev->ring_buffer_size - logpack_lsid % wdev->ring_buffer_size;
+	struct bio_wrapper *biow2;
+	unsigned int n_rec = 1, total_pb, n_pb;
+
+	if (!wdev->is_log_packed)
+		return 1;
+
+	/* Count records that will fit in the new pack. */
+	total_pb = (unsigned int)capacity_pb(pbs, bio_wrapper_log_data_lb(biow));
+	list_for_each_entry(biow2, rest_list, list) {
+		const unsigned int pb = (unsigned int)capacity_pb(
+			pbs, bio_wrapper_log_data_lb(biow2));
+
+		if (n_rec >= max_n_rec || biow2->copied_bio->bi_rw & REQ_FLUSH)
+			break;
+		if (max_logpack_pb > 0 && pb > 0 && total_pb + pb > max_logpack_pb)
+			break;
+		total_pb += pb;
+		n_rec++;
+	}
+	if (n_rec <= max_n_log_record_in_sector(pbs))
+		return 1;
+
+	/* One more record for padding. */
+	n_pb = DIV_ROUND_UP(sizeof(struct walb_logpack_header)
+		+ (n_rec + 1) * sizeof(struct walb_log_record), pbs);
+	n_pb = min(n_pb, max_n_logpack_header_pb(pbs));
+	if (rest_pb < n_pb)
+		n_pb = (unsigned int)rest_pb;
+	ASSERT(n_pb > 0);
+	return n_pb;
+}
+
 /**
  * Check the pack size exceeds max_logpack_pb or not.
  *
@@ -372,10 +595,10 @@ static bool is_pack_size_too_large(
 		return false;
 	}
 
-	if (bio_wrapper_state_is_discard(biow))
+	if (bio_wrapper_log_data_lb(biow) == 0)
 		return false;
 
-	pb = (unsigned int)capacity_pb(pbs, biow->len);
+	pb = (unsigned int)capacity_pb(pbs, bio_wrapper_log_data_lb(biow));
 	return pb + lhead->total_io_size > max_logpack_pb;
 }
 
@@ -499,13 +722,15 @@ static void task_submit_logpack_list(struct work_struct *work)
 	while (true) {
 		struct pack *wpack, *wpack_next;
 		struct bio_wrapper *biow, *biow_next;
-		bool is_empty;
+		bool is_empty, is_cut = false;
 		unsigned int n_io = 0;
+		const unsigned int io_bulk = get_logpack_io_bulk(wdev);
 
 		ASSERT(list_empty(&biow_list));
 		ASSERT(list_empty(&wpack_list));
 
 		/* Dequeue all bio wrappers from the submit queue. */
+		move_submit_stage_to_queue(iocored);
 		spin_lock(&iocored->logpack_submit_queue_lock);
 		is_empty = list_empty(&iocored->logpack_submit_queue);
 		if (is_empty) {
@@ -518,10 +743,28 @@ static void task_submit_logpack_list(struct work_struct *work)
 			list_move_tail(&biow->list, &biow_list);
 			start_write_bio_wrapper(wdev, biow);
 			n_io++;
-			if (n_io >= wdev->n_io_bulk) { break; }
+			if (n_io >= io_bulk) {
+				is_cut = !list_empty(&iocored->logpack_submit_queue);
+				break;
+			}
 		}
 		spin_unlock(&iocored->logpack_submit_queue_lock);
-		if (is_empty) { break; }
+		if (is_empty) {
+			/*
+			 * A bio wrapper may have been staged
+			 * after the stage was moved
+			 * while its pusher saw the working flag set.
+			 * Pairs with smp_mb() in push_into_lpack_submit_queue().
+			 */
+			smp_mb();
+			if (is_submit_stage_empty(iocored) ||
+				test_and_set_bit(
+					IOCORE_STATE_SUBMIT_LOG_TASK_WORKING,
+					&iocored->flags)) {
+				break;
+			}
+			continue;
+		}
 
 		/* Failure mode. */
 		if (test_bit(WALB_STATE_READ_ONLY, &wdev->flags)) {
@@ -529,6 +772,8 @@ static void task_submit_logpack_list(struct work_struct *work)
 			continue;
 		}
 
+		adapt_logpack_batch(wdev, n_io, is_cut);
+
 		/* Create and submit. */
 		if (!create_logpack_list(wdev, &biow_list, &wpack_list)) {
 			continue;
@@ -550,63 +795,105 @@ static void task_submit_logpack_list(struct work_struct *work)
 }
 
 /**
- * Wait for completion of all logpacks related to a call of request_fn.
+ * Process logpacks whose log IOs have all completed.
+ *
+ * Packs are processed in the submission order (pack->seq)
+ * and this never blocks on log IOs:
+ * it stops at the first pack that still has log IOs in flight
+ * and the last completion of them dispatches this task again
+ * (see end_logpack_io()).
  *
  * If submission a logpack is partially failed,
  * this function will end all requests related to the logpack and the followings.
  *
  * All failed (and end_request called) reqe(s) will be destroyed.
  *
- * @work work in a logpack_work.
+ * @work iocored->wait_log_work.
  *
  * CONTEXT:
  *   Workqueue task.
- *   Works are serialized by singlethread workqueue.
+ *   The same task is not executed concurrently.
  */
 static void task_wait_for_logpack_list(struct work_struct *work)
 {
-	struct walb_dev *wdev;
-	struct iocore_data *iocored;
+	struct iocore_data *iocored =
+		container_of(work, struct iocore_data, wait_log_work);
+	struct walb_dev *wdev = iocored->wdev;
 	struct list_head wpack_list;
+	struct list_head biow_list;
 
-	get_wdev_and_iocored_from_work(&wdev, &iocored, work);
+	ASSERT(wdev);
 	LOG_("begin\n");
 
 	INIT_LIST_HEAD(&wpack_list);
+	INIT_LIST_HEAD(&biow_list);
 	while (true) {
 		struct pack *wpack, *wpack_next;
-		bool is_empty;
+		bool is_fua = false;
 		unsigned int n_pack = 0;
 		ASSERT(list_empty(&wpack_list));
+		ASSERT(list_empty(&biow_list));
 
-		/* Dequeue logpack list from the submit queue. */
+		/* Dequeue the completed logpacks at the head of the wait queue. */
 		spin_lock(&iocored->logpack_wait_queue_lock);
-		is_empty = list_empty(&iocored->logpack_wait_queue);
-		if (is_empty) {
-			clear_working_flag(
-				IOCORE_STATE_WAIT_LOG_TASK_WORKING,
-				&iocored->flags);
-		}
 		list_for_each_entry_safe(wpack, wpack_next,
 					&iocored->logpack_wait_queue, list) {
+			if (!is_logpack_log_io_done(wpack))
+				break;
 			list_move_tail(&wpack->list, &wpack_list);
 			n_pack++;
 			if (n_pack >= wdev->n_pack_bulk) { break; }
 		}
 		spin_unlock(&iocored->logpack_wait_queue_lock);
-		if (is_empty) { break; }
+		if (n_pack == 0) {
+			clear_working_flag(
+				IOCORE_STATE_WAIT_LOG_TASK_WORKING,
+				&iocored->flags);
+			/*
+			 * The head may have completed or been enqueued
+			 * after it was checked, while its notifier saw
+			 * the working flag set.
+			 * Pairs with atomic_dec_and_test() in end_logpack_io()
+			 * and the enqueue in task_submit_logpack_list().
+			 */
+			smp_mb();
+			if (!is_logpack_wait_queue_head_done(iocored) ||
+				test_and_set_bit(
+					IOCORE_STATE_WAIT_LOG_TASK_WORKING,
+					&iocored->flags)) {
+				break;
+			}
+			continue;
+		}
 
-		/* Wait logpack completion and submit datapacks. */
+		/* Prepare datapacks. Their log IOs have already completed. */
 		list_for_each_entry_safe(wpack, wpack_next, &wpack_list, list) {
-			wait_for_logpack_and_submit_datapack(wdev, wpack);
+			ASSERT(wpack->seq == iocored->log_wait_seq);
+			iocored->log_wait_seq++;
+			wait_for_logpack_and_submit_datapack(wdev, wpack, &biow_list);
+			is_fua |= wpack->is_fua_contained;
 		}
+
+		/* FUA bios share flushes in flight (group commit). */
+		if (is_fua)
+			queue_fua_pack_list(wdev, &wpack_list);
+
+		/* Enqueue submit datapack task. */
+		spin_lock(&iocored->datapack_submit_queue_lock);
+		list_splice_tail_init(&biow_list, &iocored->datapack_submit_queue);
+		spin_unlock(&iocored->datapack_submit_queue_lock);
 		dispatch_submit_data_task(wdev);
 
-		/* Put packs into the gc queue. */
+		/*
+		 * Put packs into the gc queue and drop their initial
+		 * n_data_pending references. The gc task dequeues packs
+		 * with the lock held so they are alive inside the loop.
+		 */
 		atomic_add(n_pack, &iocored->n_pending_gc);
 		spin_lock(&iocored->logpack_gc_queue_lock);
 		list_for_each_entry_safe(wpack, wpack_next, &wpack_list, list) {
 			list_move_tail(&wpack->list, &iocored->logpack_gc_queue);
+			atomic_dec(&wpack->n_data_pending);
 		}
 		spin_unlock(&iocored->logpack_gc_queue_lock);
 
@@ -636,31 +923,33 @@ static void task_submit_bio_wrapper_list(struct work_struct *work)
 {
 	struct walb_dev *wdev;
 	struct iocore_data *iocored;
-	struct list_head biow_list, biow_list_sorted;
+	struct list_head biow_list, biow_list_sorted, biow_list_deferred;
+	u64 head_pos = 0;
 
 	get_wdev_and_iocored_from_work(&wdev, &iocored, work);
 	LOG_("begin\n");
 
 	INIT_LIST_HEAD(&biow_list);
 	INIT_LIST_HEAD(&biow_list_sorted);
+	/* Bio wrappers behind the head position in C-SCAN order.
+	   They are submitted before the task ends. */
+	INIT_LIST_HEAD(&biow_list_deferred);
 	while (true) {
 		struct bio_wrapper *biow, *biow_next;
 		bool is_empty;
 		u64 lsid = 0;
 		u32 pb = 0;
 		unsigned int n_io = 0;
-		struct blk_plug plug;
-#ifdef WALB_OVERLAPPED_SERIALIZE
-		bool ret;
-#endif
 
 		ASSERT(list_empty(&biow_list));
 		ASSERT(list_empty(&biow_list_sorted));
 
+		wait_for_absorb_delay(wdev);
+
 		/* Dequeue all bio wrappers from the submit queue. */
 		spin_lock(&iocored->datapack_submit_queue_lock);
 		is_empty = list_empty(&iocored->datapack_submit_queue);
-		if (is_empty) {
+		if (is_empty && list_empty(&biow_list_deferred)) {
 			clear_working_flag(
 				IOCORE_STATE_SUBMIT_DATA_TASK_WORKING,
 				&iocored->flags);
@@ -671,19 +960,17 @@ static void task_submit_bio_wrapper_list(struct work_struct *work)
 			n_io++;
 			lsid = biow->lsid;
 			ASSERT(biow->len > 0);
-			if (bio_wrapper_state_is_discard(biow))
-				pb = 0;
-			else
-				pb = capacity_pb(wdev->physical_bs, biow->len);
+			pb = capacity_pb(wdev->physical_bs,
+					bio_wrapper_log_data_lb(biow));
 			BIO_WRAPPER_CHANGE_STATE(biow);
 			if (n_io >= wdev->n_io_bulk) { break; }
 		}
 		spin_unlock(&iocored->datapack_submit_queue_lock);
-		if (is_empty) { break; }
+		if (is_empty && list_empty(&biow_list_deferred)) { break; }
 
 		/* Wait for all previous log must be permanent
 		   before submitting data IO. */
-		if (!wait_for_log_permanent(wdev, lsid + pb)) {
+		if (!is_empty && !wait_for_log_permanent(wdev, lsid + pb)) {
 			/* The device became read-only mode
 			   so all write IOs must be error. */
 			size_t nr = 0;
@@ -696,25 +983,21 @@ static void task_submit_bio_wrapper_list(struct work_struct *work)
 			continue;
 		}
 
+		/* Read data of spilled bio wrappers from the log device. */
+		reload_spilled_bio_wrapper_list(wdev, &biow_list);
+
 #ifdef WALB_OVERLAPPED_SERIALIZE
 		/* Check and insert to overlapped detection data. */
+		spin_lock(&iocored->overlapped_data_lock);
 		list_for_each_entry(biow, &biow_list, list2) {
-		retry_insert_ol:
-			spin_lock(&iocored->overlapped_data_lock);
-			ret = overlapped_check_and_insert(
-				iocored->overlapped_data,
-				&iocored->max_sectors_in_overlapped,
-				biow, GFP_ATOMIC
+			overlapped_check_and_insert(
+				iocored->overlapped_data, biow
 #ifdef WALB_DEBUG
 				, &iocored->overlapped_in_id
 #endif
 				);
-			spin_unlock(&iocored->overlapped_data_lock);
-			if (!ret) {
-				schedule();
-				goto retry_insert_ol;
-			}
 		}
+		spin_unlock(&iocored->overlapped_data_lock);
 #endif /* WALB_OVERLAPPED_SERIALIZE */
 
 		/* Sort IOs. */
@@ -722,105 +1005,170 @@ static void task_submit_bio_wrapper_list(struct work_struct *work)
 			clear_flush_bit(&biow->cloned_bio_list);
 
 #ifdef WALB_OVERLAPPED_SERIALIZE
-			if (!bio_wrapper_state_is_delayed(biow)) {
-				ASSERT(biow->n_overlapped == 0);
-				if (sort_data_io_) {
-					/* Sort. */
-					insert_to_sorted_bio_wrapper_list_by_pos(
-						biow, &biow_list_sorted);
-				} else {
-					list_add_tail(&biow->list4, &biow_list_sorted);
-				}
-			} else {
-				/* Delayed. */
-			}
-#else /* WALB_OVERLAPPED_SERIALIZE */
-			if (sort_data_io_) {
-				/* Sort. */
-				insert_to_sorted_bio_wrapper_list_by_pos(
-					biow, &biow_list_sorted);
-			} else {
-				list_add_tail(&biow->list4, &biow_list_sorted);
-			}
-#endif /* WALB_OVERLAPPED_SERIALIZE */
+			if (bio_wrapper_state_is_delayed(biow))
+				continue;
+			ASSERT(biow->n_overlapped == 0);
+#endif
+			list_add_tail(&biow->list4, &biow_list_sorted);
 		}
-
-		/* Submit. */
-		blk_start_plug(&plug);
-		list_for_each_entry_safe(biow, biow_next, &biow_list_sorted, list4) {
-			const bool is_plugging = false;
-			/* Submit bio wrapper. */
-			list_del(&biow->list4);
-			BIO_WRAPPER_CHANGE_STATE(biow);
-			BIO_WRAPPER_PRINT("data0", biow);
-			submit_write_bio_wrapper(biow, is_plugging);
+		if (sort_data_io_ >= 2) {
+			sort_bio_wrapper_list_cscan(
+				&biow_list_sorted, &biow_list_deferred,
+				&head_pos, is_empty);
+		} else {
+			list_splice_tail_init(&biow_list_deferred, &biow_list_sorted);
+			if (sort_data_io_)
+				list_sort(NULL, &biow_list_sorted, cmp_bio_wrapper_by_pos);
 		}
-		blk_finish_plug(&plug);
 
-		/* Enqueue wait task. */
-		spin_lock(&iocored->datapack_wait_queue_lock);
-		list_for_each_entry_safe(biow, biow_next, &biow_list, list2) {
-			BIO_WRAPPER_CHANGE_STATE(biow);
-			list_move_tail(&biow->list2, &iocored->datapack_wait_queue);
-		}
-		spin_unlock(&iocored->datapack_wait_queue_lock);
-		dispatch_wait_data_task(wdev);
+		/*
+		 * Each bio wrapper will be ended by its own work
+		 * after its data IO (see bio_end_io_for_data()),
+		 * so they must not be accessed through the list after submitted.
+		 * Delayed ones will be submitted by the work of
+		 * the overlapped bio wrapper.
+		 */
+		INIT_LIST_HEAD(&biow_list);
+
+		/* Submit. */
+		submit_write_bio_wrapper_list(wdev, &biow_list_sorted);
 	}
 
 	LOG_("end.\n");
 }
 
 /**
- * Wait for bio wrapper list for data device.
+ * End a write bio wrapper after its data IO completed.
+ *
+ * Bio wrappers are ended in the completion order,
+ * not in the lsid order. Their logs are already permanent and
+ * written_lsid is still updated in the lsid order by the gc task.
+ *
+ * CONTEXT:
+ *   Workqueue task queued by bio_end_io_for_data()
+ *   or submit_write_bio_wrapper().
  */
-static void task_wait_for_bio_wrapper_list(struct work_struct *work)
+static void task_end_write_bio_wrapper(struct work_struct *work)
 {
-	struct walb_dev *wdev;
-	struct iocore_data *iocored;
-	struct list_head biow_list;
+	struct bio_wrapper *biow = container_of(work, struct bio_wrapper, work);
+	struct walb_dev *wdev = biow->private_data;
 
-	get_wdev_and_iocored_from_work(&wdev, &iocored, work);
-	LOG_("begin.\n");
+	wait_for_write_bio_wrapper(wdev, biow);
+#ifdef WALB_PERFORMANCE_ANALYSIS
+	getnstimeofday(&biow->ts[WALB_TIME_DATA_COMPLETED]);
+#endif
+	latency_stage(biow, WALB_LAT_DATA_IO);
+	if (bio_wrapper_state_is_zero_copy(biow))
+		end_zero_copy_bio_wrapper(biow);
+	end_datapack_bio_wrapper(biow);
+}
 
-	INIT_LIST_HEAD(&biow_list);
-	for (;;) {
-		struct bio_wrapper *biow, *biow_next;
-		bool is_empty;
-		unsigned int n_io = 0;
+/**
+ * End io callback of the data IO of a write bio wrapper.
+ * This replaces the callback set by init_bio_entry().
+ */
+static void bio_end_io_for_data(struct bio *bio)
+{
+	struct bio_entry *bioe = bio->bi_private;
+	struct bio_wrapper *biow =
+		container_of(bioe, struct bio_wrapper, cloned_bioe);
 
-		ASSERT(list_empty(&biow_list));
+	ASSERT(bioe->bio == bio);
+	end_write_data_io(biow, bio->bi_error);
+}
 
-		/* Dequeue all bio wrappers from the submit queue. */
-		spin_lock(&iocored->datapack_wait_queue_lock);
-		is_empty = list_empty(&iocored->datapack_wait_queue);
-		if (is_empty) {
-			clear_working_flag(
-				IOCORE_STATE_WAIT_DATA_TASK_WORKING,
-				&iocored->flags);
-		}
-		list_for_each_entry_safe(biow, biow_next,
-					&iocored->datapack_wait_queue, list2) {
-			list_move_tail(&biow->list2, &biow_list);
-			n_io++;
-			BIO_WRAPPER_CHANGE_STATE(biow);
-			if (n_io >= wdev->n_io_bulk) { break; }
-		}
-		spin_unlock(&iocored->datapack_wait_queue_lock);
-		if (is_empty) { break; }
-		ASSERT(n_io <= wdev->n_io_bulk);
+/**
+ * Endio callback for a bio merged from several bio wrappers.
+ * See submit_merged_write_data_io().
+ */
+static void bio_end_io_for_merged_data(struct bio *bio)
+{
+	struct bio_wrapper *first = bio->bi_private;
+	struct bio_wrapper *biow, *biow_next;
+	const int error = bio->bi_error;
+
+	/* The first one must be ended last
+	   because its list4 works as the list head. */
+	list_for_each_entry_safe(biow, biow_next, &first->list4, list4)
+		end_write_data_io(biow, error);
+	end_write_data_io(first, error);
+	bio_put(bio);
+}
 
-		/* Wait for write bio wrapper and notify to gc task. */
-		list_for_each_entry_safe(biow, biow_next, &biow_list, list2) {
-			list_del(&biow->list2);
-			wait_for_write_bio_wrapper(wdev, biow);
-#ifdef WALB_PERFORMANCE_ANALYSIS
-			getnstimeofday(&biow->ts[WALB_TIME_DATA_COMPLETED]);
-#endif
-			complete(&biow->done);
-		}
-	}
+/**
+ * Notify the data IO completion of a write bio wrapper.
+ * biow may be destroyed after this.
+ */
+static void end_write_data_io(struct bio_wrapper *biow, int error)
+{
+	struct bio_entry *bioe = &biow->cloned_bioe;
 
-	LOG_("end.\n");
+	bioe->error = error;
+	complete(&bioe->done);
+	queue_work(wq_unbound_, &biow->work);
+}
+
+/**
+ * Notify the gc task that a bio wrapper finished its data stage.
+ * The last one in a logpack wakes up the gc task.
+ * biow may be destroyed after this.
+ */
+static void end_datapack_bio_wrapper(struct bio_wrapper *biow)
+{
+	struct pack *wpack = biow->pack;
+	struct iocore_data *iocored = get_iocored_from_wdev(biow->private_data);
+
+	ASSERT(wpack);
+	complete(&biow->done);
+	if (atomic_dec_and_test(&wpack->n_data_pending))
+		wakeup_worker(&iocored->gc_worker_data);
+}
+
+/**
+ * End io callback of the logpack header IO or the flush IO of a pack.
+ * This replaces the callback set by init_bio_entry().
+ */
+static void bio_end_io_for_logpack_header(struct bio *bio)
+{
+	struct bio_entry *bioe = bio->bi_private;
+
+	ASSERT(bioe->bio == bio);
+	end_logpack_io(container_of(bioe, struct pack, header_bioe),
+		bioe, bio->bi_error);
+}
+
+/**
+ * End io callback of the log IO of a write bio wrapper.
+ * This replaces the callback set by init_bio_entry().
+ * Split bios are chained to this.
+ */
+static void bio_end_io_for_logpack_data(struct bio *bio)
+{
+	struct bio_entry *bioe = bio->bi_private;
+	struct bio_wrapper *biow =
+		container_of(bioe, struct bio_wrapper, cloned_bioe);
+
+	ASSERT(bioe->bio == bio);
+	end_logpack_io(biow->pack, bioe, bio->bi_error);
+}
+
+/**
+ * Notify a log IO completion of a pack.
+ * The last one dispatches the wait log task.
+ * wpack may be destroyed after this.
+ *
+ * CONTEXT:
+ *   IRQ.
+ */
+static void end_logpack_io(struct pack *wpack, struct bio_entry *bioe, int error)
+{
+	struct walb_dev *wdev = wpack->wdev;
+
+	ASSERT(wdev);
+	bioe->error = error;
+	complete(&bioe->done);
+	if (atomic_dec_and_test(&wpack->n_log_pending))
+		dispatch_wait_log_task(wdev);
 }
 
 /**
@@ -859,7 +1207,9 @@ static bool create_logpack_list(
 		completed_lsid, flush_lsid,
 		written_lsid, prev_written_lsid, oldest_lsid;
 	unsigned long log_flush_jiffies;
-	bool ret, is_flush = false;
+	unsigned int seq;
+	struct lsid_set lsids;
+	bool is_flush = false;
 
 	ASSERT(wdev);
 	iocored = get_iocored_from_wdev(wdev);
@@ -869,42 +1219,38 @@ static bool create_logpack_list(
 	might_sleep();
 
 	/* Load latest_lsid */
-	spin_lock(&wdev->lsid_lock);
-	latest_lsid = wdev->lsids.latest;
-	oldest_lsid = wdev->lsids.oldest;
-	completed_lsid = wdev->lsids.completed;
-	prev_written_lsid = wdev->lsids.prev_written;
-	written_lsid = wdev->lsids.written;
-	flush_lsid = wdev->lsids.flush;
-	log_flush_jiffies = iocored->log_flush_jiffies;
-	spin_unlock(&wdev->lsid_lock);
+	do {
+		seq = read_seqbegin(&wdev->lsid_lock);
+		latest_lsid = wdev->lsids.latest;
+		oldest_lsid = wdev->lsids.oldest;
+		completed_lsid = wdev->lsids.completed;
+		prev_written_lsid = wdev->lsids.prev_written;
+		written_lsid = wdev->lsids.written;
+		flush_lsid = wdev->lsids.flush;
+		log_flush_jiffies = iocored->log_flush_jiffies;
+	} while (read_seqretry(&wdev->lsid_lock, seq));
 	latest_lsid_old = latest_lsid;
 
 	/* Create logpack(s). */
 	list_for_each_entry_safe(biow, biow_next, biow_list, list) {
 		list_del(&biow->list);
-	retry:
-		ret = writepack_add_bio_wrapper(
-			wpack_list, &wpack, biow,
-			wdev->ring_buffer_size, wdev->max_logpack_pb,
+		latency_stage(biow, WALB_LAT_QUEUE);
+		writepack_add_bio_wrapper(
+			wpack_list, &wpack, biow, biow_list,
+			wdev->ring_buffer_size, get_logpack_max_pb(wdev),
 			&latest_lsid, wdev, GFP_NOIO, &is_flush);
-		if (!ret) {
-			WLOGw(wdev, "writepack_add_bio_wrapper failed.\n");
-			schedule();
-			goto retry;
-		}
 	}
 	if (wpack) {
 		struct walb_logpack_header *logh
 			= get_logpack_header(wpack->logpack_header_sector);
 		writepack_check_and_set_zeroflush(wpack, &is_flush);
-		ASSERT(is_prepared_pack_valid(wpack));
+		ASSERT(is_prepared_pack_valid(wpack, wdev->physical_bs));
 		list_add_tail(&wpack->list, wpack_list);
 		latest_lsid = get_next_lsid_unsafe(logh);
 	}
 
 	/* Currently all requests are packed and lsid of all writepacks is defined. */
-	ASSERT(is_pack_list_valid(wpack_list));
+	ASSERT(is_pack_list_valid(wpack_list, wdev->physical_bs));
 	ASSERT(!list_empty(wpack_list));
 	ASSERT(list_empty(biow_list));
 
@@ -932,14 +1278,14 @@ static bool create_logpack_list(
 
 	/* Store lsids. */
 	ASSERT(latest_lsid >= latest_lsid_old);
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	ASSERT(wdev->lsids.latest == latest_lsid_old);
 	wdev->lsids.latest = latest_lsid;
 	if (is_flush) {
 		wpack->new_permanent_lsid = wdev->lsids.completed;
 		update_flush_lsid_if_necessary(wdev, wpack->new_permanent_lsid);
 	}
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	/* Check ring buffer overflow. */
 	ASSERT(latest_lsid >= oldest_lsid);
@@ -975,10 +1321,9 @@ static bool create_logpack_list(
 				goto error;
 			start_checkpointing(&wdev->cpd);
 		}
-		spin_lock(&wdev->lsid_lock);
-		prev_written_lsid = wdev->lsids.prev_written;
-		written_lsid = wdev->lsids.written;
-		spin_unlock(&wdev->lsid_lock);
+		get_lsid_set(wdev, &lsids);
+		prev_written_lsid = lsids.prev_written;
+		written_lsid = lsids.written;
 	}
 
 	/* Now the logpack can be submitted. */
@@ -996,7 +1341,7 @@ error:
 				atomic_dec(&iocored->n_flush_logpack);
 #endif
 			ASSERT(!bio_entry_exists(&wpack->header_bioe));
-			destroy_pack(wpack);
+			destroy_pack(wdev, wpack);
 		}
 		ASSERT(list_empty(wpack_list));
 	}
@@ -1024,15 +1369,17 @@ static void submit_logpack_list(
 
 		ASSERT_SECTOR_DATA(wpack->logpack_header_sector);
 		logh = get_logpack_header(wpack->logpack_header_sector);
+		wpack->submit_ns = ktime_get_ns();
+		wpack->wdev = wdev;
+		wpack->seq = iocored->log_submit_seq++;
+		ASSERT(atomic_read(&wpack->n_log_pending) == 1);
 
 		if (wpack->is_zero_flush_only) {
 			ASSERT(logh->n_records == 0);
 			WLOG_(wdev, "is_zero_flush_only\n");
-			if (!is_flush) {
-				/* do nothing because only the first wpack should submit flush request. */
-				continue;
-			}
-			logpack_submit_flush(wdev->ldev, wpack);
+			/* Only the first wpack should submit flush request. */
+			if (is_flush)
+				logpack_submit_flush(wdev->ldev, wpack);
 		} else {
 			ASSERT(logh->n_records > 0);
 			logpack_calc_checksum(logh, wdev->physical_bs,
@@ -1043,6 +1390,10 @@ static void submit_logpack_list(
 				wdev->ldev, wdev->ring_buffer_off,
 				wdev->ring_buffer_size, wdev->ldev_chunk_sectors);
 		}
+
+		/* The pack is not in the wait queue yet,
+		   so the caller dispatches the wait log task after enqueuing it. */
+		atomic_dec(&wpack->n_log_pending);
 	}
 	blk_finish_plug(&plug);
 }
@@ -1051,7 +1402,7 @@ static void submit_logpack_list(
  * Set checksum of each bio and calc/set log header checksum.
  *
  * @logh log pack header.
- * @pbs physical sector size (allocated size as logh).
+ * @pbs physical sector size.
  * @biow_list list of biow.
  *   checksum of each bio has already been calculated as biow->csum.
  */
@@ -1086,9 +1437,6 @@ static void logpack_calc_checksum(
 			continue;
 		}
 
-		biow->csum = bio_calc_checksum(
-			biow->copied_bio,
-			((struct walb_dev *)biow->private_data)->log_checksum_salt);
 		logh->record[i].checksum = biow->csum;
 		i++;
 	}
@@ -1102,8 +1450,9 @@ static void logpack_calc_checksum(
 	ASSERT(n_padding == logh->n_padding);
 	ASSERT(i == logh->n_records);
 	ASSERT(logh->checksum == 0);
-	logh->checksum = checksum((u8 *)logh, pbs, salt);
-	ASSERT(checksum((u8 *)logh, pbs, salt) == 0);
+	logh->checksum = checksum(
+		(u8 *)logh, pbs * get_logpack_header_pb(logh), salt);
+	ASSERT(checksum((u8 *)logh, pbs * get_logpack_header_pb(logh), salt) == 0);
 }
 
 /**
@@ -1144,19 +1493,26 @@ static void submit_logpack(
 	i = 0;
 	list_for_each_entry(biow, biow_list, list) {
 		struct walb_log_record *rec = &logh->record[i];
-		if (test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
+		u32 flags = rec->flags;
+		if (test_bit_u32(LOG_RECORD_PADDING, &flags)) {
 			i++;
 			rec = &logh->record[i];
+			flags = rec->flags;
 			/* The biow must be for the next record. */
 		}
 #ifdef WALB_PERFORMANCE_ANALYSIS
 		getnstimeofday(&biow->ts[WALB_TIME_LOG_SUBMITTED]);
 #endif
-		if (test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
+		latency_stage(biow, WALB_LAT_PACK);
+		if (test_bit_u32(LOG_RECORD_DISCARD, &flags)) {
 			/* No need to execute IO to the log device. */
 			ASSERT(bio_wrapper_state_is_discard(biow));
 			ASSERT(biow->bio->bi_rw & REQ_DISCARD);
 			ASSERT(biow->len > 0);
+		} else if (test_bit_u32(LOG_RECORD_ZERO, &flags)) {
+			/* All-zero data are not stored in the log device. */
+			ASSERT(bio_wrapper_state_is_zero(biow));
+			ASSERT(biow->len > 0);
 		} else if (biow->len == 0) {
 			/* Zero-sized IO will not be stored in logpack header.
 			   We just submit it and will wait for it. */
@@ -1168,14 +1524,22 @@ static void submit_logpack(
 
 			/* No need to submit here
 			   because its logpack header is flush request. */
+		} else if (biow->sub_offset > 0) {
+			/* Packed record.
+			   Its data is written by the bio of the first record
+			   in the physical block (see logpack_create_shared_bio()). */
+			ASSERT(i < logh->n_records);
+			ASSERT(rec->sub_offset == biow->sub_offset);
+			BIO_WRAPPER_PRINT("log0", biow);
 		} else {
 			/* Normal IO. */
 			ASSERT(i < logh->n_records);
 
 			BIO_WRAPPER_PRINT("log0", biow);
+			ASSERT(rec->sub_offset == 0);
 			/* submit bio(s) for the biow. */
 			logpack_submit_bio_wrapper(
-				biow, rec->lsid, pbs, ldev, ring_buffer_off,
+				biow, biow_list, rec->lsid, pbs, ldev, ring_buffer_off,
 				ring_buffer_size, chunk_sectors);
 		}
 		i++;
@@ -1204,11 +1568,12 @@ static void logpack_submit_header(
 	struct page *page;
 	u64 off_pb, off_lb;
 	int len;
+	const unsigned int size = pbs * get_logpack_header_pb(lhead);
 #ifdef WALB_DEBUG
 	struct page *page2;
 #endif
 	ASSERT(!bio_entry_exists(bioe));
-	ASSERT(pbs <= PAGE_SIZE);
+	ASSERT(size <= PAGE_SIZE);
 
 retry_bio:
 	bio = bio_alloc(GFP_NOIO, 1);
@@ -1219,7 +1584,7 @@ retry_bio:
 
 	page = virt_to_page(lhead);
 #ifdef WALB_DEBUG
-	page2 = virt_to_page((unsigned long)lhead + pbs - 1);
+	page2 = virt_to_page((unsigned long)lhead + size - 1);
 	ASSERT(page == page2);
 #endif
 	bio->bi_bdev = ldev;
@@ -1227,11 +1592,13 @@ retry_bio:
 	off_lb = addr_lb(pbs, off_pb);
 	bio->bi_iter.bi_sector = off_lb;
 	bio->bi_rw = is_flush ? WRITE_FLUSH : WRITE;
-	len = bio_add_page(bio, page, pbs, offset_in_page(lhead));
-	ASSERT(len == pbs);
+	len = bio_add_page(bio, page, size, offset_in_page(lhead));
+	ASSERT(len == size);
 
 	init_bio_entry(bioe, bio);
-	ASSERT((bio_entry_len(bioe) << 9) == pbs);
+	ASSERT((bio_entry_len(bioe) << 9) == size);
+	start_logpack_io(container_of(bioe, struct pack, header_bioe),
+			bioe, bio_end_io_for_logpack_header);
 
 	ASSERT(!should_split_bio_for_chunk(bioe->bio, chunk_sectors));
 	generic_make_request(bioe->bio);
@@ -1240,7 +1607,12 @@ retry_bio:
 /**
  * Submit all logpack bio(s) for a request.
  *
+ * If packed records follow in the last physical block of the request,
+ * the block is written by one bio with them.
+ *
  * @biow bio wrapper(which contains original bio).
+ *   Its data starts at the physical block of lsid.
+ * @biow_list bio wrappers of the logpack. biow is in it.
  * @lsid lsid of the bio in the logpack.
  * @pbs physical block size [bytes]
  * @ldev log device.
@@ -1248,24 +1620,43 @@ retry_bio:
  * @ring_buffer_size ring buffer size [physical block].
  */
 static void logpack_submit_bio_wrapper(
-	struct bio_wrapper *biow, u64 lsid,
+	struct bio_wrapper *biow, struct list_head *biow_list, u64 lsid,
 	unsigned int pbs, struct block_device *ldev,
 	u64 ring_buffer_off, u64 ring_buffer_size,
 	unsigned int chunk_sectors)
 {
 	struct bio_entry *bioe;
 	const u64 ldev_off_pb = get_offset_of_lsid(lsid, ring_buffer_off, ring_buffer_size);
+	struct bio *shared_bio;
+	unsigned int front_lb;
 	struct list_head tmp_list;
 	struct bio_list bio_list;
 
 	INIT_LIST_HEAD(&tmp_list);
 	ASSERT(biow);
 	ASSERT(biow->copied_bio);
+	ASSERT(biow->sub_offset == 0);
 	ASSERT(!bio_wrapper_state_is_discard(biow));
 	ASSERT((biow->copied_bio->bi_rw & REQ_DISCARD) == 0);
 
 	bioe = &biow->cloned_bioe;
-	logpack_init_bio_entry(bioe, biow->copied_bio, pbs, ldev, ldev_off_pb, 0);
+	shared_bio = logpack_create_shared_bio(
+		biow, biow_list, pbs, ldev, ldev_off_pb, &front_lb);
+	if (shared_bio && front_lb == 0) {
+		/* The whole data is in the shared block. */
+		init_bio_entry(bioe, shared_bio);
+		shared_bio = NULL;
+	} else {
+		logpack_init_bio_entry(
+			bioe, biow->copied_bio, pbs, ldev, ldev_off_pb, 0);
+		if (shared_bio) {
+			/* The shared block is written by shared_bio. */
+			bioe->bio->bi_iter.bi_size = front_lb << 9;
+			bioe->iter = bioe->bio->bi_iter;
+			bio_chain(shared_bio, bioe->bio);
+		}
+	}
+	start_logpack_io(biow->pack, bioe, bio_end_io_for_logpack_data);
 
 	/* split if required. */
 	bio_list = split_bio_for_chunk_never_giveup(
@@ -1274,8 +1665,134 @@ static void logpack_submit_bio_wrapper(
 
 	/* really submit */
 	LOG_("submit_lr: bioe %p pos %" PRIu64 " len %u\n"
-		, bioe, bioe->pos, bioe->len);
+		, bioe, bio_entry_pos(bioe), bio_entry_len(bioe));
 	submit_all_bio_list(&bio_list);
+	if (shared_bio) {
+		ASSERT(!should_split_bio_for_chunk(shared_bio, chunk_sectors));
+		generic_make_request(shared_bio);
+	}
+}
+
+/**
+ * Create a bio to write the last physical block of a log record
+ * together with the packed records following in the block.
+ *
+ * Partial writes to a physical block are read-modify-write
+ * in devices with 512-byte logical blocks inside larger physical blocks.
+ * Concurrent ones to the same block may break each other,
+ * so the shared block must be written by one bio.
+ *
+ * @biow bio wrapper whose data starts at a physical block.
+ * @biow_list bio wrappers of the logpack. biow is in it.
+ * @pbs physical block size [bytes].
+ * @ldev log device.
+ * @ldev_off_pb log device offset of the biow data [physical block].
+ * @front_lbp the size of the biow data before the shared block
+ *   [logical block] will be set.
+ *
+ * RETURN:
+ *   a bio for the shared block, or NULL if no packed record follows.
+ */
+static struct bio* logpack_create_shared_bio(
+	struct bio_wrapper *biow, struct list_head *biow_list,
+	unsigned int pbs, struct block_device *ldev, u64 ldev_off_pb,
+	unsigned int *front_lbp)
+{
+	const unsigned int data_lb = get_log_data_lb(biow);
+	const unsigned int front_lb = data_lb - (unsigned int)off_in_pb(pbs, data_lb);
+	struct bio_wrapper *first = biow, *last = biow;
+	struct bio *bio;
+	unsigned int end_lb, nr_vecs;
+
+	ASSERT(biow->sub_offset == 0);
+
+	/* Find the packed records in the shared block.
+	   Records without data may be put among them. */
+	end_lb = data_lb - front_lb;
+	nr_vecs = add_log_data_pages(NULL, biow->copied_bio, front_lb, end_lb);
+	list_for_each_entry_continue(biow, biow_list, list) {
+		if (biow->len == 0 || bio_wrapper_state_is_discard(biow) ||
+			bio_wrapper_state_is_zero(biow))
+			continue;
+		if (biow->sub_offset == 0)
+			break;
+		ASSERT(biow->sub_offset == end_lb);
+		nr_vecs += add_log_data_pages(
+			NULL, biow->copied_bio, 0, get_log_data_lb(biow));
+		end_lb += get_log_data_lb(biow);
+		last = biow;
+	}
+	if (last == first)
+		return NULL;
+	ASSERT(end_lb <= n_lb_in_pb(pbs));
+
+retry_bio:
+	bio = bio_alloc(GFP_NOIO, nr_vecs);
+	if (!bio) {
+		schedule();
+		goto retry_bio;
+	}
+	bio->bi_bdev = ldev;
+	bio->bi_iter.bi_sector = addr_lb(pbs, ldev_off_pb) + front_lb;
+	bio->bi_rw = WRITE;
+
+	biow = first;
+	add_log_data_pages(bio, biow->copied_bio, front_lb, data_lb - front_lb);
+	list_for_each_entry_continue(biow, biow_list, list) {
+		if (biow->len == 0 || bio_wrapper_state_is_discard(biow) ||
+			bio_wrapper_state_is_zero(biow))
+			continue;
+		add_log_data_pages(bio, biow->copied_bio, 0, get_log_data_lb(biow));
+		if (biow == last)
+			break;
+	}
+	ASSERT(bio->bi_iter.bi_size == (end_lb << 9));
+
+	*front_lbp = front_lb;
+	return bio;
+}
+
+/**
+ * Add pages of a range of a bio to another bio.
+ *
+ * @bio bio to add the pages to, or NULL to count them only.
+ *   It must have enough room.
+ * @src source bio.
+ * @off_lb offset of the range in src [logical block].
+ * @n_lb size of the range [logical block].
+ *
+ * RETURN:
+ *   number of the segments in the range.
+ */
+static unsigned int add_log_data_pages(
+	struct bio *bio, struct bio *src, unsigned int off_lb, unsigned int n_lb)
+{
+	struct bvec_iter start = src->bi_iter, iter;
+	struct bio_vec bv;
+	unsigned int nr = 0;
+
+	bio_advance_iter(src, &start, off_lb << 9);
+	ASSERT(start.bi_size >= (n_lb << 9));
+	start.bi_size = n_lb << 9;
+	__bio_for_each_segment(bv, src, iter, start) {
+		if (bio) {
+			UNUSED int len = bio_add_page(
+				bio, bv.bv_page, bv.bv_len, bv.bv_offset);
+			ASSERT(len == bv.bv_len);
+		}
+		nr++;
+	}
+	return nr;
+}
+
+/**
+ * RETURN:
+ *   size of the data of a bio wrapper in the log [logical block].
+ *   Only the payload of a write same bio is stored.
+ */
+static unsigned int get_log_data_lb(const struct bio_wrapper *biow)
+{
+	return bio_wrapper_state_is_write_same(biow) ? 1 : biow->len;
 }
 
 /**
@@ -1300,6 +1817,11 @@ static struct bio* logpack_create_bio(
 		const unsigned long mask = REQ_FLUSH | REQ_FUA;
 		cbio->bi_rw &= ~mask;
 	}
+	/* Only the payload of a write same bio is written to the log device. */
+	if (cbio->bi_rw & REQ_WRITE_SAME) {
+		cbio->bi_rw &= ~REQ_WRITE_SAME;
+		cbio->bi_iter.bi_size = LOGICAL_BLOCK_SIZE;
+	}
 
 	return cbio;
 }
@@ -1311,7 +1833,7 @@ static struct bio* logpack_create_bio(
  * @bio original bio to clone.
  * @pbs physical block device [bytes].
  * @ldev_off_pb log device offset for the request [physical block].
- * @bio_off_lb offset of the bio inside the whole request [logical block].
+ * @bio_off_lb offset of the bio from ldev_off_pb [logical block].
  */
 static void logpack_init_bio_entry(
 	struct bio_entry *bioe, struct bio *bio,
@@ -1344,24 +1866,90 @@ static void logpack_submit_flush(struct block_device *bdev, struct pack *pack)
 }
 
 /**
- * Gc logpack list.
+ * Count a log IO of a pack in flight and hook its completion.
+ * This must be called before the bio of bioe is submitted.
  */
-static void gc_logpack_list(struct walb_dev *wdev, struct list_head *wpack_list)
+static void start_logpack_io(
+	struct pack *wpack, struct bio_entry *bioe, bio_end_io_t *end_io)
 {
-	struct pack *wpack, *wpack_next;
-	u64 written_lsid = INVALID_LSID;
+	ASSERT(wpack);
+	ASSERT(bio_entry_exists(bioe));
+
+	bioe->bio->bi_end_io = end_io;
+	atomic_inc(&wpack->n_log_pending);
+}
+
+/**
+ * RETURN:
+ *   true if all the log IOs of the pack have completed.
+ */
+static bool is_logpack_log_io_done(struct pack *wpack)
+{
+	if (atomic_read(&wpack->n_log_pending) > 0)
+		return false;
+
+	/* Pairs with atomic_dec_and_test() in end_logpack_io(). */
+	smp_rmb();
+	return true;
+}
+
+/**
+ * RETURN:
+ *   true if all the bio wrappers of the pack have finished the data stage.
+ */
+static bool is_logpack_data_io_done(struct pack *wpack)
+{
+	if (atomic_read(&wpack->n_data_pending) > 0)
+		return false;
+
+	/* Pairs with atomic_dec_and_test() in end_datapack_bio_wrapper(). */
+	smp_rmb();
+	return true;
+}
+
+/**
+ * RETURN:
+ *   true if the head of the logpack wait queue can be processed.
+ */
+static bool is_logpack_wait_queue_head_done(struct iocore_data *iocored)
+{
+	struct pack *wpack;
+	bool ret = false;
+
+	spin_lock(&iocored->logpack_wait_queue_lock);
+	if (!list_empty(&iocored->logpack_wait_queue)) {
+		wpack = list_first_entry(
+			&iocored->logpack_wait_queue, struct pack, list);
+		ret = is_logpack_log_io_done(wpack);
+	}
+	spin_unlock(&iocored->logpack_wait_queue_lock);
+	return ret;
+}
+
+/**
+ * Gc logpack list.
+ * All the bio wrappers of the packs must have finished the data stage
+ * (see is_logpack_data_io_done()).
+ */
+static void gc_logpack_list(struct walb_dev *wdev, struct list_head *wpack_list)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct pack *wpack, *wpack_next;
+	u64 written_lsid = INVALID_LSID;
 
 	ASSERT(!list_empty(wpack_list));
 
 	list_for_each_entry_safe(wpack, wpack_next, wpack_list, list) {
 		struct bio_wrapper *biow, *biow_next;
 		list_del(&wpack->list);
+		ASSERT(wpack->seq == iocored->gc_seq);
+		iocored->gc_seq++;
 		list_for_each_entry_safe(biow, biow_next, &wpack->biow_list, list) {
 			list_del(&biow->list);
 #ifdef WALB_DEBUG
 			ASSERT(bio_wrapper_state_is_prepared(biow));
 #endif
-			wait_for_bio_wrapper(biow, completion_timeo_ms_);
+			ASSERT(completion_done(&biow->done));
 #ifdef WALB_DEBUG
 			if (!test_bit(WALB_STATE_READ_ONLY, &wdev->flags)) {
 				ASSERT(bio_wrapper_state_is_submitted(biow));
@@ -1383,19 +1971,26 @@ static void gc_logpack_list(struct walb_dev *wdev, struct list_head *wpack_list)
 		written_lsid = get_next_lsid_unsafe(
 			get_logpack_header(wpack->logpack_header_sector));
 
-		destroy_pack(wpack);
+		destroy_pack(wdev, wpack);
 	}
 	ASSERT(list_empty(wpack_list));
 
 	/* Update written_lsid. */
 	ASSERT(written_lsid != INVALID_LSID);
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.written = written_lsid;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 }
 
 /**
  * Get logpack(s) from the gc queue and execute gc for them.
+ *
+ * Packs are collected in the submission order (pack->seq)
+ * so written_lsid advances in lsid order.
+ * This never blocks on data IOs: it stops at the first pack
+ * that still has bio wrappers in the data stage
+ * and the last of them wakes up the gc worker again
+ * (see end_datapack_bio_wrapper()).
  */
 static void dequeue_and_gc_logpack_list(struct walb_dev *wdev)
 {
@@ -1409,19 +2004,19 @@ static void dequeue_and_gc_logpack_list(struct walb_dev *wdev)
 
 	INIT_LIST_HEAD(&wpack_list);
 	while (true) {
-		bool is_empty;
 		int n_pack = 0;
-		/* Dequeue logpack list */
+		/* Dequeue the completed logpacks at the head of the gc queue. */
 		spin_lock(&iocored->logpack_gc_queue_lock);
-		is_empty = list_empty(&iocored->logpack_gc_queue);
 		list_for_each_entry_safe(wpack, wpack_next,
 					&iocored->logpack_gc_queue, list) {
+			if (!is_logpack_data_io_done(wpack))
+				break;
 			list_move_tail(&wpack->list, &wpack_list);
 			n_pack++;
 			if (n_pack >= wdev->n_pack_bulk) { break; }
 		}
 		spin_unlock(&iocored->logpack_gc_queue_lock);
-		if (is_empty) { break; }
+		if (n_pack == 0) { break; }
 
 		/* Gc */
 		gc_logpack_list(wdev, &wpack_list);
@@ -1434,13 +2029,15 @@ static void dequeue_and_gc_logpack_list(struct walb_dev *wdev)
  * Check whether pack is valid.
  *   Assume just created and filled. checksum is not calculated at all.
  *
+ * @pack pack to check.
+ * @pbs physical block size [bytes].
+ *
  * RETURN:
  *   true if valid, or false.
  */
-static bool is_prepared_pack_valid(struct pack *pack)
+static bool is_prepared_pack_valid(struct pack *pack, unsigned int pbs)
 {
 	struct walb_logpack_header *lhead;
-	unsigned int pbs;
 	unsigned int i;
 	struct bio_wrapper *biow;
 	u64 total_pb; /* total io size in physical block. */
@@ -1453,10 +2050,11 @@ static bool is_prepared_pack_valid(struct pack *pack)
 	CHECKd(pack->logpack_header_sector);
 
 	lhead = get_logpack_header(pack->logpack_header_sector);
-	pbs = pack->logpack_header_sector->size;
 	ASSERT_PBS(pbs);
+	CHECKd(pack->logpack_header_sector->size == max_logpack_header_size(pbs));
 	CHECKd(lhead);
 	CHECKd(is_valid_logpack_header(lhead));
+	CHECKd(get_logpack_header_pb(lhead) <= max_n_logpack_header_pb(pbs));
 
 	CHECKd(!list_empty(&pack->biow_list));
 
@@ -1494,11 +2092,17 @@ static bool is_prepared_pack_valid(struct pack *pack)
 		CHECKd(biow->pos == (sector_t)lrec->offset);
 		CHECKd(lhead->logpack_lsid == lrec->lsid - lrec->lsid_local);
 		CHECKd(biow->len == lrec->io_size);
+		CHECKd(!test_bit_u32(LOG_RECORD_ZERO, &lrec->flags)
+			== !bio_wrapper_state_is_zero(biow));
+		if (!bio_wrapper_state_is_zero(biow)) {
+			CHECKd(!test_bit_u32(LOG_RECORD_WRITE_SAME, &lrec->flags)
+				== !bio_wrapper_state_is_write_same(biow));
+		}
 		if (test_bit_u32(LOG_RECORD_DISCARD, &lrec->flags)) {
 			CHECKd(bio_wrapper_state_is_discard(biow));
 		} else {
 			CHECKd(!bio_wrapper_state_is_discard(biow));
-			total_pb += capacity_pb(pbs, lrec->io_size);
+			total_pb += log_record_n_pb(lrec, pbs);
 		}
 		i++;
 	}
@@ -1530,16 +2134,17 @@ error:
  * This is just for debug.
  *
  * @listh list of struct pack.
+ * @pbs physical block size [bytes].
  *
  * RETURN:
  *   true if valid, or false.
  */
-static bool is_pack_list_valid(struct list_head *pack_list)
+static bool is_pack_list_valid(struct list_head *pack_list, unsigned int pbs)
 {
 	struct pack *pack;
 
 	list_for_each_entry(pack, pack_list, list) {
-		CHECKd(is_prepared_pack_valid(pack));
+		CHECKd(is_prepared_pack_valid(pack, pbs));
 	}
 	return true;
 error:
@@ -1550,9 +2155,10 @@ error:
  * Create iocore data.
  * GC worker will not be started inside this function.
  */
-static struct iocore_data* create_iocore_data(gfp_t gfp_mask)
+static struct iocore_data* create_iocore_data(gfp_t gfp_mask, unsigned int pbs)
 {
 	struct iocore_data *iocored;
+	int cpu;
 
 	iocored = kmalloc(sizeof(struct iocore_data), gfp_mask);
 	if (!iocored) {
@@ -1563,18 +2169,36 @@ static struct iocore_data* create_iocore_data(gfp_t gfp_mask)
 	/* Flags. */
 	iocored->flags = 0;
 
+	/* Per-cpu submit stage. */
+	iocored->submit_stage = alloc_percpu(struct submit_stage);
+	if (!iocored->submit_stage) {
+		LOGe("submit_stage allocation failure.\n");
+		goto error1;
+	}
+	for_each_possible_cpu(cpu) {
+		struct submit_stage *stage =
+			per_cpu_ptr(iocored->submit_stage, cpu);
+		spin_lock_init(&stage->lock);
+		INIT_LIST_HEAD(&stage->list);
+	}
+	cpumask_clear(&iocored->submit_stage_mask);
+
+	/* Latency histograms. */
+	iocored->latency = walb_latency_alloc();
+	if (!iocored->latency) {
+		LOGe("latency allocation failure.\n");
+		goto error2;
+	}
+
 	/* Queues and their locks. */
 	spin_lock_init(&iocored->logpack_submit_queue_lock);
-	iocored->is_frozen_sys = false;
-	iocored->is_frozen_usr = false;
+	iocored->is_frozen = false;
 	INIT_LIST_HEAD(&iocored->frozen_queue);
 	INIT_LIST_HEAD(&iocored->logpack_submit_queue);
 	spin_lock_init(&iocored->logpack_wait_queue_lock);
 	INIT_LIST_HEAD(&iocored->logpack_wait_queue);
 	spin_lock_init(&iocored->datapack_submit_queue_lock);
 	INIT_LIST_HEAD(&iocored->datapack_submit_queue);
-	spin_lock_init(&iocored->datapack_wait_queue_lock);
-	INIT_LIST_HEAD(&iocored->datapack_wait_queue);
 	spin_lock_init(&iocored->logpack_gc_queue_lock);
 	INIT_LIST_HEAD(&iocored->logpack_gc_queue);
 
@@ -1583,17 +2207,47 @@ static struct iocore_data* create_iocore_data(gfp_t gfp_mask)
 	atomic_set(&iocored->n_pending_bio, 0);
 	atomic_set(&iocored->n_pending_gc, 0);
 
+	/* Log wait stage and pack sequence counters. */
+	iocored->wdev = NULL;
+	INIT_WORK(&iocored->wait_log_work, task_wait_for_logpack_list);
+	iocored->log_submit_seq = 0;
+	iocored->log_wait_seq = 0;
+	iocored->gc_seq = 0;
+
 	/* Log flush time. */
 	iocored->log_flush_jiffies = jiffies;
+	mutex_init(&iocored->ldev_flush_lock);
+	init_waitqueue_head(&iocored->log_permanent_wait_queue);
+
+	/* Group commit of FUA bios. */
+	spin_lock_init(&iocored->fua_lock);
+	INIT_LIST_HEAD(&iocored->fua_wait_list);
+	iocored->fua_flush_lsid = INVALID_LSID;
+	iocored->fua_flush_error = 0;
+	INIT_WORK(&iocored->fua_flush_work, task_end_fua_flush);
+
+	/* Adaptive logpack batching.
+	   The limits will be set by iocore_initialize(). */
+	iocored->cur_io_bulk = 0;
+	iocored->cur_logpack_pb = 0;
+	iocored->log_lat_avg_ns = 0;
+
+	iocored->logpack_header_pool = mempool_create(
+		LOGPACK_HEADER_POOL_MIN_NR,
+		logpack_header_pool_alloc, logpack_header_pool_free,
+		(void *)(unsigned long)pbs);
+	if (!iocored->logpack_header_pool) {
+		LOGe("logpack_header_pool allocation failure.\n");
+		goto error3;
+	}
 
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	spin_lock_init(&iocored->overlapped_data_lock);
-	iocored->overlapped_data = multimap_create(gfp_mask, &mmgr_);
+	iocored->overlapped_data = interval_multimap_create(gfp_mask, NULL);
 	if (!iocored->overlapped_data) {
 		LOGe("overlapped_data allocation failure.\n");
-		goto error1;
+		goto error4;
 	}
-	iocored->max_sectors_in_overlapped = 0;
 #ifdef WALB_DEBUG
 	iocored->overlapped_in_id = 0;
 	iocored->overlapped_out_id = 0;
@@ -1601,14 +2255,20 @@ static struct iocore_data* create_iocore_data(gfp_t gfp_mask)
 #endif
 
 	spin_lock_init(&iocored->pending_data_lock);
-	iocored->pending_data = multimap_create(gfp_mask, &mmgr_);
+	iocored->pending_data = interval_multimap_create(gfp_mask, NULL);
 	if (!iocored->pending_data) {
 		LOGe("pending_data allocation failure.\n");
-		goto error2;
+		goto error5;
 	}
 	iocored->pending_sectors = 0;
-	iocored->queue_restart_jiffies = jiffies;
-	iocored->max_sectors_in_pending = 0;
+	atomic_set(&iocored->inflight_sectors, 0);
+	init_waitqueue_head(&iocored->admission_wait_queue);
+	atomic64_set(&iocored->n_absorbed_io, 0);
+	atomic64_set(&iocored->n_absorbed_bytes, 0);
+	atomic64_set(&iocored->n_spilled_io, 0);
+	atomic64_set(&iocored->n_spilled_bytes, 0);
+	atomic64_set(&iocored->n_zero_io, 0);
+	atomic64_set(&iocored->n_zero_bytes, 0);
 
 #ifdef WALB_DEBUG
 	atomic_set(&iocored->n_flush_io, 0);
@@ -1619,13 +2279,19 @@ static struct iocore_data* create_iocore_data(gfp_t gfp_mask)
 #endif
 	return iocored;
 
-error2:
-	multimap_destroy(iocored->pending_data);
+error5:
+	interval_multimap_destroy(iocored->pending_data);
 
 #ifdef WALB_OVERLAPPED_SERIALIZE
-error1:
-	multimap_destroy(iocored->overlapped_data);
+error4:
+	interval_multimap_destroy(iocored->overlapped_data);
 #endif
+	mempool_destroy(iocored->logpack_header_pool);
+error3:
+	walb_latency_free(iocored->latency);
+error2:
+	free_percpu(iocored->submit_stage);
+error1:
 	kfree(iocored);
 error0:
 	return NULL;
@@ -1638,10 +2304,13 @@ static void destroy_iocore_data(struct iocore_data *iocored)
 {
 	ASSERT(iocored);
 
-	multimap_destroy(iocored->pending_data);
+	interval_multimap_destroy(iocored->pending_data);
 #ifdef WALB_OVERLAPPED_SERIALIZE
-	multimap_destroy(iocored->overlapped_data);
+	interval_multimap_destroy(iocored->overlapped_data);
 #endif
+	mempool_destroy(iocored->logpack_header_pool);
+	walb_latency_free(iocored->latency);
+	free_percpu(iocored->submit_stage);
 	kfree(iocored);
 }
 
@@ -1664,30 +2333,163 @@ static void make_frozen_queue_empty(struct iocore_data *iocored)
 }
 
 /**
- * Push a bio wrapper into the logpack submit queue if not stopped,
- * else use frozen queue.
+ * Push a bio wrapper into the submit stage of the current cpu.
+ * The logpack submit task will move it to the logpack submit queue
+ * if not stopped, else to the frozen queue.
+ *
+ * The global logpack_submit_queue_lock is not taken here
+ * so that many cpus can push bio wrappers concurrently.
  *
  * RETURN:
- *   true if the logpack submit queue is not empty.
+ *   true if the logpack submit task is not working.
  */
 static bool push_into_lpack_submit_queue(struct bio_wrapper *biow)
 {
-       struct walb_dev *wdev = biow->private_data;
-       struct iocore_data *iocored = get_iocored_from_wdev(wdev);
-       bool ret;
-
-       spin_lock(&iocored->logpack_submit_queue_lock);
-       if (is_frozen(iocored)) {
-               list_add_tail(&biow->list, &iocored->frozen_queue);
-               ret = !list_empty(&iocored->logpack_submit_queue);
-       } else {
-               make_frozen_queue_empty(iocored);
-               list_add_tail(&biow->list, &iocored->logpack_submit_queue);
-               ret = true;
-       }
-       spin_unlock(&iocored->logpack_submit_queue_lock);
+	struct walb_dev *wdev = biow->private_data;
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct submit_stage *stage;
+	int cpu;
+
+	cpu = get_cpu();
+	stage = per_cpu_ptr(iocored->submit_stage, cpu);
+	spin_lock(&stage->lock);
+	list_add_tail(&biow->list, &stage->list);
+	if (!cpumask_test_cpu(cpu, &iocored->submit_stage_mask))
+		cpumask_set_cpu(cpu, &iocored->submit_stage_mask);
+	spin_unlock(&stage->lock);
+	put_cpu();
+
+	/* Pairs with smp_mb() in task_submit_logpack_list(). */
+	smp_mb();
+	return !test_bit(IOCORE_STATE_SUBMIT_LOG_TASK_WORKING, &iocored->flags);
+}
+
+/**
+ * For list_sort() of bio wrappers linked with list4.
+ */
+static int cmp_bio_wrapper_by_pos(
+	void *priv, struct list_head *a, struct list_head *b)
+{
+	struct bio_wrapper *biow_a = list_entry(a, struct bio_wrapper, list4);
+	struct bio_wrapper *biow_b = list_entry(b, struct bio_wrapper, list4);
+
+	if (biow_a->pos < biow_b->pos)
+		return -1;
+	if (biow_a->pos > biow_b->pos)
+		return 1;
+	return 0;
+}
+
+/**
+ * Sort bio wrappers in C-SCAN order across batches.
+ *
+ * Bio wrappers at or after the head position are submitted in this batch
+ * in ascending order. The ones behind the head are deferred
+ * to following batches, until the sweep wraps around.
+ * The sweep wraps around when is_wrap is true (no more batches)
+ * or a deferred bio wrapper becomes older than cscan_max_age_ms_.
+ *
+ * A bio wrapper overlapping another one in the batch or the deferred ones
+ * is never deferred. Otherwise a newer overlapping write could reach
+ * the data device before it, which WALB_OVERLAPPED_SERIALIZE
+ * does not prevent when it is disabled.
+ *
+ * @biow_list bio wrappers linked with list4. They will be sorted.
+ * @deferred_list deferred bio wrappers linked with list4.
+ *   They are merged into biow_list, and the ones deferred again
+ *   are moved back.
+ * @head_posp head position, which is updated to the end of the last one.
+ * @is_wrap true to submit all.
+ */
+static void sort_bio_wrapper_list_cscan(
+	struct list_head *biow_list, struct list_head *deferred_list,
+	u64 *head_posp, bool is_wrap)
+{
+	const unsigned long max_age =
+		msecs_to_jiffies(READ_ONCE(cscan_max_age_ms_));
+	struct bio_wrapper *biow, *biow_next;
+	struct list_head behind;
+	u64 max_end = 0;
+
+	INIT_LIST_HEAD(&behind);
+	list_splice_tail_init(deferred_list, biow_list);
+	list_sort(NULL, biow_list, cmp_bio_wrapper_by_pos);
+
+	/* Cut the ones behind the head except overlapped ones.
+	   The list is sorted by position so a bio wrapper overlaps
+	   a following one if and only if it overlaps the next one. */
+	list_for_each_entry_safe(biow, biow_next, biow_list, list4) {
+		const u64 end = biow->pos + biow->len;
+		bool is_overlapped;
+
+		if (biow->pos >= *head_posp)
+			break;
+		is_overlapped = biow->pos < max_end ||
+			(!list_is_last(&biow->list4, biow_list) &&
+				biow_next->pos < end);
+		max_end = max(max_end, end);
+		if (time_after(jiffies, biow->start_time + max_age))
+			is_wrap = true;
+		if (!is_overlapped)
+			list_move_tail(&biow->list4, &behind);
+	}
+
+	if (is_wrap)
+		list_splice_tail_init(&behind, biow_list);
+	else
+		list_splice_tail_init(&behind, deferred_list);
+
+	if (!list_empty(biow_list)) {
+		biow = list_last_entry(biow_list, struct bio_wrapper, list4);
+		*head_posp = biow->pos + biow->len;
+	}
+}
+
+/**
+ * Move all bio wrappers in the per-cpu submit stages
+ * to the logpack submit queue or the frozen queue.
+ * Only non-empty stages in submit_stage_mask are visited.
+ * Each stage keeps its FIFO order. There is no order among
+ * bio wrappers of different cpus because they are in flight together,
+ * and lsids are assigned in the merged order.
+ *
+ * CONTEXT:
+ *   The logpack submit task only.
+ */
+static void move_submit_stage_to_queue(struct iocore_data *iocored)
+{
+	struct list_head biow_list;
+	int cpu;
+
+	INIT_LIST_HEAD(&biow_list);
+	for_each_cpu(cpu, &iocored->submit_stage_mask) {
+		struct submit_stage *stage =
+			per_cpu_ptr(iocored->submit_stage, cpu);
+		spin_lock(&stage->lock);
+		list_splice_tail_init(&stage->list, &biow_list);
+		cpumask_clear_cpu(cpu, &iocored->submit_stage_mask);
+		spin_unlock(&stage->lock);
+	}
+	if (list_empty(&biow_list))
+		return;
+
+	spin_lock(&iocored->logpack_submit_queue_lock);
+	if (iocored->is_frozen) {
+		list_splice_tail(&biow_list, &iocored->frozen_queue);
+	} else {
+		make_frozen_queue_empty(iocored);
+		list_splice_tail(&biow_list, &iocored->logpack_submit_queue);
+	}
+	spin_unlock(&iocored->logpack_submit_queue_lock);
+}
 
-       return ret;
+/**
+ * RETURN:
+ *   true if all the per-cpu submit stages are empty.
+ */
+static bool is_submit_stage_empty(struct iocore_data *iocored)
+{
+	return cpumask_empty(&iocored->submit_stage_mask);
 }
 
 static void update_biow_lsid(struct walb_logpack_header *logh, struct bio_wrapper *biow)
@@ -1701,6 +2503,7 @@ static void update_biow_lsid(struct walb_logpack_header *logh, struct bio_wrappe
 	ASSERT(rec->offset == biow->pos);
 	ASSERT(rec->io_size == biow->len);
 	biow->lsid = rec->lsid;
+	biow->sub_offset = rec->sub_offset;
 }
 
 /**
@@ -1709,20 +2512,21 @@ static void update_biow_lsid(struct walb_logpack_header *logh, struct bio_wrappe
  * @wpack_list wpack list.
  * @wpackp pointer to a wpack pointer. *wpackp can be NULL.
  * @biow bio_wrapper to add.
+ * @rest_list bio wrappers in the batch not added yet after the biow,
+ *   linked with list.
  * @ring_buffer_size ring buffer size [physical block]
  * @latest_lsidp pointer to the latest_lsid value.
  *   *latest_lsidp must be always (*wpackp)->logpack_lsid.
  * @wdev wrapper block device.
- * @gfp_mask memory allocation mask.
+ * @gfp_mask memory allocation mask. This must allow blocking
+ *   so that allocation from the mempools never fails.
  *
- * RETURN:
- *   true if successfuly added, or false (due to memory allocation failure).
  * CONTEXT:
  *   serialized.
  */
-static bool writepack_add_bio_wrapper(
+static void writepack_add_bio_wrapper(
 	struct list_head *wpack_list, struct pack **wpackp,
-	struct bio_wrapper *biow,
+	struct bio_wrapper *biow, struct list_head *rest_list,
 	u64 ring_buffer_size, unsigned int max_logpack_pb,
 	u64 *latest_lsidp, struct walb_dev *wdev, gfp_t gfp_mask, bool *is_flushp)
 {
@@ -1740,6 +2544,7 @@ static bool writepack_add_bio_wrapper(
 	ASSERT(biow->copied_bio);
 	ASSERT(biow->copied_bio->bi_rw & REQ_WRITE);
 	ASSERT(wdev);
+	ASSERT(gfpflags_allow_blocking(gfp_mask));
 	pbs = wdev->physical_bs;
 	ASSERT_PBS(pbs);
 
@@ -1752,7 +2557,7 @@ static bool writepack_add_bio_wrapper(
 
 	ASSERT(pack);
 	ASSERT(pack->logpack_header_sector);
-	ASSERT(pbs == pack->logpack_header_sector->size);
+	ASSERT(max_logpack_header_size(pbs) == pack->logpack_header_sector->size);
 	lhead = get_logpack_header(pack->logpack_header_sector);
 	ASSERT(*latest_lsidp == lhead->logpack_lsid);
 
@@ -1765,7 +2570,9 @@ static bool writepack_add_bio_wrapper(
 		/* Flush request must be the first of the pack. */
 		goto newpack;
 	}
-	if (!walb_logpack_header_add_bio(lhead, bio, pbs, ring_buffer_size)) {
+	if (!walb_logpack_header_add_bio(
+			lhead, bio, pbs, ring_buffer_size, wdev->is_log_packed,
+			bio_wrapper_state_is_zero(biow))) {
 		/* logpack header capacity full so create a new pack. */
 		goto newpack;
 	}
@@ -1775,20 +2582,26 @@ static bool writepack_add_bio_wrapper(
 newpack:
 	if (lhead) {
 		writepack_check_and_set_zeroflush(pack, is_flushp);
-		ASSERT(is_prepared_pack_valid(pack));
+		ASSERT(is_prepared_pack_valid(pack, pbs));
 		list_add_tail(&pack->list, wpack_list);
 		*latest_lsidp = get_next_lsid_unsafe(lhead);
 	}
-	pack = create_writepack(gfp_mask, pbs, *latest_lsidp);
-	if (!pack) { goto error0; }
+	pack = create_writepack(
+		get_iocored_from_wdev(wdev), gfp_mask, pbs, *latest_lsidp,
+		biow->len == 0 ? 1 : decide_n_header_pb(
+			wdev, *latest_lsidp, max_logpack_pb, biow, rest_list));
+	ASSERT(pack);
 	*wpackp = pack;
 	lhead = get_logpack_header(pack->logpack_header_sector);
-	ret = walb_logpack_header_add_bio(lhead, bio, pbs, ring_buffer_size);
+	ret = walb_logpack_header_add_bio(
+		lhead, bio, pbs, ring_buffer_size, wdev->is_log_packed,
+		bio_wrapper_state_is_zero(biow));
 	ASSERT(ret);
 	update_biow_lsid(lhead, biow);
 fin:
 	/* The request is just added to the pack. */
 	list_add_tail(&biow->list, &pack->biow_list);
+	biow->pack = pack;
 	if (bio->bi_rw & REQ_FLUSH && !(bio->bi_rw & REQ_FUA)) {
 		*is_flushp = true;
 
@@ -1802,66 +2615,6 @@ fin:
 		pack->is_fua_contained = true;
 	}
 	LOG_("normal end\n");
-	return true;
-error0:
-	LOG_("failure end\n");
-	return false;
-}
-
-/**
- * Insert a bio wrapper to a sorted bio wrapper list.
- * using insertion sort.
- *
- * They are sorted by biow->pos.
- * Use biow->list4 for list operations.
- *
- * Sort cost is O(n^2) in a worst case,
- * while the cost is O(1) in sequential write.
- *
- * @biow (struct bio_wrapper *)
- * @biow_list (struct list_head *)
- */
-static void insert_to_sorted_bio_wrapper_list_by_pos(
-	struct bio_wrapper *biow, struct list_head *biow_list)
-{
-	struct bio_wrapper *biow_tmp, *biow_next;
-	bool moved;
-#ifdef WALB_DEBUG
-	sector_t pos;
-#endif
-
-	ASSERT(biow);
-	ASSERT(biow_list);
-
-	if (!list_empty(biow_list)) {
-		/* last entry. */
-		biow_tmp = list_last_entry(biow_list, struct bio_wrapper, list4);
-		ASSERT(biow_tmp);
-		if (biow->pos > biow_tmp->pos) {
-			list_add_tail(&biow->list4, biow_list);
-			return;
-		}
-	}
-	moved = false;
-	list_for_each_entry_safe_reverse(biow_tmp, biow_next, biow_list, list4) {
-		if (biow->pos > biow_tmp->pos) {
-			list_add(&biow->list4, &biow_tmp->list4);
-			moved = true;
-			break;
-		}
-	}
-	if (!moved) {
-		list_add(&biow->list4, biow_list);
-	}
-
-#ifdef WALB_DEBUG
-	pos = 0;
-	list_for_each_entry_safe(biow_tmp, biow_next, biow_list, list4) {
-		LOG_("%" PRIu64 "\n", (u64)biow_tmp->pos);
-		ASSERT(pos <= biow_tmp->pos);
-		pos = biow_tmp->pos;
-	}
-#endif
 }
 
 /**
@@ -1895,45 +2648,58 @@ static bool wait_for_logpack_header(struct pack *wpack)
 }
 
 /**
- * Wait for completion of all bio(s) and enqueue datapack tasks.
+ * Check the results of all log bio(s) of a pack and prepare datapacks.
+ * All the log IOs must have completed (see is_logpack_log_io_done()),
+ * so the waits inside never block.
  *
- * Request success -> enqueue datapack.
+ * Request success -> add the bio wrapper to the biow_list.
  * Request failure -> all subsequent requests must fail.
  *
+ * FUA bios are not ended here.
+ * The caller must call queue_fua_pack_list() for them.
+ *
  * If any write failed, wdev will be read-only mode.
+ *
+ * @biow_list bio wrappers to be submitted to the data device
+ *   will be added using biow->list2.
+ *   Each of them is counted in wpack->n_data_pending.
  */
 /* TODO: refactor */
 static void wait_for_logpack_and_submit_datapack(
-	struct walb_dev *wdev, struct pack *wpack)
+	struct walb_dev *wdev, struct pack *wpack, struct list_head *biow_list)
 {
 	struct bio_wrapper *biow, *biow_next;
 	bool is_failed = false;
 	struct iocore_data *iocored;
-	bool is_pending_insert_succeeded;
-	bool is_stop_queue = false;
+	bool has_header_io;
 
 	ASSERT(wpack);
 	ASSERT(wdev);
+	ASSERT(atomic_read(&wpack->n_log_pending) == 0);
+	ASSERT(atomic_read(&wpack->n_data_pending) == 1);
 
 	/* Check read only mode. */
 	if (test_bit(WALB_STATE_READ_ONLY, &wdev->flags))
 		is_failed = true;
 
-	/* Wait for logpack header or flush IO. */
+	/* Logpack header or flush IO. */
+	has_header_io = bio_entry_exists(&wpack->header_bioe);
 	if (!wait_for_logpack_header(wpack))
 		is_failed = true;
+	else if (has_header_io)
+		update_log_latency(get_iocored_from_wdev(wdev), wpack);
 
 	/* Update permanent_lsid if necessary. */
 	if (!is_failed && pack_header_should_flush(wpack)) {
 		bool should_notice = false;
 		ASSERT(wpack->new_permanent_lsid != INVALID_LSID);
-		spin_lock(&wdev->lsid_lock);
+		write_seqlock(&wdev->lsid_lock);
 		if (wdev->lsids.permanent < wpack->new_permanent_lsid) {
 			should_notice = is_permanent_log_empty(&wdev->lsids);
 			wdev->lsids.permanent = wpack->new_permanent_lsid;
 			LOG_("log_flush_completed_header\n");
 		}
-		spin_unlock(&wdev->lsid_lock);
+		write_sequnlock(&wdev->lsid_lock);
 		if (should_notice)
 			walb_sysfs_notify(wdev, "lsids");
 	}
@@ -1941,7 +2707,7 @@ static void wait_for_logpack_and_submit_datapack(
 	iocored = get_iocored_from_wdev(wdev);
 	/*
 	 * For each biow,
-	 *   (1) Wait for each log IOs corresponding to the biow.
+	 *   (1) Get the result of the log IOs corresponding to the biow.
 	 *   (2) Flush request with size zero will be destoroyed.
 	 *   (3) Clone the bio and split if necessary.
 	 *   (4) Insert cloned bio to the pending data.
@@ -1954,6 +2720,7 @@ static void wait_for_logpack_and_submit_datapack(
 #ifdef WALB_PERFORMANCE_ANALYSIS
 		getnstimeofday(&biow->ts[WALB_TIME_LOG_COMPLETED]);
 #endif
+		latency_stage(biow, WALB_LAT_LOG_IO);
 		if (biow->len == 0) {
 			/* Zero-flush. */
 			ASSERT(wpack->is_zero_flush_only);
@@ -1967,7 +2734,13 @@ static void wait_for_logpack_and_submit_datapack(
 				bio_wrapper_state_is_discard(biow);
 			const bool support_discard =
 				blk_queue_discard(bdev_get_queue(wdev->ddev));
-			if (!is_discard || support_discard) {
+			const bool is_fua =
+				(biow->copied_bio->bi_rw & REQ_FUA) != 0;
+			if (should_spill_bio_wrapper(wdev, biow)) {
+				/* Drop the data. It will be read from the log device
+				   before the data IO. */
+				spill_bio_wrapper(wdev, biow);
+			} else if (!is_discard || support_discard) {
 				/* Create all related bio(s) by copying IO data. */
 				init_bio_entry_by_clone_never_giveup(
 					&biow->cloned_bioe, biow->copied_bio,
@@ -1986,71 +2759,39 @@ static void wait_for_logpack_and_submit_datapack(
 						GFP_NOIO);
 			}
 
-			/* Try to insert pending data. */
-		retry_insert_pending:
+			/* Insert to pending data. */
 			spin_lock(&iocored->pending_data_lock);
 			LOG_("pending_sectors %u\n", iocored->pending_sectors);
-			is_stop_queue = should_stop_queue(wdev, biow);
 			if (is_discard) {
 				/* Discard IO does not have buffer of biow->len bytes.
 				   We consider its metadata only. */
 				iocored->pending_sectors++;
-				is_pending_insert_succeeded = true;
 			} else {
 				iocored->pending_sectors += biow->len;
-				is_pending_insert_succeeded =
-					pending_insert_and_delete_fully_overwritten(
-						iocored->pending_data,
-						&iocored->max_sectors_in_pending,
-						biow, GFP_ATOMIC);
+				pending_insert_and_delete_fully_overwritten(
+					iocored->pending_data, biow);
 			}
 			spin_unlock(&iocored->pending_data_lock);
-			if (!is_pending_insert_succeeded) {
-				spin_lock(&iocored->pending_data_lock);
-				if (bio_wrapper_state_is_discard(biow)) {
-					iocored->pending_sectors--;
-				} else {
-					iocored->pending_sectors -= biow->len;
-				}
-				spin_unlock(&iocored->pending_data_lock);
-				schedule();
-				goto retry_insert_pending;
-			}
-
-			/* Check pending data size and stop the queue if needed. */
-			if (is_stop_queue && !test_and_set_bit(IOCORE_STATE_IS_QUEUE_STOPPED, &iocored->flags))
-				freeze_detail(iocored, false);
-
-			/* We must flush here for REQ_FUA request before calling bio_endio().
-			   because WalB must flush all the previous logpacks and
-			   the logpack header and all the previous IOs and itself in the same logpack
-			   in order to make the IO be permanent in the log device. */
-			if (biow->copied_bio->bi_rw & REQ_FUA) {
-				u32 pb;
-				if (bio_wrapper_state_is_discard(biow))
-					pb = 0;
-				else
-					pb = capacity_pb(wdev->physical_bs, biow->len);
-				spin_lock(&wdev->lsid_lock);
-				wdev->lsids.completed = biow->lsid + pb;
-				spin_unlock(&wdev->lsid_lock);
-				force_flush_ldev(wdev);
-			}
 
 			/* call endio here in fast algorithm,
-			   while easy algorithm call it after data device IO. */
-			io_acct_end(biow);
-			BIO_WRAPPER_PRINT("log1", biow);
-			bio_endio(biow->bio);
-			biow->bio = NULL;
+			   while easy algorithm call it after data device IO.
+			   Zero-copy wrappers share pages with the original bio,
+			   so they follow the easy algorithm.
+			   REQ_FUA requests will be ended after the log device flush
+			   by task_end_fua_flush(). */
+			if (!bio_wrapper_state_is_zero_copy(biow) && !is_fua) {
+				latency_end(biow);
+				io_acct_end(biow);
+				BIO_WRAPPER_PRINT("log1", biow);
+				bio_endio(biow->bio);
+				biow->bio = NULL;
+			}
 
 			bio_wrapper_state_set_prepared(biow);
 			BIO_WRAPPER_CHANGE_STATE(biow);
 
-			/* Enqueue submit datapack task. */
-			spin_lock(&iocored->datapack_submit_queue_lock);
-			list_add_tail(&biow->list2, &iocored->datapack_submit_queue);
-			spin_unlock(&iocored->datapack_submit_queue_lock);
+			atomic_inc(&wpack->n_data_pending);
+			list_add_tail(&biow->list2, biow_list);
 		}
 		continue;
 	error_io:
@@ -2069,7 +2810,7 @@ static void wait_for_logpack_and_submit_datapack(
 		struct walb_logpack_header *logh =
 			get_logpack_header(wpack->logpack_header_sector);
 		bool should_notice = false;
-		spin_lock(&wdev->lsid_lock);
+		write_seqlock(&wdev->lsid_lock);
 		wdev->lsids.completed = get_next_lsid(logh);
 		if (!(is_queue_flush_enabled(wdev->queue))) {
 			/* For flush-not-supportted device. */
@@ -2077,10 +2818,203 @@ static void wait_for_logpack_and_submit_datapack(
 			wdev->lsids.flush = wdev->lsids.completed;
 			wdev->lsids.permanent = wdev->lsids.completed;
 		}
-		spin_unlock(&wdev->lsid_lock);
+		write_sequnlock(&wdev->lsid_lock);
 		if (should_notice)
 			walb_sysfs_notify(wdev, "lsids");
 	}
+	wakeup_log_permanent_waiters(wdev);
+}
+
+/**
+ * Queue logpacks containing FUA bios for group commit.
+ *
+ * WalB must flush all the previous logpacks, the logpack header,
+ * and all the previous IOs and itself in the same logpack
+ * in order to make a REQ_FUA request be permanent in the log device.
+ * The FUA bios attach to the flush in flight if it covers them,
+ * or they share the next flush. They are ended in lsid order
+ * by task_end_fua_flush().
+ *
+ * Zero-copy FUA bios are ended after their data IOs,
+ * which wait for their logs to be permanent.
+ *
+ * @wpack_list logpacks processed by wait_for_logpack_and_submit_datapack().
+ *   completed_lsid covers all of them.
+ */
+static void queue_fua_pack_list(
+	struct walb_dev *wdev, struct list_head *wpack_list)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct pack *wpack;
+
+	spin_lock(&iocored->fua_lock);
+	list_for_each_entry(wpack, wpack_list, list) {
+		if (!wpack->is_fua_contained)
+			continue;
+		/* The pack must not be garbage-collected
+		   until its FUA bios are ended. */
+		atomic_inc(&wpack->n_data_pending);
+		list_add_tail(&wpack->fua_list, &iocored->fua_wait_list);
+	}
+	spin_unlock(&iocored->fua_lock);
+
+	start_fua_flush_if_necessary(wdev);
+}
+
+/**
+ * Submit a log device flush for the waiting FUA bios
+ * unless a flush is in flight.
+ * Its target is completed_lsid, which covers all the waiting packs.
+ *
+ * CONTEXT:
+ *   Non-atomic.
+ */
+static void start_fua_flush_if_necessary(struct walb_dev *wdev)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct bio *bio;
+	bool is_permanent;
+
+	spin_lock(&iocored->fua_lock);
+	if (iocored->fua_flush_lsid != INVALID_LSID ||
+		list_empty(&iocored->fua_wait_list)) {
+		spin_unlock(&iocored->fua_lock);
+		return;
+	}
+	write_seqlock(&wdev->lsid_lock);
+	iocored->fua_flush_lsid = wdev->lsids.completed;
+	is_permanent = iocored->fua_flush_lsid <= wdev->lsids.permanent;
+	if (!is_permanent)
+		update_flush_lsid_if_necessary(wdev, iocored->fua_flush_lsid);
+	write_sequnlock(&wdev->lsid_lock);
+	spin_unlock(&iocored->fua_lock);
+
+	if (is_permanent) {
+		/* Another flush has already made them permanent. */
+		iocored->fua_flush_error = 0;
+		queue_work(wq_unbound_, &iocored->fua_flush_work);
+		return;
+	}
+
+	/* This never fails because bio_alloc() uses a mempool. */
+	bio = bio_alloc(GFP_NOIO, 0);
+	ASSERT(bio);
+	bio->bi_bdev = wdev->ldev;
+	bio->bi_rw = WRITE_FLUSH;
+	bio->bi_end_io = bio_end_io_for_fua_flush;
+	bio->bi_private = wdev;
+#ifdef WALB_DEBUG
+	atomic_inc(&iocored->n_flush_force);
+#endif
+	generic_make_request(bio);
+}
+
+/**
+ * End io callback of the log device flush for FUA bios.
+ * lsid_lock can not be taken in IRQ context,
+ * so the rest is done by task_end_fua_flush().
+ */
+static void bio_end_io_for_fua_flush(struct bio *bio)
+{
+	struct walb_dev *wdev = bio->bi_private;
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	iocored->fua_flush_error = bio->bi_error;
+	bio_put(bio);
+	queue_work(wq_unbound_, &iocored->fua_flush_work);
+}
+
+/**
+ * Make permanent_lsid advance by the completed flush
+ * and end the FUA bios covered by it in lsid order.
+ * Then start the next flush for the rest.
+ *
+ * CONTEXT:
+ *   Workqueue task queued by bio_end_io_for_fua_flush()
+ *   or start_fua_flush_if_necessary().
+ *   The same task is not executed concurrently
+ *   because one flush is in flight at most.
+ */
+static void task_end_fua_flush(struct work_struct *work)
+{
+	struct iocore_data *iocored =
+		container_of(work, struct iocore_data, fua_flush_work);
+	struct walb_dev *wdev = iocored->wdev;
+	struct pack *wpack, *wpack_next;
+	struct list_head wpack_list;
+	u64 flush_lsid, permanent_lsid;
+	bool should_notice = false, is_failed;
+
+	ASSERT(iocored->fua_flush_lsid != INVALID_LSID);
+	flush_lsid = iocored->fua_flush_lsid;
+
+	if (iocored->fua_flush_error &&
+		!test_and_set_bit(WALB_STATE_READ_ONLY, &wdev->flags))
+		WLOGe(wdev, "log device flush failed. to be read-only mode.\n");
+	is_failed = test_bit(WALB_STATE_READ_ONLY, &wdev->flags);
+
+	/* Update permanent_lsid. */
+	write_seqlock(&wdev->lsid_lock);
+	if (!is_failed && wdev->lsids.permanent < flush_lsid) {
+		should_notice = is_permanent_log_empty(&wdev->lsids);
+		ASSERT(flush_lsid <= wdev->lsids.flush);
+		wdev->lsids.permanent = flush_lsid;
+		LOG_("log_flush_completed_fua\n");
+	}
+	permanent_lsid = wdev->lsids.permanent;
+	ASSERT(lsid_set_is_valid(&wdev->lsids));
+	write_sequnlock(&wdev->lsid_lock);
+	wakeup_log_permanent_waiters(wdev);
+	if (should_notice)
+		walb_sysfs_notify(wdev, "lsids");
+
+	/* Dequeue the packs covered by the flush. */
+	INIT_LIST_HEAD(&wpack_list);
+	spin_lock(&iocored->fua_lock);
+	iocored->fua_flush_lsid = INVALID_LSID;
+	list_for_each_entry_safe(wpack, wpack_next,
+				&iocored->fua_wait_list, fua_list) {
+		struct walb_logpack_header *logh =
+			get_logpack_header(wpack->logpack_header_sector);
+		if (!is_failed && get_next_lsid_unsafe(logh) > permanent_lsid)
+			break;
+		list_move_tail(&wpack->fua_list, &wpack_list);
+	}
+	spin_unlock(&iocored->fua_lock);
+
+	/* End them in lsid order. */
+	list_for_each_entry_safe(wpack, wpack_next, &wpack_list, fua_list) {
+		list_del_init(&wpack->fua_list);
+		end_fua_pack(wdev, wpack, is_failed);
+	}
+
+	start_fua_flush_if_necessary(wdev);
+}
+
+/**
+ * End the FUA bios of a logpack and drop its reference for them.
+ * wpack may be destroyed after this.
+ */
+static void end_fua_pack(struct walb_dev *wdev, struct pack *wpack, bool is_failed)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct bio_wrapper *biow;
+
+	list_for_each_entry(biow, &wpack->biow_list, list) {
+		if (bio_wrapper_state_is_zero_copy(biow) || !biow->bio)
+			continue;
+		ASSERT(biow->copied_bio->bi_rw & REQ_FUA);
+		latency_end(biow);
+		io_acct_end(biow);
+		BIO_WRAPPER_PRINT("log1", biow);
+		if (is_failed)
+			bio_io_error(biow->bio);
+		else
+			bio_endio(biow->bio);
+		biow->bio = NULL;
+	}
+	if (atomic_dec_and_test(&wpack->n_data_pending))
+		wakeup_worker(&iocored->gc_worker_data);
 }
 
 /**
@@ -2089,9 +3023,8 @@ static void wait_for_logpack_and_submit_datapack(
 static void wait_for_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow)
 {
-	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
-	bool starts_queue;
 #ifdef WALB_OVERLAPPED_SERIALIZE
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
 	struct bio_wrapper *biow_tmp, *biow_tmp_next;
 	unsigned int n_should_submit;
 	struct list_head should_submit_list;
@@ -2121,7 +3054,6 @@ static void wait_for_write_bio_wrapper(
 	spin_lock(&iocored->overlapped_data_lock);
 	n_should_submit = overlapped_delete_and_notify(
 		iocored->overlapped_data,
-		&iocored->max_sectors_in_overlapped,
 		&should_submit_list, biow
 #ifdef WALB_DEBUG
 		, &iocored->overlapped_out_id
@@ -2152,17 +3084,12 @@ static void wait_for_write_bio_wrapper(
 #endif
 
 	/* Delete from pending data. */
-	starts_queue = delete_bio_wrapper_from_pending_data(wdev, biow);
-	if (starts_queue && test_bit(IOCORE_STATE_IS_QUEUE_STOPPED, &iocored->flags)) {
-		if (melt_detail(iocored, false))
-			dispatch_submit_log_task(wdev);
-		clear_bit(IOCORE_STATE_IS_QUEUE_STOPPED, &iocored->flags);
-	}
+	delete_bio_wrapper_from_pending_data(wdev, biow);
 
 	/* Put related bio(s) and free resources. */
 	if (bio_entry_exists(&biow->cloned_bioe)) {
 		fin_bio_entry(&biow->cloned_bioe);
-	} else {
+	} else if (!bio_wrapper_state_is_overwritten(biow)) {
 		ASSERT(bio_wrapper_state_is_discard(biow));
 		ASSERT(!blk_queue_discard(bdev_get_queue(wdev->ddev)));
 	}
@@ -2193,7 +3120,10 @@ static void wait_for_bio_wrapper_io(struct bio_wrapper *biow, bool is_endio, boo
 		wait_for_bio_entry(bioe, completion_timeo_ms_);
 		biow->error = bioe->error;
 	} else
-		ASSERT(biow->len == 0 || bio_wrapper_state_is_discard(biow));
+		ASSERT(biow->len == 0 || bio_wrapper_state_is_discard(biow) ||
+			bio_wrapper_state_is_zero(biow) ||
+			bio_wrapper_state_is_overwritten(biow) ||
+			biow->sub_offset > 0);
 
 	if (is_endio) {
 		ASSERT(biow->bio);
@@ -2214,13 +3144,40 @@ static void wait_for_bio_wrapper_io(struct bio_wrapper *biow, bool is_endio, boo
  */
 static void submit_write_bio_wrapper(struct bio_wrapper *biow, bool is_plugging)
 {
-#ifdef WALB_DEBUG
-	struct walb_dev *wdev = biow->private_data;
-	const bool bioe_exists = bio_entry_exists(&biow->cloned_bioe);
-#endif
 	struct blk_plug plug;
 
-#ifdef WALB_OVERLAPPED_SERIALIZE
+	if (!begin_write_data_io(biow)) {
+		/* Absorbed, or discard IO not supported by the data device. */
+		queue_work(wq_unbound_, &biow->work);
+		return;
+	}
+
+	/* Submit all related bio(s). */
+	if (is_plugging)
+		blk_start_plug(&plug);
+
+	submit_write_data_io(biow);
+
+	if (is_plugging)
+		blk_finish_plug(&plug);
+}
+
+/**
+ * Mark a write bio wrapper submitted and decide whether its data IO is required.
+ * biow->work is initialized to end it.
+ *
+ * RETURN:
+ *   true if its cloned bio(s) must be submitted,
+ *   or false if biow->work must be queued instead.
+ */
+static bool begin_write_data_io(struct bio_wrapper *biow)
+{
+	struct walb_dev *wdev = biow->private_data;
+#ifdef WALB_DEBUG
+	const bool bioe_exists = bio_entry_exists(&biow->cloned_bioe);
+#endif
+
+#ifdef WALB_OVERLAPPED_SERIALIZE
 	ASSERT(biow->n_overlapped == 0);
 #endif
 
@@ -2234,51 +3191,524 @@ static void submit_write_bio_wrapper(struct bio_wrapper *biow, bool is_plugging)
 		!blk_queue_discard(bdev_get_queue(wdev->ddev))) {
 		/* Data device does not support REQ_DISCARD. */
 		ASSERT(!bioe_exists);
+	} else if (bio_wrapper_state_is_spilled(biow)) {
+		/* Not reloaded because it will be absorbed. */
+		ASSERT(!bioe_exists);
+		ASSERT(bio_wrapper_state_is_overwritten(biow));
 	} else {
 		ASSERT(bioe_exists);
 		ASSERT(!bio_list_empty(&biow->cloned_bio_list));
 	}
 #endif
-	/* Submit all related bio(s). */
-	if (is_plugging)
-		blk_start_plug(&plug);
+	if (bio_wrapper_state_is_overwritten(biow) &&
+		(bio_wrapper_state_is_spilled(biow) ||
+			(READ_ONCE(wdev->absorb_writes) &&
+				bio_entry_exists(&biow->cloned_bioe))))
+		absorb_write_bio_wrapper(wdev, biow);
 
 	LOG_("submit_lr: bioe %p pos %" PRIu64 " len %u\n"
 		, bioe, bioe->pos, bioe->len);
-	submit_all_bio_list(&biow->cloned_bio_list);
-
-	if (is_plugging)
-		blk_finish_plug(&plug);
-
+	latency_stage(biow, WALB_LAT_PENDING);
 #ifdef WALB_PERFORMANCE_ANALYSIS
 	getnstimeofday(&biow->ts[WALB_TIME_DATA_SUBMITTED]);
 #endif
+
+	INIT_WORK(&biow->work, task_end_write_bio_wrapper);
+	return bio_entry_exists(&biow->cloned_bioe);
 }
 
-static void cancel_write_bio_wrapper(struct walb_dev *wdev, struct bio_wrapper *biow)
+/**
+ * Submit the cloned bio(s) of a write bio wrapper as they are.
+ * biow may be ended and destroyed after this.
+ */
+static void submit_write_data_io(struct bio_wrapper *biow)
+{
+	ASSERT(bio_entry_exists(&biow->cloned_bioe));
+
+	biow->cloned_bioe.bio->bi_end_io = bio_end_io_for_data;
+	submit_all_bio_list(&biow->cloned_bio_list);
+}
+
+/**
+ * Whether a bio wrapper can be a member of a merged data IO.
+ * It must have just one cloned bio with data,
+ * which never crosses a chunk boundary.
+ * A write same bio can not be merged because it has only its payload.
+ */
+static bool is_mergeable_write_bio_wrapper(struct bio_wrapper *biow)
+{
+	struct bio_list *bio_list = &biow->cloned_bio_list;
+
+	return bio_list->head && bio_list->head == bio_list->tail &&
+		bio_has_data(biow->cloned_bioe.bio) &&
+		!bio_wrapper_state_is_write_same(biow);
+}
+
+/**
+ * Whether [pos, pos + len) is inside a chunk.
+ */
+static bool is_in_a_chunk(u64 pos, unsigned int len, unsigned int chunk_sectors)
+{
+	u64 last = pos + len - 1;
+
+	if (chunk_sectors == 0)
+		return true;
+
+	do_div(pos, chunk_sectors);
+	do_div(last, chunk_sectors);
+	return pos == last;
+}
+
+/**
+ * Submit sorted write bio wrappers to the data device.
+ * LBA-contiguous ones with the same bi_rw are merged into a bio
+ * if merge_data_io_ is set.
+ *
+ * @wdev walb device.
+ * @biow_list bio wrappers sorted by position, linked with list4.
+ *   It will be empty.
+ */
+static void submit_write_bio_wrapper_list(
+	struct walb_dev *wdev, struct list_head *biow_list)
+{
+	struct request_queue *q = bdev_get_queue(wdev->ddev);
+	const unsigned int max_sectors = queue_max_sectors(q);
+	const unsigned int max_vecs =
+		min_t(unsigned int, BIO_MAX_PAGES, queue_max_segments(q));
+	const bool is_merge = READ_ONCE(merge_data_io_) != 0;
+	struct bio_wrapper *biow, *biow_next;
+	struct list_head run;
+	u64 run_pos = 0;
+	unsigned int run_len = 0, run_vecs = 0;
+	unsigned long run_rw = 0;
+	struct blk_plug plug;
+
+	INIT_LIST_HEAD(&run);
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(biow, biow_next, biow_list, list4) {
+		const bool is_plugging = false;
+		unsigned int vecs;
+
+		list_del(&biow->list4);
+		BIO_WRAPPER_CHANGE_STATE(biow);
+		BIO_WRAPPER_PRINT("data0", biow);
+		if (!is_merge) {
+			submit_write_bio_wrapper(biow, is_plugging);
+			continue;
+		}
+		if (!begin_write_data_io(biow)) {
+			queue_work(wq_unbound_, &biow->work);
+			continue;
+		}
+		if (!is_mergeable_write_bio_wrapper(biow)) {
+			submit_write_data_io(biow);
+			continue;
+		}
+
+		vecs = bio_segments(biow->cloned_bioe.bio);
+		if (!list_empty(&run) &&
+			(run_rw != biow->cloned_bioe.bio->bi_rw ||
+				run_pos + run_len != biow->pos ||
+				run_len + biow->len > max_sectors ||
+				run_vecs + vecs > max_vecs ||
+				!is_in_a_chunk(run_pos, run_len + biow->len,
+					wdev->ddev_chunk_sectors))) {
+			submit_merged_write_data_io(wdev, &run, run_vecs);
+		}
+		if (list_empty(&run)) {
+			run_pos = biow->pos;
+			run_len = 0;
+			run_vecs = 0;
+			run_rw = biow->cloned_bioe.bio->bi_rw;
+		}
+		list_add_tail(&biow->list4, &run);
+		run_len += biow->len;
+		run_vecs += vecs;
+	}
+	if (!list_empty(&run))
+		submit_merged_write_data_io(wdev, &run, run_vecs);
+	blk_finish_plug(&plug);
+}
+
+/**
+ * Submit a bio covering the data of LBA-contiguous bio wrappers.
+ * Their cloned bios are not submitted but just put in their end.
+ *
+ * The members are left linked as a ring through list4
+ * without the list head, which bio_end_io_for_merged_data() uses.
+ *
+ * @wdev walb device.
+ * @run bio wrappers (mergeable, contiguous, and with the same bi_rw)
+ *   linked with list4.
+ *   It will be empty.
+ * @nr_vecs total number of segments of the members.
+ */
+static void submit_merged_write_data_io(
+	struct walb_dev *wdev, struct list_head *run, unsigned int nr_vecs)
+{
+	struct bio_wrapper *first, *biow, *biow_next;
+	struct bio *bio;
+
+	ASSERT(!list_empty(run));
+	first = list_first_entry(run, struct bio_wrapper, list4);
+	if (list_is_singular(run)) {
+		list_del(&first->list4);
+		submit_write_data_io(first);
+		return;
+	}
+
+	bio = bio_alloc(GFP_NOIO, nr_vecs);
+	if (!bio) {
+		list_for_each_entry_safe(biow, biow_next, run, list4) {
+			list_del(&biow->list4);
+			submit_write_data_io(biow);
+		}
+		return;
+	}
+	bio->bi_bdev = wdev->ddev;
+	bio->bi_iter.bi_sector = first->pos;
+	/* All the members have the same bi_rw. */
+	bio->bi_rw = first->cloned_bioe.bio->bi_rw;
+	bio->bi_end_io = bio_end_io_for_merged_data;
+	bio->bi_private = first;
+
+	list_for_each_entry(biow, run, list4) {
+		struct bio *clone = biow->cloned_bioe.bio;
+		struct bio_vec bv;
+		struct bvec_iter iter;
+
+		ASSERT(is_mergeable_write_bio_wrapper(biow));
+		ASSERT(clone->bi_rw == bio->bi_rw);
+		bio_for_each_segment(bv, clone, iter) {
+			UNUSED int len = bio_add_page(
+				bio, bv.bv_page, bv.bv_len, bv.bv_offset);
+			ASSERT(len == bv.bv_len);
+		}
+		/* The clone will be put by fin_bio_entry(). */
+		bio_list_init(&biow->cloned_bio_list);
+	}
+	list_del(run);
+	generic_make_request(bio);
+}
+
+/**
+ * Delay data IOs to let newer write IOs overwrite pending ones.
+ * Sleep until the oldest queued bio wrapper has stayed
+ * wdev->absorb_delay_ms since its arrival.
+ * Never delay while writers are waiting for admission.
+ *
+ * CONTEXT:
+ *   Called from task_submit_bio_wrapper_list() only.
+ */
+static void wait_for_absorb_delay(struct walb_dev *wdev)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	const unsigned int delay_ms = READ_ONCE(wdev->absorb_delay_ms);
+	struct bio_wrapper *biow;
+	unsigned long timeout = 0, now;
+
+	if (!READ_ONCE(wdev->absorb_writes) || delay_ms == 0)
+		return;
+
+	spin_lock(&iocored->datapack_submit_queue_lock);
+	biow = list_first_entry_or_null(
+		&iocored->datapack_submit_queue, struct bio_wrapper, list2);
+	if (biow)
+		timeout = biow->start_time + msecs_to_jiffies(delay_ms);
+	spin_unlock(&iocored->datapack_submit_queue_lock);
+	if (!biow)
+		return;
+
+	now = jiffies;
+	if (time_before(now, timeout) &&
+		!waitqueue_active(&iocored->admission_wait_queue))
+		schedule_timeout_uninterruptible(timeout - now);
+}
+
+/**
+ * Drop the data IO of a write bio wrapper
+ * whose range is fully overwritten by a newer pending write IO.
+ *
+ * Its log is already permanent and the newer one will be written
+ * to the data device after this, so skipping the data IO is safe.
+ * written_lsid is still updated in the lsid order by the gc task,
+ * which never goes beyond the newer one before its data IO completes,
+ * and redo from written_lsid always replays the newer one.
+ */
+static void absorb_write_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	ASSERT(bio_wrapper_state_is_overwritten(biow));
+	ASSERT(!bio_wrapper_state_is_discard(biow));
+
+	put_all_bio_list(&biow->cloned_bio_list);
+	biow->cloned_bioe.bio = NULL; // cloned_bio_list contains cloned_bioe->bio.
+
+	atomic64_inc(&iocored->n_absorbed_io);
+	atomic64_add((u64)biow->len << 9, &iocored->n_absorbed_bytes);
+}
+
+/**
+ * Whether the data of a logged write bio wrapper should be dropped
+ * instead of being kept until its data IO.
+ *
+ * Write IOs sleep in the admission control
+ * while the data device is slower than the log device.
+ * In spill mode, in-flight data over wdev->min_pending_sectors
+ * are dropped from the memory and read from the log device again,
+ * so writers keep going at the cost of the extra log reads.
+ * Zero-copy and FUA ones are never spilled because their
+ * original bios are still alive.
+ * Zero ones are never spilled because they have no data in the log device.
+ * Write same ones are never spilled because their data are just the payload.
+ */
+static bool should_spill_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!READ_ONCE(wdev->spill_writes))
+		return false;
+	if (bio_wrapper_state_is_discard(biow) ||
+		bio_wrapper_state_is_zero_copy(biow) ||
+		bio_wrapper_state_is_zero(biow) ||
+		bio_wrapper_state_is_write_same(biow) ||
+		(biow->copied_bio->bi_rw & REQ_FUA))
+		return false;
+
+	return (unsigned int)atomic_read(&iocored->inflight_sectors)
+		> wdev->min_pending_sectors;
+}
+
+/**
+ * Drop the data of a bio wrapper whose log has been written.
+ * It must be called before inserting it to the pending data.
+ * Its admission sectors are given back.
+ */
+static void spill_bio_wrapper(struct walb_dev *wdev, struct bio_wrapper *biow)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	const u64 off_pb = get_offset_of_lsid(
+		biow->lsid, wdev->ring_buffer_off, wdev->ring_buffer_size);
+
+	ASSERT(biow->copied_bio);
+	ASSERT(!bio_entry_exists(&biow->cloned_bioe));
+
+	bio_put_with_pages(biow->copied_bio);
+	biow->copied_bio = NULL;
+	biow->spilled_pos = addr_lb(wdev->physical_bs, off_pb) + biow->sub_offset;
+	set_bit(BIO_WRAPPER_SPILLED, &biow->flags);
+	release_write_admission(wdev, biow);
+
+	atomic64_inc(&iocored->n_spilled_io);
+	atomic64_add((u64)biow->len << 9, &iocored->n_spilled_bytes);
+}
+
+/**
+ * Whether the data of a spilled bio wrapper must be read.
+ * Overwritten ones are not read when absorption is enabled.
+ * begin_write_data_io() will absorb them.
+ */
+static bool should_reload_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow)
+{
+	if (!bio_wrapper_state_is_spilled(biow))
+		return false;
+
+	return !(READ_ONCE(wdev->absorb_writes) &&
+		bio_wrapper_state_is_overwritten(biow));
+}
+
+/**
+ * Read the data of spilled bio wrappers from the log device
+ * and prepare their cloned bio(s) for the data device.
+ * All the reads are submitted before waiting for them.
+ *
+ * If a read fails, the device becomes read-only
+ * and the bio wrapper is canceled.
+ *
+ * @biow_list bio wrappers connected by list2.
+ *   Their logs must be permanent.
+ */
+static void reload_spilled_bio_wrapper_list(
+	struct walb_dev *wdev, struct list_head *biow_list)
 {
 	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
-	bool starts_queue;
+	struct bio_wrapper *biow, *biow_next;
+	struct blk_plug plug;
+	unsigned int nr = 0;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(biow, biow_list, list2) {
+		struct bio *bio;
+
+		if (!should_reload_bio_wrapper(wdev, biow))
+			continue;
+		ASSERT(!biow->copied_bio);
+		ASSERT(!bio_entry_exists(&biow->cloned_bioe));
+
+		/* The log may start inside a physical block
+		   so read just the data. */
+		while (!(bio = bio_alloc_with_pages(
+				 biow->len << 9, wdev->ldev, GFP_NOIO))) {
+			schedule();
+		}
+		bio->bi_rw = READ;
+		bio->bi_iter.bi_sector = biow->spilled_pos;
+		init_bio_entry(&biow->cloned_bioe, bio);
+		generic_make_request(bio);
+		nr++;
+	}
+	blk_finish_plug(&plug);
+	if (nr == 0)
+		return;
+
+	list_for_each_entry_safe(biow, biow_next, biow_list, list2) {
+		struct bio_entry *bioe = &biow->cloned_bioe;
+		struct bio *bio;
+
+		if (!bio_wrapper_state_is_spilled(biow) ||
+			!bio_entry_exists(bioe))
+			continue;
+
+		wait_for_bio_entry(bioe, completion_timeo_ms_);
+		bio = bioe->bio;
+		bioe->bio = NULL;
+		if (bioe->error) {
+			bio_put_with_pages(bio);
+			if (!test_and_set_bit(WALB_STATE_READ_ONLY, &wdev->flags))
+				WLOGe(wdev, "changed to read-only mode.\n");
+			list_del(&biow->list2);
+			cancel_write_bio_wrapper(wdev, biow);
+			continue;
+		}
+
+		/* The read bio becomes the copied bio. */
+		bio->bi_bdev = wdev->ddev;
+		bio->bi_rw = WRITE;
+		bio->bi_error = 0;
+		bio->bi_end_io = NULL;
+		bio->bi_private = NULL;
+		bio->bi_iter.bi_sector = biow->pos;
+		bio->bi_iter.bi_size = biow->len << 9;
+		bio->bi_iter.bi_idx = 0;
+		bio->bi_iter.bi_bvec_done = 0;
+
+		init_bio_entry_by_clone_never_giveup(
+			bioe, bio, wdev->ddev, GFP_NOIO);
+		biow->cloned_bio_list = split_bio_for_chunk_never_giveup(
+			bioe->bio, wdev->ddev_chunk_sectors, GFP_NOIO);
+
+		/* Readers of the pending data use the cloned bio from now. */
+		spin_lock(&iocored->pending_data_lock);
+		biow->copied_bio = bio;
+		clear_bit(BIO_WRAPPER_SPILLED, &biow->flags);
+		spin_unlock(&iocored->pending_data_lock);
+	}
+}
+
+static void cancel_write_bio_wrapper(struct walb_dev *wdev, struct bio_wrapper *biow)
+{
 #ifdef WALB_DEBUG
 	ASSERT(bio_wrapper_state_is_prepared(biow));
 	ASSERT(!bio_wrapper_state_is_submitted(biow));
 #endif
 
-	starts_queue = delete_bio_wrapper_from_pending_data(wdev, biow);
-	if (starts_queue && melt_detail(iocored, false))
-		dispatch_submit_log_task(wdev);
+	delete_bio_wrapper_from_pending_data(wdev, biow);
 
 	/* Put related bio(s) and free resources. */
 	if (bio_entry_exists(&biow->cloned_bioe)) {
 		put_all_bio_list(&biow->cloned_bio_list);
 		biow->cloned_bioe.bio = NULL; // cloned_bio_list contains cloned_bioe->bio.
-	} else {
+	} else if (!bio_wrapper_state_is_spilled(biow)) {
 		ASSERT(bio_wrapper_state_is_discard(biow));
 		ASSERT(!blk_queue_discard(bdev_get_queue(wdev->ddev)));
 	}
 
 	biow->error = -EIO;
-	complete(&biow->done);
+	if (bio_wrapper_state_is_zero_copy(biow))
+		end_zero_copy_bio_wrapper(biow);
+	end_datapack_bio_wrapper(biow);
+}
+
+/**
+ * End the original bio of a zero-copy write bio wrapper.
+ * This must be called after all IOs sharing its pages have completed.
+ */
+static void end_zero_copy_bio_wrapper(struct bio_wrapper *biow)
+{
+	ASSERT(bio_wrapper_state_is_zero_copy(biow));
+	ASSERT(biow->bio);
+
+	latency_end(biow);
+	io_acct_end(biow);
+	BIO_WRAPPER_PRINT("data2", biow);
+	if (biow->error)
+		bio_io_error(biow->bio);
+	else
+		bio_endio(biow->bio);
+	biow->bio = NULL;
+}
+
+/**
+ * Endio callback for a read bio remapped by try_remap_read_bio_wrapper().
+ * The bio is ended again with its original callback.
+ */
+static void bio_end_io_for_remapped_read(struct bio *bio)
+{
+	struct bio_wrapper *biow = bio->bi_private;
+	struct walb_dev *wdev = biow->private_data;
+
+	ASSERT(biow->bio == bio);
+
+	bio->bi_end_io = biow->orig_end_io;
+	bio->bi_private = biow->orig_private;
+	io_acct_end(biow);
+	biow->bio = NULL;
+	destroy_bio_wrapper_dec(wdev, biow);
+	bio_endio(bio);
+}
+
+/**
+ * Remap a read bio to the data device directly
+ * if no pending write overlaps it.
+ * The bio is neither cloned nor split, and it completes without workers.
+ *
+ * A write overlapping it may be inserted to the pending data
+ * after the check, but such a write has not been completed yet
+ * so the read may return either old or new data.
+ *
+ * RETURN:
+ *   true if the bio has been submitted,
+ *   or false if submit_read_bio_wrapper() must process it.
+ */
+static bool try_remap_read_bio_wrapper(
+	struct walb_dev *wdev, struct bio_wrapper *biow)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	struct bio *bio = biow->bio;
+	bool is_overlapped;
+
+	if (biow->len == 0 ||
+		!is_in_a_chunk(biow->pos, biow->len, wdev->ddev_chunk_sectors))
+		return false;
+
+	spin_lock(&iocored->pending_data_lock);
+	is_overlapped = pending_is_overlapped(
+		iocored->pending_data, biow->pos, biow->len);
+	spin_unlock(&iocored->pending_data_lock);
+	if (is_overlapped)
+		return false;
+
+	biow->orig_end_io = bio->bi_end_io;
+	biow->orig_private = bio->bi_private;
+	bio->bi_end_io = bio_end_io_for_remapped_read;
+	bio->bi_private = biow;
+	bio->bi_bdev = wdev->ddev;
+	generic_make_request(bio);
+	return true;
 }
 
 /**
@@ -2297,6 +3727,9 @@ static void submit_read_bio_wrapper(
 
 	ASSERT(bio_list_empty(bio_list));
 
+	if (try_remap_read_bio_wrapper(wdev, biow))
+		return;
+
 	/* Create cloned bio. */
 	if (!init_bio_entry_by_clone(bioe, biow->bio, wdev->ddev, GFP_NOIO))
 		goto error0;
@@ -2311,8 +3744,7 @@ static void submit_read_bio_wrapper(
 	BIO_WRAPPER_PRINT_LS("read0", biow, bio_list_size(bio_list));
 	spin_lock(&iocored->pending_data_lock);
 	ret = pending_check_and_copy(
-		iocored->pending_data,
-		iocored->max_sectors_in_pending, biow, GFP_ATOMIC);
+		iocored->pending_data, biow, wdev->ldev, GFP_ATOMIC);
 	spin_unlock(&iocored->pending_data_lock);
 	if (!ret)
 		goto error1;
@@ -2321,8 +3753,13 @@ static void submit_read_bio_wrapper(
 	LOG_("submit_lr: bioe %p pos %" PRIu64 " len %u\n"
 		, bioe, bioe->pos, bioe->len);
 	BIO_WRAPPER_PRINT_LS("read1", biow, bio_list_size(bio_list));
-	/* TODO: if bio_list is empty,
-	   we need not delay to call bio_endio and gc it. */
+	if (bio_list_empty(bio_list)) {
+		/* All the data have been copied from the pending data
+		   and the cloned bio has been ended already. */
+		wait_for_bio_wrapper_io(biow, true, true);
+		destroy_bio_wrapper_dec(wdev, biow);
+		return;
+	}
 	submit_all_bio_list(bio_list);
 
 	/* Enqueue wait/gc task. */
@@ -2344,7 +3781,7 @@ error0:
 /**
  * Submit a flush request.
  *
- * @bioe bio entry to use.
+ * @bioe header bio entry of a pack to use.
  * @bdev block device.
  *
  * RETURN:
@@ -2366,6 +3803,8 @@ static bool submit_flush(struct bio_entry *bioe, struct block_device *bdev)
 
 	init_bio_entry(bioe, bio);
 	ASSERT(bio_entry_len(bioe) == 0);
+	start_logpack_io(container_of(bioe, struct pack, header_bioe),
+			bioe, bio_end_io_for_logpack_header);
 
 	generic_make_request(bio);
 
@@ -2392,15 +3831,16 @@ static void dispatch_submit_log_task(struct walb_dev *wdev)
 
 /**
  * Dispatch logpack wait task if necessary.
+ *
+ * CONTEXT:
+ *   Any context. Log IO completion callbacks call this.
  */
 static void dispatch_wait_log_task(struct walb_dev *wdev)
 {
-	dispatch_task_if_necessary(
-		wdev,
-		IOCORE_STATE_WAIT_LOG_TASK_WORKING,
-		&get_iocored_from_wdev(wdev)->flags,
-		wq_unbound_,
-		task_wait_for_logpack_list);
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!test_and_set_bit(IOCORE_STATE_WAIT_LOG_TASK_WORKING, &iocored->flags))
+		queue_work(wq_unbound_, &iocored->wait_log_work);
 }
 
 /**
@@ -2416,19 +3856,6 @@ static void dispatch_submit_data_task(struct walb_dev *wdev)
 		task_submit_bio_wrapper_list);
 }
 
-/**
- * Dispatch datapack wait task if necessary.
- */
-static void dispatch_wait_data_task(struct walb_dev *wdev)
-{
-	dispatch_task_if_necessary(
-		wdev,
-		IOCORE_STATE_WAIT_DATA_TASK_WORKING,
-		&get_iocored_from_wdev(wdev)->flags,
-		wq_unbound_,
-		task_wait_for_bio_wrapper_list);
-}
-
 /**
  * Start to processing write bio_wrapper.
  */
@@ -2469,6 +3896,8 @@ static void wait_for_logpack_submit_queue_empty(struct walb_dev *wdev)
                spin_lock(&iocored->logpack_submit_queue_lock);
                is_empty = list_empty(&iocored->logpack_submit_queue);
                spin_unlock(&iocored->logpack_submit_queue_lock);
+               if (is_empty)
+                       is_empty = is_submit_stage_empty(iocored);
 
                if (is_empty)
                        return;
@@ -2498,15 +3927,31 @@ static void wait_for_all_pending_gc_done(struct walb_dev *wdev)
  */
 static void force_flush_ldev(struct walb_dev *wdev)
 {
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
 	int err;
-	u64 new_permanent_lsid;
+	u64 target_lsid, new_permanent_lsid;
+	struct lsid_set lsids;
 	bool should_notice = false;
 
+	get_lsid_set(wdev, &lsids);
+	target_lsid = lsids.completed;
+
+	/*
+	 * Callers share flushes.
+	 * The flush in flight may make target_lsid permanent.
+	 */
+	mutex_lock(&iocored->ldev_flush_lock);
+
 	/* Get completed_lsid and update flush_lsid. */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
+	if (target_lsid <= wdev->lsids.permanent) {
+		write_sequnlock(&wdev->lsid_lock);
+		mutex_unlock(&iocored->ldev_flush_lock);
+		return;
+	}
 	new_permanent_lsid = wdev->lsids.completed;
 	update_flush_lsid_if_necessary(wdev, new_permanent_lsid);
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 #if 0
 	WLOGi(wdev, "force_flush lsid %" PRIu64 "\n", new_permanent_lsid);
@@ -2524,7 +3969,7 @@ static void force_flush_ldev(struct walb_dev *wdev)
 #endif
 
 	/* Update permanent_lsid. */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	if (wdev->lsids.permanent < new_permanent_lsid) {
 		should_notice = is_permanent_log_empty(&wdev->lsids);
 		ASSERT(new_permanent_lsid <= wdev->lsids.flush);
@@ -2532,7 +3977,9 @@ static void force_flush_ldev(struct walb_dev *wdev)
 		LOG_("log_flush_completed_data\n");
 	}
 	ASSERT(lsid_set_is_valid(&wdev->lsids));
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
+	mutex_unlock(&iocored->ldev_flush_lock);
+	wakeup_log_permanent_waiters(wdev);
 	if (should_notice)
 		walb_sysfs_notify(wdev, "lsids");
 }
@@ -2555,43 +4002,75 @@ static void force_flush_ldev(struct walb_dev *wdev)
  */
 static bool wait_for_log_permanent(struct walb_dev *wdev, u64 lsid)
 {
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
 	struct lsid_set lsids;
 	unsigned long timeout_jiffies;
+	long timeo;
 
 	/* We will wait for log flush at most the given interval period. */
 	timeout_jiffies = jiffies + wdev->log_flush_interval_jiffies;
-retry:
-	if (test_bit(WALB_STATE_READ_ONLY, &wdev->flags))
-		return false;
-	spin_lock(&wdev->lsid_lock);
-	lsids = wdev->lsids;
-	spin_unlock(&wdev->lsid_lock);
-	if (lsid <= lsids.permanent) {
-		/* No need to wait. */
-		return true;
-	}
-	if (lsid > lsids.completed) {
-		/* The ldev IO is still not completed. */
-		msleep(1);
-		goto retry;
-	}
-	if (lsid <= lsids.flush) {
-		/* Flush request to make lsid permanent will be completed soon. */
-		msleep(1);
-		goto retry;
-	}
-	if (time_is_after_jiffies(timeout_jiffies) &&
-		lsid < lsids.flush + wdev->log_flush_interval_pb) {
-		/* Too early to force flush log device.
-		   Wait for a while. */
-		msleep(1);
-		goto retry;
+	while (true) {
+		if (test_bit(WALB_STATE_READ_ONLY, &wdev->flags))
+			return false;
+		get_lsid_set(wdev, &lsids);
+		if (lsid <= lsids.permanent) {
+			/* No need to wait. */
+			return true;
+		}
+		if (lsid > lsids.completed) {
+			/* The ldev IO is still not completed. */
+			timeo = msecs_to_jiffies(LOG_PERMANENT_WAIT_TIMEO_MS);
+		} else if (lsid <= lsids.flush) {
+			/* Flush request to make lsid permanent will be completed soon. */
+			timeo = msecs_to_jiffies(LOG_PERMANENT_WAIT_TIMEO_MS);
+		} else if (time_is_after_jiffies(timeout_jiffies) &&
+			lsid < lsids.flush + wdev->log_flush_interval_pb) {
+			/* Too early to force flush log device.
+			   Wait until the interval expires. */
+			timeo = timeout_jiffies - jiffies;
+		} else {
+			break;
+		}
+		wait_event_timeout(iocored->log_permanent_wait_queue,
+				is_lsid_set_changed(wdev, &lsids), timeo);
 	}
 
 	force_flush_ldev(wdev);
 	return !test_bit(WALB_STATE_READ_ONLY, &wdev->flags);
 }
 
+/**
+ * RETURN:
+ *   true if completed/flush/permanent lsid differs from the snapshot
+ *   or wdev became read-only mode.
+ */
+static bool is_lsid_set_changed(
+	struct walb_dev *wdev, const struct lsid_set *lsids)
+{
+	struct lsid_set cur;
+
+	if (test_bit(WALB_STATE_READ_ONLY, &wdev->flags))
+		return true;
+	get_lsid_set(wdev, &cur);
+	return cur.completed != lsids->completed ||
+		cur.flush != lsids->flush ||
+		cur.permanent != lsids->permanent;
+}
+
+/**
+ * Wake up wait_for_log_permanent() callers.
+ * Call this after completed_lsid or permanent_lsid advances.
+ */
+static void wakeup_log_permanent_waiters(struct walb_dev *wdev)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	/* Pairs with the barrier in prepare_to_wait(). */
+	smp_mb();
+	if (waitqueue_active(&iocored->log_permanent_wait_queue))
+		wake_up_all(&iocored->log_permanent_wait_queue);
+}
+
 /**
  * Flush all workqueues for IO.
  */
@@ -2667,7 +4146,7 @@ static void fail_and_destroy_bio_wrapper_list(
 
 /**
  * Update flush lsid.
- * The lsids spinlock must be held.
+ * wdev->lsid_lock must be held with write_seqlock().
  */
 static void update_flush_lsid_if_necessary(struct walb_dev *wdev, u64 flush_lsid)
 {
@@ -2679,128 +4158,130 @@ static void update_flush_lsid_if_necessary(struct walb_dev *wdev, u64 flush_lsid
 }
 
 /**
- * RETURN:
- *   should_start_queue() return value.
+ * Delete a bio wrapper from the pending data.
  */
-static bool delete_bio_wrapper_from_pending_data(
+static void delete_bio_wrapper_from_pending_data(
 	struct walb_dev *wdev, struct bio_wrapper *biow)
 {
 	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
-	bool starts_queue;
 
 	spin_lock(&iocored->pending_data_lock);
-	starts_queue = should_start_queue(wdev, biow);
 	if (bio_wrapper_state_is_discard(biow)) {
 		iocored->pending_sectors--;
 	} else {
 		iocored->pending_sectors -= biow->len;
 		if (!bio_wrapper_state_is_overwritten(biow)) {
-			pending_delete(iocored->pending_data,
-				&iocored->max_sectors_in_pending, biow);
+			pending_delete(iocored->pending_data, biow);
 		}
 	}
 	spin_unlock(&iocored->pending_data_lock);
-
-	return starts_queue;
 }
 
 /**
- * Check whether walb should stop the queue
- * due to too much pending data.
- *
- * CONTEXT:
- *   pending_data_lock must be held.
+ * Admission size of a write bio [logical block].
+ * Discard IOs have no buffer so their metadata only is considered
+ * as the pending data does.
  */
-static bool should_stop_queue(
-	struct walb_dev *wdev, struct bio_wrapper *biow)
+static unsigned int get_bio_admission_sectors(struct bio *bio)
 {
-	bool should_stop;
-	struct iocore_data *iocored;
-
-	ASSERT(wdev);
-	ASSERT(biow);
-	iocored = get_iocored_from_wdev(wdev);
-	ASSERT(iocored);
-
-	if (test_bit(IOCORE_STATE_IS_QUEUE_STOPPED, &iocored->flags))
-		return false;
+	if (bio->bi_rw & REQ_DISCARD)
+		return 1;
+	return bio_sectors(bio);
+}
 
-	should_stop = iocored->pending_sectors + biow->len
-		> wdev->max_pending_sectors;
+/**
+ * Admission size of a write bio wrapper [logical block].
+ * This equals get_bio_admission_sectors() of its original bio.
+ */
+static unsigned int get_admission_sectors(struct bio_wrapper *biow)
+{
+	if (bio_wrapper_state_is_discard(biow))
+		return 1;
+	return biow->len;
+}
 
-	if (should_stop) {
-		iocored->queue_restart_jiffies =
-			jiffies + wdev->queue_stop_timeout_jiffies;
-		return true;
-	} else {
-		return false;
+/**
+ * Take sectors from the admission budget if the sum does not exceed the limit.
+ * A bio is always admitted when nothing is in flight
+ * in order not to block bios larger than the limit forever.
+ */
+static bool try_admit_write(
+	struct iocore_data *iocored, unsigned int sectors, unsigned int limit)
+{
+	int cur = atomic_read(&iocored->inflight_sectors);
+
+	while (cur == 0 || (unsigned int)cur + sectors <= limit) {
+		const int old = atomic_cmpxchg(
+			&iocored->inflight_sectors, cur, cur + sectors);
+		if (old == cur)
+			return true;
+		cur = old;
 	}
+	return false;
 }
 
 /**
- * Check whether walb should restart the queue
- * because pending data is not too much now.
+ * Wait for the write admission of a bio wrapper.
+ *
+ * This replaces stopping the queue with the frozen state.
+ * The writer sleeps while wdev->max_pending_sectors are in flight,
+ * and it is woken up when they decrease under wdev->min_pending_sectors.
+ * It is admitted anyway after wdev->queue_stop_timeout_jiffies.
  *
  * CONTEXT:
- *   pending_data_lock must be held.
+ *   Non-atomic.
  */
-static bool should_start_queue(
+static void admit_write_bio_wrapper(
 	struct walb_dev *wdev, struct bio_wrapper *biow)
 {
-	bool is_size;
-	bool is_timeout;
-	struct iocore_data *iocored;
-
-	ASSERT(wdev);
-	ASSERT(biow);
-	iocored = get_iocored_from_wdev(wdev);
-	ASSERT(iocored);
-
-	if (!test_bit(IOCORE_STATE_IS_QUEUE_STOPPED, &iocored->flags))
-		return false;
-
-	if (iocored->pending_sectors >= biow->len)
-		is_size = iocored->pending_sectors - biow->len
-			< wdev->min_pending_sectors;
-	else
-		is_size = true;
-
-	is_timeout = time_is_before_jiffies(iocored->queue_restart_jiffies);
-
-	return is_size || is_timeout;
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	const unsigned int sectors = get_admission_sectors(biow);
+
+	if (sectors == 0)
+		return; /* zero-size flush. */
+
+	if (!try_admit_write(iocored, sectors, wdev->max_pending_sectors)) {
+		const long timeo = wait_event_timeout(
+			iocored->admission_wait_queue,
+			try_admit_write(iocored, sectors, wdev->min_pending_sectors),
+			wdev->queue_stop_timeout_jiffies);
+		if (timeo == 0)
+			atomic_add(sectors, &iocored->inflight_sectors);
+	}
+	set_bit(BIO_WRAPPER_ADMITTED, &biow->flags);
 }
 
 /**
- * Increment n_users of treemap memory manager and
- * iniitialize mmgr_ if necessary.
+ * Give back the admission sectors of a bio wrapper.
  */
-static bool treemap_memory_manager_get(void)
+static void release_write_admission(
+	struct walb_dev *wdev, struct bio_wrapper *biow)
 {
-	bool ret;
+	if (!test_and_clear_bit(BIO_WRAPPER_ADMITTED, &biow->flags))
+		return;
 
-	if (atomic_inc_return(&n_users_of_memory_manager_) == 1) {
-		ret = initialize_treemap_memory_manager(
-			&mmgr_, N_ITEMS_IN_MEMPOOL,
-			TREE_NODE_CACHE_NAME,
-			TREE_CELL_HEAD_CACHE_NAME,
-			TREE_CELL_CACHE_NAME);
-		if (!ret) { goto error; }
-	}
-	return true;
-error:
-	atomic_dec(&n_users_of_memory_manager_);
-	return false;
+	give_back_admission_sectors(wdev, get_admission_sectors(biow));
 }
 
 /**
- * Decrement n_users of treemap memory manager and
- * finalize mmgr_ if necessary.
+ * Give back sectors to the admission budget
+ * and resume the writers when it has enough room.
  */
-static void treemap_memory_manager_put(void)
+static void give_back_admission_sectors(
+	struct walb_dev *wdev, unsigned int sectors)
 {
-	if (atomic_dec_return(&n_users_of_memory_manager_) == 0) {
-		finalize_treemap_memory_manager(&mmgr_);
-	}
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	int cur;
+
+	cur = atomic_sub_return(sectors, &iocored->inflight_sectors);
+	ASSERT(cur >= 0);
+	if (cur > 0 && (unsigned int)cur >= wdev->min_pending_sectors)
+		return;
+	if (waitqueue_active(&iocored->admission_wait_queue))
+		wake_up_all(&iocored->admission_wait_queue);
+	/* Pairs with smp_mb() in admit_walb_mq_request(). */
+	if (test_and_clear_bit(IOCORE_STATE_MQ_ADMISSION_STOPPED, &iocored->flags))
+		blk_mq_start_stopped_hw_queues(wdev->queue, true);
 }
 
 static bool pack_cache_get(void)
@@ -2810,11 +4291,19 @@ static bool pack_cache_get(void)
 			KMEM_CACHE_PACK_NAME,
 			sizeof(struct pack), 0, 0, NULL);
 		if (!pack_cache_) {
-			goto error;
+			goto error0;
+		}
+		pack_pool_ = mempool_create_slab_pool(
+			PACK_POOL_MIN_NR, pack_cache_);
+		if (!pack_pool_) {
+			goto error1;
 		}
 	}
 	return true;
-error:
+error1:
+	kmem_cache_destroy(pack_cache_);
+	pack_cache_ = NULL;
+error0:
 	atomic_dec(&n_users_of_pack_cache_);
 	return false;
 }
@@ -2822,6 +4311,8 @@ error:
 static void pack_cache_put(void)
 {
 	if (atomic_dec_return(&n_users_of_pack_cache_) == 0) {
+		mempool_destroy(pack_pool_);
+		pack_pool_ = NULL;
 		kmem_cache_destroy(pack_cache_);
 		pack_cache_ = NULL;
 	}
@@ -2835,6 +4326,9 @@ static void io_acct_start(struct bio_wrapper *biow)
 	struct hd_struct *part0 = &wdev->gd->part0;
 
 	biow->start_time = jiffies;
+	/* blk-mq accounts requests by itself. */
+	if (wdev->queue->mq_ops)
+		return;
 
 	cpu = part_stat_lock();
 	part_round_stats(cpu, part0);
@@ -2856,6 +4350,9 @@ static void io_acct_end(struct bio_wrapper *biow)
 	struct hd_struct *part0 = &wdev->gd->part0;
 	unsigned long duration = jiffies - biow->start_time;
 
+	if (wdev->queue->mq_ops)
+		return;
+
 	cpu = part_stat_lock();
 	part_stat_add(cpu, part0, ticks[rw], duration);
 	part_round_stats(cpu, part0);
@@ -2868,49 +4365,237 @@ static void io_acct_end(struct bio_wrapper *biow)
 }
 
 /**
- * iocored->logpack_submit_queue_lock must be held.
+ * Start latency measurement of a write bio wrapper.
+ */
+static void latency_begin(struct bio_wrapper *biow)
+{
+	biow->lat_begin_ns = ktime_get_ns();
+	biow->lat_prev_ns = biow->lat_begin_ns;
+}
+
+/**
+ * Account the period from the end of the previous stage.
+ */
+static void latency_stage(struct bio_wrapper *biow, unsigned int stage)
+{
+	struct walb_dev *wdev = biow->private_data;
+
+	walb_latency_add_since(
+		get_iocored_from_wdev(wdev)->latency, stage,
+		&biow->lat_prev_ns);
+}
+
+/**
+ * Account the whole period until the write bio is ended.
+ */
+static void latency_end(struct bio_wrapper *biow)
+{
+	struct walb_dev *wdev = biow->private_data;
+
+	walb_latency_add(
+		get_iocored_from_wdev(wdev)->latency, WALB_LAT_WRITE,
+		ktime_get_ns() - biow->lat_begin_ns);
+}
+
+/**
+ * Batch size limit [bio] of the submit log task.
+ */
+static unsigned int get_logpack_io_bulk(struct walb_dev *wdev)
+{
+	if (!READ_ONCE(adaptive_batch_))
+		return wdev->n_io_bulk;
+	return get_iocored_from_wdev(wdev)->cur_io_bulk;
+}
+
+/**
+ * Logpack size limit [physical block] of the submit log task.
+ * 0 means unlimited.
+ */
+static unsigned int get_logpack_max_pb(struct walb_dev *wdev)
+{
+	if (!READ_ONCE(adaptive_batch_))
+		return wdev->max_logpack_pb;
+	return get_iocored_from_wdev(wdev)->cur_logpack_pb;
+}
+
+/**
+ * Adapt the logpack batch size to the load.
+ *
+ * A deep submit queue or a slow log device makes large logpacks cheap
+ * because the header IO and its checksum are shared by more bios.
+ * A shallow submit queue with a fast log device prefers small logpacks
+ * because every bio in a logpack waits for the whole logpack.
+ * wdev->n_io_bulk and wdev->max_logpack_pb are the upper bounds.
+ *
+ * @n_io number of bio wrappers dequeued at once.
+ * @is_cut true if the dequeue stopped at the batch size limit.
+ *
+ * CONTEXT:
+ *   Submit log task only.
  */
-static bool is_frozen(struct iocore_data *iocored)
+static void adapt_logpack_batch(
+	struct walb_dev *wdev, unsigned int n_io, bool is_cut)
 {
-       return iocored->is_frozen_sys || iocored->is_frozen_usr;
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	const u64 target_ns = (u64)READ_ONCE(adaptive_target_latency_us_) * 1000;
+	const bool is_slow = READ_ONCE(iocored->log_lat_avg_ns) > target_ns;
+	unsigned int io_bulk = iocored->cur_io_bulk;
+	unsigned int pb = iocored->cur_logpack_pb;
+	unsigned int min_io_bulk, min_pb;
+
+	if (!READ_ONCE(adaptive_batch_))
+		return;
+
+	min_io_bulk = READ_ONCE(adaptive_min_io_bulk_);
+	min_io_bulk = clamp(min_io_bulk, 1U, wdev->n_io_bulk);
+	min_pb = READ_ONCE(adaptive_min_logpack_kb_) * 1024 / wdev->physical_bs;
+	min_pb = clamp(min_pb, 1U, max(wdev->max_logpack_pb, 1U));
+
+	if (is_cut || (is_slow && n_io * 2 >= io_bulk)) {
+		io_bulk = min(io_bulk * 2, wdev->n_io_bulk);
+		pb = min(pb * 2, wdev->max_logpack_pb);
+	} else if (!is_slow && n_io * 4 < io_bulk) {
+		io_bulk /= 2;
+		pb /= 2;
+	}
+	io_bulk = max(io_bulk, min_io_bulk);
+	/* max_logpack_pb 0 means unlimited and it is kept. */
+	pb = wdev->max_logpack_pb == 0 ? 0 : max(pb, min_pb);
+
+	WRITE_ONCE(iocored->cur_io_bulk, io_bulk);
+	WRITE_ONCE(iocored->cur_logpack_pb, pb);
 }
 
 /**
- * iocored->logpack_submit_queue_lock must be held.
+ * Update the moving average of the logpack header IO latency.
+ * The weight of the new sample is 1/8.
+ *
+ * CONTEXT:
+ *   Wait log task only.
  */
-static void set_frozen(struct iocore_data *iocored, bool is_usr, bool value)
+static void update_log_latency(
+	struct iocore_data *iocored, struct pack *wpack)
 {
-       bool *p;
+	const u64 now = ktime_get_ns();
+	const u64 lat = now > wpack->submit_ns ? now - wpack->submit_ns : 0;
+	const u64 avg = iocored->log_lat_avg_ns;
 
-       if (is_usr)
-               p = &iocored->is_frozen_usr;
-       else
-               p = &iocored->is_frozen_sys;
+	WRITE_ONCE(iocored->log_lat_avg_ns, avg - (avg >> 3) + (lat >> 3));
+}
 
-       if (*p != value)
-               *p = value;
+static void freeze_detail(struct iocore_data *iocored)
+{
+	spin_lock(&iocored->logpack_submit_queue_lock);
+	iocored->is_frozen = true;
+	spin_unlock(&iocored->logpack_submit_queue_lock);
 }
 
-static void freeze_detail(struct iocore_data *iocored, bool is_usr)
+static void melt_detail(struct iocore_data *iocored)
 {
-       spin_lock(&iocored->logpack_submit_queue_lock);
-       set_frozen(iocored, is_usr, true);
-       spin_unlock(&iocored->logpack_submit_queue_lock);
+	spin_lock(&iocored->logpack_submit_queue_lock);
+	iocored->is_frozen = false;
+	make_frozen_queue_empty(iocored);
+	spin_unlock(&iocored->logpack_submit_queue_lock);
 }
 
-static bool melt_detail(struct iocore_data *iocored, bool is_usr)
+/**
+ * Make request.
+ *
+ * @is_admitted true if the caller has already taken
+ *   get_bio_admission_sectors(bio) from the write admission budget.
+ *   Otherwise a write waits for its admission here.
+ */
+static void make_request_detail(
+	struct walb_dev *wdev, struct bio *bio, bool is_admitted)
 {
-       bool melted;
+	struct bio_wrapper *biow;
+	struct iocore_data *iocored;
+	const bool is_write = (bio->bi_rw & REQ_WRITE) != 0;
+	u64 t0;
+
+	ASSERT(is_write || !is_admitted);
+
+	/* Check whether the device is dying. */
+	if (is_wdev_dying(wdev)) {
+		bio->bi_error = -ENODEV;
+		goto error_bio;
+	}
+	iocored = get_iocored_from_wdev(wdev);
+
+	/* Check whether read-only mode. */
+	if (is_write && test_bit(WALB_STATE_READ_ONLY, &wdev->flags)) {
+		bio->bi_error = -EIO;
+		goto error_bio;
+	}
+
+	/* Create bio wrapper. */
+	biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO);
+	if (!biow) {
+		bio->bi_error = -ENOMEM;
+		goto error_bio;
+	}
+	init_bio_wrapper(biow, bio);
+	biow->private_data = wdev;
+	if (is_admitted)
+		set_bit(BIO_WRAPPER_ADMITTED, &biow->flags);
 
-       spin_lock(&iocored->logpack_submit_queue_lock);
-       set_frozen(iocored, is_usr, false);
-       melted = !is_frozen(iocored);
-       if (melted)
-               make_frozen_queue_empty(iocored);
+	/* IO accounting for diskstats. */
+	io_acct_start(biow);
 
-       spin_unlock(&iocored->logpack_submit_queue_lock);
+	if (is_write) {
+#ifdef WALB_PERFORMANCE_ANALYSIS
+		getnstimeofday(&biow->ts[WALB_TIME_BEGIN]);
+#endif
+		latency_begin(biow);
+
+		/* This may sleep while too much data is in flight. */
+		if (!is_admitted)
+			admit_write_bio_wrapper(wdev, biow);
+
+		/* All-zero data need no data area in the log.
+		   They are detected before the copy, which is skipped then.
+		   The payload of a write same bio is always checked
+		   because it is just a logical block. */
+		t0 = ktime_get_ns();
+		if (wdev->is_log_packed &&
+			(READ_ONCE(wdev->detect_zero) ||
+				bio_wrapper_state_is_write_same(biow)) &&
+			bio_is_zero(bio)) {
+			set_bit(BIO_WRAPPER_ZERO, &biow->flags);
+			atomic64_inc(&iocored->n_zero_io);
+			atomic64_add((u64)biow->len << 9, &iocored->n_zero_bytes);
+		}
+		/* Allocate another buffer and copy bio data
+		   with its checksum calculation on this cpu.
+		   Do not use original bio's data from now.
+		   In zero-copy mode, the pages are shared instead
+		   and the bio will be ended after its data IO.
+		   Zero data share ZERO_PAGE. */
+		if (!bio_wrapper_prepare_copied_bio(
+				biow, READ_ONCE(wdev->zero_copy),
+				wdev->log_checksum_salt, GFP_NOIO))
+			goto error0;
+		walb_latency_add(iocored->latency,
+			WALB_LAT_CHECKSUM, ktime_get_ns() - t0);
 
-       return melted;
+		/* Push into the submit stage and invoke submit task. */
+		if (push_into_lpack_submit_queue(biow))
+			dispatch_submit_log_task(wdev);
+	} else {
+		/* Reads are not admission-controlled
+		   because they pin no data in the iocore. */
+		submit_read_bio_wrapper(wdev, biow);
+	}
+	return;
+error0:
+	io_acct_end(biow);
+	destroy_bio_wrapper_dec(wdev, biow);
+	bio_io_error(bio);
+	return;
+error_bio:
+	if (is_admitted)
+		give_back_admission_sectors(wdev, get_bio_admission_sectors(bio));
+	bio_endio(bio);
 }
 
 /*******************************************************************************
@@ -2925,44 +4610,42 @@ bool iocore_initialize(struct walb_dev *wdev)
 	int ret;
 	struct iocore_data *iocored;
 
-	if (!treemap_memory_manager_get()) {
-		LOGe("Treemap memory manager inc failed.\n");
-		goto error0;
-	}
-
 	if (!pack_cache_get()) {
 		LOGe("Failed to create a kmem_cache for pack.\n");
-		goto error1;
+		goto error0;
 	}
 
 	if (!bio_entry_init()) {
 		LOGe("Failed to init bio_entry.\n");
-		goto error2;
+		goto error1;
 	}
 
 	if (!bio_wrapper_init()) {
 		LOGe("Failed to init bio_wrapper.\n");
-		goto error3;
+		goto error2;
 	}
 
 	if (!pack_work_init()) {
 		LOGe("Failed to init pack_work.\n");
-		goto error4;
+		goto error3;
 	}
 
-	iocored = create_iocore_data(GFP_KERNEL);
+	iocored = create_iocore_data(GFP_KERNEL, wdev->physical_bs);
 	if (!iocored) {
 		LOGe("Memory allocation failed.\n");
-		goto error5;
+		goto error4;
 	}
 	wdev->private_data = iocored;
+	iocored->wdev = wdev;
+	iocored->cur_io_bulk = wdev->n_io_bulk;
+	iocored->cur_logpack_pb = wdev->max_logpack_pb;
 
 	/* Decide gc worker name and start it. */
 	ret = snprintf(iocored->gc_worker_data.name, WORKER_NAME_MAX_LEN,
 		"%s/%u", WORKER_NAME_GC, MINOR(wdev->devt) / 2);
 	if (ret >= WORKER_NAME_MAX_LEN) {
 		LOGe("Thread name size too long.\n");
-		goto error6;
+		goto error5;
 	}
 	initialize_worker(&iocored->gc_worker_data,
 			run_gc_logpack_list, (void *)wdev);
@@ -2970,22 +4653,20 @@ bool iocore_initialize(struct walb_dev *wdev)
 	return true;
 
 #if 0
-error7:
+error6:
 	finalize_worker(&iocored->gc_worker_data);
 #endif
-error6:
+error5:
 	destroy_iocore_data(iocored);
 	wdev->private_data = NULL;
-error5:
-	pack_work_exit();
 error4:
-	bio_wrapper_exit();
+	pack_work_exit();
 error3:
-	bio_entry_exit();
+	bio_wrapper_exit();
 error2:
-	pack_cache_put();
+	bio_entry_exit();
 error1:
-	treemap_memory_manager_put();
+	pack_cache_put();
 error0:
 	return false;
 }
@@ -3012,7 +4693,6 @@ void iocore_finalize(struct walb_dev *wdev)
 	bio_wrapper_exit();
 	bio_entry_exit();
 	pack_cache_put();
-	treemap_memory_manager_put();
 
 #ifdef WALB_DEBUG
 	LOGi("n_flush_io: %d\nn_flush_logpack: %d\nn_flush_force: %d\n"
@@ -3035,7 +4715,7 @@ void iocore_freeze(struct walb_dev *wdev)
 
 	might_sleep();
 
-	freeze_detail(iocored, true);
+	freeze_detail(iocored);
 
 	/* We must wait for this at first. */
 	wait_for_logpack_submit_queue_empty(wdev);
@@ -3048,9 +4728,7 @@ void iocore_freeze(struct walb_dev *wdev)
 	   which update wdev->written_lsid. */
 	wait_for_all_pending_gc_done(wdev);
 
-	spin_lock(&wdev->lsid_lock);
-	lsids = wdev->lsids;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
 	WLOGi(wdev, "iocore frozen."
 		" latest %" PRIu64 ""
 		" written %" PRIu64 "\n"
@@ -3067,10 +4745,9 @@ void iocore_melt(struct walb_dev *wdev)
 
 	might_sleep();
 
-	if (melt_detail(iocored, true)) {
-		dispatch_submit_log_task(wdev);
-		WLOGi(wdev, "iocore melted.\n");
-	}
+	melt_detail(iocored);
+	dispatch_submit_log_task(wdev);
+	WLOGi(wdev, "iocore melted.\n");
 }
 
 /**
@@ -3078,61 +4755,7 @@ void iocore_melt(struct walb_dev *wdev)
  */
 void iocore_make_request(struct walb_dev *wdev, struct bio *bio)
 {
-	struct bio_wrapper *biow;
-	struct iocore_data *iocored;
-	const bool is_write = (bio->bi_rw & REQ_WRITE) != 0;
-
-	/* Check whether the device is dying. */
-	if (is_wdev_dying(wdev)) {
-		bio->bi_error = -ENODEV;
-		bio_endio(bio);
-		return;
-	}
-	iocored = get_iocored_from_wdev(wdev);
-
-	/* Check whether read-only mode. */
-	if (is_write && test_bit(WALB_STATE_READ_ONLY, &wdev->flags)) {
-		bio_io_error(bio);
-		return;
-	}
-
-	/* Create bio wrapper. */
-	biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO);
-	if (!biow) {
-		bio->bi_error = -ENOMEM;
-		bio_endio(bio);
-		return;
-	}
-	init_bio_wrapper(biow, bio);
-	biow->private_data = wdev;
-
-	/* IO accounting for diskstats. */
-	io_acct_start(biow);
-
-	if (is_write) {
-#ifdef WALB_PERFORMANCE_ANALYSIS
-		getnstimeofday(&biow->ts[WALB_TIME_BEGIN]);
-#endif
-
-		/* Allocate another buffer and copy bio data.
-		   Do not use original bio's data from now. */
-		biow->copied_bio = bio_deep_clone(bio, GFP_NOIO);
-		if (!biow->copied_bio)
-			goto error0;
-
-		/* Push into queue and invoke submit task. */
-		if (push_into_lpack_submit_queue(biow))
-			dispatch_submit_log_task(wdev);
-	} else {
-		submit_read_bio_wrapper(wdev, biow);
-
-		/* TODO: support IOCORE_STATE_QUEUE_STOPPED for read also. */
-	}
-	return;
-error0:
-	io_acct_end(biow);
-	destroy_bio_wrapper_dec(wdev, biow);
-	bio_io_error(bio);
+	make_request_detail(wdev, bio, false);
 }
 
 /**
@@ -3226,6 +4849,7 @@ void destroy_bio_wrapper_dec(
 	ASSERT(biow);
 
 	started = bio_wrapper_state_is_started(biow);
+	release_write_admission(wdev, biow);
 	destroy_bio_wrapper(biow);
 
 	atomic_dec(&iocored->n_pending_bio);
@@ -3250,6 +4874,139 @@ blk_qc_t walb_make_request(struct request_queue *q, struct bio *bio)
 #endif
 }
 
+/**
+ * Take the write admission for all the bios of a request.
+ *
+ * This replaces sleeping in admit_write_bio_wrapper():
+ * the hardware queue is stopped instead and the request is requeued.
+ * The queues are started again when the budget has enough room
+ * (see give_back_admission_sectors()).
+ *
+ * RETURN:
+ *   true if admitted, or false if the request must be requeued.
+ */
+static bool admit_walb_mq_request(
+	struct walb_dev *wdev, struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	unsigned int sectors = 0;
+	struct bio *bio;
+
+	__rq_for_each_bio(bio, rq)
+		sectors += get_bio_admission_sectors(bio);
+
+	if (try_admit_write(iocored, sectors, wdev->max_pending_sectors))
+		return true;
+
+	set_bit(IOCORE_STATE_MQ_ADMISSION_STOPPED, &iocored->flags);
+	blk_mq_stop_hw_queue(hctx);
+	/*
+	 * The budget may have been given back before the flag was set.
+	 * Pairs with atomic_sub_return() in give_back_admission_sectors().
+	 */
+	smp_mb();
+	if (!try_admit_write(iocored, sectors, wdev->max_pending_sectors))
+		return false;
+
+	if (test_and_clear_bit(IOCORE_STATE_MQ_ADMISSION_STOPPED, &iocored->flags))
+		blk_mq_start_stopped_hw_queues(wdev->queue, true);
+	return true;
+}
+
+static void walb_mq_put_cmd(struct walb_mq_cmd *cmd)
+{
+	if (atomic_dec_and_test(&cmd->n_pending))
+		blk_mq_end_request(cmd->rq, cmd->error);
+}
+
+static void bio_end_io_for_walb_mq(struct bio *clone)
+{
+	struct walb_mq_cmd *cmd = clone->bi_private;
+
+	if (clone->bi_error)
+		WRITE_ONCE(cmd->error, clone->bi_error);
+	bio_put(clone);
+	walb_mq_put_cmd(cmd);
+}
+
+/**
+ * queue_rq callback of the blk-mq frontend.
+ *
+ * The bios of a request are cloned from wdev->mq_bio_set
+ * and passed to the iocore directly on this cpu,
+ * so the bio wrappers are pushed to the submit stage of the cpu
+ * and reads are remapped without any task.
+ * An empty flush request has no bio so a flush bio is made for it.
+ *
+ * blk-mq has already issued the pre-flush of a data request
+ * with REQ_FLUSH as an empty flush request,
+ * so REQ_FLUSH is cleared from the clones not to flush the log twice.
+ *
+ * CONTEXT:
+ *   Non-atomic (BLK_MQ_F_BLOCKING).
+ */
+static int walb_mq_queue_rq(
+	struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct walb_dev *wdev = hctx->queue->queuedata;
+	struct walb_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	const bool is_write = rq_data_dir(rq) == WRITE;
+	struct bio *bio, *clone;
+
+	if (is_write && !admit_walb_mq_request(wdev, hctx, rq))
+		return BLK_MQ_RQ_QUEUE_BUSY;
+
+	blk_mq_start_request(rq);
+	cmd->rq = rq;
+	atomic_set(&cmd->n_pending, 1);
+	cmd->error = 0;
+
+	if (!rq->bio) {
+		ASSERT(rq->cmd_flags & REQ_FLUSH);
+		/* This never fails because the bio_set has a mempool. */
+		clone = bio_alloc_bioset(GFP_NOIO, 0, wdev->mq_bio_set);
+		ASSERT(clone);
+		clone->bi_rw = WRITE_FLUSH;
+		clone->bi_end_io = bio_end_io_for_walb_mq;
+		clone->bi_private = cmd;
+		atomic_inc(&cmd->n_pending);
+		make_request_detail(wdev, clone, is_write);
+		goto fin;
+	}
+
+	__rq_for_each_bio(bio, rq) {
+		/* This never fails because the bio_set has a mempool. */
+		clone = bio_clone_fast(bio, GFP_NOIO, wdev->mq_bio_set);
+		ASSERT(clone);
+		clone->bi_rw &= ~REQ_FLUSH;
+		clone->bi_end_io = bio_end_io_for_walb_mq;
+		clone->bi_private = cmd;
+		atomic_inc(&cmd->n_pending);
+		make_request_detail(wdev, clone, is_write);
+	}
+fin:
+	walb_mq_put_cmd(cmd);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+/**
+ * Operations of the blk-mq frontend.
+ * The queue depth is limited by tags of each hardware context.
+ */
+struct blk_mq_ops walb_mq_ops = {
+	.queue_rq = walb_mq_queue_rq,
+	.map_queue = blk_mq_map_queue,
+};
+
+/**
+ * Size of per-request data of the blk-mq frontend.
+ */
+unsigned int walb_mq_cmd_size(void)
+{
+	return sizeof(struct walb_mq_cmd);
+}
+
 /**
  * Walblog device make request.
  *
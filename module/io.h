@@ -10,12 +10,19 @@
 #include "check_kernel.h"
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/list.h>
+#include <linux/cpumask.h>
+#include <linux/mempool.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/version.h>
 #include "kern.h"
 #include "bio_wrapper.h"
 #include "worker.h"
 #include "treemap.h"
+#include "latency.h"
 
 /**
  * iocored->flags bit.
@@ -25,10 +32,21 @@ enum {
 	IOCORE_STATE_SUBMIT_LOG_TASK_WORKING = 0,
 	IOCORE_STATE_WAIT_LOG_TASK_WORKING,
 	IOCORE_STATE_SUBMIT_DATA_TASK_WORKING,
-	IOCORE_STATE_WAIT_DATA_TASK_WORKING,
+	/* Hardware queues of the blk-mq frontend are stopped
+	   by the write admission control. */
+	IOCORE_STATE_MQ_ADMISSION_STOPPED,
+};
 
-	/* To keep order of stopping and restarting queue. */
-	IOCORE_STATE_IS_QUEUE_STOPPED,
+/**
+ * Per-cpu staging list of write bio wrappers.
+ * iocore_make_request() puts bio wrappers here
+ * and task_submit_logpack_list() moves them to
+ * the logpack submit queue (or the frozen queue).
+ */
+struct submit_stage
+{
+	spinlock_t lock; /* Use spin_lock()/spin_unlock(). */
+	struct list_head list; /* bio_wrapper list. */
 };
 
 /**
@@ -39,6 +57,15 @@ struct iocore_data
 	/* See IOCORE_STATE_XXXXX */
 	unsigned long flags;
 
+	/*
+	 * Per-cpu staging lists in front of logpack_submit_queue.
+	 * Each list must be accessed with its own lock held.
+	 * A cpu bit of submit_stage_mask is set while its list is not empty,
+	 * which is updated with the list lock held.
+	 */
+	struct submit_stage __percpu *submit_stage;
+	struct cpumask submit_stage_mask;
+
 	/*
 	 * There are four queues.
 	 * Each queue must be accessed with its own lock held.
@@ -52,22 +79,17 @@ struct iocore_data
 	 *   writepack list.
 	 * datapack_submit_queue:
 	 *   bio_wrapper list.
-	 * datapack_wait_queue:
-	 *   bio_wrapper list.
 	 * logpack_gc_queue:
 	 *   writepack list.
 	 */
 	spinlock_t logpack_submit_queue_lock;
-	bool is_frozen_sys;
-	bool is_frozen_usr;
+	bool is_frozen;
 	struct list_head frozen_queue;
 	struct list_head logpack_submit_queue;
 	spinlock_t logpack_wait_queue_lock;
 	struct list_head logpack_wait_queue;
 	spinlock_t datapack_submit_queue_lock;
 	struct list_head datapack_submit_queue;
-	spinlock_t datapack_wait_queue_lock;
-	struct list_head datapack_wait_queue;
 	spinlock_t logpack_gc_queue_lock;
 	struct list_head logpack_gc_queue;
 
@@ -83,20 +105,40 @@ struct iocore_data
 	/* for gc worker. */
 	struct worker_data gc_worker_data;
 
+	/* Back pointer. */
+	struct walb_dev *wdev;
+
+	/*
+	 * The wait log task is queued by log IO completion callbacks,
+	 * which may run in interrupt context, so its work is embedded here
+	 * instead of allocating a pack_work.
+	 * IOCORE_STATE_WAIT_LOG_TASK_WORKING guards it.
+	 */
+	struct work_struct wait_log_work;
+
+	/*
+	 * Per-stage sequence counters of packs.
+	 * Each is updated only by its own stage, which is serialized.
+	 *   log_submit_seq: next pack->seq to be submitted.
+	 *   log_wait_seq: next pack->seq to finish the log stage.
+	 *   gc_seq: next pack->seq to be garbage-collected.
+	 */
+	u64 log_submit_seq;
+	u64 log_wait_seq;
+	u64 gc_seq;
+
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	/**
 	 * All req_entry data may not keep reqe->bioe_list.
 	 * You must keep address and size information in another way.
 	 */
 	spinlock_t overlapped_data_lock; /* Use spin_lock()/spin_unlock(). */
-	struct multimap *overlapped_data; /* key: blk_rq_pos(req),
-					     val: pointer to req_entry. */
-
-	/* Maximum request size [logical block]. */
-	unsigned int max_sectors_in_overlapped;
+	/* key: [biow->pos, biow->pos + biow->len),
+	   val: pointer to bio_wrapper. */
+	struct interval_multimap *overlapped_data;
 
 #ifdef WALB_DEBUG
-	/* In order to check FIFO property. */
+	/* Number of inserted and deleted bio wrappers. */
 	u64 overlapped_in_id;
 	u64 overlapped_out_id;
 #endif
@@ -110,23 +152,85 @@ struct iocore_data
 	/* Use spin_lock()/spin_unlock(). */
 	spinlock_t pending_data_lock;
 
-	/* key: biow->pos,
+	/* key: [biow->pos, biow->pos + biow->len),
 	   val: pointer to bio_wrapper. */
-	struct multimap *pending_data;
+	struct interval_multimap *pending_data;
 
 	/* Number of sectors pending
 	   [logical block]. */
 	unsigned int pending_sectors;
 
-	/* Maximum request size [logical block]. */
-	unsigned int max_sectors_in_pending;
+	/*
+	 * Write admission control [logical block].
+	 * Each write bio takes its size (1 for discard) in make_request
+	 * and gives it back when its bio wrapper is destroyed
+	 * or its data are spilled (see wdev->spill_writes).
+	 * Writers sleep on admission_wait_queue
+	 * while the sum exceeds wdev->max_pending_sectors.
+	 */
+	atomic_t inflight_sectors;
+	wait_queue_head_t admission_wait_queue;
 
-	/* For queue stopped timeout check. */
-	unsigned long queue_restart_jiffies;
+	/* Number of data IOs and their size [byte]
+	   absorbed by newer write IOs. See wdev->absorb_writes. */
+	atomic64_t n_absorbed_io;
+	atomic64_t n_absorbed_bytes;
+
+	/* Number of write IOs and their size [byte]
+	   whose data were dropped in spill mode. See wdev->spill_writes. */
+	atomic64_t n_spilled_io;
+	atomic64_t n_spilled_bytes;
+
+	/* Number of all-zero write IOs and their size [byte]
+	   logged without data. See wdev->detect_zero. */
+	atomic64_t n_zero_io;
+	atomic64_t n_zero_bytes;
 
 	/* To check that we should flush log device. */
 	unsigned long log_flush_jiffies;
 
+	/* Serializes force_flush_ldev() calls.
+	   A caller whose lsid has been made permanent
+	   by the preceding flush does not issue another one. */
+	struct mutex ldev_flush_lock;
+
+	/* wait_for_log_permanent() callers sleep here
+	   until completed_lsid or permanent_lsid advances. */
+	wait_queue_head_t log_permanent_wait_queue;
+
+	/*
+	 * Group commit of FUA bios.
+	 * fua_wait_list: packs whose FUA bios wait for
+	 *   their logs to be permanent, in lsid order (pack->fua_list).
+	 * fua_flush_lsid: permanent_lsid that the flush in flight will make,
+	 *   or INVALID_LSID if there is no flush in flight.
+	 *   Packs until it attach to the flush in flight
+	 *   and the others wait for the next one.
+	 * They must be accessed with fua_lock held.
+	 * fua_flush_work ends the waiting packs after the flush completes.
+	 */
+	spinlock_t fua_lock;
+	struct list_head fua_wait_list;
+	u64 fua_flush_lsid;
+	int fua_flush_error;
+	struct work_struct fua_flush_work;
+
+	/* Reserved logpack header sectors of physical block size.
+	   This guarantees forward progress of logpack creation. */
+	mempool_t *logpack_header_pool;
+
+	/* Per-cpu latency histograms of write IO stages. */
+	struct walb_latency __percpu *latency;
+
+	/*
+	 * Adaptive logpack batching.
+	 * cur_io_bulk and cur_logpack_pb are updated by the submit log task.
+	 * log_lat_avg_ns is updated by the wait log task [ns].
+	 */
+	unsigned int cur_io_bulk;
+	unsigned int cur_logpack_pb;
+	u64 log_lat_avg_ns;
+
 #ifdef WALB_DEBUG
 	atomic_t n_flush_io;
 	atomic_t n_flush_logpack;
@@ -139,6 +243,13 @@ struct iocore_data
 /* Completion timeout [msec]. */
 static const unsigned long completion_timeo_ms_ = 10000; /* 10 seconds. */
 
+/* Wakeup is not delivered when wdev becomes read-only mode
+   outside the IO core, so waiters check it with this period [msec]. */
+#define LOG_PERMANENT_WAIT_TIMEO_MS 100
+
+/* Upper bound of wdev->absorb_delay_ms [msec]. */
+#define ABSORB_DELAY_MAX_MS 1000
+
 /**
  * Get iocore data from wdev.
  */
@@ -158,6 +269,19 @@ blk_qc_t walb_make_request(struct request_queue *q, struct bio *bio);
 blk_qc_t walblog_make_request(struct request_queue *q, struct bio *bio);
 #endif
 
+/*
+ * blk-mq frontend.
+ * Its queue_rq() calls iocore_make_request(), which may sleep,
+ * so it is available only with BLK_MQ_F_BLOCKING.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+#define WALB_BLK_MQ_F_BLOCKING BLK_MQ_F_BLOCKING
+#else
+#define WALB_BLK_MQ_F_BLOCKING 0
+#endif
+extern struct blk_mq_ops walb_mq_ops;
+unsigned int walb_mq_cmd_size(void);
+
 /* For iocore interface. */
 bool iocore_initialize(struct walb_dev *wdev);
 void iocore_finalize(struct walb_dev *wdev);
@@ -11,8 +11,10 @@
 #include <linux/workqueue.h>
 #include <linux/bio.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/kernel.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/mutex.h>
 
 #include "linux/walb/common.h"
@@ -40,8 +42,15 @@ extern struct workqueue_struct *wq_misc_;
 
 /**
  * If non-zero, data IOs will be sorted for better performance.
+ * If 2, they will be sorted in C-SCAN order across batches.
  */
 extern unsigned int sort_data_io_;
+extern unsigned int cscan_max_age_ms_;
+
+/**
+ * If non-zero, LBA-contiguous data IOs will be merged.
+ */
+extern unsigned int merge_data_io_;
 
 /**
  * Executable binary path for error notification.
@@ -55,6 +64,14 @@ extern char exec_path_on_error_[];
  */
 extern unsigned int error_before_overflow_;
 
+/**
+ * Adaptive logpack batching parameters.
+ */
+extern unsigned int adaptive_batch_;
+extern unsigned int adaptive_min_io_bulk_;
+extern unsigned int adaptive_min_logpack_kb_;
+extern unsigned int adaptive_target_latency_us_;
+
 /*
  * Minor number and partition management.
  */
@@ -172,9 +189,14 @@ struct walb_dev
 	   This is used for logpack header and log data. */
 	u32 log_checksum_salt;
 
+	/* True if the log device is formatted with WALB_LOG_VERSION_PACKED.
+	   Then small log records are packed inside shared physical blocks. */
+	bool is_log_packed;
+
 	/* Lsids and its lock.
-	   Each variable must be accessed with lsid_lock held. */
-	spinlock_t lsid_lock;
+	   Writers must hold lsid_lock with write_seqlock().
+	   Readers may use get_lsid_set() instead of the lock. */
+	seqlock_t lsid_lock;
 	struct lsid_set lsids;
 
 	/*
@@ -183,6 +205,12 @@ struct walb_dev
 	struct request_queue *queue;
 	struct gendisk *gd;
 	atomic_t n_users; /* number of users */
+	/* Tags of the blk-mq frontend.
+	   tag_set.ops is NULL for the bio-based frontend. */
+	struct blk_mq_tag_set tag_set;
+	/* Clones of bios of the blk-mq frontend are allocated from this.
+	   NULL for the bio-based frontend. */
+	struct bio_set *mq_bio_set;
 
 	/*
 	 * For wrapper log device.
@@ -210,15 +238,15 @@ struct walb_dev
 	/* Log flush time interval must not exceed this value [jiffies]. */
 	unsigned int log_flush_interval_jiffies;
 
-	/* max_pending_sectors < pending_sectors
-	   we must stop the queue. */
+	/* Write bios wait for admission
+	   while this value is in flight. */
 	unsigned int max_pending_sectors;
 
-	/* min_pending_sectors > pending_sectors
-	   we can restart the queue. */
+	/* Waiting write bios are admitted
+	   after in-flight sectors decrease under this value. */
 	unsigned int min_pending_sectors;
 
-	/* queue stopped period must not exceed this value. */
+	/* Write admission waiting period must not exceed this value. */
 	unsigned int queue_stop_timeout_jiffies;
 
 	/* If you prefer small response to large throughput,
@@ -228,13 +256,42 @@ struct walb_dev
 	/* If you use IO-scheduling-sensitive storage for the data device,
 	 * you should set larger n_io_bulk value.
 	 * For example, HDD with little cache.
-	 * This must not be so large because we use insertion sort. */
+	 * Data IOs are sorted with list_sort() so thousands are fine. */
 	unsigned int n_io_bulk;
 
 	/* for sysfs. */
 	bool support_flush;
 	bool support_fua;
 	bool support_discard;
+	bool support_write_same;
+
+	/* If true, write IOs share pages with the original bios
+	   instead of copying them, and the original bios are ended
+	   after their data IOs. The submitter must keep the pages stable.
+	   This can be changed through sysfs. */
+	bool zero_copy;
+
+	/* If true, data IOs of write IOs fully overwritten
+	   by newer pending write IOs are not submitted.
+	   Data IOs are delayed absorb_delay_ms [ms] at most after their arrival
+	   to absorb more of them.
+	   These can be changed through sysfs. */
+	bool absorb_writes;
+	unsigned int absorb_delay_ms;
+
+	/* If true, logged write IOs drop their data while more than
+	   min_pending_sectors are in flight, and the data are read
+	   from the log device again before their data IOs.
+	   Reads of them are also served from the log device.
+	   Writers are not blocked by a slow data device then.
+	   This can be changed through sysfs. */
+	bool spill_writes;
+
+	/* If true, write IOs of all-zero data are logged
+	   as records without data (see LOG_RECORD_ZERO).
+	   Only devices of WALB_LOG_VERSION_PACKED support it.
+	   This can be changed through sysfs. */
+	bool detect_zero;
 
 	/*
 	 * For freeze/melt.
@@ -303,10 +360,27 @@ static inline struct walb_dev* get_wdev_from_checkpoint_data(
 	return wdev;
 }
 
+/**
+ * Get a consistent snapshot of wdev->lsids without taking lsid_lock.
+ * The snapshot satisfies lsid_set_is_valid()
+ * because writers keep it inside their critical sections.
+ */
+static inline void get_lsid_set(struct walb_dev *wdev, struct lsid_set *lsids)
+{
+	unsigned int seq;
+
+	ASSERT(wdev);
+	ASSERT(lsids);
+	do {
+		seq = read_seqbegin(&wdev->lsid_lock);
+		*lsids = wdev->lsids;
+	} while (read_seqretry(&wdev->lsid_lock, seq));
+}
+
 /**
  * Check there is no permanent log or not.
  *
- * wdev->lsid_lock must be held.
+ * wdev->lsid_lock must be held if lsids is &wdev->lsids.
  */
 static inline bool is_permanent_log_empty(const struct lsid_set *lsids)
 {
@@ -319,7 +393,7 @@ static inline bool is_permanent_log_empty(const struct lsid_set *lsids)
  * RETURN:
  *   true is lsid set is valid.
  *
- * wdev->lsid_lock must be held.
+ * wdev->lsid_lock must be held if lsids is &wdev->lsids.
  */
 static inline bool lsid_set_is_valid(const struct lsid_set *lsids)
 {
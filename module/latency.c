@@ -0,0 +1,82 @@
+/**
+ * latency.c - Latency histograms of IO processing stages.
+ */
+#include <linux/module.h>
+#include <linux/string.h>
+#include "linux/walb/common.h"
+#include "latency.h"
+
+/*******************************************************************************
+ * Global functions definition.
+ *******************************************************************************/
+
+/**
+ * Allocate zero-cleared histograms.
+ */
+struct walb_latency __percpu *walb_latency_alloc(void)
+{
+	return alloc_percpu(struct walb_latency);
+}
+
+void walb_latency_free(struct walb_latency __percpu *lat)
+{
+	free_percpu(lat);
+}
+
+/**
+ * Clear all the histograms.
+ * Concurrent updates may be lost or survive.
+ */
+void walb_latency_reset(struct walb_latency __percpu *lat)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(lat, cpu), 0, sizeof(struct walb_latency));
+}
+
+/**
+ * Print a histogram.
+ *
+ * Each line is "upper_usec count" for buckets
+ * up to the last non-empty one.
+ * The upper bound of the last bucket is printed as "inf".
+ *
+ * RETURN:
+ *   Printed size in bytes.
+ */
+ssize_t walb_latency_sprint(
+	struct walb_latency __percpu *lat, unsigned int stage,
+	char *buf, size_t size)
+{
+	u64 count[WALB_LAT_NR_BUCKETS];
+	unsigned int i, n = 0;
+	int cpu;
+	size_t len = 0;
+
+	ASSERT(stage < WALB_LAT_MAX);
+
+	memset(count, 0, sizeof(count));
+	for_each_possible_cpu(cpu) {
+		const struct walb_latency *l = per_cpu_ptr(lat, cpu);
+		for (i = 0; i < WALB_LAT_NR_BUCKETS; i++)
+			count[i] += READ_ONCE(l->count[stage][i]);
+	}
+	for (i = 0; i < WALB_LAT_NR_BUCKETS; i++) {
+		if (count[i] > 0)
+			n = i + 1;
+	}
+	for (i = 0; i < n && len < size; i++) {
+		if (i == WALB_LAT_NR_BUCKETS - 1) {
+			len += scnprintf(buf + len, size - len,
+					"inf %" PRIu64 "\n", count[i]);
+		} else {
+			len += scnprintf(buf + len, size - len,
+					"%" PRIu64 " %" PRIu64 "\n",
+					(u64)1 << i, count[i]);
+		}
+	}
+	return len;
+}
+
+MODULE_LICENSE("Dual BSD/GPL");
@@ -0,0 +1,82 @@
+/**
+ * latency.h - Latency histograms of IO processing stages.
+ */
+#ifndef WALB_LATENCY_H_KERNEL
+#define WALB_LATENCY_H_KERNEL
+
+#include "check_kernel.h"
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
+
+/**
+ * IO processing stages to measure.
+ * Each of them except WALB_LAT_CHECKSUM and WALB_LAT_WRITE
+ * is the period from the end of the previous stage.
+ */
+enum
+{
+	WALB_LAT_QUEUE = 0, /* make_request -> dequeued by the submit task. */
+	WALB_LAT_PACK, /* dequeued -> log IO submitted. */
+	WALB_LAT_CHECKSUM, /* data copy and checksum calculation in make_request. */
+	WALB_LAT_LOG_IO, /* log IO submitted -> completed. */
+	WALB_LAT_PENDING, /* log IO completed -> data IO submitted. */
+	WALB_LAT_DATA_IO, /* data IO submitted -> completed. */
+	WALB_LAT_WRITE, /* make_request -> the write bio is ended. */
+	WALB_LAT_MAX,
+};
+
+/**
+ * Number of log2 buckets.
+ * The i'th bucket counts latencies in [2^(i-1), 2^i) usec
+ * (the 0th is less than 1 usec and the last one has no upper bound).
+ */
+#define WALB_LAT_NR_BUCKETS 32
+
+/**
+ * Per-cpu histograms.
+ */
+struct walb_latency
+{
+	u64 count[WALB_LAT_MAX][WALB_LAT_NR_BUCKETS];
+};
+
+/**
+ * Add a latency to a histogram.
+ *
+ * @lat per-cpu histograms.
+ * @stage WALB_LAT_XXX.
+ * @ns latency [nsec].
+ */
+static inline void walb_latency_add(
+	struct walb_latency __percpu *lat, unsigned int stage, u64 ns)
+{
+	const u64 us = div_u64(ns, NSEC_PER_USEC);
+	const unsigned int idx = min_t(unsigned int, fls64(us),
+				WALB_LAT_NR_BUCKETS - 1);
+
+	this_cpu_inc(lat->count[stage][idx]);
+}
+
+/**
+ * Add the period from *prev_ns to now and set *prev_ns to now.
+ */
+static inline void walb_latency_add_since(
+	struct walb_latency __percpu *lat, unsigned int stage, u64 *prev_ns)
+{
+	const u64 now = ktime_get_ns();
+
+	walb_latency_add(lat, stage, now - *prev_ns);
+	*prev_ns = now;
+}
+
+struct walb_latency __percpu *walb_latency_alloc(void);
+void walb_latency_free(struct walb_latency __percpu *lat);
+void walb_latency_reset(struct walb_latency __percpu *lat);
+ssize_t walb_latency_sprint(
+	struct walb_latency __percpu *lat, unsigned int stage,
+	char *buf, size_t size);
+
+#endif /* WALB_LATENCY_H_KERNEL */
@@ -23,31 +23,41 @@ void walb_logpack_header_print(
 		"checksum: %08x\n"
 		"n_records: %u\n"
 		"n_padding: %u\n"
+		"n_header_pb: %u\n"
 		"total_io_size: %u\n"
 		"logpack_lsid: %"PRIu64"\n",
 		level,
 		lhead->checksum,
 		lhead->n_records,
 		lhead->n_padding,
+		get_logpack_header_pb(lhead),
 		lhead->total_io_size,
 		lhead->logpack_lsid);
 	for (i = 0; i < lhead->n_records; i++) {
+		const u32 flags = lhead->record[i].flags;
+
 		printk("%srecord %d\n"
 			"  checksum: %08x\n"
 			"  lsid: %llu\n"
 			"  lsid_local: %u\n"
+			"  sub_offset: %u\n"
 			"  is_exist: %u\n"
 			"  is_padding: %u\n"
 			"  is_discard: %u\n"
+			"  is_zero: %u\n"
+			"  is_write_same: %u\n"
 			"  offset: %"PRIu64"\n"
 			"  io_size: %u\n",
 			level, i,
 			lhead->record[i].checksum,
 			lhead->record[i].lsid,
 			lhead->record[i].lsid_local,
-			test_bit_u32(LOG_RECORD_EXIST, &lhead->record[i].flags),
-			test_bit_u32(LOG_RECORD_PADDING, &lhead->record[i].flags),
-			test_bit_u32(LOG_RECORD_DISCARD, &lhead->record[i].flags),
+			lhead->record[i].sub_offset,
+			test_bit_u32(LOG_RECORD_EXIST, &flags),
+			test_bit_u32(LOG_RECORD_PADDING, &flags),
+			test_bit_u32(LOG_RECORD_DISCARD, &flags),
+			test_bit_u32(LOG_RECORD_ZERO, &flags),
+			test_bit_u32(LOG_RECORD_WRITE_SAME, &flags),
 			lhead->record[i].offset,
 			lhead->record[i].io_size);
 		printk("%slogpack lsid: %llu\n", level,
@@ -55,21 +65,70 @@ void walb_logpack_header_print(
 	}
 }
 
+/**
+ * Get the offset to pack a log record inside
+ * the last physical block of a logpack.
+ *
+ * @lhead logpack header.
+ * @pbs physical block size.
+ * @n_lb io size of the record to add [logical block].
+ *
+ * RETURN:
+ *   offset in the last physical block [logical block]
+ *   if the record fits in its unused area,
+ *   or 0 (the record must start at a new physical block).
+ */
+static unsigned int get_sub_offset_to_pack(
+	const struct walb_logpack_header *lhead,
+	unsigned int pbs, unsigned int n_lb)
+{
+	const struct walb_log_record *rec = NULL;
+	unsigned int end_lb;
+	int i;
+
+	/* Discard and zero records have no data. */
+	for (i = lhead->n_records - 1; i >= 0; i--) {
+		rec = &lhead->record[i];
+		if (log_record_has_data(rec))
+			break;
+	}
+	if (i < 0 || test_bit_u32(LOG_RECORD_PADDING, &rec->flags))
+		return 0;
+
+	/* The data of the record ends in the last physical block. */
+	ASSERT(rec->lsid_local - get_logpack_header_pb(lhead)
+		+ capacity_pb(pbs, rec->sub_offset + log_record_data_lb(rec))
+		== lhead->total_io_size);
+	end_lb = (unsigned int)off_in_pb(
+		pbs, rec->sub_offset + log_record_data_lb(rec));
+	if (end_lb == 0 || end_lb + n_lb > n_lb_in_pb(pbs))
+		return 0;
+	return end_lb;
+}
+
 /**
  * Add a bio to a logpack header.
  * Almost the same as walb_logpack_header_add_req().
  * Do not validate checksum.
  *
  * REQ_DISCARD is supported.
+ * All-zero writes can be added without data area.
+ * REQ_WRITE_SAME is supported and only its payload is stored.
  *
  * @lhead log pack header.
  *   lhead->logpack_lsid must be set correctly.
  *   lhead->sector_type must be set correctly.
+ *   lhead->n_header_pb must be set correctly.
  * @logpack_lsid lsid of the log pack.
  * @bio bio to add. must be write and its size >= 0.
  *	size == 0 is permitted with flush requests only.
  * @pbs physical block size.
  * @ring_buffer_size ring buffer size [physical block]
+ * @is_packed true to pack the record inside the last physical block
+ *   if it has enough unused area (WALB_LOG_VERSION_PACKED).
+ * @is_zero true if the bio data are all zero.
+ *   Its record will have LOG_RECORD_ZERO and no data area.
+ *   This requires WALB_LOG_VERSION_PACKED.
  *
  * RETURN:
  *   true in success, or false (you must create new logpack for the bio).
@@ -77,15 +136,15 @@ void walb_logpack_header_print(
 bool walb_logpack_header_add_bio(
 	struct walb_logpack_header *lhead,
 	const struct bio *bio,
-	unsigned int pbs, u64 ring_buffer_size)
+	unsigned int pbs, u64 ring_buffer_size, bool is_packed, bool is_zero)
 {
 	u64 logpack_lsid;
 	u64 bio_lsid;
-	unsigned int bio_lb, bio_pb;
+	unsigned int bio_lb, data_lb, bio_pb;
 	u64 padding_pb;
-	unsigned int max_n_rec;
+	unsigned int max_n_rec, n_header_pb;
 	int idx;
-	bool is_discard;
+	bool is_discard, is_write_same, has_data;
 	UNUSED const char no_more_bio_msg[] = "no more bio can not be added.\n";
 
 	ASSERT(lhead);
@@ -94,9 +153,11 @@ bool walb_logpack_header_add_bio(
 	ASSERT_PBS(pbs);
 	ASSERT(bio->bi_rw & REQ_WRITE);
 	ASSERT(ring_buffer_size > 0);
+	ASSERT(!is_zero || is_packed);
 
 	logpack_lsid = lhead->logpack_lsid;
-	max_n_rec = max_n_log_record_in_sector(pbs);
+	n_header_pb = get_logpack_header_pb(lhead);
+	max_n_rec = max_n_log_record_in_header(pbs, n_header_pb);
 	idx = lhead->n_records;
 
 	ASSERT(lhead->n_records <= max_n_rec);
@@ -105,7 +166,7 @@ bool walb_logpack_header_add_bio(
 		return false;
 	}
 
-	bio_lsid = logpack_lsid + 1 + lhead->total_io_size;
+	bio_lsid = logpack_lsid + n_header_pb + lhead->total_io_size;
 	bio_lb = bio_sectors(bio);
 	if (bio_lb == 0) {
 		/* Only flush requests can have zero-size. */
@@ -115,10 +176,43 @@ bool walb_logpack_header_add_bio(
 		return true;
 	}
 	ASSERT(0 < bio_lb);
-	bio_pb = capacity_pb(pbs, bio_lb);
 	is_discard = ((bio->bi_rw & REQ_DISCARD) != 0);
 	if (!is_discard)
 		ASSERT(bio_lb <= WALB_MAX_NORMAL_IO_SECTORS);
+	ASSERT(!(is_discard && is_zero));
+	has_data = !is_discard && !is_zero;
+	/* A write same bio of zero payload is logged as a zero record. */
+	is_write_same = has_data && (bio->bi_rw & REQ_WRITE_SAME) != 0;
+	ASSERT(!is_write_same || is_packed);
+	ASSERT(!is_write_same || bio_iovec(bio).bv_len == LOGICAL_BLOCK_SIZE);
+	data_lb = is_write_same ? 1 : bio_lb;
+	bio_pb = capacity_pb(pbs, data_lb);
+
+	/* Pack check.
+	   A packed record never crosses the end of the ring buffer
+	   and does not increase lhead->total_io_size. */
+	if (is_packed && has_data) {
+		const unsigned int sub_offset =
+			get_sub_offset_to_pack(lhead, pbs, data_lb);
+		if (sub_offset > 0) {
+			bio_lsid--;
+			set_bit_u32(LOG_RECORD_EXIST, &lhead->record[idx].flags);
+			clear_bit_u32(LOG_RECORD_PADDING, &lhead->record[idx].flags);
+			clear_bit_u32(LOG_RECORD_DISCARD, &lhead->record[idx].flags);
+			clear_bit_u32(LOG_RECORD_ZERO, &lhead->record[idx].flags);
+			if (is_write_same)
+				set_bit_u32(LOG_RECORD_WRITE_SAME, &lhead->record[idx].flags);
+			else
+				clear_bit_u32(LOG_RECORD_WRITE_SAME, &lhead->record[idx].flags);
+			lhead->record[idx].lsid = bio_lsid;
+			lhead->record[idx].lsid_local = (u16)(bio_lsid - logpack_lsid);
+			lhead->record[idx].sub_offset = (u16)sub_offset;
+			lhead->record[idx].offset = (u64)bio->bi_iter.bi_sector;
+			lhead->record[idx].io_size = (u32)bio_lb;
+			lhead->n_records++;
+			return true;
+		}
+	}
 
 	/* Padding check. */
 	{
@@ -126,7 +220,7 @@ bool walb_logpack_header_add_bio(
 		div64_u64_rem(bio_lsid, ring_buffer_size, &rem);
 		padding_pb = ring_buffer_size - rem;
 	}
-	if (!is_discard && padding_pb < bio_pb) {
+	if (has_data && padding_pb < bio_pb) {
 		/* Log of this request will cross the end of ring buffer.
 		   So padding is required. */
 		u64 cap_lb;
@@ -153,7 +247,7 @@ bool walb_logpack_header_add_bio(
 
 		bio_lsid += padding_pb;
 		idx++;
-		ASSERT(bio_lsid == logpack_lsid + 1 + lhead->total_io_size);
+		ASSERT(bio_lsid == logpack_lsid + n_header_pb + lhead->total_io_size);
 
 		if (lhead->n_records == max_n_rec) {
 			/* The last record is padding. */
@@ -162,7 +256,7 @@ bool walb_logpack_header_add_bio(
 		}
 	}
 
-	if (!is_discard &&
+	if (has_data &&
 		lhead->total_io_size + bio_pb
 		> MAX_TOTAL_IO_SIZE_IN_LOGPACK_HEADER) {
 		LOG_(no_more_bio_msg);
@@ -174,16 +268,25 @@ bool walb_logpack_header_add_bio(
 	clear_bit_u32(LOG_RECORD_PADDING, &lhead->record[idx].flags);
 	lhead->record[idx].lsid = bio_lsid;
 	lhead->record[idx].lsid_local = (u16)(bio_lsid - logpack_lsid);
+	lhead->record[idx].sub_offset = 0;
 	lhead->record[idx].offset = (u64)bio->bi_iter.bi_sector;
 	lhead->record[idx].io_size = (u32)bio_lb;
 	lhead->n_records++;
-	if (is_discard) {
+	if (is_discard)
 		set_bit_u32(LOG_RECORD_DISCARD, &lhead->record[idx].flags);
-		/* lhead->total_io_size will not be added. */
-	} else {
+	else
 		clear_bit_u32(LOG_RECORD_DISCARD, &lhead->record[idx].flags);
+	if (is_zero)
+		set_bit_u32(LOG_RECORD_ZERO, &lhead->record[idx].flags);
+	else
+		clear_bit_u32(LOG_RECORD_ZERO, &lhead->record[idx].flags);
+	if (is_write_same)
+		set_bit_u32(LOG_RECORD_WRITE_SAME, &lhead->record[idx].flags);
+	else
+		clear_bit_u32(LOG_RECORD_WRITE_SAME, &lhead->record[idx].flags);
+	/* Discard and zero records do not add lhead->total_io_size. */
+	if (has_data)
 		lhead->total_io_size += bio_pb;
-	}
 	return true;
 }
 
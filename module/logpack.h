@@ -27,6 +27,6 @@ void walb_logpack_header_print(
 bool walb_logpack_header_add_bio(
 	struct walb_logpack_header *lhead,
 	const struct bio *bio,
-	unsigned int pbs, u64 ring_buffer_size);
+	unsigned int pbs, u64 ring_buffer_size, bool is_packed, bool is_zero);
 
 #endif /* WALB_LOGPACK_H_KERNEL */
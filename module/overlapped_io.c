@@ -12,64 +12,45 @@
 
 /**
  * Overlapped check and insert.
+ * This never fails because biow->ol_node is used.
  *
  * CONTEXT:
  *   overlapped_data lock must be held.
- * RETURN:
- *   true in success, or false (memory allocation failure).
  */
 #ifdef WALB_OVERLAPPED_SERIALIZE
-bool overlapped_check_and_insert(
-	struct multimap *overlapped_data,
-	unsigned int *max_sectors_p,
-	struct bio_wrapper *biow, gfp_t gfp_mask
+void overlapped_check_and_insert(
+	struct interval_multimap *overlapped_data,
+	struct bio_wrapper *biow
 #ifdef WALB_DEBUG
 	, u64 *overlapped_in_id
 #endif
 	)
 {
-	struct multimap_cursor cur;
-	u64 max_io_size, start_pos;
-	int ret;
+	struct interval_multimap_cursor cur;
+	UNUSED int ret;
 	struct bio_wrapper *biow_tmp;
 
 	ASSERT(overlapped_data);
-	ASSERT(max_sectors_p);
 	ASSERT(biow);
 	ASSERT(biow->len > 0);
 
-	/* Decide search start position. */
-	max_io_size = *max_sectors_p;
-	if (biow->pos > max_io_size) {
-		start_pos = biow->pos - max_io_size;
-	} else {
-		start_pos = 0;
-	}
-
-	multimap_cursor_init(overlapped_data, &cur);
 	biow->n_overlapped = 0;
 
 	/* Search the smallest candidate. */
-	if (!multimap_cursor_search(&cur, start_pos, MAP_SEARCH_GE, 0)) {
+	if (!interval_multimap_cursor_search(
+			&cur, overlapped_data, biow->pos, biow->len)) {
 		goto fin;
 	}
 
 	/* Count overlapped requests previously. */
 	BIO_WRAPPER_PRINT("cmpr0", biow);
-	while (multimap_cursor_key(&cur) < biow->pos + biow->len) {
-
-		ASSERT(multimap_cursor_is_valid(&cur));
-
-		biow_tmp = (struct bio_wrapper *)multimap_cursor_val(&cur);
+	do {
+		biow_tmp = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		ASSERT(biow_tmp);
 		BIO_WRAPPER_PRINT("cmpr1", biow_tmp);
-		if (bio_wrapper_is_overlap(biow, biow_tmp)) {
-			biow->n_overlapped++;
-		}
-		if (!multimap_cursor_next(&cur)) {
-			break;
-		}
-	}
+		ASSERT(bio_wrapper_is_overlap(biow, biow_tmp));
+		biow->n_overlapped++;
+	} while (interval_multimap_cursor_next(&cur));
 
 	if (biow->n_overlapped > 0) {
 		LOG_("n_overlapped %u\n", biow->n_overlapped);
@@ -77,22 +58,14 @@ bool overlapped_check_and_insert(
 		ASSERT(!ret);
 	}
 fin:
-	ret = multimap_add(overlapped_data, biow->pos, (unsigned long)biow, gfp_mask);
-	ASSERT(ret != -EEXIST);
-	ASSERT(ret != -EINVAL);
-	if (ret) {
-		ASSERT(ret == -ENOMEM);
-		LOGe("overlapped_check_and_insert failed.\n");
-		return false;
-	}
-	*max_sectors_p = max(*max_sectors_p, biow->len);
+	interval_multimap_add_node(overlapped_data, &biow->ol_node,
+				biow->pos, biow->len, (unsigned long)biow);
 #ifdef WALB_DEBUG
 	{
 		biow->ol_id = *overlapped_in_id;
 		(*overlapped_in_id)++;
 	}
 #endif
-	return true;
 }
 #endif
 
@@ -101,7 +74,6 @@ fin:
  * and waiting overlapped requests
  *
  * @overlapped_data overlapped data.
- * @max_sectors_p pointer to max_sectors value.
  * @should_submit_list bio wrapper(s) which n_overlapped became 0
  *     will be added.
  *     using biow->list4 for list operations.
@@ -112,8 +84,7 @@ fin:
  */
 #ifdef WALB_OVERLAPPED_SERIALIZE
 unsigned int overlapped_delete_and_notify(
-	struct multimap *overlapped_data,
-	unsigned int *max_sectors_p,
+	struct interval_multimap *overlapped_data,
 	struct list_head *should_submit_list,
 	struct bio_wrapper *biow
 #ifdef WALB_DEBUG
@@ -121,89 +92,68 @@ unsigned int overlapped_delete_and_notify(
 #endif
 	)
 {
-	struct multimap_cursor cur;
-	u64 max_io_size, start_pos;
+	struct interval_multimap_cursor cur;
 	struct bio_wrapper *biow_tmp;
 	unsigned int n_should_submit = 0;
 
 	ASSERT(overlapped_data);
-	ASSERT(max_sectors_p);
 	ASSERT(biow);
 	ASSERT(biow->n_overlapped == 0);
 
-	max_io_size = *max_sectors_p;
-	if (biow->pos > max_io_size) {
-		start_pos = biow->pos - max_io_size;
-	} else {
-		start_pos = 0;
-	}
-
 	/* Delete from the overlapped data. */
-	biow_tmp = (struct bio_wrapper *)multimap_del(
-		overlapped_data, biow->pos, (unsigned long)biow);
-	LOG_("biow_tmp %p biow %p\n", biow_tmp, biow); /* debug */
-	ASSERT(biow_tmp == biow);
+	ASSERT(biow->ol_node.val == (unsigned long)biow);
+	interval_multimap_del_node(overlapped_data, &biow->ol_node);
 
 #ifdef WALB_DEBUG
-	{
-		ASSERT(biow->ol_id == *overlapped_out_id);
-		(*overlapped_out_id)++;
-	}
+	/* Bio wrappers may be deleted out of order,
+	   but never before the overlapped ones inserted earlier.
+	   See the check in the loop below. */
+	(*overlapped_out_id)++;
 #endif
-	/* Initialize max_sectors. */
-	if (multimap_is_empty(overlapped_data)) {
-		*max_sectors_p = 0;
-	}
 
 	/* Search the smallest candidate. */
-	multimap_cursor_init(overlapped_data, &cur);
-	if (!multimap_cursor_search(&cur, start_pos, MAP_SEARCH_GE, 0)) {
+	if (!interval_multimap_cursor_search(
+			&cur, overlapped_data, biow->pos, biow->len)) {
 		return 0;
 	}
 	/* Decrement count of overlapped requests afterward and notify if need. */
-	while (multimap_cursor_key(&cur) < biow->pos + biow->len) {
-
-		ASSERT(multimap_cursor_is_valid(&cur));
-
-		biow_tmp = (struct bio_wrapper *)multimap_cursor_val(&cur);
+	do {
+		biow_tmp = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		ASSERT(biow_tmp);
-		if (bio_wrapper_is_overlap(biow, biow_tmp)) {
-			biow_tmp->n_overlapped--;
-			if (biow_tmp->n_overlapped == 0) {
-				/* There is no overlapped request before it. */
-				list_add_tail(
-					&biow_tmp->list4, should_submit_list);
-				n_should_submit++;
-			}
-		}
-		if (!multimap_cursor_next(&cur)) {
-			break;
+		ASSERT(bio_wrapper_is_overlap(biow, biow_tmp));
+#ifdef WALB_DEBUG
+		ASSERT(biow->ol_id < biow_tmp->ol_id);
+#endif
+		biow_tmp->n_overlapped--;
+		if (biow_tmp->n_overlapped == 0) {
+			/* There is no overlapped request before it. */
+			list_add_tail(&biow_tmp->list4, should_submit_list);
+			n_should_submit++;
 		}
-	}
+	} while (interval_multimap_cursor_next(&cur));
+
 	return n_should_submit;
 }
 #endif
 
 #ifdef WALB_OVERLAPPED_SERIALIZE
-void overlapped_data_print(struct multimap *overlapped_data)
+void overlapped_data_print(struct interval_multimap *overlapped_data)
 {
-	struct multimap_cursor cur;
+	struct interval_multimap_cursor cur;
 	ASSERT(overlapped_data);
-	multimap_cursor_init(overlapped_data, &cur);
 
-	if (!multimap_cursor_begin(&cur))
+	if (!interval_multimap_cursor_search(&cur, overlapped_data, 0, (u64)(-1)))
 		return;
 
 	printk(KERN_INFO "overlapped_data_print BEGIN\n");
-	while (multimap_cursor_next(&cur)) {
+	do {
 		struct bio_wrapper *biow;
-		ASSERT(multimap_cursor_is_valid(&cur));
-		biow = (struct bio_wrapper *)multimap_cursor_val(&cur);
+		biow = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		if (!biow)
 			printk(KERN_INFO "biow null\n");
 		else
 			print_bio_wrapper(KERN_INFO, biow);
-	}
+	} while (interval_multimap_cursor_next(&cur));
 	printk(KERN_INFO "overlapped_data_print END\n");
 }
 #endif
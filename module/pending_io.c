@@ -14,6 +14,8 @@
  * Static functions prototype.
  *******************************************************************************/
 
+static bool is_bio_wrapper_log_older(
+	const struct bio_wrapper *biow0, const struct bio_wrapper *biow1);
 static void insert_to_sorted_bio_wrapper_list_by_lsid(
 	struct bio_wrapper *biow, struct list_head *biow_list);
 
@@ -21,11 +23,22 @@ static void insert_to_sorted_bio_wrapper_list_by_lsid(
  * Static functions definition.
  *******************************************************************************/
 
+/**
+ * Check the log of biow0 precedes the one of biow1.
+ */
+static bool is_bio_wrapper_log_older(
+	const struct bio_wrapper *biow0, const struct bio_wrapper *biow1)
+{
+	if (biow0->lsid != biow1->lsid)
+		return biow0->lsid < biow1->lsid;
+	return biow0->sub_offset < biow1->sub_offset;
+}
+
 /**
  * Insert a bio wrapper to a sorted bio wrapper list.
  * using insertion sort.
  *
- * They are sorted by biow->lsid.
+ * They are sorted by biow->lsid and biow->sub_offset.
  * Use biow->list3 for list operations.
  *
  * @biow (struct bio_wrapper *)
@@ -47,14 +60,14 @@ static void insert_to_sorted_bio_wrapper_list_by_lsid(
 		biow_tmp = list_first_entry(
 			biow_list, struct bio_wrapper, list3);
 		ASSERT(biow_tmp);
-		if (biow->lsid < biow_tmp->lsid) {
+		if (is_bio_wrapper_log_older(biow, biow_tmp)) {
 			list_add(&biow->list3, biow_list);
 			return;
 		}
 	}
 	moved = false;
 	list_for_each_entry_safe(biow_tmp, biow_next, biow_list, list3) {
-		if (biow->lsid < biow_tmp->lsid) {
+		if (is_bio_wrapper_log_older(biow, biow_tmp)) {
 			list_add_tail(&biow->list3, &biow_tmp->list3);
 			moved = true;
 			break;
@@ -79,36 +92,23 @@ static void insert_to_sorted_bio_wrapper_list_by_lsid(
 
 /**
  * Insert a req_entry from a pending data.
+ * This never fails because biow->pending_node is used.
  *
  * CONTEXT:
  *   pending_data lock must be held.
  */
-bool pending_insert(
-	struct multimap *pending_data,
-	unsigned int *max_sectors_p,
-	struct bio_wrapper *biow, gfp_t gfp_mask)
+void pending_insert(
+	struct interval_multimap *pending_data, struct bio_wrapper *biow)
 {
-	int ret;
-
 	ASSERT(pending_data);
-	ASSERT(max_sectors_p);
 	ASSERT(biow);
-	ASSERT(biow->copied_bio);
-	ASSERT(biow->copied_bio->bi_rw & REQ_WRITE);
+	ASSERT(bio_wrapper_state_is_spilled(biow) || biow->copied_bio);
+	ASSERT(!biow->copied_bio || (biow->copied_bio->bi_rw & REQ_WRITE));
 	ASSERT(biow->len > 0);
 
 	/* Insert the entry. */
-	ret = multimap_add(pending_data, biow->pos,
-			(unsigned long)biow, gfp_mask);
-	ASSERT(ret != EEXIST);
-	ASSERT(ret != EINVAL);
-	if (ret) {
-		ASSERT(ret == ENOMEM);
-		LOGe("pending_insert failed.\n");
-		return false;
-	}
-	*max_sectors_p = max(*max_sectors_p, biow->len);
-	return true;
+	interval_multimap_add_node(pending_data, &biow->pending_node,
+				biow->pos, biow->len, (unsigned long)biow);
 }
 
 /**
@@ -118,28 +118,38 @@ bool pending_insert(
  *   pending_data lock must be held.
  */
 void pending_delete(
-	struct multimap *pending_data,
-	unsigned int *max_sectors_p,
-	struct bio_wrapper *biow)
+	struct interval_multimap *pending_data, struct bio_wrapper *biow)
 {
-	struct bio_wrapper *biow_tmp;
-
 	ASSERT(pending_data);
-	ASSERT(max_sectors_p);
 	ASSERT(biow);
+	ASSERT(biow->pending_node.val == (unsigned long)biow);
 
 	/* Delete the entry. */
-	biow_tmp = (struct bio_wrapper *)multimap_del(
-		pending_data, biow->pos, (unsigned long)biow);
-	LOG_("biow_tmp %p biow %p\n", biow_tmp, biow);
-	ASSERT(biow_tmp == biow);
-	if (multimap_is_empty(pending_data)) {
-		*max_sectors_p = 0;
-	}
+	interval_multimap_del_node(pending_data, &biow->pending_node);
+}
+
+/**
+ * Check whether any pending write overlaps [pos, pos + len).
+ *
+ * CONTEXT:
+ *   pending_data lock must be held.
+ */
+bool pending_is_overlapped(
+	struct interval_multimap *pending_data, u64 pos, unsigned int len)
+{
+	struct interval_multimap_cursor cur;
+
+	ASSERT(pending_data);
+	ASSERT(len > 0);
+
+	return interval_multimap_cursor_search(&cur, pending_data, pos, len);
 }
 
 /**
  * Check overlapped writes and copy from them.
+ * Bio(s) overlapped with spilled writes are redirected to the log device.
+ *
+ * @ldev log device.
  *
  * RETURN:
  *   true in success, or false due to data copy failed.
@@ -148,11 +158,10 @@ void pending_delete(
  *   pending_data lock must be held.
  */
 bool pending_check_and_copy(
-	struct multimap *pending_data, unsigned int max_sectors,
-	struct bio_wrapper *biow, gfp_t gfp_mask)
+	struct interval_multimap *pending_data,
+	struct bio_wrapper *biow, struct block_device *ldev, gfp_t gfp_mask)
 {
-	struct multimap_cursor cur;
-	u64 max_io_size, start_pos;
+	struct interval_multimap_cursor cur;
 	struct bio_wrapper *biow_tmp;
 	struct list_head biow_list;
 	unsigned int n_overlapped_bios;
@@ -163,47 +172,36 @@ bool pending_check_and_copy(
 	ASSERT(pending_data);
 	ASSERT(biow);
 
-	/* Decide search start position. */
-	max_io_size = max_sectors;
-	if (biow->pos > max_io_size) {
-		start_pos = biow->pos - max_io_size;
-	} else {
-		start_pos = 0;
-	}
-
 	/* Search the smallest candidate. */
-	multimap_cursor_init(pending_data, &cur);
-	if (!multimap_cursor_search(&cur, start_pos, MAP_SEARCH_GE, 0)) {
+	if (!interval_multimap_cursor_search(
+			&cur, pending_data, biow->pos, biow->len)) {
 		/* No overlapped requests. */
 		return true;
 	}
 	/* Copy data from pending and overlapped write requests. */
 	INIT_LIST_HEAD(&biow_list);
 	n_overlapped_bios = 0;
-	while (multimap_cursor_key(&cur) < biow->pos + biow->len) {
-
-		ASSERT(multimap_cursor_is_valid(&cur));
-
-		biow_tmp = (struct bio_wrapper *)multimap_cursor_val(&cur);
+	do {
+		biow_tmp = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		ASSERT(biow_tmp);
-		if (!bio_wrapper_state_is_discard(biow_tmp) &&
-			bio_wrapper_is_overlap(biow, biow_tmp)) {
+		ASSERT(bio_wrapper_is_overlap(biow, biow_tmp));
+		if (!bio_wrapper_state_is_discard(biow_tmp)) {
 			n_overlapped_bios++;
 			insert_to_sorted_bio_wrapper_list_by_lsid(
 				biow_tmp, &biow_list);
 		}
-		if (!multimap_cursor_next(&cur)) {
-			break;
-		}
-	}
+	} while (interval_multimap_cursor_next(&cur));
+
 	if (n_overlapped_bios > 64) {
 		pr_warn_ratelimited("Too many overlapped bio(s): %u\n",
 				n_overlapped_bios);
 	}
-	/* Copy overlapped pending bio(s) in the order of lsid. */
-	list_for_each_entry(biow_tmp, &biow_list, list3) {
+	/* Copy overlapped pending bio(s) in the reverse order of lsid.
+	   The newest one claims each range,
+	   so copies and reads from the log device never conflict. */
+	list_for_each_entry_reverse(biow_tmp, &biow_list, list3) {
 		BIO_WRAPPER_PRINT("copy", biow_tmp);
-		if (!bio_wrapper_copy_overlapped(biow, biow_tmp, gfp_mask))
+		if (!bio_wrapper_copy_overlapped(biow, biow_tmp, ldev, gfp_mask))
 			return false;
 	}
 	bio_wrapper_endio_copied(biow);
@@ -231,88 +229,72 @@ bool pending_check_and_copy(
  * @biow bio wrapper as a target for comparison.
  */
 void pending_delete_fully_overwritten(
-	struct multimap *pending_data, const struct bio_wrapper *biow)
+	struct interval_multimap *pending_data, const struct bio_wrapper *biow)
 {
-	struct multimap_cursor cur;
-	u64 start_pos, end_pos;
+	struct interval_multimap_cursor cur;
+	int ret;
 
 	ASSERT(pending_data);
 	ASSERT(biow);
 	ASSERT(biow->len > 0);
 
-	start_pos = biow->pos;
-	end_pos = start_pos + biow->len;
-
 	/* Search the smallest candidate. */
-	multimap_cursor_init(pending_data, &cur);
-	if (!multimap_cursor_search(&cur, start_pos, MAP_SEARCH_GE, 0)) {
+	if (!interval_multimap_cursor_search(
+			&cur, pending_data, biow->pos, biow->len)) {
 		/* No overlapped requests. */
 		return;
 	}
 
 	/* Search and delete overwritten biow(s). */
-	while (multimap_cursor_key(&cur) < end_pos) {
+	do {
 		struct bio_wrapper *biow_tmp;
-		int ret;
-		ASSERT(multimap_cursor_is_valid(&cur));
-		biow_tmp = (struct bio_wrapper *)multimap_cursor_val(&cur);
+		biow_tmp = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		ASSERT(biow_tmp);
 		ret = biow_tmp != biow &&
 			bio_wrapper_is_overwritten_by(biow_tmp, biow);
 		if (ret) {
 			set_bit(BIO_WRAPPER_OVERWRITTEN, &biow_tmp->flags);
-			ret = multimap_cursor_del(&cur);
+			ret = interval_multimap_cursor_del(&cur);
 			ASSERT(ret);
-			ret = multimap_cursor_is_data(&cur);
+			ret = interval_multimap_cursor_is_data(&cur);
 		} else {
-			ret = multimap_cursor_next(&cur);
+			ret = interval_multimap_cursor_next(&cur);
 		}
-		if (!ret) { break; }
-	}
+	} while (ret);
 }
 
 /**
  * Insert a biow to and
  * delete fully overwritten (not overlapped) biow(s) by the biow from
  * a pending data.
- *
- * RETURN:
- *   true in success, or false.
  */
-bool pending_insert_and_delete_fully_overwritten(
-	struct multimap *pending_data, unsigned int *max_sectors_p,
-	struct bio_wrapper *biow, gfp_t gfp_mask)
+void pending_insert_and_delete_fully_overwritten(
+	struct interval_multimap *pending_data, struct bio_wrapper *biow)
 {
 	ASSERT(pending_data);
-	ASSERT(max_sectors_p);
 	ASSERT(biow);
 
-	if (!pending_insert(pending_data, max_sectors_p, biow, gfp_mask))
-		return false;
-
+	pending_insert(pending_data, biow);
 	pending_delete_fully_overwritten(pending_data, biow);
-	return true;
 }
 
-void pending_data_print(struct multimap *pending_data)
+void pending_data_print(struct interval_multimap *pending_data)
 {
-	struct multimap_cursor cur;
-	multimap_cursor_init(pending_data, &cur);
+	struct interval_multimap_cursor cur;
 
-	if (!multimap_cursor_begin(&cur))
+	if (!interval_multimap_cursor_search(&cur, pending_data, 0, (u64)(-1)))
 		return;
 
 	printk(KERN_INFO "pending_data_print BEGIN\n");
-	while (multimap_cursor_next(&cur)) {
+	do {
 		struct bio_wrapper *biow;
-		ASSERT(multimap_cursor_is_valid(&cur));
-		biow = (struct bio_wrapper *)multimap_cursor_val(&cur);
+		biow = (struct bio_wrapper *)interval_multimap_cursor_val(&cur);
 		if (!biow) {
 			printk(KERN_INFO "biow null\n");
 		} else {
 			print_bio_wrapper(KERN_INFO, biow);
 		}
-	}
+	} while (interval_multimap_cursor_next(&cur));
 	printk(KERN_INFO "pending_data_print END\n");
 
 }
@@ -13,20 +13,19 @@
 #include "bio_wrapper.h"
 
 /* Pending data functions. */
-bool pending_insert(
-	struct multimap *pending_data, unsigned int *max_sectors_p,
-	struct bio_wrapper *biow, gfp_t gfp_mask);
+void pending_insert(
+	struct interval_multimap *pending_data, struct bio_wrapper *biow);
 void pending_delete(
-	struct multimap *pending_data, unsigned int *max_sectors_p,
-	struct bio_wrapper *biow);
+	struct interval_multimap *pending_data, struct bio_wrapper *biow);
+bool pending_is_overlapped(
+	struct interval_multimap *pending_data, u64 pos, unsigned int len);
 bool pending_check_and_copy(
-	struct multimap *pending_data, unsigned int max_sectors,
-	struct bio_wrapper *biow, gfp_t gfp_mask);
+	struct interval_multimap *pending_data,
+	struct bio_wrapper *biow, struct block_device *ldev, gfp_t gfp_mask);
 void pending_delete_fully_overwritten(
-	struct multimap *pending_data, const struct bio_wrapper *biow);
-bool pending_insert_and_delete_fully_overwritten(
-	struct multimap *pending_data, unsigned int *max_sectors_p,
-	struct bio_wrapper *biow, gfp_t gfp_mask);
-void pending_data_print(struct multimap *pending_data);
+	struct interval_multimap *pending_data, const struct bio_wrapper *biow);
+void pending_insert_and_delete_fully_overwritten(
+	struct interval_multimap *pending_data, struct bio_wrapper *biow);
+void pending_data_print(struct interval_multimap *pending_data);
 
 #endif /* WALB_PENDING_IO_H_KERNEL */
@@ -6,6 +6,8 @@
  */
 #include <linux/module.h>
 #include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
 #include "linux/walb/logger.h"
 #include "kern.h"
 #include "io.h"
@@ -38,13 +40,63 @@ struct redo_data
 	unsigned int queue_len;
 };
 
+/**
+ * Checksum of a log record for redo.
+ */
+struct redo_csum
+{
+	u32 csum;
+	bool is_calculated;
+};
+
 /**
  * Logpack for redo.
+ * Logpacks are fetched ahead into a pipeline and
+ * checksums of their records are calculated in parallel
+ * with redo of the preceding logpacks.
  */
 struct redo_pack
 {
+	struct list_head list; /* entry of the pipeline. */
+	struct walb_dev *wdev;
 	struct bio_wrapper *logh_biow;
-	struct list_head biow_list;
+	struct list_head biow_list; /* biows of the whole logpack data. */
+	unsigned int n_pb; /* logpack size including its header. */
+
+	/* Checksum tasks. NULL if they are not used. */
+	struct redo_csum_work *cworks;
+	unsigned int n_cworks;
+
+	/* Array of n_records items. NULL if cworks is NULL. */
+	struct redo_csum *csums;
+};
+
+/**
+ * Maximum number of physical blocks in a log read IO for redo.
+ */
+#define REDO_READ_IO_MAX_PB BIO_MAX_PAGES
+
+/**
+ * A log read IO for redo.
+ * One bio reads contiguous physical blocks,
+ * each of which has its own bio wrapper.
+ */
+struct redo_read_io
+{
+	unsigned int n_biow;
+	struct bio_wrapper *biow[REDO_READ_IO_MAX_PB];
+};
+
+/**
+ * Checksum calculation of consecutive log records for redo.
+ */
+struct redo_csum_work
+{
+	struct work_struct work;
+	struct redo_pack *pack;
+	unsigned int begin; /* the first record index. */
+	unsigned int end; /* the next of the last record index. */
+	struct bio_wrapper *biow; /* the first bio wrapper of the begin record. */
 };
 
 /*******************************************************************************
@@ -55,6 +107,21 @@ struct redo_pack
    Currently 8MB. */
 #define READ_AHEAD_LB (8 * 1024 * 1024 / LOGICAL_BLOCK_SIZE)
 
+/* Log records are grouped into a checksum task for redo
+   until their data size reaches this [logical block]. */
+#define REDO_CSUM_WORK_MIN_LB 64
+
+/* Maximum number of logpacks in the redo pipeline.
+   Their total size is also limited by READ_AHEAD_LB. */
+#define REDO_PIPELINE_MAX_PACKS 16
+
+/**
+ * Max size of a bio to redo a zero or write same record
+ * without REQ_WRITE_SAME [logical block].
+ * All the bio segments are the same page.
+ */
+#define REDO_SAME_IO_MAX_LB (BIO_MAX_PAGES * (PAGE_SIZE / LOGICAL_BLOCK_SIZE))
+
 /*******************************************************************************
  * Static functions prototype.
  *******************************************************************************/
@@ -64,12 +131,22 @@ static void destroy_redo_data(struct redo_data* data);
 static void run_read_log_in_redo(void *data);
 static void run_gc_log_in_redo(void *data);
 static struct bio_wrapper* create_log_bio_wrapper_for_redo(
-	struct walb_dev *wdev, u64 lsid, struct sector_data *sectd);
+	struct walb_dev *wdev, u64 lsid, struct sector_data *sectd,
+	unsigned int n_pb);
+static struct bio* create_log_read_bio_for_redo(
+	struct walb_dev *wdev, u64 lsid, unsigned int n_pb,
+	struct list_head *biow_list);
+static void bio_end_io_for_redo_read(struct bio *bio);
 static bool prepare_data_bio_for_redo(
 	struct walb_dev *wdev, struct bio_wrapper *biow,
 	u64 pos, unsigned int len);
 static struct bio_wrapper* create_discard_bio_wrapper_for_redo(
 	struct walb_dev *wdev, u64 pos, unsigned int len);
+static struct bio_wrapper* create_zero_bio_wrapper_for_redo(
+	struct walb_dev *wdev, u64 pos, unsigned int len);
+static struct bio_wrapper* create_write_same_bio_wrapper_for_redo(
+	struct walb_dev *wdev, u64 pos, unsigned int len,
+	const u8 *payload, bool is_native);
 static void destroy_bio_wrapper_for_redo(
 	struct walb_dev *wdev, struct bio_wrapper* biow);
 static void bio_end_io_for_redo(struct bio *bio);
@@ -83,22 +160,41 @@ static unsigned int get_bio_wrapper_from_read_queue(
 static struct bio_wrapper* get_logpack_header_for_redo(
 	struct worker_data *read_wd, struct redo_data *read_rd,
 	u64 written_lsid);
-static bool redo_logpack(
+static bool get_rest_logpack_header_for_redo(
 	struct worker_data *read_wd, struct redo_data *read_rd,
-	struct redo_data *gc_rd,
-	struct bio_wrapper *logh_biow, u64 *written_lsid_p,
-	bool *should_terminate);
+	struct bio_wrapper *biow, unsigned int n_pb);
+static struct redo_pack* fetch_logpack_for_redo(
+	struct worker_data *read_wd, struct redo_data *read_rd, u64 lsid);
+static void destroy_redo_pack(struct redo_pack *pack);
+static bool redo_logpack(
+	struct redo_data *gc_rd, struct redo_pack *pack,
+	u64 *written_lsid_p, bool *should_terminate);
 static u32 calc_checksum_for_redo(
 	unsigned int n_lb, unsigned int pbs, u32 salt,
-	struct list_head *biow_list);
+	struct bio_wrapper *biow);
+static bool is_checksum_target_for_redo(const struct walb_log_record *rec);
+static void task_calc_checksums_for_redo(struct work_struct *work);
+static void start_checksums_for_redo(struct redo_pack *pack);
+static void wait_for_checksums_for_redo(struct redo_pack *pack);
 static void create_data_io_for_redo(
 	struct walb_dev *wdev,
 	struct walb_log_record *rec,
 	struct list_head *biow_list);
+static struct bio_wrapper* create_packed_data_io_for_redo(
+	struct walb_dev *wdev, const struct walb_log_record *rec,
+	const struct sector_data *shared_sectd, u32 *csump);
 static void create_discard_data_io_for_redo(
 	struct walb_dev *wdev,
 	struct walb_log_record *rec,
 	struct list_head *biow_list);
+static void create_zero_data_io_for_redo(
+	struct walb_dev *wdev,
+	struct walb_log_record *rec,
+	struct list_head *biow_list);
+static void create_write_same_data_io_for_redo(
+	struct walb_dev *wdev,
+	const struct walb_log_record *rec, const u8 *payload,
+	struct list_head *biow_list);
 static void submit_data_bio_for_redo(
 	UNUSED struct walb_dev *wdev, struct bio_wrapper *biow);
 
@@ -144,8 +240,9 @@ static void destroy_redo_data(struct redo_data* data)
  *
  * What this function will do:
  *   while queue is not occupied:
- *     create buf/bio/biow and submit it.
- *     enqueue the biow.
+ *     create buf/biow(s) for contiguous physical blocks
+ *     and a bio to read all of them, then submit it.
+ *     enqueue the biow(s).
  *
  * You must call wakeup_worker() to read more data.
  *
@@ -156,10 +253,12 @@ static void run_read_log_in_redo(void *data)
 	struct redo_data *redod;
 	struct walb_dev *wdev;
 	struct list_head biow_list;
+	struct bio_list bio_list;
 	unsigned int queue_len;
 	unsigned int pbs;
 	unsigned int max_len;
 	struct bio_wrapper *biow, *biow_next;
+	struct bio *bio;
 	struct blk_plug plug;
 
 	redod = (struct redo_data *)data;
@@ -170,37 +269,43 @@ static void run_read_log_in_redo(void *data)
 	max_len = capacity_pb(pbs, READ_AHEAD_LB);
 
 	INIT_LIST_HEAD(&biow_list);
+	bio_list_init(&bio_list);
 
 	spin_lock(&redod->queue_lock);
 	queue_len = redod->queue_len;
 	spin_unlock(&redod->queue_lock);
 
 	while (queue_len < max_len) {
-		/* Create biow for redo. */
+		/* A read IO must not cross the end of the ring buffer. */
+		const u64 to_end = wdev->ring_buffer_size
+			- redod->lsid % wdev->ring_buffer_size;
+		const unsigned int n_pb = min_t(u64, to_end,
+			min_t(unsigned int, max_len - queue_len,
+				REDO_READ_IO_MAX_PB));
+
+		/* Create biow(s) and a bio for redo. */
 	retry:
-		biow = create_log_bio_wrapper_for_redo(
-			wdev, redod->lsid, NULL);
-		if (!biow) {
+		bio = create_log_read_bio_for_redo(
+			wdev, redod->lsid, n_pb, &biow_list);
+		if (!bio) {
 			schedule();
 			goto retry;
 		}
-
-		list_add_tail(&biow->list, &biow_list);
+		bio_list_add(&bio_list, bio);
 
 		/* Iterate. */
-		queue_len++;
-		redod->lsid++;
+		queue_len += n_pb;
+		redod->lsid += n_pb;
 	}
 
 	if (list_empty(&biow_list)) {
 		goto fin;
 	}
 
-	/* Submit biow(s). */
+	/* Submit bio(s). */
 	blk_start_plug(&plug);
-	list_for_each_entry_safe(biow, biow_next, &biow_list, list) {
-		generic_make_request(biow->bio);
-	}
+	while ((bio = bio_list_pop(&bio_list)))
+		generic_make_request(bio);
 	blk_finish_plug(&plug);
 
 	/* Enqueue submitted biow(s). */
@@ -277,7 +382,6 @@ static void run_gc_log_in_redo(void *data)
 			spin_lock(&iocored->overlapped_data_lock);
 			overlapped_delete_and_notify(
 				iocored->overlapped_data,
-				&iocored->max_sectors_in_overlapped,
 				&should_submit_list, biow
 #ifdef WALB_DEBUG
 				, &iocored->overlapped_out_id
@@ -310,12 +414,15 @@ static void run_gc_log_in_redo(void *data)
  * @wdev walb device (log device will be used for target).
  * @lsid target lsid to read.
  * @sectd sector data. if NULL then newly allocated.
+ * @n_pb number of physical blocks to read.
+ *   This must be 1 when sectd is NULL.
  *
  * RETURN:
  *   bio wrapper in success, or false.
  */
 static struct bio_wrapper* create_log_bio_wrapper_for_redo(
-	struct walb_dev *wdev, u64 lsid, struct sector_data *sectd)
+	struct walb_dev *wdev, u64 lsid, struct sector_data *sectd,
+	unsigned int n_pb)
 {
 	struct bio *bio;
 	struct bio_wrapper *biow;
@@ -324,9 +431,10 @@ static struct bio_wrapper* create_log_bio_wrapper_for_redo(
 	int bytes;
 	bool is_sectd_alloc = false;
 
-	ASSERT(pbs <= PAGE_SIZE);
+	ASSERT(pbs * n_pb <= PAGE_SIZE);
 
 	if (!sectd) {
+		ASSERT(n_pb == 1);
 		is_sectd_alloc = true;
 		sectd = sector_alloc(pbs, GFP_NOIO);
 		if (!sectd) { goto error0; }
@@ -344,10 +452,11 @@ static struct bio_wrapper* create_log_bio_wrapper_for_redo(
 	bio->bi_rw = READ;
 	bio->bi_end_io = bio_end_io_for_redo;
 	bio->bi_private = biow;
+	ASSERT(pbs * n_pb <= sectd->size);
 	bytes = bio_add_page(bio, virt_to_page(sectd->data),
-			pbs, offset_in_page(sectd->data));
-	ASSERT(bytes == pbs);
-	ASSERT((bio_sectors(bio) << 9) == pbs);
+			pbs * n_pb, offset_in_page(sectd->data));
+	ASSERT(bytes == pbs * n_pb);
+	ASSERT((bio_sectors(bio) << 9) == pbs * n_pb);
 
 	init_bio_wrapper(biow, bio);
 	biow->private_data = sectd;
@@ -367,6 +476,90 @@ error0:
 	return NULL;
 }
 
+/**
+ * Create a bio to read contiguous physical blocks of the log in redo.
+ *
+ * @wdev walb device (log device will be used for target).
+ * @lsid the first lsid to read.
+ * @n_pb number of physical blocks to read.
+ *   The range must not cross the end of the ring buffer.
+ * @biow_list created bio wrappers will be added to the tail.
+ *   Each of them has its own sector data as biow->private_data,
+ *   biow->bio is NULL, and biow->done will be completed
+ *   when the returned bio has completed.
+ *
+ * RETURN:
+ *   bio to submit in success, or NULL.
+ */
+static struct bio* create_log_read_bio_for_redo(
+	struct walb_dev *wdev, u64 lsid, unsigned int n_pb,
+	struct list_head *biow_list)
+{
+	struct redo_read_io *rio;
+	struct bio *bio;
+	struct bio_wrapper *biow;
+	const unsigned int pbs = wdev->physical_bs;
+	const unsigned int n_lb = n_lb_in_pb(pbs);
+	u64 off_lb, off_pb;
+	unsigned int i;
+
+	ASSERT(pbs <= PAGE_SIZE);
+	ASSERT(0 < n_pb && n_pb <= REDO_READ_IO_MAX_PB);
+
+	rio = kmalloc(sizeof(*rio), GFP_NOIO);
+	if (!rio) { goto error0; }
+	rio->n_biow = 0;
+	bio = bio_alloc(GFP_NOIO, n_pb);
+	if (!bio) { goto error1; }
+
+	bio->bi_bdev = wdev->ldev;
+	off_pb = get_offset_of_lsid(lsid, wdev->ring_buffer_off, wdev->ring_buffer_size);
+	WLOG_(wdev, "lsid: %" PRIu64 " off_pb: %" PRIu64 " n_pb %u\n"
+		, lsid, off_pb, n_pb);
+	off_lb = addr_lb(pbs, off_pb);
+	bio->bi_iter.bi_sector = off_lb;
+	bio->bi_rw = READ;
+	bio->bi_end_io = bio_end_io_for_redo_read;
+	bio->bi_private = rio;
+
+	for (i = 0; i < n_pb; i++) {
+		struct sector_data *sectd;
+		int bytes;
+
+		sectd = sector_alloc(pbs, GFP_NOIO);
+		if (!sectd) { goto error2; }
+		biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO);
+		if (!biow) {
+			sector_free(sectd);
+			goto error2;
+		}
+		bytes = bio_add_page(bio, virt_to_page(sectd->data),
+				pbs, offset_in_page(sectd->data));
+		ASSERT(bytes == pbs);
+
+		init_bio_wrapper(biow, NULL);
+		biow->pos = off_lb + i * n_lb;
+		biow->len = n_lb;
+		biow->private_data = sectd;
+		rio->biow[rio->n_biow++] = biow;
+	}
+	ASSERT((bio_sectors(bio) << 9) == pbs * n_pb);
+
+	for (i = 0; i < rio->n_biow; i++)
+		list_add_tail(&rio->biow[i]->list, biow_list);
+
+	return bio;
+
+error2:
+	for (i = 0; i < rio->n_biow; i++)
+		destroy_bio_wrapper_for_redo(wdev, rio->biow[i]);
+	bio_put(bio);
+error1:
+	kfree(rio);
+error0:
+	return NULL;
+}
+
 /**
  * Prepare data bio for redo and assign in a bio wrapper.
  *
@@ -450,6 +643,127 @@ error0:
 	return NULL;
 }
 
+/**
+ * Create zero bio wrapper for redo.
+ * All the segments of the bio are the zero page.
+ *
+ * @wdev walb device.
+ * @pos IO position [logical block].
+ * @len IO size [logical block]. It must be <= REDO_SAME_IO_MAX_LB.
+ *
+ * RETURN:
+ *   Created bio_wrapper data in success, or NULL.
+ */
+static struct bio_wrapper* create_zero_bio_wrapper_for_redo(
+	struct walb_dev *wdev, u64 pos, unsigned int len)
+{
+	struct bio *bio;
+	struct bio_wrapper *biow;
+	unsigned int rest, bytes;
+
+	ASSERT(0 < len && len <= REDO_SAME_IO_MAX_LB);
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(len << 9, PAGE_SIZE));
+	if (!bio) { goto error0; }
+	for (rest = len << 9; rest > 0; rest -= bytes) {
+		bytes = min_t(unsigned int, rest, PAGE_SIZE);
+		if (bio_add_page(bio, ZERO_PAGE(0), bytes, 0) != bytes)
+			goto error1;
+	}
+	ASSERT(bio_sectors(bio) == len);
+	biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO);
+	if (!biow) { goto error1; }
+
+	bio->bi_bdev = wdev->ddev;
+	bio->bi_iter.bi_sector = pos;
+	bio->bi_rw = WRITE;
+	bio->bi_end_io = bio_end_io_for_redo;
+	bio->bi_private = biow;
+
+	init_bio_wrapper(biow, bio);
+	set_bit(BIO_WRAPPER_ZERO, &biow->flags);
+	ASSERT(!biow->private_data);
+	return biow;
+
+error1:
+	bio_put(bio);
+error0:
+	return NULL;
+}
+
+/**
+ * Create write same bio wrapper for redo.
+ *
+ * @wdev walb device.
+ * @pos IO position [logical block].
+ * @len IO size [logical block].
+ *   It must be <= REDO_SAME_IO_MAX_LB if is_native is false.
+ * @payload data of a logical block to write repeatedly.
+ * @is_native true to use REQ_WRITE_SAME.
+ *   Otherwise all the bio segments are a page filled with the payload.
+ *
+ * RETURN:
+ *   Created bio_wrapper data in success, or NULL.
+ */
+static struct bio_wrapper* create_write_same_bio_wrapper_for_redo(
+	struct walb_dev *wdev, u64 pos, unsigned int len,
+	const u8 *payload, bool is_native)
+{
+	struct sector_data *sectd;
+	struct bio *bio;
+	struct bio_wrapper *biow;
+	unsigned int i, rest, bytes;
+
+	ASSERT(0 < len);
+	ASSERT(is_native || len <= REDO_SAME_IO_MAX_LB);
+
+	sectd = sector_alloc(
+		is_native ? LOGICAL_BLOCK_SIZE : PAGE_SIZE, GFP_NOIO);
+	if (!sectd) { goto error0; }
+	for (i = 0; i < sectd->size / LOGICAL_BLOCK_SIZE; i++) {
+		memcpy((u8 *)sectd->data + i * LOGICAL_BLOCK_SIZE,
+			payload, LOGICAL_BLOCK_SIZE);
+	}
+
+	if (is_native) {
+		bio = bio_alloc(GFP_NOIO, 1);
+		if (!bio) { goto error1; }
+		bio_add_page(bio, virt_to_page(sectd->data),
+			LOGICAL_BLOCK_SIZE, offset_in_page(sectd->data));
+		bio->bi_iter.bi_size = len << 9;
+		bio->bi_rw = WRITE | REQ_WRITE_SAME;
+	} else {
+		bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(len << 9, PAGE_SIZE));
+		if (!bio) { goto error1; }
+		for (rest = len << 9; rest > 0; rest -= bytes) {
+			bytes = min_t(unsigned int, rest, PAGE_SIZE);
+			if (bio_add_page(bio, virt_to_page(sectd->data),
+					bytes, 0) != bytes)
+				goto error2;
+		}
+		bio->bi_rw = WRITE;
+	}
+	ASSERT(bio_sectors(bio) == len);
+	biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO);
+	if (!biow) { goto error2; }
+
+	bio->bi_bdev = wdev->ddev;
+	bio->bi_iter.bi_sector = pos;
+	bio->bi_end_io = bio_end_io_for_redo;
+	bio->bi_private = biow;
+
+	init_bio_wrapper(biow, bio);
+	biow->private_data = sectd;
+	return biow;
+
+error2:
+	bio_put(bio);
+error1:
+	sector_free(sectd);
+error0:
+	return NULL;
+}
+
 /**
  * Destroy bio wrapper created by create_bio_wrapper_for_redo().
  */
@@ -485,7 +799,8 @@ static void bio_end_io_for_redo(struct bio *bio)
 
 	LOG_("pos %" PRIu64 "\n", (u64)biow->pos);
 #ifdef WALB_DEBUG
-	if (bio_wrapper_state_is_discard(biow)) {
+	if (bio_wrapper_state_is_discard(biow) ||
+		bio_wrapper_state_is_zero(biow)) {
 		ASSERT(!biow->private_data);
 	} else {
 		ASSERT(biow->private_data); /* sector data */
@@ -498,6 +813,28 @@ static void bio_end_io_for_redo(struct bio *bio)
 	complete(&biow->done);
 }
 
+/**
+ * bio_end_io for log read in redo.
+ * All the bio wrappers sharing the bio will be completed.
+ */
+static void bio_end_io_for_redo_read(struct bio *bio)
+{
+	struct redo_read_io *rio = bio->bi_private;
+	const int error = bio->bi_error;
+	unsigned int i;
+
+	ASSERT(rio);
+	bio_put(bio);
+
+	/* Do not touch a bio wrapper after its completion. */
+	for (i = 0; i < rio->n_biow; i++) {
+		struct bio_wrapper *biow = rio->biow[i];
+		biow->error = error;
+		complete(&biow->done);
+	}
+	kfree(rio);
+}
+
 /**
  * Wait for all IOs for log read and destroy.
  */
@@ -618,16 +955,18 @@ static unsigned int get_bio_wrapper_from_read_queue(
  *
  * RETURN:
  *   bio wrapper if it is valid logpack header, or NULL.
+ *   Its private_data stores the whole logpack header.
  */
 static struct bio_wrapper* get_logpack_header_for_redo(
 	struct worker_data *read_wd, struct redo_data *read_rd,
 	u64 written_lsid)
 {
-	unsigned int n;
+	unsigned int n, n_pb;
 	struct list_head biow_list;
 	struct bio_wrapper *biow;
 	struct sector_data *sectd;
 	const struct walb_logpack_header *logh;
+	const unsigned int pbs = read_rd->wdev->physical_bs;
 
 	ASSERT(read_rd);
 	INIT_LIST_HEAD(&biow_list);
@@ -650,14 +989,169 @@ retry:
 	sectd = biow->private_data;
 	ASSERT_SECTOR_DATA(sectd);
 	logh = get_logpack_header_const(sectd);
+	if (!is_valid_logpack_header(logh)
+		|| logh->logpack_lsid != written_lsid)
+		goto error;
+
+	/* Multi-block logpack header. */
+	n_pb = get_logpack_header_pb(logh);
+	if (n_pb > 1) {
+		if (n_pb > max_n_logpack_header_pb(pbs))
+			goto error;
+		if (!get_rest_logpack_header_for_redo(
+				read_wd, read_rd, biow, n_pb))
+			goto error;
+		sectd = biow->private_data;
+		ASSERT_SECTOR_DATA(sectd);
+		logh = get_logpack_header_const(sectd);
+	}
+
 	if (is_valid_logpack_header_with_checksum(
-			logh, sectd->size, read_rd->wdev->log_checksum_salt)
-		&& logh->logpack_lsid == written_lsid) {
+			logh, pbs, read_rd->wdev->log_checksum_salt))
 		return biow;
-	} else {
-		destroy_bio_wrapper_for_redo(read_rd->wdev, biow);
+error:
+	destroy_bio_wrapper_for_redo(read_rd->wdev, biow);
+	return NULL;
+}
+
+/**
+ * Get the rest blocks of a multi-block logpack header.
+ *
+ * A logpack header never crosses the end of the ring buffer
+ * so the rest blocks are the next ones in the read queue.
+ *
+ * @read_rd redo data for read.
+ * @biow bio wrapper of the first block of the logpack header.
+ *   Its private_data will be replaced by a sector data
+ *   that stores the whole logpack header.
+ * @n_pb number of physical blocks of the logpack header.
+ *
+ * RETURN:
+ *   true in success, or false due to IO error.
+ */
+static bool get_rest_logpack_header_for_redo(
+	struct worker_data *read_wd, struct redo_data *read_rd,
+	struct bio_wrapper *biow, unsigned int n_pb)
+{
+	struct walb_dev *wdev = read_rd->wdev;
+	const unsigned int pbs = wdev->physical_bs;
+	struct list_head biow_list;
+	struct bio_wrapper *biow2, *biow_next;
+	struct sector_data *sectd, *sectd2;
+	unsigned int n = 0, i = 1;
+	bool ret = true;
+
+	ASSERT(n_pb > 1);
+	INIT_LIST_HEAD(&biow_list);
+retry:
+	n += get_bio_wrapper_from_read_queue(read_rd, &biow_list, n_pb - 1 - n);
+	if (n < n_pb - 1) {
+		wakeup_worker(read_wd);
+		schedule();
+		goto retry;
+	}
+
+	while (!(sectd = sector_alloc(max_logpack_header_size(pbs), GFP_NOIO)))
+		schedule();
+	sector_zeroclear(sectd);
+	sectd2 = biow->private_data;
+	memcpy(sectd->data, sectd2->data, pbs);
+
+	list_for_each_entry_safe(biow2, biow_next, &biow_list, list) {
+		wait_for_completion(&biow2->done);
+		if (biow2->error)
+			ret = false;
+		sectd2 = biow2->private_data;
+		ASSERT_SECTOR_DATA(sectd2);
+		memcpy((u8 *)sectd->data + i * pbs, sectd2->data, pbs);
+		i++;
+		list_del(&biow2->list);
+		destroy_bio_wrapper_for_redo(wdev, biow2);
+	}
+	ASSERT(i == n_pb);
+
+	sector_free(biow->private_data);
+	biow->private_data = sectd;
+	return ret;
+}
+
+/**
+ * Fetch a logpack from the read queue for redo
+ * and start checksum calculation of its records.
+ *
+ * @read_rd redo data for read.
+ * @lsid lsid of the logpack.
+ *
+ * RETURN:
+ *   redo pack if its logpack header is valid, or NULL.
+ *   Its logpack data are not fetched if logh_biow->error is not 0.
+ */
+static struct redo_pack* fetch_logpack_for_redo(
+	struct worker_data *read_wd, struct redo_data *read_rd, u64 lsid)
+{
+	struct redo_pack *pack;
+	struct bio_wrapper *logh_biow, *biow;
+	const struct walb_logpack_header *logh;
+	unsigned int n_pb = 0;
+
+	logh_biow = get_logpack_header_for_redo(read_wd, read_rd, lsid);
+	if (!logh_biow)
 		return NULL;
+
+	while (!(pack = kmalloc(sizeof(*pack), GFP_NOIO)))
+		schedule();
+	INIT_LIST_HEAD(&pack->list);
+	pack->wdev = read_rd->wdev;
+	pack->logh_biow = logh_biow;
+	INIT_LIST_HEAD(&pack->biow_list);
+	pack->n_pb = 0;
+	pack->cworks = NULL;
+	pack->n_cworks = 0;
+	pack->csums = NULL;
+	if (logh_biow->error)
+		return pack;
+
+	logh = get_logpack_header_const(logh_biow->private_data);
+	pack->n_pb = get_logpack_header_pb(logh) + logh->total_io_size;
+retry:
+	n_pb += get_bio_wrapper_from_read_queue(
+		read_rd, &pack->biow_list, logh->total_io_size - n_pb);
+	if (n_pb < logh->total_io_size) {
+		wakeup_worker(read_wd);
+		LOG_("n_pb %u total_io_size %u\n", n_pb, logh->total_io_size);
+		schedule();
+		goto retry;
+	}
+	ASSERT(n_pb == logh->total_io_size);
+
+	/* Wait for log read IO completion. */
+	list_for_each_entry(biow, &pack->biow_list, list) {
+		wait_for_completion(&biow->done);
 	}
+
+	start_checksums_for_redo(pack);
+	return pack;
+}
+
+/**
+ * Destroy a redo pack with its remaining biow(s).
+ */
+static void destroy_redo_pack(struct redo_pack *pack)
+{
+	struct bio_wrapper *biow, *biow_next;
+
+	ASSERT(pack);
+	wait_for_checksums_for_redo(pack);
+	kfree(pack->cworks);
+	kfree(pack->csums);
+
+	list_for_each_entry_safe(biow, biow_next, &pack->biow_list, list) {
+		list_del(&biow->list);
+		destroy_bio_wrapper_for_redo(pack->wdev, biow);
+	}
+	if (pack->logh_biow)
+		destroy_bio_wrapper_for_redo(pack->wdev, pack->logh_biow);
+	kfree(pack);
 }
 
 /**
@@ -667,12 +1161,11 @@ retry:
  * invalid IOs records will be deleted from the logpack header
  * and the updated logpack header will be written to the log device.
  *
- * @read_rd redo data for read.
  * @gc_rd redo data for gc.
- * @logh_biow !!!valid!!! logpack header biow.
+ * @pack redo pack with !!!valid!!! logpack header.
  *   This logpack header will be updated
  *   if the logpack is partially invalid.
- *   logh_biow will be destroyed in the function.
+ *   The pack will be destroyed in the function.
  * @written_lsid_p pointer to written_lsid.
  * @should_terminate when true redo should be terminated.
  *
@@ -680,33 +1173,33 @@ retry:
  *   true if redo succeeded, or false (due to IO error etc.)
  */
 static bool redo_logpack(
-	struct worker_data *read_wd, struct redo_data *read_rd,
-	struct redo_data *gc_rd,
-	struct bio_wrapper *logh_biow, u64 *written_lsid_p,
-	bool *should_terminate)
+	struct redo_data *gc_rd, struct redo_pack *pack,
+	u64 *written_lsid_p, bool *should_terminate)
 {
 	struct walb_dev *wdev;
 	struct sector_data *sectd;
 	struct walb_logpack_header *logh;
 	unsigned int i, invalid_idx = 0;
-	struct list_head biow_list_pack, biow_list_io, biow_list_ready;
+	struct list_head biow_list_io, biow_list_ready;
 	unsigned int n_pb, n;
 	unsigned int pbs;
+	struct bio_wrapper *logh_biow;
 	struct bio_wrapper *biow, *biow_next;
+	struct bio_wrapper *last_biow = NULL;
 	u32 csum;
 	bool is_valid = true;
 	int error = 0;
 	struct blk_plug plug;
 	bool retb = true;
 
-	ASSERT(read_rd);
-	wdev = read_rd->wdev;
+	ASSERT(pack);
+	wdev = pack->wdev;
 	ASSERT(wdev);
 	pbs = wdev->physical_bs;
 	ASSERT(gc_rd);
-	INIT_LIST_HEAD(&biow_list_pack);
 	INIT_LIST_HEAD(&biow_list_io);
 	INIT_LIST_HEAD(&biow_list_ready);
+	logh_biow = pack->logh_biow;
 	ASSERT(logh_biow);
 	sectd = logh_biow->private_data;
 	ASSERT_SECTOR_DATA(sectd);
@@ -714,40 +1207,31 @@ static bool redo_logpack(
 	logh = get_logpack_header(sectd);
 	ASSERT(logh);
 
-	n_pb = 0;
-retry1:
-	n_pb += get_bio_wrapper_from_read_queue(
-		read_rd, &biow_list_pack,
-		logh->total_io_size - n_pb);
-	if (n_pb < logh->total_io_size) {
-		wakeup_worker(read_wd);
-		LOG_("n_pb %u total_io_size %u\n", n_pb, logh->total_io_size);
-		schedule();
-		goto retry1;
-	}
-	ASSERT(n_pb == logh->total_io_size);
-
-	/* Wait for log read IO completion. */
-	list_for_each_entry(biow, &biow_list_pack, list) {
-		wait_for_completion(&biow->done);
-	}
+	/* Checksums have been calculated in parallel since the fetch.
+	   Records without them are calculated below. */
+	wait_for_checksums_for_redo(pack);
 
 	for (i = 0; i < logh->n_records; i++) {
 		struct walb_log_record *rec = &logh->record[i];
+		const u32 flags = rec->flags;
 		const bool is_discard =
-			test_bit_u32(LOG_RECORD_DISCARD, &rec->flags);
+			test_bit_u32(LOG_RECORD_DISCARD, &flags);
+		const bool is_zero =
+			test_bit_u32(LOG_RECORD_ZERO, &flags);
 		const bool is_padding =
-			test_bit_u32(LOG_RECORD_PADDING, &rec->flags);
+			test_bit_u32(LOG_RECORD_PADDING, &flags);
+		const bool is_write_same =
+			test_bit_u32(LOG_RECORD_WRITE_SAME, &flags);
 		unsigned int n_lb = rec->io_size;
 
-		ASSERT(test_bit_u32(LOG_RECORD_EXIST, &rec->flags));
+		ASSERT(test_bit_u32(LOG_RECORD_EXIST, &flags));
 		ASSERT(list_empty(&biow_list_io));
 
 		if (n_lb == 0) {
 			/* zero-sized IO. */
 			continue;
 		}
-		n_pb = capacity_pb(pbs, n_lb);
+		n_pb = log_record_n_pb(rec, pbs);
 
 		if (is_discard) {
 			if (blk_queue_discard(bdev_get_queue(wdev->ddev))) {
@@ -759,6 +1243,44 @@ retry1:
 			continue;
 		}
 
+		/* Zero IO has no data in the log. */
+		if (is_zero) {
+			create_zero_data_io_for_redo(
+				wdev, rec, &biow_list_ready);
+			continue;
+		}
+
+		/*
+		 * Packed IO.
+		 * Its data is inside the last physical block
+		 * of the previous record.
+		 */
+		if (rec->sub_offset > 0) {
+			if (!last_biow || n_pb > 0) {
+				WLOGe(wdev, "invalid packed record: lsid %" PRIu64
+					" sub_offset %u io_size %u\n",
+					rec->lsid, rec->sub_offset, rec->io_size);
+				is_valid = false;
+				invalid_idx = i;
+				break;
+			}
+			biow = create_packed_data_io_for_redo(
+				wdev, rec, last_biow->private_data, &csum);
+			if (csum != rec->checksum) {
+				destroy_bio_wrapper_for_redo(wdev, biow);
+				is_valid = false;
+				invalid_idx = i;
+				break;
+			}
+			list_add_tail(&biow->list, &biow_list_ready);
+			if (is_write_same) {
+				const struct sector_data *sectd = biow->private_data;
+				create_write_same_data_io_for_redo(
+					wdev, rec, sectd->data, &biow_list_ready);
+			}
+			continue;
+		}
+
 		/*
 		 * Normal IO.
 		 */
@@ -766,7 +1288,7 @@ retry1:
 		/* Move the corresponding biow to biow_list_io. */
 		ASSERT(list_empty(&biow_list_io));
 		n = 0;
-		list_for_each_entry_safe(biow, biow_next, &biow_list_pack, list) {
+		list_for_each_entry_safe(biow, biow_next, &pack->biow_list, list) {
 			if (biow->error) {
 				error = biow->error;
 			}
@@ -786,13 +1308,19 @@ retry1:
 				list_del(&biow->list);
 				destroy_bio_wrapper_for_redo(wdev, biow);
 			}
+			last_biow = NULL;
 			continue;
 		}
 
 		/* Validate checksum. */
-		csum = calc_checksum_for_redo(
-			rec->io_size, pbs,
-			wdev->log_checksum_salt, &biow_list_io);
+		if (pack->csums && pack->csums[i].is_calculated) {
+			csum = pack->csums[i].csum;
+		} else {
+			csum = calc_checksum_for_redo(
+				log_record_data_lb(rec), pbs, wdev->log_checksum_salt,
+				list_first_entry(&biow_list_io,
+						struct bio_wrapper, list));
+		}
 		if (csum != rec->checksum) {
 			is_valid = false;
 			invalid_idx = i;
@@ -801,9 +1329,36 @@ retry1:
 
 		/* Create data bio. */
 		create_data_io_for_redo(wdev, rec, &biow_list_io);
+		/* Packed records may follow in its last physical block. */
+		last_biow = list_last_entry(&biow_list_io, struct bio_wrapper, list);
 		list_for_each_entry_safe(biow, biow_next, &biow_list_io, list) {
 			list_move_tail(&biow->list, &biow_list_ready);
 		}
+		if (is_write_same) {
+			const struct sector_data *sectd = last_biow->private_data;
+			create_write_same_data_io_for_redo(
+				wdev, rec, sectd->data, &biow_list_ready);
+		}
+	}
+
+	/*
+	 * The valid records may have no data in the log
+	 * when they are all discard or zero ones.
+	 * Then the logpack is discarded as a whole like fully invalid one,
+	 * so their data IOs must not be submitted.
+	 */
+	if (!is_valid && invalid_idx > 0) {
+		unsigned int total_pb = 0;
+		for (i = 0; i < invalid_idx; i++)
+			total_pb += log_record_n_pb(&logh->record[i], pbs);
+		if (total_pb == 0) {
+			invalid_idx = 0;
+			list_for_each_entry_safe(biow, biow_next,
+						&biow_list_ready, list) {
+				list_del(&biow->list);
+				destroy_bio_wrapper_for_redo(wdev, biow);
+			}
+		}
 	}
 
 	/* Submit ready biow(s). */
@@ -828,8 +1383,9 @@ retry1:
 	 * Case (1): valid.
 	 */
 	if (is_valid) {
-		ASSERT(list_empty(&biow_list_pack));
-		*written_lsid_p = logh->logpack_lsid + 1 + logh->total_io_size;
+		ASSERT(list_empty(&pack->biow_list));
+		*written_lsid_p = logh->logpack_lsid
+			+ get_logpack_header_pb(logh) + logh->total_io_size;
 		*should_terminate = false;
 		retb = true;
 		goto fin;
@@ -859,10 +1415,7 @@ retry1:
 	logh->n_padding = 0;
 	for (i = 0; i < logh->n_records; i++) {
 		struct walb_log_record *rec = &logh->record[i];
-		if (!test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
-			logh->total_io_size += capacity_pb(
-				pbs, rec->io_size);
-		}
+		logh->total_io_size += log_record_n_pb(rec, pbs);
 		if (test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
 			logh->n_padding++;
 		}
@@ -870,13 +1423,14 @@ retry1:
 	ASSERT(logh->total_io_size > 0);
 	logh->checksum = 0;
 	logh->checksum = checksum(
-		(const u8 *)logh, pbs, wdev->log_checksum_salt);
-	/* Try to overwrite the last logpack header block. */
+		(const u8 *)logh, pbs * get_logpack_header_pb(logh),
+		wdev->log_checksum_salt);
+	/* Try to overwrite the last logpack header block(s). */
 	logh_biow->private_data = NULL;
 	destroy_bio_wrapper_for_redo(wdev, logh_biow);
 retry2:
 	logh_biow = create_log_bio_wrapper_for_redo(
-		wdev, logh->logpack_lsid, sectd);
+		wdev, logh->logpack_lsid, sectd, get_logpack_header_pb(logh));
 	if (!logh_biow) {
 		schedule();
 		goto retry2;
@@ -889,7 +1443,8 @@ retry2:
 		retb = false;
 		goto fin;
 	}
-	*written_lsid_p = logh->logpack_lsid + 1 + logh->total_io_size;
+	*written_lsid_p = logh->logpack_lsid
+		+ get_logpack_header_pb(logh) + logh->total_io_size;
 	*should_terminate = true;
 	retb = true;
 
@@ -899,11 +1454,8 @@ fin:
 		list_del(&biow->list);
 		destroy_bio_wrapper_for_redo(wdev, biow);
 	}
-	list_for_each_entry_safe(biow, biow_next, &biow_list_pack, list) {
-		list_del(&biow->list);
-		destroy_bio_wrapper_for_redo(wdev, biow);
-	}
-	destroy_bio_wrapper_for_redo(wdev, logh_biow);
+	pack->logh_biow = logh_biow;
+	destroy_redo_pack(pack);
 	return retb;
 }
 
@@ -913,41 +1465,179 @@ fin:
  * @n_lb io size [logical block].
  * @pbs physical block size [bytes].
  * @salt checksum salt.
- * @biow_list biow list where each biow size is pbs.
+ * @biow the first biow of the IO in a biow list
+ *   where each biow size is pbs.
+ *   The list must contain capacity_pb(pbs, n_lb) biows from it.
  *
  * RETURN:
  *   checksum of the IO data.
  */
 static u32 calc_checksum_for_redo(
 	unsigned int n_lb, unsigned int pbs, u32 salt,
-	struct list_head *biow_list)
+	struct bio_wrapper *biow)
 {
-	struct bio_wrapper *biow;
 	u32 csum = salt;
 
 	ASSERT(n_lb > 0);
 	ASSERT_PBS(pbs);
-	ASSERT(biow_list);
-	ASSERT(!list_empty(biow_list));
+	ASSERT(biow);
 
-	list_for_each_entry(biow, biow_list, list) {
+	while (n_lb > 0) {
 		struct sector_data *sectd = biow->private_data;
 		const unsigned int len = min(biow->len, n_lb);
 		ASSERT_SECTOR_DATA(sectd);
 		ASSERT(sectd->size == pbs);
 		ASSERT(biow->len == n_lb_in_pb(pbs));
-		ASSERT(n_lb > 0);
 
 		csum = checksum_partial(
 			csum, sectd->data, len * LOGICAL_BLOCK_SIZE);
 		n_lb -= len;
+		biow = list_next_entry(biow, list);
 	}
-	ASSERT(n_lb == 0);
 	return checksum_finish(csum);
 }
 
+/**
+ * Check whether the checksum of a log record is calculated
+ * by checksum tasks for redo.
+ * Packed records are calculated with their data copy.
+ */
+static bool is_checksum_target_for_redo(const struct walb_log_record *rec)
+{
+	return rec->io_size > 0 && log_record_has_data(rec)
+		&& !test_bit_u32(LOG_RECORD_PADDING, &rec->flags)
+		&& rec->sub_offset == 0;
+}
+
+static void task_calc_checksums_for_redo(struct work_struct *work)
+{
+	struct redo_csum_work *cwork =
+		container_of(work, struct redo_csum_work, work);
+	struct redo_pack *pack = cwork->pack;
+	const struct walb_logpack_header *logh =
+		get_logpack_header_const(pack->logh_biow->private_data);
+	const unsigned int pbs = pack->wdev->physical_bs;
+	const u32 salt = pack->wdev->log_checksum_salt;
+	struct bio_wrapper *biow = cwork->biow;
+	unsigned int i;
+
+	for (i = cwork->begin; i < cwork->end; i++) {
+		const struct walb_log_record *rec = &logh->record[i];
+		unsigned int n_pb;
+
+		if (is_checksum_target_for_redo(rec)) {
+			pack->csums[i].csum = calc_checksum_for_redo(
+				log_record_data_lb(rec), pbs, salt, biow);
+			pack->csums[i].is_calculated = true;
+		}
+
+		/* Go to the first biow of the next record. */
+		n_pb = log_record_n_pb(rec, pbs);
+		while (n_pb > 0 && !list_is_last(&biow->list, &pack->biow_list)) {
+			biow = list_next_entry(biow, list);
+			n_pb--;
+		}
+	}
+}
+
+/**
+ * Start checksum calculation of log records in a logpack
+ * using unbound workqueue tasks.
+ *
+ * Consecutive records are grouped into a task
+ * so that small records are also calculated in parallel.
+ * The results will be available after wait_for_checksums_for_redo().
+ *
+ * @pack redo pack. All the read IOs must have completed.
+ */
+static void start_checksums_for_redo(struct redo_pack *pack)
+{
+	const unsigned int pbs = pack->wdev->physical_bs;
+	const struct walb_logpack_header *logh =
+		get_logpack_header_const(pack->logh_biow->private_data);
+	struct redo_csum_work *cwork = NULL;
+	struct bio_wrapper *biow;
+	unsigned int i, n_lb = 0, rest_pb = logh->total_io_size;
+
+	ASSERT(!pack->cworks);
+	if (logh->n_records == 0)
+		return;
+
+	/* The record loop in redo_logpack() handles IO errors. */
+	list_for_each_entry(biow, &pack->biow_list, list) {
+		if (biow->error)
+			return;
+	}
+
+	pack->cworks = kcalloc(logh->n_records, sizeof(*pack->cworks), GFP_NOIO);
+	pack->csums = kcalloc(logh->n_records, sizeof(*pack->csums), GFP_NOIO);
+	if (!pack->cworks || !pack->csums) {
+		kfree(pack->cworks);
+		kfree(pack->csums);
+		pack->cworks = NULL;
+		pack->csums = NULL;
+		return;
+	}
+
+	biow = list_first_entry_or_null(&pack->biow_list, struct bio_wrapper, list);
+	for (i = 0; i < logh->n_records; i++) {
+		const struct walb_log_record *rec = &logh->record[i];
+		unsigned int n_pb = log_record_n_pb(rec, pbs);
+
+		if (n_pb > rest_pb)
+			break;
+
+		if (is_checksum_target_for_redo(rec)) {
+			if (!cwork) {
+				cwork = &pack->cworks[pack->n_cworks];
+				cwork->pack = pack;
+				cwork->begin = i;
+				cwork->biow = biow;
+				n_lb = 0;
+			}
+			n_lb += log_record_data_lb(rec);
+		}
+
+		/* Go to the first biow of the next record. */
+		rest_pb -= n_pb;
+		while (biow && n_pb > 0) {
+			if (list_is_last(&biow->list, &pack->biow_list))
+				biow = NULL;
+			else
+				biow = list_next_entry(biow, list);
+			n_pb--;
+		}
+
+		if (cwork && n_lb >= REDO_CSUM_WORK_MIN_LB) {
+			cwork->end = i + 1;
+			INIT_WORK(&cwork->work, task_calc_checksums_for_redo);
+			queue_work(wq_unbound_, &cwork->work);
+			pack->n_cworks++;
+			cwork = NULL;
+		}
+	}
+	if (cwork) {
+		cwork->end = i;
+		INIT_WORK(&cwork->work, task_calc_checksums_for_redo);
+		queue_work(wq_unbound_, &cwork->work);
+		pack->n_cworks++;
+	}
+}
+
+/**
+ * Wait for all the checksum tasks of a redo pack.
+ */
+static void wait_for_checksums_for_redo(struct redo_pack *pack)
+{
+	unsigned int i;
+
+	for (i = 0; i < pack->n_cworks; i++)
+		flush_work(&pack->cworks[i].work);
+}
+
 /**
  * Create data io for redo.
+ * Only the payload is written for a write same record.
  *
  * @wdev walb device.
  * @rec log record.
@@ -973,7 +1663,7 @@ static void create_data_io_for_redo(
 	ASSERT(!test_bit_u32(LOG_RECORD_DISCARD, &rec->flags));
 
 	off = rec->offset;
-	n_lb = rec->io_size;
+	n_lb = log_record_data_lb(rec);
 	n_pb = capacity_pb(pbs, n_lb);
 
 	INIT_LIST_HEAD(&new_list);
@@ -1001,6 +1691,53 @@ static void create_data_io_for_redo(
 	ASSERT(list_empty(&new_list));
 }
 
+/**
+ * Create data io of a packed log record for redo.
+ *
+ * The data is copied from the physical block
+ * shared with the previous record with its checksum calculated.
+ * Only the payload is written for a write same record.
+ *
+ * @wdev walb device.
+ * @rec log record. rec->sub_offset must be non-zero.
+ * @shared_sectd sector data of the shared physical block.
+ * @csump checksum of the record data will be set.
+ *
+ * RETURN:
+ *   created bio wrapper. Never NULL.
+ */
+static struct bio_wrapper* create_packed_data_io_for_redo(
+	struct walb_dev *wdev, const struct walb_log_record *rec,
+	const struct sector_data *shared_sectd, u32 *csump)
+{
+	const unsigned int pbs = wdev->physical_bs;
+	struct sector_data *sectd;
+	struct bio_wrapper *biow;
+
+	ASSERT(rec->sub_offset > 0);
+	ASSERT(rec->sub_offset + log_record_data_lb(rec) <= n_lb_in_pb(pbs));
+	ASSERT_SECTOR_DATA(shared_sectd);
+	ASSERT(shared_sectd->size == pbs);
+
+	while (!(sectd = sector_alloc(pbs, GFP_NOIO)))
+		schedule();
+	while (!(biow = alloc_bio_wrapper_inc(wdev, GFP_NOIO)))
+		schedule();
+
+	*csump = checksum_finish(checksum_copy_partial(
+			wdev->log_checksum_salt, sectd->data,
+			(const u8 *)shared_sectd->data
+			+ rec->sub_offset * LOGICAL_BLOCK_SIZE,
+			log_record_data_lb(rec) * LOGICAL_BLOCK_SIZE));
+
+	init_bio_wrapper(biow, NULL);
+	biow->private_data = sectd;
+	while (!prepare_data_bio_for_redo(
+			wdev, biow, rec->offset, log_record_data_lb(rec)))
+		schedule();
+	return biow;
+}
+
 /**
  * Create discard data io for redo.
  *
@@ -1029,6 +1766,80 @@ retry:
 	list_add_tail(&biow->list, biow_list);
 }
 
+/**
+ * Create zero data io for redo.
+ *
+ * @wdev walb device.
+ * @rec log record (must be zero)
+ * @biow_list biow list
+ *   created bio wrapper(s) will be added to the tail.
+ */
+static void create_zero_data_io_for_redo(
+	struct walb_dev *wdev,
+	struct walb_log_record *rec,
+	struct list_head *biow_list)
+{
+	struct bio_wrapper *biow;
+	u64 pos;
+	unsigned int rest, len;
+
+	ASSERT(rec);
+	ASSERT(test_bit_u32(LOG_RECORD_ZERO, &rec->flags));
+
+	pos = rec->offset;
+	rest = rec->io_size;
+	while (rest > 0) {
+		len = min_t(unsigned int, rest, REDO_SAME_IO_MAX_LB);
+		while (!(biow = create_zero_bio_wrapper_for_redo(wdev, pos, len)))
+			schedule();
+		list_add_tail(&biow->list, biow_list);
+		pos += len;
+		rest -= len;
+	}
+}
+
+/**
+ * Create data io of a write same record for redo
+ * except for its first logical block,
+ * which is written with the payload by create_data_io_for_redo()
+ * or create_packed_data_io_for_redo().
+ * REQ_WRITE_SAME is used if the data device supports it.
+ *
+ * @wdev walb device.
+ * @rec log record (must be write same)
+ * @payload payload of the record.
+ * @biow_list biow list
+ *   created bio wrapper(s) will be added to the tail.
+ */
+static void create_write_same_data_io_for_redo(
+	struct walb_dev *wdev,
+	const struct walb_log_record *rec, const u8 *payload,
+	struct list_head *biow_list)
+{
+	const unsigned int max_native_lb = bdev_write_same(wdev->ddev);
+	const bool is_native = max_native_lb > 0;
+	struct bio_wrapper *biow;
+	u64 pos;
+	unsigned int rest, len;
+
+	ASSERT(rec);
+	ASSERT(test_bit_u32(LOG_RECORD_WRITE_SAME, &rec->flags));
+	ASSERT(rec->io_size > 0);
+
+	pos = rec->offset + 1;
+	rest = rec->io_size - 1;
+	while (rest > 0) {
+		len = min_t(unsigned int, rest,
+			is_native ? max_native_lb : REDO_SAME_IO_MAX_LB);
+		while (!(biow = create_write_same_bio_wrapper_for_redo(
+					wdev, pos, len, payload, is_native)))
+			schedule();
+		list_add_tail(&biow->list, biow_list);
+		pos += len;
+		rest -= len;
+	}
+}
+
 /**
  * Submit data bio for redo.
  *
@@ -1040,7 +1851,6 @@ static void submit_data_bio_for_redo(
 {
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
-	bool is_overlapped_insert_succeeded;
 	int n_overlapped;
 #endif
 
@@ -1048,23 +1858,15 @@ static void submit_data_bio_for_redo(
 
 #ifdef WALB_OVERLAPPED_SERIALIZE
 	/* check and insert to overlapped detection data. */
-retry_insert_ol:
 	spin_lock(&iocored->overlapped_data_lock);
-	is_overlapped_insert_succeeded =
-		overlapped_check_and_insert(
-			iocored->overlapped_data,
-			&iocored->max_sectors_in_overlapped,
-			biow, GFP_ATOMIC
+	overlapped_check_and_insert(
+		iocored->overlapped_data, biow
 #ifdef WALB_DEBUG
-			, &iocored->overlapped_in_id
+		, &iocored->overlapped_in_id
 #endif
-			);
+		);
 	n_overlapped = biow->n_overlapped;
 	spin_unlock(&iocored->overlapped_data_lock);
-	if (!is_overlapped_insert_succeeded) {
-		schedule();
-		goto retry_insert_ol;
-	}
 	if (bio_wrapper_state_is_delayed(biow)) {
 		LOG_("n_overlapped %d\n", n_overlapped);
 		ASSERT(n_overlapped > 0);
@@ -1095,15 +1897,19 @@ bool execute_redo(struct walb_dev *wdev)
 	unsigned int minor;
 	struct worker_data *read_wd, *gc_wd;
 	struct redo_data *read_rd, *gc_rd;
-	struct list_head biow_list;
-	struct bio_wrapper *logh_biow;
+	struct list_head pack_list;
+	struct redo_pack *pack, *pack_next;
+	unsigned int n_packs = 0, n_pb_packs = 0;
+	bool is_fetch_end = false;
 	unsigned int pbs;
-	u64 written_lsid, start_lsid;
+	u64 written_lsid, start_lsid, fetch_lsid;
+	struct lsid_set lsids;
 	bool failed = false;
 	bool should_terminate;
 	int ret;
 	struct timespec ts[2];
 	u64 n_logpack = 0;
+	u64 period_us, throughput_kib;
 
 	ASSERT(wdev);
 	minor = MINOR(wdev->devt);
@@ -1122,9 +1928,8 @@ bool execute_redo(struct walb_dev *wdev)
 		"%s/%u", "redo_gc", minor / 2);
 	ASSERT(ret < WORKER_NAME_MAX_LEN);
 
-	spin_lock(&wdev->lsid_lock);
-	written_lsid = wdev->lsids.written;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
+	written_lsid = lsids.written;
 	start_lsid = written_lsid;
 	read_rd = create_redo_data(wdev, written_lsid);
 	if (!read_rd) { goto error2; }
@@ -1139,30 +1944,52 @@ bool execute_redo(struct walb_dev *wdev)
 	initialize_worker(gc_wd,
 			run_gc_log_in_redo, (void *)gc_rd);
 
-	/* Get biow and construct log pack and submit redo IOs. */
-	INIT_LIST_HEAD(&biow_list);
+	/*
+	 * Fetch logpacks ahead and redo them in order.
+	 * Checksums of the fetched logpacks are calculated in parallel.
+	 */
+	INIT_LIST_HEAD(&pack_list);
+	fetch_lsid = written_lsid;
 	getnstimeofday(&ts[0]);
 	while (true) {
-		/* Get logpack header. */
-		logh_biow = get_logpack_header_for_redo(
-			read_wd, read_rd, written_lsid);
-		if (!logh_biow) {
-			/* Redo should be terminated. */
-			break;
+		/* Fill the pipeline. */
+		while (!is_fetch_end && (n_packs == 0 ||
+				(n_packs < REDO_PIPELINE_MAX_PACKS &&
+					n_pb_packs < capacity_pb(pbs, READ_AHEAD_LB)))) {
+			pack = fetch_logpack_for_redo(read_wd, read_rd, fetch_lsid);
+			if (!pack) {
+				/* Redo should be terminated after the fetched ones. */
+				is_fetch_end = true;
+				break;
+			}
+			list_add_tail(&pack->list, &pack_list);
+			n_packs++;
+			if (pack->logh_biow->error) {
+				is_fetch_end = true;
+				break;
+			}
+			n_pb_packs += pack->n_pb;
+			fetch_lsid += pack->n_pb;
+			wakeup_worker(read_wd);
 		}
 
+		pack = list_first_entry_or_null(&pack_list, struct redo_pack, list);
+		if (!pack)
+			break;
+		list_del(&pack->list);
+		n_packs--;
+
 		/* Check IO error of the logpack header. */
-		if (logh_biow->error) {
-			destroy_bio_wrapper_for_redo(wdev, logh_biow);
+		if (pack->logh_biow->error) {
+			destroy_redo_pack(pack);
 			failed = true;
 			break;
 		}
+		n_pb_packs -= pack->n_pb;
 
 		/* Try to redo the logpack. */
 		LOG_("Try to redo (lsid %"PRIu64")\n", written_lsid);
-		if (!redo_logpack(read_wd, read_rd, gc_rd,
-					logh_biow, &written_lsid,
-					&should_terminate)) {
+		if (!redo_logpack(gc_rd, pack, &written_lsid, &should_terminate)) {
 			/* IO error occurred. */
 			failed = true;
 			break;
@@ -1176,6 +2003,12 @@ bool execute_redo(struct walb_dev *wdev)
 		wakeup_worker(read_wd);
 	}
 
+	/* Destroy the logpacks remaining in the pipeline. */
+	list_for_each_entry_safe(pack, pack_next, &pack_list, list) {
+		list_del(&pack->list);
+		destroy_redo_pack(pack);
+	}
+
 	/* Finalize. */
 	finalize_worker(read_wd);
 	wait_for_all_read_io_and_destroy(read_rd);
@@ -1198,14 +2031,14 @@ bool execute_redo(struct walb_dev *wdev)
 	}
 
 	/* Update lsid variables. */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.prev_written = written_lsid;
 	wdev->lsids.written = written_lsid;
 	wdev->lsids.completed = written_lsid;
 	wdev->lsids.permanent = written_lsid;
 	wdev->lsids.flush = written_lsid;
 	wdev->lsids.latest = written_lsid;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	/* Synchronize superblock. */
 	if (!walb_sync_super_block(wdev))
@@ -1214,8 +2047,14 @@ bool execute_redo(struct walb_dev *wdev)
 	/* Get end time. */
 	getnstimeofday(&ts[1]);
 	ts[0] = timespec_sub(ts[1], ts[0]);
-	WLOGi(wdev, "Redo period: %ld.%09ld second\n"
-		, ts[0].tv_sec, ts[0].tv_nsec);
+	period_us = max_t(u64, (u64)ts[0].tv_sec * USEC_PER_SEC
+			+ ts[0].tv_nsec / NSEC_PER_USEC, 1);
+	throughput_kib = div64_u64(
+		(written_lsid - start_lsid) * pbs / 1024 * USEC_PER_SEC,
+		period_us);
+	WLOGi(wdev, "Redo period: %ld.%09ld second"
+		" (%" PRIu64 " KiB/sec)\n"
+		, ts[0].tv_sec, ts[0].tv_nsec, throughput_kib);
 	WLOGi(wdev, "Redo %" PRIu64 " logpack of totally "
 		"%" PRIu64 " physical blocks.\n"
 		, n_logpack, written_lsid - start_lsid);
@@ -164,9 +164,9 @@ bool walb_read_super_sector(
 	}
 
 	/* Validate version number. */
-	if (sect->version != WALB_LOG_VERSION) {
-		LOGe("walb version mismatch: superblock: %u module %u\n",
-			sect->version, WALB_LOG_VERSION);
+	if (!is_valid_log_version(sect->version)) {
+		LOGe("walb version mismatch: superblock: %u module %u or %u\n",
+			sect->version, WALB_LOG_VERSION, WALB_LOG_VERSION_PACKED);
 		goto error0;
 	}
 
@@ -22,6 +22,7 @@
 bool walb_sync_super_block(struct walb_dev *wdev)
 {
 	u64 written_lsid, oldest_lsid;
+	struct lsid_set lsids;
 	struct sector_data *lsuper_tmp;
 	struct walb_super_sector *sect;
 	u64 device_size;
@@ -38,10 +39,9 @@ bool walb_sync_super_block(struct walb_dev *wdev)
 		goto error0;
 
 	/* Get written/oldest lsid. */
-	spin_lock(&wdev->lsid_lock);
-	written_lsid = wdev->lsids.written;
-	oldest_lsid = wdev->lsids.oldest;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
+	written_lsid = lsids.written;
+	oldest_lsid = lsids.oldest;
 
 	/* device size. */
 	spin_lock(&wdev->size_lock);
@@ -75,9 +75,9 @@ bool walb_sync_super_block(struct walb_dev *wdev)
 	sector_free(lsuper_tmp);
 
 	/* Update previously written lsid. */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.prev_written = written_lsid;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	return true;
 
@@ -98,9 +98,9 @@ error0:
  */
 bool walb_finalize_super_block(struct walb_dev *wdev, bool is_superblock_sync)
 {
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.written = wdev->lsids.latest;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	if (is_superblock_sync) {
 		WLOGi(wdev, "finalize super block\n");
@@ -9,6 +9,7 @@
 #include "kern.h"
 #include "io.h"
 #include "wdev_util.h"
+#include "bio_entry.h"
 
 /*******************************************************************************
  * Utiltities.
@@ -42,9 +43,7 @@ static ssize_t walb_attr_show_lsids(struct walb_dev *wdev, char *buf)
 {
 	struct lsid_set lsids;
 
-	spin_lock(&wdev->lsid_lock);
-	lsids = wdev->lsids;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
 	return sprintf(buf,
 		"latest       %" PRIu64 "\n"
 		"completed    %" PRIu64 "\n"
@@ -118,14 +117,12 @@ static ssize_t walb_attr_show_status(struct walb_dev *wdev, char *buf)
 		"submit_log_task_working  %u\n"
 		"wait_log_task_working    %u\n"
 		"submit_data_task_working %u\n"
-		"wait_data_task_working   %u\n"
 		, test_bit(WALB_STATE_READ_ONLY, &flagsW)
 		, test_bit(WALB_STATE_OVERFLOW, &flagsW)
 		, test_bit(WALB_STATE_FINALIZE, &flagsW)
 		, test_bit(IOCORE_STATE_SUBMIT_LOG_TASK_WORKING, &flagsC)
 		, test_bit(IOCORE_STATE_WAIT_LOG_TASK_WORKING, &flagsC)
-		, test_bit(IOCORE_STATE_SUBMIT_DATA_TASK_WORKING, &flagsC)
-		, test_bit(IOCORE_STATE_WAIT_DATA_TASK_WORKING, &flagsC));
+		, test_bit(IOCORE_STATE_SUBMIT_DATA_TASK_WORKING, &flagsC));
 }
 
 static ssize_t walb_attr_show_support_flush(struct walb_dev *wdev, char *buf)
@@ -143,6 +140,229 @@ static ssize_t walb_attr_show_support_discard(struct walb_dev *wdev, char *buf)
 	return snprintf(buf, PAGE_SIZE, "%d\n", wdev->support_discard ? 1 : 0);
 }
 
+static ssize_t walb_attr_show_support_write_same(
+	struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", wdev->support_write_same ? 1 : 0);
+}
+
+static ssize_t walb_attr_show_zero_copy(struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(wdev->zero_copy) ? 1 : 0);
+}
+
+static ssize_t walb_attr_show_absorb_writes(struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(wdev->absorb_writes) ? 1 : 0);
+}
+
+static ssize_t walb_attr_show_absorb_delay_ms(struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(wdev->absorb_delay_ms));
+}
+
+static ssize_t walb_attr_show_spill_writes(struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(wdev->spill_writes) ? 1 : 0);
+}
+
+static ssize_t walb_attr_show_detect_zero(struct walb_dev *wdev, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(wdev->detect_zero) ? 1 : 0);
+}
+
+/**
+ * Data IOs absorbed by newer write IOs.
+ */
+static ssize_t walb_attr_show_absorption(struct walb_dev *wdev, char *buf)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!iocored)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE,
+		"absorbed_io    %" PRIu64 "\n"
+		"absorbed_bytes %" PRIu64 "\n"
+		, (u64)atomic64_read(&iocored->n_absorbed_io)
+		, (u64)atomic64_read(&iocored->n_absorbed_bytes));
+}
+
+/**
+ * Write IOs whose data were dropped in spill mode.
+ */
+static ssize_t walb_attr_show_spill(struct walb_dev *wdev, char *buf)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!iocored)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE,
+		"spilled_io    %" PRIu64 "\n"
+		"spilled_bytes %" PRIu64 "\n"
+		, (u64)atomic64_read(&iocored->n_spilled_io)
+		, (u64)atomic64_read(&iocored->n_spilled_bytes));
+}
+
+/**
+ * Write IOs of all-zero data logged without data.
+ */
+static ssize_t walb_attr_show_zero(struct walb_dev *wdev, char *buf)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!iocored)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE,
+		"zero_io    %" PRIu64 "\n"
+		"zero_bytes %" PRIu64 "\n"
+		, (u64)atomic64_read(&iocored->n_zero_io)
+		, (u64)atomic64_read(&iocored->n_zero_bytes));
+}
+
+/**
+ * The page pool is shared by all the walb devices.
+ */
+static ssize_t walb_attr_show_page_pool(struct walb_dev *wdev, char *buf)
+{
+	struct page_pool_stat stat;
+
+	bio_entry_get_page_pool_stat(&stat);
+	return snprintf(buf, PAGE_SIZE,
+		"hit          %" PRIu64 "\n"
+		"miss         %" PRIu64 "\n"
+		"cached       %u\n"
+		"reserved     %u\n"
+		"min_reserved %u\n"
+		, stat.n_hit
+		, stat.n_miss
+		, stat.n_cached
+		, stat.n_reserved
+		, stat.min_reserved);
+}
+
+/**
+ * Current limits of the adaptive logpack batching.
+ * The static limits are shown while it is disabled.
+ */
+static ssize_t walb_attr_show_batch(struct walb_dev *wdev, char *buf)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+	const bool is_adaptive = READ_ONCE(adaptive_batch_) != 0;
+
+	if (!iocored)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE,
+		"adaptive       %u\n"
+		"io_bulk        %u\n"
+		"logpack_pb     %u\n"
+		"log_latency_us %" PRIu64 "\n"
+		, is_adaptive
+		, is_adaptive ? READ_ONCE(iocored->cur_io_bulk) : wdev->n_io_bulk
+		, is_adaptive ? READ_ONCE(iocored->cur_logpack_pb) : wdev->max_logpack_pb
+		, div_u64(READ_ONCE(iocored->log_lat_avg_ns), 1000));
+}
+
+static ssize_t walb_attr_show_latency(
+	struct walb_dev *wdev, unsigned int stage, char *buf)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!iocored)
+		return 0;
+
+	return walb_latency_sprint(iocored->latency, stage, buf, PAGE_SIZE);
+}
+
+/*******************************************************************************
+ * Funtions to store attributes.
+ *******************************************************************************/
+
+static ssize_t walb_attr_store_zero_copy(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	bool val;
+
+	if (strtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(wdev->zero_copy, val);
+	WLOGi(wdev, "zero_copy %d\n", val ? 1 : 0);
+	return count;
+}
+
+static ssize_t walb_attr_store_absorb_writes(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	bool val;
+
+	if (strtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(wdev->absorb_writes, val);
+	WLOGi(wdev, "absorb_writes %d\n", val ? 1 : 0);
+	return count;
+}
+
+static ssize_t walb_attr_store_absorb_delay_ms(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 10, &val) || val > ABSORB_DELAY_MAX_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(wdev->absorb_delay_ms, val);
+	WLOGi(wdev, "absorb_delay_ms %u\n", val);
+	return count;
+}
+
+static ssize_t walb_attr_store_spill_writes(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	bool val;
+
+	if (strtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(wdev->spill_writes, val);
+	WLOGi(wdev, "spill_writes %d\n", val ? 1 : 0);
+	return count;
+}
+
+static ssize_t walb_attr_store_detect_zero(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	bool val;
+
+	if (strtobool(buf, &val))
+		return -EINVAL;
+	if (val && !wdev->is_log_packed)
+		return -EINVAL;
+
+	WRITE_ONCE(wdev->detect_zero, val);
+	WLOGi(wdev, "detect_zero %d\n", val ? 1 : 0);
+	return count;
+}
+
+/**
+ * Any write clears all the latency histograms.
+ */
+static ssize_t walb_attr_store_latency_reset(
+	struct walb_dev *wdev, const char *buf, size_t count)
+{
+	struct iocore_data *iocored = get_iocored_from_wdev(wdev);
+
+	if (!iocored)
+		return -ENODEV;
+
+	walb_latency_reset(iocored->latency);
+	return count;
+}
+
 /*******************************************************************************
  * Ops and attributes definition.
  *******************************************************************************/
@@ -150,7 +370,7 @@ static ssize_t walb_attr_show_support_discard(struct walb_dev *wdev, char *buf)
 struct walb_sysfs_attr {
 	struct attribute attr;
 	ssize_t (*show)(struct walb_dev *, char *);
-	ssize_t (*store)(struct walb_dev *, char *);
+	ssize_t (*store)(struct walb_dev *, const char *, size_t);
 };
 
 static ssize_t walb_attr_show(
@@ -161,18 +381,41 @@ static ssize_t walb_attr_show(
 
 	if (!wdev)
 		return -EINVAL;
+	if (!wattr->show)
+		return -EIO;
 
 	return wattr->show(wdev, buf);
 }
 
+static ssize_t walb_attr_store(
+	struct kobject *kobj, struct attribute *attr,
+	const char *buf, size_t count)
+{
+	struct walb_sysfs_attr *wattr = container_of(attr, struct walb_sysfs_attr, attr);
+	struct walb_dev *wdev = get_wdev_from_kobj(kobj);
+
+	if (!wdev)
+		return -EINVAL;
+	if (!wattr->store)
+		return -EIO;
+
+	return wattr->store(wdev, buf, count);
+}
+
 static const struct sysfs_ops walb_sysfs_ops = {
 	.show = walb_attr_show,
+	.store = walb_attr_store,
 };
 
 #define DECLARE_WALB_SYSFS_ATTR(name)					\
 	struct walb_sysfs_attr walb_attr_##name =				\
 		__ATTR(name, S_IRUGO, walb_attr_show_##name, NULL)
 
+#define DECLARE_WALB_SYSFS_ATTR_RW(name)				\
+	struct walb_sysfs_attr walb_attr_##name =				\
+		__ATTR(name, S_IRUGO | S_IWUSR,					\
+			walb_attr_show_##name, walb_attr_store_##name)
+
 static DECLARE_WALB_SYSFS_ATTR(ldev);
 static DECLARE_WALB_SYSFS_ATTR(ddev);
 static DECLARE_WALB_SYSFS_ATTR(lsids);
@@ -184,6 +427,17 @@ static DECLARE_WALB_SYSFS_ATTR(status);
 static DECLARE_WALB_SYSFS_ATTR(support_flush);
 static DECLARE_WALB_SYSFS_ATTR(support_fua);
 static DECLARE_WALB_SYSFS_ATTR(support_discard);
+static DECLARE_WALB_SYSFS_ATTR(support_write_same);
+static DECLARE_WALB_SYSFS_ATTR_RW(zero_copy);
+static DECLARE_WALB_SYSFS_ATTR_RW(absorb_writes);
+static DECLARE_WALB_SYSFS_ATTR_RW(absorb_delay_ms);
+static DECLARE_WALB_SYSFS_ATTR(absorption);
+static DECLARE_WALB_SYSFS_ATTR_RW(spill_writes);
+static DECLARE_WALB_SYSFS_ATTR(spill);
+static DECLARE_WALB_SYSFS_ATTR_RW(detect_zero);
+static DECLARE_WALB_SYSFS_ATTR(zero);
+static DECLARE_WALB_SYSFS_ATTR(page_pool);
+static DECLARE_WALB_SYSFS_ATTR(batch);
 
 static struct attribute *walb_attrs[] = {
 	&walb_attr_ldev.attr,
@@ -197,9 +451,61 @@ static struct attribute *walb_attrs[] = {
 	&walb_attr_support_flush.attr,
 	&walb_attr_support_fua.attr,
 	&walb_attr_support_discard.attr,
+	&walb_attr_support_write_same.attr,
+	&walb_attr_zero_copy.attr,
+	&walb_attr_absorb_writes.attr,
+	&walb_attr_absorb_delay_ms.attr,
+	&walb_attr_absorption.attr,
+	&walb_attr_spill_writes.attr,
+	&walb_attr_spill.attr,
+	&walb_attr_detect_zero.attr,
+	&walb_attr_zero.attr,
+	&walb_attr_page_pool.attr,
+	&walb_attr_batch.attr,
 	NULL,
 };
 
+/*
+ * Latency histograms in the "latency" directory.
+ * See latency.h for the stages and the format.
+ */
+#define DECLARE_WALB_LATENCY_ATTR(name, stage)				\
+	static ssize_t walb_attr_show_latency_##name(			\
+		struct walb_dev *wdev, char *buf)			\
+	{								\
+		return walb_attr_show_latency(wdev, stage, buf);	\
+	}								\
+	static struct walb_sysfs_attr walb_attr_latency_##name =	\
+		__ATTR(name, S_IRUGO, walb_attr_show_latency_##name, NULL)
+
+DECLARE_WALB_LATENCY_ATTR(queue, WALB_LAT_QUEUE);
+DECLARE_WALB_LATENCY_ATTR(pack, WALB_LAT_PACK);
+DECLARE_WALB_LATENCY_ATTR(checksum, WALB_LAT_CHECKSUM);
+DECLARE_WALB_LATENCY_ATTR(log_io, WALB_LAT_LOG_IO);
+DECLARE_WALB_LATENCY_ATTR(pending, WALB_LAT_PENDING);
+DECLARE_WALB_LATENCY_ATTR(data_io, WALB_LAT_DATA_IO);
+DECLARE_WALB_LATENCY_ATTR(write, WALB_LAT_WRITE);
+
+static struct walb_sysfs_attr walb_attr_latency_reset =
+	__ATTR(reset, S_IWUSR, NULL, walb_attr_store_latency_reset);
+
+static struct attribute *walb_latency_attrs[] = {
+	&walb_attr_latency_queue.attr,
+	&walb_attr_latency_pack.attr,
+	&walb_attr_latency_checksum.attr,
+	&walb_attr_latency_log_io.attr,
+	&walb_attr_latency_pending.attr,
+	&walb_attr_latency_data_io.attr,
+	&walb_attr_latency_write.attr,
+	&walb_attr_latency_reset.attr,
+	NULL,
+};
+
+static struct attribute_group walb_latency_attr_group = {
+	.name = "latency",
+	.attrs = walb_latency_attrs,
+};
+
 static struct kobj_type walb_ktype = {
 	.sysfs_ops = &walb_sysfs_ops,
 	.default_attrs = walb_attrs,
@@ -211,15 +517,25 @@ static struct kobj_type walb_ktype = {
 
 int walb_sysfs_init(struct walb_dev *wdev)
 {
+	int err;
+
 	LOGd("walb_sysfs_init\n");
 	memset(&wdev->kobj, 0, sizeof(struct kobject));
-	return kobject_init_and_add(&wdev->kobj, &walb_ktype,
+	err = kobject_init_and_add(&wdev->kobj, &walb_ktype,
 				&disk_to_dev(wdev->gd)->kobj,
 				"%s", "walb");
+	if (err)
+		return err;
+
+	err = sysfs_create_group(&wdev->kobj, &walb_latency_attr_group);
+	if (err)
+		kobject_put(&wdev->kobj);
+	return err;
 }
 
 void walb_sysfs_exit(struct walb_dev *wdev)
 {
+	sysfs_remove_group(&wdev->kobj, &walb_latency_attr_group);
 	kobject_put(&wdev->kobj);
 	LOGd("walb_sysfs_exit\n");
 }
@@ -8,10 +8,12 @@
 #include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/delay.h>
+#include <linux/highmem.h>
 
 #include "linux/walb/logger.h"
 #include "bio_entry.h"
 #include "bio_wrapper.h"
+#include "bio_util.h"
 
 static unsigned int obj_size_ = 1;
 module_param_named(obj_size, obj_size_, uint, S_IRUGO);
@@ -23,19 +25,242 @@ struct test_struct
 	void *p;
 };
 
+/**
+ * Fill or check a bio data with a pattern depending on the byte position.
+ *
+ * RETURN:
+ *   false if check failed.
+ */
+static bool bio_data_pattern(struct bio *bio, bool is_fill)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	u64 off = (u64)bio->bi_iter.bi_sector << 9;
+	bool ret = true;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		u8 *p = (u8 *)kmap(bvec.bv_page) + bvec.bv_offset;
+		uint i;
+		for (i = 0; i < bvec.bv_len; i++) {
+			const u8 c = (u8)((off + i) * 7 + 1);
+			if (is_fill)
+				p[i] = c;
+			else if (p[i] != c)
+				ret = false;
+		}
+		kunmap(bvec.bv_page);
+		off += bvec.bv_len;
+	}
+	return ret;
+}
+
+/**
+ * Read-after-write through pending data with deep-copied
+ * and zero-copied write bio wrappers.
+ * The write covers [0, 16) and the read is [4, 12) in sectors.
+ */
+static bool test_copy_overlapped(bool zero_copy)
+{
+	struct bio *wbio, *rbio;
+	struct bio_wrapper *src, *dst;
+	bool ret = false;
+
+	wbio = bio_alloc_with_pages(16 << 9, NULL, GFP_KERNEL);
+	if (!wbio)
+		goto error0;
+	wbio->bi_rw = WRITE;
+	wbio->bi_iter.bi_sector = 0;
+	bio_data_pattern(wbio, true);
+
+	rbio = bio_alloc_with_pages(8 << 9, NULL, GFP_KERNEL);
+	if (!rbio)
+		goto error1;
+	rbio->bi_rw = READ;
+	rbio->bi_iter.bi_sector = 4;
+
+	src = alloc_bio_wrapper(GFP_KERNEL);
+	if (!src)
+		goto error2;
+	init_bio_wrapper(src, wbio);
+	if (!bio_wrapper_prepare_copied_bio(src, zero_copy, 0x1234, GFP_KERNEL))
+		goto error3;
+	if (src->csum != bio_calc_checksum(src->copied_bio, 0x1234)) {
+		LOGe("checksum mismatch.\n");
+		goto error3;
+	}
+	if (bio_wrapper_state_is_zero_copy(src) != zero_copy) {
+		LOGe("zero_copy flag mismatch.\n");
+		goto error3;
+	}
+	if ((bio_page(src->copied_bio) == bio_page(wbio)) != zero_copy) {
+		LOGe("page sharing mismatch.\n");
+		goto error3;
+	}
+	if (!init_bio_entry_by_clone(&src->cloned_bioe, src->copied_bio, NULL, GFP_KERNEL))
+		goto error3;
+
+	dst = alloc_bio_wrapper(GFP_KERNEL);
+	if (!dst)
+		goto error3;
+	init_bio_wrapper(dst, rbio);
+	if (!init_bio_entry_by_clone(&dst->cloned_bioe, rbio, NULL, GFP_KERNEL))
+		goto error4;
+	bio_list_add(&dst->cloned_bio_list, dst->cloned_bioe.bio);
+
+	if (!bio_wrapper_copy_overlapped(dst, src, NULL, GFP_KERNEL))
+		goto error5;
+	if (bio_list_size(&dst->cloned_bio_list) != 1 ||
+		!bio_private_lsb_get(dst->cloned_bioe.bio)) {
+		LOGe("fully covered bio must be copied without split.\n");
+		goto error5;
+	}
+	ret = bio_data_pattern(rbio, false);
+	if (!ret)
+		LOGe("read data mismatch.\n");
+
+	/* The copied bio is not submitted so we put it directly. */
+	bio_private_lsb_clear(dst->cloned_bioe.bio);
+error5:
+	bio_list_init(&dst->cloned_bio_list);
+error4:
+	destroy_bio_wrapper(dst);
+error3:
+	destroy_bio_wrapper(src);
+error2:
+	bio_put_with_pages(rbio);
+error1:
+	bio_put_with_pages(wbio);
+error0:
+	return ret;
+}
+
+/**
+ * A read overlapping a spilled write must be redirected to the log device.
+ * The spilled write covers [8, 16) and the read is [4, 12) in sectors,
+ * so the read is split into [4, 8) for the data device
+ * and [8, 12) for the log device.
+ */
+static bool test_redirect_spilled(void)
+{
+	struct block_device *ldev = (struct block_device *)&ldev; /* never used. */
+	const u64 spilled_pos = 1000;
+	struct bio *rbio, *bio;
+	struct bio_wrapper *src, *dst;
+	bool ret = false;
+
+	rbio = bio_alloc_with_pages(8 << 9, NULL, GFP_KERNEL);
+	if (!rbio)
+		goto error0;
+	rbio->bi_rw = READ;
+	rbio->bi_iter.bi_sector = 4;
+
+	src = alloc_bio_wrapper(GFP_KERNEL);
+	if (!src)
+		goto error1;
+	init_bio_wrapper(src, NULL);
+	src->pos = 8;
+	src->len = 8;
+	src->spilled_pos = spilled_pos;
+	set_bit(BIO_WRAPPER_SPILLED, &src->flags);
+
+	dst = alloc_bio_wrapper(GFP_KERNEL);
+	if (!dst)
+		goto error2;
+	init_bio_wrapper(dst, rbio);
+	if (!init_bio_entry_by_clone(&dst->cloned_bioe, rbio, NULL, GFP_KERNEL))
+		goto error3;
+	bio_list_add(&dst->cloned_bio_list, dst->cloned_bioe.bio);
+
+	if (!bio_wrapper_copy_overlapped(dst, src, ldev, GFP_KERNEL))
+		goto error4;
+	bio = bio_list_peek(&dst->cloned_bio_list);
+	if (bio_list_size(&dst->cloned_bio_list) != 2 ||
+		bio->bi_bdev || bio->bi_iter.bi_sector != 4 ||
+		bio_private_lsb_get(bio)) {
+		LOGe("the head must be read from the data device.\n");
+		goto error4;
+	}
+	bio = dst->cloned_bioe.bio;
+	if (bio->bi_bdev != ldev ||
+		bio->bi_iter.bi_sector != spilled_pos ||
+		bio_sectors(bio) != 4 || bio_private_lsb_get(bio)) {
+		LOGe("the tail must be redirected to the log device.\n");
+		goto error4;
+	}
+	ret = true;
+
+error4:
+	/* The bios are not submitted so we put the split one directly. */
+	bio = bio_list_pop(&dst->cloned_bio_list);
+	if (bio != dst->cloned_bioe.bio)
+		bio_put(bio);
+	bio_list_init(&dst->cloned_bio_list);
+error3:
+	destroy_bio_wrapper(dst);
+error2:
+	destroy_bio_wrapper(src);
+error1:
+	bio_put_with_pages(rbio);
+error0:
+	return ret;
+}
+
+/**
+ * Zero-block detection of a write bio.
+ */
+static bool test_bio_is_zero(void)
+{
+	struct bio *bio;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	u8 *p;
+	bool ret = false;
+
+	bio = bio_alloc_with_pages(16 << 9, NULL, GFP_KERNEL);
+	if (!bio)
+		return false;
+	bio->bi_rw = WRITE;
+	bio_for_each_segment(bvec, bio, iter) {
+		p = (u8 *)kmap(bvec.bv_page) + bvec.bv_offset;
+		memset(p, 0, bvec.bv_len);
+		kunmap(bvec.bv_page);
+	}
+	if (!bio_is_zero(bio)) {
+		LOGe("zero data must be detected.\n");
+		goto fin;
+	}
+
+	/* The last byte only is non-zero. */
+	bvec = bio->bi_io_vec[bio->bi_vcnt - 1];
+	p = (u8 *)kmap(bvec.bv_page) + bvec.bv_offset;
+	p[bvec.bv_len - 1] = 1;
+	kunmap(bvec.bv_page);
+	if (bio_is_zero(bio)) {
+		LOGe("non-zero data must not be detected.\n");
+		goto fin;
+	}
+	ret = true;
+fin:
+	bio_put_with_pages(bio);
+	return ret;
+}
+
 static int __init test_init(void)
 {
 	struct kmem_cache *cache;
 
-#if 0
-	bio_entry_init();
-	bio_entry_exit();
-#endif
-
-#if 0
-	bio_wrapper_init();
-	bio_wrapper_exit();
-#endif
+	if (bio_entry_init() && bio_wrapper_init()) {
+		LOGn("test_copy_overlapped deep-copy %s\n",
+			test_copy_overlapped(false) ? "ok" : "NG");
+		LOGn("test_copy_overlapped zero-copy %s\n",
+			test_copy_overlapped(true) ? "ok" : "NG");
+		LOGn("test_redirect_spilled %s\n",
+			test_redirect_spilled() ? "ok" : "NG");
+		LOGn("test_bio_is_zero %s\n",
+			test_bio_is_zero() ? "ok" : "NG");
+		bio_wrapper_exit();
+		bio_entry_exit();
+	}
 
 	LOGn("sizeof bio_entry %zu bio_wrapper %zu\n",
 		sizeof(struct bio_entry),
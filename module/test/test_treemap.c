@@ -7,6 +7,8 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
 
 #include "linux/walb/walb.h"
 #include "linux/walb/logger.h"
@@ -14,6 +16,13 @@
 #include "treemap.h"
 #include "util.h"
 
+static bool bench_ = false;
+module_param_named(bench, bench_, bool, S_IRUGO);
+MODULE_PARM_DESC(bench, "Run overlap search benchmark of multimap and interval_multimap.");
+
+static unsigned int bench_n_items_ = 100000;
+module_param_named(bench_n_items, bench_n_items_, uint, S_IRUGO);
+
 /**
  * Test treemap for debug.
  *
@@ -696,6 +705,259 @@ error:
 	return -1;
 }
 
+/**
+ * Count items overlapped with [pos, pos + len) in a interval multimap.
+ */
+static unsigned int count_overlapped_in_interval_multimap(
+	struct interval_multimap *imap, u64 pos, u64 len)
+{
+	struct interval_multimap_cursor cur;
+	unsigned int n = 0;
+
+	if (!interval_multimap_cursor_search(&cur, imap, pos, len))
+		return 0;
+	do {
+		n++;
+	} while (interval_multimap_cursor_next(&cur));
+	return n;
+}
+
+/**
+ * Test interval multimap for debug.
+ *
+ * @return 0 in success, or -1.
+ */
+int __init interval_multimap_test(void)
+{
+	struct interval_multimap *imap;
+	struct interval_multimap_cursor cur;
+	struct treemap_memory_manager mmgr;
+	u64 starts[64], lens[64];
+	int i, j;
+	bool ret;
+
+	LOGd("interval_multimap_test begin.\n");
+
+	ret = initialize_treemap_memory_manager_kmalloc(&mmgr, 1);
+	CHECKd(ret);
+
+	imap = interval_multimap_create(GFP_KERNEL, &mmgr);
+	CHECKd(imap);
+	CHECKd(interval_multimap_is_empty(imap));
+	CHECKd(interval_multimap_add(imap, 0, 0, 0, GFP_KERNEL) == -EINVAL);
+	CHECKd(interval_multimap_add(imap, 0, 1, TREEMAP_INVALID_VAL, GFP_KERNEL)
+		== -EINVAL);
+
+	/* Add random intervals including the same ones. */
+	for (i = 0; i < 64; i++) {
+		if (i % 8 == 7) {
+			starts[i] = starts[i - 1];
+			lens[i] = lens[i - 1];
+		} else {
+			starts[i] = prandom_u32() % 1024;
+			lens[i] = 1 + prandom_u32() % ((i % 4 == 0) ? 512 : 8);
+		}
+		CHECKd(interval_multimap_add(
+				imap, starts[i], lens[i], i, GFP_KERNEL) == 0);
+	}
+	CHECKd(interval_multimap_n_items(imap) == 64);
+
+	/* Compare overlap search with brute force. */
+	for (i = 0; i < 1024; i++) {
+		u64 pos = prandom_u32() % 1100;
+		u64 len = 1 + prandom_u32() % 16;
+		unsigned int n = 0;
+		u64 prev_start = 0;
+
+		for (j = 0; j < 64; j++) {
+			if (starts[j] < pos + len && pos < starts[j] + lens[j])
+				n++;
+		}
+		CHECKd(count_overlapped_in_interval_multimap(imap, pos, len) == n);
+
+		/* Items must be sorted by start. */
+		if (interval_multimap_cursor_search(&cur, imap, pos, len)) {
+			do {
+				CHECKd(prev_start <= interval_multimap_cursor_start(&cur));
+				prev_start = interval_multimap_cursor_start(&cur);
+			} while (interval_multimap_cursor_next(&cur));
+		}
+	}
+
+	/* Delete. */
+	CHECKd(interval_multimap_del(imap, starts[0], lens[0] + 1, 0)
+		== TREEMAP_INVALID_VAL);
+	CHECKd(interval_multimap_del(imap, starts[7], lens[7], 7) == 7);
+	CHECKd(interval_multimap_del(imap, starts[7], lens[7], 7)
+		== TREEMAP_INVALID_VAL);
+	CHECKd(interval_multimap_n_items(imap) == 63);
+
+	/* Delete with cursor. */
+	CHECKd(interval_multimap_cursor_search(&cur, imap, 0, 2048));
+	while (interval_multimap_cursor_is_data(&cur)) {
+		if (interval_multimap_cursor_val(&cur) % 2 == 0) {
+			CHECKd(interval_multimap_cursor_del(&cur));
+		} else {
+			interval_multimap_cursor_next(&cur);
+		}
+	}
+	CHECKd(interval_multimap_n_items(imap) == 31);
+	CHECKd(count_overlapped_in_interval_multimap(imap, 0, 2048) == 31);
+
+	interval_multimap_empty(imap);
+	CHECKd(interval_multimap_is_empty(imap));
+	interval_multimap_destroy(imap);
+	finalize_treemap_memory_manager(&mmgr);
+
+	LOGd("interval_multimap_test end.\n");
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * Test intrusive interval multimap for debug.
+ *
+ * @return 0 in success, or -1.
+ */
+int __init interval_multimap_intrusive_test(void)
+{
+	struct interval_multimap *imap;
+	struct interval_multimap_cursor cur;
+	struct interval_node nodes[16];
+	int i;
+
+	LOGd("interval_multimap_intrusive_test begin.\n");
+
+	imap = interval_multimap_create(GFP_KERNEL, NULL);
+	CHECKd(imap);
+	CHECKd(interval_multimap_add(imap, 0, 1, 0, GFP_KERNEL) == -EINVAL);
+
+	/* [i * 4, i * 4 + 8) for each node. */
+	for (i = 0; i < 16; i++)
+		interval_multimap_add_node(imap, &nodes[i], i * 4, 8, i);
+	CHECKd(interval_multimap_n_items(imap) == 16);
+	CHECKd(count_overlapped_in_interval_multimap(imap, 20, 1) == 2);
+
+	/* Delete nodes directly and with a cursor. */
+	interval_multimap_del_node(imap, &nodes[5]);
+	CHECKd(interval_multimap_n_items(imap) == 15);
+	CHECKd(count_overlapped_in_interval_multimap(imap, 20, 1) == 1);
+	CHECKd(interval_multimap_cursor_search(&cur, imap, 0, 12));
+	CHECKd(interval_multimap_cursor_val(&cur) == 0);
+	CHECKd(interval_multimap_cursor_del(&cur));
+	CHECKd(interval_multimap_n_items(imap) == 14);
+	CHECKd(count_overlapped_in_interval_multimap(imap, 0, 64) == 14);
+
+	/* The nodes are owned by the caller. */
+	interval_multimap_empty(imap);
+	CHECKd(interval_multimap_is_empty(imap));
+	interval_multimap_destroy(imap);
+
+	LOGd("interval_multimap_intrusive_test end.\n");
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * Simple deterministic pseudo random generator
+ * to make the same query sequence.
+ */
+static u32 lcg_rand(u32 *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state;
+}
+
+/**
+ * Compare overlap search of multimap with the max size scan
+ * (the way pending/overlapped data used) and interval_multimap.
+ *
+ * Most IOs are small and a few are large,
+ * which makes the max size scan visit many unrelated items.
+ *
+ * @return 0 in success, or -1.
+ */
+int __init overlap_search_bench(unsigned int n_items)
+{
+	const u64 capacity = 1ULL << 24;
+	const unsigned int n_query = 100000;
+	struct treemap_memory_manager mmgr;
+	struct multimap *map = NULL;
+	struct interval_multimap *imap = NULL;
+	u64 max_len = 0, n_visit = 0, n_found0 = 0, n_found1 = 0;
+	ktime_t t0, t1, t2;
+	unsigned int i;
+	u32 state;
+	bool ret;
+
+	ret = initialize_treemap_memory_manager_kmalloc(&mmgr, 1);
+	CHECKd(ret);
+	map = multimap_create(GFP_KERNEL, &mmgr);
+	CHECKld(error1, map);
+	imap = interval_multimap_create(GFP_KERNEL, &mmgr);
+	CHECKld(error1, imap);
+
+	for (i = 0; i < n_items; i++) {
+		u64 pos = prandom_u32() % capacity;
+		u64 len = (i % 1000 == 0) ? 2048 : 8;
+		CHECKld(error1, multimap_add(map, pos, len, GFP_KERNEL) == 0);
+		CHECKld(error1, interval_multimap_add(
+				imap, pos, len, len, GFP_KERNEL) == 0);
+		max_len = max(max_len, len);
+	}
+
+	/* Start with pos - max_len and scan. */
+	state = 0;
+	t0 = ktime_get();
+	for (i = 0; i < n_query; i++) {
+		struct multimap_cursor cur;
+		u64 pos = lcg_rand(&state) % capacity;
+		u64 len = 8;
+		u64 start = pos > max_len ? pos - max_len : 0;
+
+		multimap_cursor_init(map, &cur);
+		if (!multimap_cursor_search(&cur, start, MAP_SEARCH_GE, 0))
+			continue;
+		while (multimap_cursor_key(&cur) < pos + len) {
+			u64 key = multimap_cursor_key(&cur);
+			n_visit++;
+			if (pos < key + multimap_cursor_val(&cur))
+				n_found0++;
+			if (!multimap_cursor_next(&cur))
+				break;
+		}
+	}
+	t1 = ktime_get();
+	state = 0;
+	for (i = 0; i < n_query; i++) {
+		u64 pos = lcg_rand(&state) % capacity;
+		n_found1 += count_overlapped_in_interval_multimap(imap, pos, 8);
+	}
+	t2 = ktime_get();
+	CHECKld(error1, n_found0 == n_found1);
+
+	LOGn("overlap_search_bench: n_items %u n_query %u\n"
+		"multimap (max size scan): %lld us (visited %" PRIu64 " found %" PRIu64 ")\n"
+		"interval_multimap: %lld us (found %" PRIu64 ")\n"
+		, n_items, n_query
+		, ktime_us_delta(t1, t0), n_visit, n_found0
+		, ktime_us_delta(t2, t1), n_found1);
+
+	multimap_destroy(map);
+	interval_multimap_destroy(imap);
+	finalize_treemap_memory_manager(&mmgr);
+	return 0;
+
+error1:
+	multimap_destroy(map);
+	interval_multimap_destroy(imap);
+	finalize_treemap_memory_manager(&mmgr);
+error:
+	return -1;
+}
+
 struct treemap_memory_manager mmgr_;
 
 static bool initialize(void)
@@ -705,7 +967,8 @@ static bool initialize(void)
 		&mmgr_, 1,
 		"test_node_cache",
 		"test_cell_head_cache",
-		"test_cell_cache");
+		"test_cell_cache",
+		"test_interval_node_cache");
 	return ret;
 }
 
@@ -740,6 +1003,18 @@ static int __init test_treemap_init(void)
 		printk(KERN_ERR "multimap_cursor_test() failed.\n");
 		goto error;
 	}
+	if (interval_multimap_test()) {
+		printk(KERN_ERR "interval_multimap_test() failed.\n");
+		goto error;
+	}
+	if (interval_multimap_intrusive_test()) {
+		printk(KERN_ERR "interval_multimap_intrusive_test() failed.\n");
+		goto error;
+	}
+	if (bench_ && overlap_search_bench(bench_n_items_)) {
+		printk(KERN_ERR "overlap_search_bench() failed.\n");
+		goto error;
+	}
 
 	finalize();
 	printk(KERN_INFO "test_treemap_init end\n");
@@ -9,6 +9,7 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/mempool.h>
+#include <linux/interval_tree_generic.h>
 
 #include "linux/walb/walb.h"
 #include "linux/walb/logger.h"
@@ -62,6 +63,18 @@ UNUSED static void print_multimap_cursor(
 #define free_cell_head(mmgr, chead) mempool_free(chead, mmgr->cell_head_pool)
 #define alloc_cell(mmgr, gfp_mask) mempool_alloc(mmgr->cell_pool, gfp_mask)
 #define free_cell(mmgr, cell) mempool_free(cell, mmgr->cell_pool)
+#define alloc_interval_node(mmgr, gfp_mask) mempool_alloc(mmgr->interval_node_pool, gfp_mask)
+#define free_interval_node(mmgr, inode) mempool_free(inode, mmgr->interval_node_pool)
+
+/**
+ * Augmented rb-tree operations for interval multimap.
+ * This defines itree_insert(), itree_remove(),
+ * itree_iter_first(), and itree_iter_next().
+ */
+#define ITREE_START(inode) ((inode)->start)
+#define ITREE_LAST(inode) ((inode)->last)
+INTERVAL_TREE_DEFINE(struct interval_node, node, u64, subtree_last,
+		ITREE_START, ITREE_LAST, static, itree)
 
 /*******************************************************************************
  * Static functions.
@@ -282,10 +295,12 @@ static bool is_valid_treemap_memory_manager(struct treemap_memory_manager *mmgr)
 	ret1 = mmgr &&
 		mmgr->node_pool &&
 		mmgr->cell_head_pool &&
-		mmgr->cell_pool;
+		mmgr->cell_pool &&
+		mmgr->interval_node_pool;
 	ret2 = mmgr->node_cache &&
 		mmgr->cell_head_cache &&
-		mmgr->cell_cache;
+		mmgr->cell_cache &&
+		mmgr->interval_node_cache;
 
 	if (mmgr->is_kmem_cache) {
 		return ret1 && ret2;
@@ -498,13 +513,15 @@ bool initialize_treemap_memory_manager(
 	struct treemap_memory_manager *mmgr, int min_nr,
 	const char *node_cache_name,
 	const char *cell_head_cache_name,
-	const char *cell_cache_name)
+	const char *cell_cache_name,
+	const char *interval_node_cache_name)
 {
 	ASSERT(mmgr);
 	ASSERT(min_nr > 0);
 	ASSERT(node_cache_name);
 	ASSERT(cell_head_cache_name);
 	ASSERT(cell_cache_name);
+	ASSERT(interval_node_cache_name);
 
 	memset(mmgr, 0, sizeof(struct treemap_memory_manager));
 	mmgr->is_kmem_cache = true;
@@ -524,6 +541,11 @@ bool initialize_treemap_memory_manager(
 		sizeof(struct tree_cell), 0, 0, NULL);
 	if (!mmgr->cell_cache) { goto error; }
 
+	mmgr->interval_node_cache = kmem_cache_create(
+		interval_node_cache_name,
+		sizeof(struct interval_node), 0, 0, NULL);
+	if (!mmgr->interval_node_cache) { goto error; }
+
 	mmgr->node_pool = mempool_create_slab_pool(min_nr, mmgr->node_cache);
 	if (!mmgr->node_pool) { goto error; }
 
@@ -533,6 +555,10 @@ bool initialize_treemap_memory_manager(
 	mmgr->cell_pool = mempool_create_slab_pool(min_nr, mmgr->cell_cache);
 	if (!mmgr->cell_pool) { goto error; }
 
+	mmgr->interval_node_pool = mempool_create_slab_pool(
+		min_nr, mmgr->interval_node_cache);
+	if (!mmgr->interval_node_pool) { goto error; }
+
 	return true;
 
 error:
@@ -564,6 +590,10 @@ bool initialize_treemap_memory_manager_kmalloc(
 		min_nr, sizeof(struct tree_cell));
 	if (!mmgr->cell_pool) { goto error; }
 
+	mmgr->interval_node_pool = mempool_create_kmalloc_pool(
+		min_nr, sizeof(struct interval_node));
+	if (!mmgr->interval_node_pool) { goto error; }
+
 	return true;
 
 error:
@@ -578,6 +608,10 @@ void finalize_treemap_memory_manager(struct treemap_memory_manager *mmgr)
 {
 	if (!mmgr) { return; }
 
+	if (mmgr->interval_node_pool) {
+		mempool_destroy(mmgr->interval_node_pool);
+		mmgr->interval_node_pool = NULL;
+	}
 	if (mmgr->cell_pool) {
 		mempool_destroy(mmgr->cell_pool);
 		mmgr->cell_pool = NULL;
@@ -592,6 +626,10 @@ void finalize_treemap_memory_manager(struct treemap_memory_manager *mmgr)
 	}
 
 	if (mmgr->is_kmem_cache) {
+		if (mmgr->interval_node_cache) {
+			kmem_cache_destroy(mmgr->interval_node_cache);
+			mmgr->interval_node_cache = NULL;
+		}
 		if (mmgr->cell_cache) {
 			kmem_cache_destroy(mmgr->cell_cache);
 			mmgr->cell_cache = NULL;
@@ -1819,4 +1857,317 @@ int multimap_cursor_del(struct multimap_cursor *cursor)
 	return 1;
 }
 
+/*******************************************************************************
+ * Interval multimap operations.
+ *******************************************************************************/
+
+/**
+ * Create an interval multimap.
+ */
+struct interval_multimap* interval_multimap_create(
+	gfp_t gfp_mask, struct treemap_memory_manager *mmgr)
+{
+	struct interval_multimap *imap;
+
+	imap = kmalloc(sizeof(struct interval_multimap), gfp_mask);
+	if (!imap) {
+		LOGe("interval_multimap_create: memory allocation failed.\n");
+		return NULL;
+	}
+	interval_multimap_init(imap, mmgr);
+	return imap;
+}
+
+/**
+ * Initialize an interval multimap structure.
+ */
+void interval_multimap_init(
+	struct interval_multimap *imap, struct treemap_memory_manager *mmgr)
+{
+	ASSERT(imap);
+
+	imap->root = RB_ROOT;
+	imap->mmgr = mmgr;
+	imap->n_items = 0;
+	ASSERT_INTERVAL_MULTIMAP(imap);
+}
+
+/**
+ * Destroy an interval multimap.
+ */
+void interval_multimap_destroy(struct interval_multimap *imap)
+{
+	if (!imap) { return; }
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	interval_multimap_empty(imap);
+	kfree(imap);
+}
+
+/**
+ * Add an interval-value pair to the interval multimap.
+ *
+ * The same interval can be added several times.
+ * Items with the same start are iterated in insertion order.
+ *
+ * @return 0 in success,
+ *	   -ENOMEM if no memory.
+ *	   -EINVAL if the interval or value is invalid.
+ */
+int interval_multimap_add(
+	struct interval_multimap *imap, u64 start, u64 len,
+	unsigned long val, gfp_t gfp_mask)
+{
+	struct interval_node *inode;
+
+	ASSERT_INTERVAL_MULTIMAP(imap);
+
+	if (val == TREEMAP_INVALID_VAL) {
+		LOGe("Val must not be TREEMAP_INVALID_VAL.\n");
+		return -EINVAL;
+	}
+	if (len == 0 || start + len - 1 < start) {
+		LOGe("Invalid interval (%" PRIu64 ", %" PRIu64 ").\n", start, len);
+		return -EINVAL;
+	}
+
+	if (!imap->mmgr) {
+		LOGe("Use interval_multimap_add_node() for an intrusive map.\n");
+		return -EINVAL;
+	}
+
+	inode = alloc_interval_node(imap->mmgr, gfp_mask);
+	if (!inode) {
+		LOGe("interval_multimap_add: memory allocation failed.\n");
+		return -ENOMEM;
+	}
+	inode->start = start;
+	inode->last = start + len - 1;
+	inode->val = val;
+	itree_insert(inode, &imap->root);
+	imap->n_items++;
+	return 0;
+}
+
+/**
+ * Delete an interval-value pair from the interval multimap.
+ *
+ * @return val if found, or TREEMAP_INVALID_VAL.
+ */
+unsigned long interval_multimap_del(
+	struct interval_multimap *imap, u64 start, u64 len, unsigned long val)
+{
+	struct interval_multimap_cursor cur;
+
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	ASSERT(len > 0);
+
+	/* Items with the same start are adjacent in the iteration. */
+	interval_multimap_cursor_search(&cur, imap, start, len);
+	while (interval_multimap_cursor_is_data(&cur)) {
+		struct interval_node *inode = cur.curr;
+		if (inode->start > start)
+			break;
+		if (inode->start == start &&
+			inode->last == start + len - 1 &&
+			inode->val == val) {
+			interval_multimap_cursor_del(&cur);
+			return val;
+		}
+		interval_multimap_cursor_next(&cur);
+	}
+	return TREEMAP_INVALID_VAL;
+}
+
+/**
+ * Add a user-owned node to an intrusive interval multimap.
+ * This never fails because no memory is allocated.
+ *
+ * @inode node embedded in the user data. It must not be in any map.
+ */
+void interval_multimap_add_node(
+	struct interval_multimap *imap, struct interval_node *inode,
+	u64 start, u64 len, unsigned long val)
+{
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	ASSERT(!imap->mmgr);
+	ASSERT(inode);
+	ASSERT(val != TREEMAP_INVALID_VAL);
+	ASSERT(len > 0 && start + len - 1 >= start);
+
+	inode->start = start;
+	inode->last = start + len - 1;
+	inode->val = val;
+	itree_insert(inode, &imap->root);
+	imap->n_items++;
+}
+
+/**
+ * Delete a user-owned node from an intrusive interval multimap.
+ * No search is required.
+ *
+ * @inode node added by interval_multimap_add_node().
+ */
+void interval_multimap_del_node(
+	struct interval_multimap *imap, struct interval_node *inode)
+{
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	ASSERT(!imap->mmgr);
+	ASSERT(inode);
+	ASSERT(imap->n_items > 0);
+
+	itree_remove(inode, &imap->root);
+	imap->n_items--;
+}
+
+/**
+ * Make the interval multimap empty.
+ */
+void interval_multimap_empty(struct interval_multimap *imap)
+{
+	struct rb_node *node;
+
+	ASSERT_INTERVAL_MULTIMAP(imap);
+
+	while ((node = rb_first(&imap->root))) {
+		struct interval_node *inode =
+			container_of(node, struct interval_node, node);
+		itree_remove(inode, &imap->root);
+		if (imap->mmgr)
+			free_interval_node(imap->mmgr, inode);
+	}
+	imap->n_items = 0;
+}
+
+/**
+ * Check the interval multimap is empty or not.
+ *
+ * @return Non-zero if the map is empty, or 0.
+ */
+int interval_multimap_is_empty(const struct interval_multimap *imap)
+{
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	return RB_EMPTY_ROOT(&imap->root);
+}
+
+/**
+ * Get the number of items in the interval multimap.
+ */
+int interval_multimap_n_items(const struct interval_multimap *imap)
+{
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	return imap->n_items;
+}
+
+/**
+ * Search the first item overlapped with [start, start + len).
+ *
+ * @return Non-zero if found, or 0.
+ */
+int interval_multimap_cursor_search(
+	struct interval_multimap_cursor *cursor,
+	struct interval_multimap *imap, u64 start, u64 len)
+{
+	ASSERT(cursor);
+	ASSERT_INTERVAL_MULTIMAP(imap);
+	ASSERT(len > 0);
+
+	cursor->map = imap;
+	cursor->start = start;
+	cursor->last = start + len - 1;
+	cursor->curr = itree_iter_first(
+		&imap->root, cursor->start, cursor->last);
+	return cursor->curr != NULL;
+}
+
+/**
+ * Go to the next overlapped item.
+ *
+ * @return Non-zero if the cursor indicates an item, or 0.
+ */
+int interval_multimap_cursor_next(struct interval_multimap_cursor *cursor)
+{
+	ASSERT(cursor);
+
+	if (!cursor->curr)
+		return 0;
+	cursor->curr = itree_iter_next(
+		cursor->curr, cursor->start, cursor->last);
+	return cursor->curr != NULL;
+}
+
+/**
+ * @return Non-zero if the cursor indicates an item, or 0.
+ */
+int interval_multimap_cursor_is_data(
+	const struct interval_multimap_cursor *cursor)
+{
+	ASSERT(cursor);
+	return cursor->curr != NULL;
+}
+
+/**
+ * Get the start of the interval the cursor indicates.
+ */
+u64 interval_multimap_cursor_start(
+	const struct interval_multimap_cursor *cursor)
+{
+	ASSERT(cursor);
+	ASSERT(cursor->curr);
+	return cursor->curr->start;
+}
+
+/**
+ * Get the length of the interval the cursor indicates.
+ */
+u64 interval_multimap_cursor_len(
+	const struct interval_multimap_cursor *cursor)
+{
+	ASSERT(cursor);
+	ASSERT(cursor->curr);
+	return cursor->curr->last - cursor->curr->start + 1;
+}
+
+/**
+ * Get the value the cursor indicates.
+ *
+ * @return value, or TREEMAP_INVALID_VAL.
+ */
+unsigned long interval_multimap_cursor_val(
+	const struct interval_multimap_cursor *cursor)
+{
+	ASSERT(cursor);
+	if (!cursor->curr)
+		return TREEMAP_INVALID_VAL;
+	return cursor->curr->val;
+}
+
+/**
+ * Delete the item the cursor indicates.
+ * The cursor will indicate the next overlapped item.
+ *
+ * Rotations of the removal keep the in-order sequence,
+ * so the next item found before the removal is still valid.
+ *
+ * RETURN:
+ *   Non-zero when the deletion succeeded, or 0.
+ */
+int interval_multimap_cursor_del(struct interval_multimap_cursor *cursor)
+{
+	struct interval_node *inode, *next;
+
+	ASSERT(cursor);
+
+	inode = cursor->curr;
+	if (!inode)
+		return 0;
+
+	next = itree_iter_next(inode, cursor->start, cursor->last);
+	itree_remove(inode, &cursor->map->root);
+	if (cursor->map->mmgr)
+		free_interval_node(cursor->map->mmgr, inode);
+	cursor->map->n_items--;
+	cursor->curr = next;
+	return 1;
+}
+
 MODULE_LICENSE("Dual BSD/GPL");
@@ -21,6 +21,10 @@
  * Key type is u64.
  * Value type is unsigned long, which can store value of
  * pointer type, unsigned int, unsigned long, or u32.
+ *
+ * interval_multimap is an augmented tree (see <linux/interval_tree_generic.h>)
+ * whose keys are intervals [start, start + len).
+ * Overlap search costs O(log n + k) where k is the number of results.
  */
 
 /**
@@ -64,6 +68,26 @@ struct tree_cell
 	unsigned long val;
 };
 
+/**
+ * Tree node for interval multimap.
+ *
+ * This data structure is created by @interval_multimap_add()
+ * and deleted by @interval_multimap_del() or @interval_multimap_cursor_del().
+ * Do not allocate/deallocate by yourself.
+ *
+ * For an intrusive interval multimap, embed it in your data
+ * and use @interval_multimap_add_node() and @interval_multimap_del_node().
+ * It is never allocated/deallocated by the map.
+ */
+struct interval_node
+{
+	struct rb_node node;
+	u64 start; /* first key of the interval. */
+	u64 last; /* last key of the interval (inclusive). */
+	u64 subtree_last; /* max last in the subtree. */
+	unsigned long val;
+};
+
 /**
  * Memory manager.
  */
@@ -74,10 +98,12 @@ struct treemap_memory_manager
 	mempool_t* node_pool;
 	mempool_t* cell_head_pool;
 	mempool_t* cell_pool;
+	mempool_t* interval_node_pool;
 
 	struct kmem_cache *node_cache;
 	struct kmem_cache *cell_head_cache;
 	struct kmem_cache *cell_cache;
+	struct kmem_cache *interval_node_cache;
 };
 
 /**
@@ -95,6 +121,18 @@ struct multimap
 	struct treemap_memory_manager *mmgr;
 };
 
+/**
+ * Interval multimap data structure.
+ * The same interval can be added several times with different values.
+ * mmgr is NULL for an intrusive one, where the users own the nodes.
+ */
+struct interval_multimap
+{
+	struct rb_root root;
+	struct treemap_memory_manager *mmgr;
+	unsigned int n_items;
+};
+
 /**
  * Map cursor state.
  */
@@ -149,6 +187,22 @@ struct multimap_cursor
 	struct tree_cell *cell;
 };
 
+/**
+ * Interval multimap cursor structure.
+ *
+ * It indicates intervals overlapped with [start, last] in order of start.
+ * Calling interval_multimap_add() or interval_multimap_del()
+ * may invalidate the cursor.
+ * For deletion, use interval_multimap_cursor_del() instead.
+ */
+struct interval_multimap_cursor
+{
+	struct interval_multimap *map;
+	u64 start;
+	u64 last;
+	struct interval_node *curr;
+};
+
 /**
  * Memroy manager helper functions.
  */
@@ -156,7 +210,8 @@ bool initialize_treemap_memory_manager(
 	struct treemap_memory_manager *mmgr, int min_nr,
 	const char *node_cache_name,
 	const char *cell_head_cache_name,
-	const char *cell_cache_name);
+	const char *cell_cache_name,
+	const char *interval_node_cache_name);
 bool initialize_treemap_memory_manager_kmalloc(
 	struct treemap_memory_manager *mmgr, int min_nr);
 void finalize_treemap_memory_manager(struct treemap_memory_manager *mmgr);
@@ -242,6 +297,53 @@ unsigned long multimap_cursor_val(const struct multimap_cursor *cursor);
 u64 multimap_cursor_key(const struct multimap_cursor *cursor);
 int multimap_cursor_del(struct multimap_cursor *cursor);
 
+/**
+ * Prototypes for interval multimap operations.
+ *
+ * key: interval [start, start + len). len must be positive.
+ * val: unsigned long value that can be a pointer.
+ *	Do not use TREEMAP_INVALID_VAL.
+ * Specify NULL as mmgr to create an intrusive one,
+ * which accepts interval_multimap_add_node() only for insertion.
+ */
+struct interval_multimap* interval_multimap_create(
+	gfp_t gfp_mask, struct treemap_memory_manager *mmgr);
+void interval_multimap_init(
+	struct interval_multimap *imap, struct treemap_memory_manager *mmgr);
+void interval_multimap_destroy(struct interval_multimap *imap);
+
+int interval_multimap_add(
+	struct interval_multimap *imap, u64 start, u64 len,
+	unsigned long val, gfp_t gfp_mask);
+unsigned long interval_multimap_del(
+	struct interval_multimap *imap, u64 start, u64 len, unsigned long val);
+void interval_multimap_add_node(
+	struct interval_multimap *imap, struct interval_node *inode,
+	u64 start, u64 len, unsigned long val);
+void interval_multimap_del_node(
+	struct interval_multimap *imap, struct interval_node *inode);
+void interval_multimap_empty(struct interval_multimap *imap);
+
+int interval_multimap_is_empty(const struct interval_multimap *imap);
+int interval_multimap_n_items(const struct interval_multimap *imap);
+
+/**
+ * Prototypes for interval multimap cursor operations.
+ */
+int interval_multimap_cursor_search(
+	struct interval_multimap_cursor *cursor,
+	struct interval_multimap *imap, u64 start, u64 len);
+int interval_multimap_cursor_next(struct interval_multimap_cursor *cursor);
+int interval_multimap_cursor_is_data(
+	const struct interval_multimap_cursor *cursor);
+u64 interval_multimap_cursor_start(
+	const struct interval_multimap_cursor *cursor);
+u64 interval_multimap_cursor_len(
+	const struct interval_multimap_cursor *cursor);
+unsigned long interval_multimap_cursor_val(
+	const struct interval_multimap_cursor *cursor);
+int interval_multimap_cursor_del(struct interval_multimap_cursor *cursor);
+
 /**
  * Assertions.
  */
@@ -251,6 +353,10 @@ int multimap_cursor_del(struct multimap_cursor *cursor);
 #define ASSERT_TREEMAP(tmap)						\
 	ASSERT((tmap) && is_valid_treemap_memory_manager((tmap)->mmgr))
 
+#define ASSERT_INTERVAL_MULTIMAP(imap)					\
+	ASSERT((imap) && (!(imap)->mmgr ||				\
+			is_valid_treemap_memory_manager((imap)->mmgr)))
+
 #define ASSERT_TREENODE(tnode)				\
 	ASSERT((tnode) &&				\
 		(tnode)->val != TREEMAP_INVALID_VAL)
@@ -67,10 +67,26 @@ module_param_named(sync_superblock, sync_superblock_, int, S_IRUGO|S_IWUSR);
  * Set Non-zero if you want to sort data IOs
  * before submitting to the data device.
  * The parameter n_io_bulk will work as sort buffer size.
+ * Set 2 to keep C-SCAN order across consecutive batches.
  */
 unsigned int sort_data_io_ = 1;
 module_param_named(sort_data_io, sort_data_io_, uint, S_IRUGO|S_IWUSR);
 
+/**
+ * Data IOs deferred in C-SCAN order (sort_data_io=2)
+ * are submitted after this period [ms] at most since their arrival.
+ */
+unsigned int cscan_max_age_ms_ = 100;
+module_param_named(cscan_max_age_ms, cscan_max_age_ms_, uint, S_IRUGO|S_IWUSR);
+
+/**
+ * Set non-zero if you want to merge LBA-contiguous data IOs
+ * into a bio before submitting to the data device.
+ * This works well with sort_data_io.
+ */
+unsigned int merge_data_io_ = 1;
+module_param_named(merge_data_io, merge_data_io_, uint, S_IRUGO|S_IWUSR);
+
 /**
  * An executable binary for error notification.
  * When an error ocurred, the exec will be invoked with arguments.
@@ -94,6 +110,41 @@ module_param_named(error_before_overflow, error_before_overflow_, uint, S_IRUGO)
 unsigned int support_discard_ = 1;
 module_param_named(discard, support_discard_, uint, S_IRUGO|S_IWUSR);
 
+/**
+ * Set non-zero if you want the logpack batch size to follow
+ * the submit queue depth and the log device latency.
+ * n_io_bulk and max_logpack_kb of each device work as the upper bounds.
+ */
+unsigned int adaptive_batch_ = 0;
+module_param_named(adaptive_batch, adaptive_batch_, uint, S_IRUGO|S_IWUSR);
+
+/**
+ * Lower bounds of the adaptive logpack batching.
+ */
+unsigned int adaptive_min_io_bulk_ = 16;
+module_param_named(adaptive_min_io_bulk, adaptive_min_io_bulk_, uint, S_IRUGO|S_IWUSR);
+unsigned int adaptive_min_logpack_kb_ = 64;
+module_param_named(adaptive_min_logpack_kb, adaptive_min_logpack_kb_, uint, S_IRUGO|S_IWUSR);
+
+/**
+ * Log IO latency [usec] regarded as slow by the adaptive logpack batching.
+ */
+unsigned int adaptive_target_latency_us_ = 1000;
+module_param_named(adaptive_target_latency_us, adaptive_target_latency_us_, uint, S_IRUGO|S_IWUSR);
+
+/**
+ * Set non-zero to use the blk-mq frontend for walb devices
+ * with a hardware context per cpu instead of the bio-based one.
+ * Each context has blk_mq_queue_depth tags, which can be changed
+ * by the nr_requests queue attribute of the device.
+ * The bio-based one is used if the kernel does not support
+ * BLK_MQ_F_BLOCKING (see WALB_BLK_MQ_F_BLOCKING).
+ */
+static unsigned int blk_mq_ = 0;
+module_param_named(blk_mq, blk_mq_, uint, S_IRUGO);
+static unsigned int blk_mq_queue_depth_ = 128;
+module_param_named(blk_mq_queue_depth, blk_mq_queue_depth_, uint, S_IRUGO);
+
 /*******************************************************************************
  * Shared data definition.
  *******************************************************************************/
@@ -392,11 +443,39 @@ static int walb_prepare_device(
 {
 	struct request_queue *lq, *dq;
 
-	/* Using bio interface */
-	wdev->queue = blk_alloc_queue(GFP_KERNEL);
-	if (!wdev->queue)
-		goto out;
-	blk_queue_make_request(wdev->queue, walb_make_request);
+	if (blk_mq_ && !WALB_BLK_MQ_F_BLOCKING)
+		LOGw("blk-mq frontend is not supported. Use bio-based one.\n");
+
+	if (blk_mq_ && WALB_BLK_MQ_F_BLOCKING) {
+		/* Using blk-mq interface */
+		struct blk_mq_tag_set *set = &wdev->tag_set;
+		wdev->mq_bio_set = bioset_create(BIO_POOL_SIZE, 0);
+		if (!wdev->mq_bio_set)
+			goto out;
+		set->ops = &walb_mq_ops;
+		set->nr_hw_queues = nr_cpu_ids;
+		set->queue_depth = max_t(unsigned int, blk_mq_queue_depth_, 1);
+		set->numa_node = NUMA_NO_NODE;
+		set->cmd_size = walb_mq_cmd_size();
+		/* queue_rq() may sleep in iocore_make_request(). */
+		set->flags = BLK_MQ_F_SHOULD_MERGE | WALB_BLK_MQ_F_BLOCKING;
+		set->driver_data = wdev;
+		if (blk_mq_alloc_tag_set(set)) {
+			set->ops = NULL;
+			goto out_bio_set;
+		}
+		wdev->queue = blk_mq_init_queue(set);
+		if (IS_ERR(wdev->queue)) {
+			wdev->queue = NULL;
+			goto out_tag_set;
+		}
+	} else {
+		/* Using bio interface */
+		wdev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (!wdev->queue)
+			goto out;
+		blk_queue_make_request(wdev->queue, walb_make_request);
+	}
 	wdev->queue->queuedata = wdev;
 
 	/* Queue limits. */
@@ -456,6 +535,17 @@ out_disk:
 out_queue:
 	if (wdev->queue) {
 		blk_cleanup_queue(wdev->queue);
+		wdev->queue = NULL;
+	}
+out_tag_set:
+	if (wdev->tag_set.ops) {
+		blk_mq_free_tag_set(&wdev->tag_set);
+		wdev->tag_set.ops = NULL;
+	}
+out_bio_set:
+	if (wdev->mq_bio_set) {
+		bioset_free(wdev->mq_bio_set);
+		wdev->mq_bio_set = NULL;
 	}
 out:
 	return -1;
@@ -474,6 +564,14 @@ static void walb_finalize_device(struct walb_dev *wdev)
 		blk_cleanup_queue(wdev->queue);
 		wdev->queue = NULL;
 	}
+	if (wdev->tag_set.ops) {
+		blk_mq_free_tag_set(&wdev->tag_set);
+		wdev->tag_set.ops = NULL;
+	}
+	if (wdev->mq_bio_set) {
+		bioset_free(wdev->mq_bio_set);
+		wdev->mq_bio_set = NULL;
+	}
 }
 
 /**
@@ -776,6 +874,7 @@ struct walb_dev* prepare_wdev(
 	struct request_queue *lq, *dq;
 	bool retb;
 	u64 latest_lsid, oldest_lsid;
+	struct lsid_set lsids;
 #ifdef WALB_DEBUG
 	u64 completed_lsid, flush_lsid, written_lsid, prev_written_lsid;
 #endif
@@ -791,7 +890,7 @@ struct walb_dev* prepare_wdev(
 		LOGe("kmalloc failed.\n");
 		goto out;
 	}
-	spin_lock_init(&wdev->lsid_lock);
+	seqlock_init(&wdev->lsid_lock);
 	spin_lock_init(&wdev->lsuper0_lock);
 	spin_lock_init(&wdev->size_lock);
 	wdev->flags = 0;
@@ -849,7 +948,7 @@ struct walb_dev* prepare_wdev(
 	init_checkpointing(&wdev->cpd);
 
 	/* Set lsids. */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.oldest = super->oldest_lsid;
 	wdev->lsids.prev_written = super->written_lsid;
 	wdev->lsids.written = super->written_lsid;
@@ -857,11 +956,12 @@ struct walb_dev* prepare_wdev(
 	wdev->lsids.flush = super->written_lsid;
 	wdev->lsids.completed = super->written_lsid;
 	wdev->lsids.latest = super->written_lsid;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	wdev->ring_buffer_size = super->ring_buffer_size;
 	wdev->ring_buffer_off = get_ring_buffer_offset_2(super);
 	wdev->log_checksum_salt = super->log_checksum_salt;
+	wdev->is_log_packed = (super->version == WALB_LOG_VERSION_PACKED);
 	wdev->size = super->device_size;
 	if (wdev->size > wdev->ddev_size) {
 		LOGe("device size > underlying data device size.\n");
@@ -960,16 +1060,15 @@ struct walb_dev* prepare_wdev(
 		LOGe("Redo failed.\n");
 		goto out_iocore_init;
 	}
-	spin_lock(&wdev->lsid_lock);
-	latest_lsid = wdev->lsids.latest;
-	oldest_lsid = wdev->lsids.oldest;
+	get_lsid_set(wdev, &lsids);
+	latest_lsid = lsids.latest;
+	oldest_lsid = lsids.oldest;
 #ifdef WALB_DEBUG
-	completed_lsid = wdev->lsids.completed;
-	written_lsid = wdev->lsids.written;
-	prev_written_lsid = wdev->lsids.prev_written;
-	flush_lsid = wdev->lsids.flush;
+	completed_lsid = lsids.completed;
+	written_lsid = lsids.written;
+	prev_written_lsid = lsids.prev_written;
+	flush_lsid = lsids.flush;
 #endif
-	spin_unlock(&wdev->lsid_lock);
 #ifdef WALB_DEBUG
 	ASSERT(prev_written_lsid == latest_lsid);
 	ASSERT(prev_written_lsid == completed_lsid);
@@ -107,16 +107,16 @@ static int ioctl_wdev_get_oldest_lsid(struct walb_dev *wdev, struct walb_ctl *ct
 static int ioctl_wdev_set_oldest_lsid(struct walb_dev *wdev, struct walb_ctl *ctl)
 {
 	u64 lsid, oldest_lsid, prev_written_lsid, permanent_lsid;
+	struct lsid_set lsids;
 
 	LOG_("WALB_IOCTL_SET_OLDEST_LSID_SET\n");
 
 	lsid = ctl->val_u64;
 
-	spin_lock(&wdev->lsid_lock);
-	prev_written_lsid = wdev->lsids.prev_written;
-	permanent_lsid = wdev->lsids.permanent;
-	oldest_lsid = wdev->lsids.oldest;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
+	prev_written_lsid = lsids.prev_written;
+	permanent_lsid = lsids.permanent;
+	oldest_lsid = lsids.oldest;
 
 	if (lsid < oldest_lsid || prev_written_lsid < lsid) {
 		WLOGe(wdev, "lsid %" PRIu64 " is not valid.\n"
@@ -133,9 +133,9 @@ static int ioctl_wdev_set_oldest_lsid(struct walb_dev *wdev, struct walb_ctl *ct
 		}
 	}
 
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.oldest = lsid;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	if (!walb_sync_super_block(wdev))
 		return -EFAULT;
@@ -431,7 +431,7 @@ static int ioctl_wdev_clear_log(struct walb_dev *wdev, struct walb_ctl *ctl)
 	backup_lsid_set(wdev, &lsids);
 
 	/* Initialize lsid(s). */
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids.latest = 0;
 	wdev->lsids.flush = 0;
 	wdev->lsids.completed = 0;
@@ -439,7 +439,7 @@ static int ioctl_wdev_clear_log(struct walb_dev *wdev, struct walb_ctl *ctl)
 	wdev->lsids.written = 0;
 	wdev->lsids.prev_written = 0;
 	wdev->lsids.oldest = 0;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 
 	/* Grow the walblog device. */
 	if (old_ldev_size < new_ldev_size) {
@@ -24,40 +24,64 @@
  */
 int walb_check_lsid_valid(struct walb_dev *wdev, u64 lsid)
 {
-	struct sector_data *sect;
+	struct sector_data *sect, *hsect;
 	struct walb_logpack_header *logh;
+	const unsigned int pbs = wdev->physical_bs;
+	unsigned int i, n_pb;
 	u64 off;
 
 	ASSERT(wdev);
 
-	sect = sector_alloc(wdev->physical_bs, GFP_NOIO);
+	sect = sector_alloc(pbs, GFP_NOIO);
 	if (!sect) {
 		WLOGe(wdev, "alloc sector failed.\n");
 		goto error0;
 	}
 	ASSERT(is_same_size_sector(sect, wdev->lsuper0));
-	logh = get_logpack_header(sect);
+	hsect = sector_alloc(max_logpack_header_size(pbs), GFP_NOIO);
+	if (!hsect) {
+		WLOGe(wdev, "alloc sector failed.\n");
+		goto error1;
+	}
+	sector_zeroclear(hsect);
+	logh = get_logpack_header(hsect);
 
 	spin_lock(&wdev->lsuper0_lock);
 	off = get_offset_of_lsid_2(get_super_sector(wdev->lsuper0), lsid);
 	spin_unlock(&wdev->lsuper0_lock);
-	if (!sector_io(READ, wdev->ldev, off, sect)) {
-		WLOGe(wdev, "read sector failed.\n");
-		goto error1;
+
+	/* A logpack header never crosses the ring buffer end. */
+	n_pb = 1;
+	for (i = 0; i < n_pb; i++) {
+		if (!sector_io(READ, wdev->ldev, off + i, sect)) {
+			WLOGe(wdev, "read sector failed.\n");
+			goto error2;
+		}
+		memcpy((u8 *)hsect->data + i * pbs, sect->data, pbs);
+		if (i == 0) {
+			if (!is_valid_logpack_header(logh))
+				goto error2;
+			n_pb = get_logpack_header_pb(logh);
+			if (n_pb > max_n_logpack_header_pb(pbs))
+				goto error2;
+		}
 	}
 
 	/* Check valid logpack header. */
 	if (!is_valid_logpack_header_with_checksum(
-			logh, wdev->physical_bs, wdev->log_checksum_salt))
-		goto error1;
+			logh, pbs, wdev->log_checksum_salt))
+		goto error2;
 
 	/* Check lsid. */
 	if (logh->logpack_lsid != lsid)
-		goto error1;
+		goto error2;
 
+	sector_free(hsect);
 	sector_free(sect);
 	return 1;
 
+error2:
+	sector_free(hsect);
 error1:
 	sector_free(sect);
 error0:
@@ -71,15 +95,12 @@ error0:
  */
 u64 get_oldest_lsid(struct walb_dev *wdev)
 {
-	u64 ret;
+	struct lsid_set lsids;
 
 	ASSERT(wdev);
 
-	spin_lock(&wdev->lsid_lock);
-	ret = wdev->lsids.oldest;
-	spin_unlock(&wdev->lsid_lock);
-
-	return ret;
+	get_lsid_set(wdev, &lsids);
+	return lsids.oldest;
 }
 
 /**
@@ -89,15 +110,12 @@ u64 get_oldest_lsid(struct walb_dev *wdev)
  */
 u64 get_written_lsid(struct walb_dev *wdev)
 {
-	u64 ret;
+	struct lsid_set lsids;
 
 	ASSERT(wdev);
 
-	spin_lock(&wdev->lsid_lock);
-	ret = wdev->lsids.written;
-	spin_unlock(&wdev->lsid_lock);
-
-	return ret;
+	get_lsid_set(wdev, &lsids);
+	return lsids.written;
 }
 
 /**
@@ -107,15 +125,12 @@ u64 get_written_lsid(struct walb_dev *wdev)
  */
 u64 get_permanent_lsid(struct walb_dev *wdev)
 {
-	u64 ret;
+	struct lsid_set lsids;
 
 	ASSERT(wdev);
 
-	spin_lock(&wdev->lsid_lock);
-	ret = wdev->lsids.permanent;
-	spin_unlock(&wdev->lsid_lock);
-
-	return ret;
+	get_lsid_set(wdev, &lsids);
+	return lsids.permanent;
 }
 
 /**
@@ -126,11 +141,10 @@ u64 get_permanent_lsid(struct walb_dev *wdev)
  */
 u64 get_completed_lsid(struct walb_dev *wdev)
 {
-	u64 ret;
-	spin_lock(&wdev->lsid_lock);
-	ret = wdev->lsids.completed;
-	spin_unlock(&wdev->lsid_lock);
-	return ret;
+	struct lsid_set lsids;
+
+	get_lsid_set(wdev, &lsids);
+	return lsids.completed;
 }
 
 /**
@@ -247,10 +261,29 @@ void walb_discard_support(struct walb_dev *wdev, bool support)
 	wdev->support_discard = support;
 }
 
+/**
+ * Support write same.
+ *
+ * REQ_WRITE_SAME is supported only if the data device supports it
+ * and the log format can store its payload (WALB_LOG_VERSION_PACKED).
+ * Write same IOs of zero payload are logged as zero records.
+ */
 void walb_write_same_support(struct walb_dev *wdev)
 {
-	WLOGi(wdev, "Do not supports REQ_WRITE_SAME.\n");
-	blk_queue_max_write_same_sectors(wdev->queue, 0);
+	const unsigned int ddev_sectors = bdev_write_same(wdev->ddev);
+
+	if (wdev->is_log_packed && ddev_sectors > 0) {
+		WLOGi(wdev, "Supports REQ_WRITE_SAME.\n");
+		blk_queue_max_write_same_sectors(
+			wdev->queue,
+			min_t(unsigned int, ddev_sectors,
+				WALB_MAX_NORMAL_IO_SECTORS));
+		wdev->support_write_same = true;
+	} else {
+		WLOGi(wdev, "Do not supports REQ_WRITE_SAME.\n");
+		blk_queue_max_write_same_sectors(wdev->queue, 0);
+		wdev->support_write_same = false;
+	}
 	WLOGd(wdev, "max_write_same_sectors: %u\n"
 		, wdev->queue->limits.max_write_same_sectors);
 }
@@ -335,9 +368,7 @@ bool invalidate_lsid(struct walb_dev *wdev, u64 lsid)
  */
 void backup_lsid_set(struct walb_dev *wdev, struct lsid_set *lsids)
 {
-	spin_lock(&wdev->lsid_lock);
-	*lsids = wdev->lsids;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, lsids);
 }
 
 /**
@@ -345,9 +376,9 @@ void backup_lsid_set(struct walb_dev *wdev, struct lsid_set *lsids)
  */
 void restore_lsid_set(struct walb_dev *wdev, const struct lsid_set *lsids)
 {
-	spin_lock(&wdev->lsid_lock);
+	write_seqlock(&wdev->lsid_lock);
 	wdev->lsids = *lsids;
-	spin_unlock(&wdev->lsid_lock);
+	write_sequnlock(&wdev->lsid_lock);
 }
 
 /**
@@ -607,11 +638,11 @@ void print_queue_limits(
 u64 walb_get_log_usage(struct walb_dev *wdev)
 {
 	u64 latest_lsid, oldest_lsid;
+	struct lsid_set lsids;
 
-	spin_lock(&wdev->lsid_lock);
-	latest_lsid = wdev->lsids.latest;
-	oldest_lsid = wdev->lsids.oldest;
-	spin_unlock(&wdev->lsid_lock);
+	get_lsid_set(wdev, &lsids);
+	latest_lsid = lsids.latest;
+	oldest_lsid = lsids.oldest;
 
 	ASSERT(latest_lsid >= oldest_lsid);
 	return latest_lsid - oldest_lsid;
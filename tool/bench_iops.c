@@ -0,0 +1,133 @@
+/**
+ * Measure random write IOPS of a block device.
+ *
+ * Each thread issues one O_DIRECT write at a time,
+ * so the number of threads is the queue depth.
+ *
+ * @license 3-clause BSD, GPL version 2 or later.
+ */
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "random.h"
+#include "util.h"
+
+struct bench_thread
+{
+	pthread_t th;
+	int fd;
+	unsigned int block_size;
+	u64 n_blocks;
+	double end_time;
+	unsigned int seed;
+	u64 n_io;
+	int error;
+};
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static void* run_bench_thread(void *data)
+{
+	struct bench_thread *bth = data;
+	u8 *buf;
+
+	if (posix_memalign((void **)&buf, 4096, bth->block_size) != 0) {
+		bth->error = 1;
+		return NULL;
+	}
+	memset(buf, 0xa5, bth->block_size);
+
+	while (get_time() < bth->end_time) {
+		const u64 blk = (u64)rand_r(&bth->seed) % bth->n_blocks;
+		const off_t off = (off_t)(blk * bth->block_size);
+
+		if (pwrite(bth->fd, buf, bth->block_size, off)
+			!= (ssize_t)bth->block_size) {
+			bth->error = 1;
+			break;
+		}
+		bth->n_io++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * USAGE:
+ *   bench_iops BLOCK_DEVICE_PATH QUEUE_DEPTH SECONDS [BLOCK_SIZE]
+ */
+int main(int argc, char* argv[])
+{
+	int fd, qd, sec, i;
+	unsigned int bs = 4096;
+	u64 n_io = 0;
+	struct bdev_info info;
+	double begin, end;
+	struct bench_thread *bth;
+	int error = 0;
+
+	if (argc != 4 && argc != 5) {
+		printf("usage: bench_iops [walb device] [queue depth] [seconds] [block size]\n");
+		exit(1);
+	}
+	qd = atoi(argv[2]);
+	sec = atoi(argv[3]);
+	if (argc == 5)
+		bs = atoi(argv[4]);
+	if (qd <= 0 || sec <= 0 || bs == 0 || bs % 512 != 0) {
+		printf("invalid argument.\n");
+		exit(1);
+	}
+
+	if (!open_bdev_and_get_info(argv[1], &info, &fd, O_RDWR | O_DIRECT)) {
+		printf("open error\n");
+		exit(1);
+	}
+	if (info.size < bs || bs % info.lbs != 0) {
+		printf("invalid block size.\n");
+		exit(1);
+	}
+
+	bth = calloc(qd, sizeof(struct bench_thread));
+	if (!bth) {
+		printf("malloc error\n");
+		exit(1);
+	}
+
+	init_random();
+	begin = get_time();
+	for (i = 0; i < qd; i++) {
+		bth[i].fd = fd;
+		bth[i].block_size = bs;
+		bth[i].n_blocks = info.size / bs;
+		bth[i].end_time = begin + sec;
+		bth[i].seed = rand() + i;
+		if (pthread_create(&bth[i].th, NULL, run_bench_thread, &bth[i])) {
+			perror("pthread_create failed.");
+			exit(1);
+		}
+	}
+	for (i = 0; i < qd; i++) {
+		pthread_join(bth[i].th, NULL);
+		n_io += bth[i].n_io;
+		error |= bth[i].error;
+	}
+	end = get_time();
+
+	printf("qd %d bs %u n_io %" PRIu64 " iops %.0f%s\n"
+		, qd, bs, n_io, (double)n_io / (end - begin)
+		, error ? " (IO error)" : "");
+
+	free(bth);
+	if (close(fd)) {
+		perror("close failed.");
+	}
+	return error;
+}
@@ -28,7 +28,7 @@
  * @super_sectp super sector.
  * @lsid logpack lsid to read.
  * @logh_sect buffer to store logpack header data.
- *   This allocated size must be sector size.
+ *   This allocated size must be max_logpack_header_size(pbs).
  * @salt log checksum salt.
  *
  * RETURN:
@@ -39,13 +39,17 @@ bool read_logpack_header_from_wldev(
 	u64 lsid, u32 salt, struct sector_data *logh_sect)
 {
 	/* calc offset in the ring buffer */
+	const unsigned int pbs = super_sectp->physical_bs;
 	u64 ring_buffer_offset = get_ring_buffer_offset_2(super_sectp);
 	u64 ring_buffer_size = super_sectp->ring_buffer_size;
 	u64 off = ring_buffer_offset + lsid % ring_buffer_size;
 	struct walb_logpack_header *logh = get_logpack_header(logh_sect);
+	unsigned int n_pb;
 
-	/* read sector */
-	if (!sector_read(fd, off, logh_sect)) {
+	ASSERT(logh_sect->size == max_logpack_header_size(pbs));
+
+	/* read the first sector */
+	if (!read_sector_raw(fd, (u8 *)logh, pbs, off)) {
 		LOGe("read logpack header (lsid %"PRIu64") failed.\n", lsid);
 		return false;
 	}
@@ -56,8 +60,21 @@ bool read_logpack_header_from_wldev(
 			lsid, logh->logpack_lsid);
 		return false;
 	}
-	if (!is_valid_logpack_header_with_checksum(
-			logh, super_sectp->physical_bs, salt)) {
+
+	/* read the rest sectors.
+	   A logpack header never crosses the ring buffer end. */
+	n_pb = get_logpack_header_pb(logh);
+	if (n_pb > max_n_logpack_header_pb(pbs)) {
+		LOGe("logpack header size %u is invalid.\n", n_pb);
+		return false;
+	}
+	if (n_pb > 1 && !read_sectors_raw(
+			fd, (u8 *)logh + pbs, pbs, off + 1, n_pb - 1)) {
+		LOGe("read logpack header (lsid %"PRIu64") failed.\n", lsid);
+		return false;
+	}
+
+	if (!is_valid_logpack_header_with_checksum(logh, pbs, salt)) {
 		LOGe("check logpack header failed.\n");
 		return false;
 	}
@@ -75,32 +92,42 @@ void print_logpack_header(const struct walb_logpack_header* logh)
 	int i;
 	printf("*****logpack header*****\n"
 		"checksum: %08x\n"
+		"n_header_pb: %u\n"
 		"n_records: %u\n"
 		"n_padding: %u\n"
 		"total_io_size: %u\n"
 		"logpack_lsid: %"PRIu64"\n",
 		logh->checksum,
+		get_logpack_header_pb(logh),
 		logh->n_records,
 		logh->n_padding,
 		logh->total_io_size,
 		logh->logpack_lsid);
 	for (i = 0; i < logh->n_records; i++) {
+		const u32 flags = logh->record[i].flags;
+
 		printf("record %d\n"
 			"  checksum: %08x\n"
 			"  lsid: %"PRIu64"\n"
 			"  lsid_local: %u\n"
+			"  sub_offset: %u\n"
 			"  is_exist: %u\n"
 			"  is_padding: %u\n"
 			"  is_discard: %u\n"
+			"  is_zero: %u\n"
+			"  is_write_same: %u\n"
 			"  offset: %"PRIu64"\n"
 			"  io_size: %u\n",
 			i,
 			logh->record[i].checksum,
 			logh->record[i].lsid,
 			logh->record[i].lsid_local,
-			test_bit_u32(LOG_RECORD_EXIST, &logh->record[i].flags),
-			test_bit_u32(LOG_RECORD_PADDING, &logh->record[i].flags),
-			test_bit_u32(LOG_RECORD_DISCARD, &logh->record[i].flags),
+			logh->record[i].sub_offset,
+			test_bit_u32(LOG_RECORD_EXIST, &flags),
+			test_bit_u32(LOG_RECORD_PADDING, &flags),
+			test_bit_u32(LOG_RECORD_DISCARD, &flags),
+			test_bit_u32(LOG_RECORD_ZERO, &flags),
+			test_bit_u32(LOG_RECORD_WRITE_SAME, &flags),
 			logh->record[i].offset,
 			logh->record[i].io_size);
 		printf("logpack lsid: %"PRIu64"\n",
@@ -122,7 +149,7 @@ bool write_logpack_header(
 	int fd, unsigned int pbs,
 	const struct walb_logpack_header* logh)
 {
-	return write_data(fd, (const u8 *)logh, pbs);
+	return write_data(fd, (const u8 *)logh, pbs * get_logpack_header_pb(logh));
 }
 
 /**
@@ -147,8 +174,9 @@ unsigned int read_logpack_data_from_wldev(
 {
 	const int lbs = super->logical_bs;
 	const int pbs = super->physical_bs;
+	const unsigned int header_pb = get_logpack_header_pb(logh);
 	int i;
-	int total_pb;
+	unsigned int total_pb;
 
 	ASSERT(lbs == LOGICAL_BLOCK_SIZE);
 	ASSERT_PBS(pbs);
@@ -160,39 +188,49 @@ unsigned int read_logpack_data_from_wldev(
 
 	total_pb = 0;
 	for (i = 0; i < logh->n_records; i++) {
+		const struct walb_log_record *rec = &logh->record[i];
 		u64 log_off;
 		u32 log_lb, log_pb;
 
-		if (test_bit_u32(LOG_RECORD_DISCARD, &logh->record[i].flags)) {
+		if (!log_record_has_data(rec)) {
 			continue;
 		}
-		log_lb = logh->record[i].io_size;
-		log_pb = capacity_pb(pbs, log_lb);
-		log_off = get_offset_of_lsid_2
-			(super, logh->record[i].lsid);
+		log_lb = log_record_data_lb(rec);
+		log_pb = log_record_n_pb(rec, pbs);
+		/* A packed record shares the physical block
+		   already read for the previous record. */
+		if ((unsigned int)rec->lsid_local - header_pb
+			+ (rec->sub_offset > 0 ? 1 : 0)
+			!= total_pb) {
+			LOGe("log record %d position is invalid.\n", i);
+			return i;
+		}
+		log_off = get_offset_of_lsid_2(super, rec->lsid)
+			+ (rec->sub_offset > 0 ? 1 : 0);
 		LOGd_("lsid: %"PRIu64" log_off: %"PRIu64"\n",
-			logh->record[i].lsid,
+			rec->lsid,
 			log_off);
 
 		/* Read data for the log record. */
-		if (!sector_array_pread(
+		if (log_pb > 0 && !sector_array_pread(
 				fd, log_off, sect_ary,
 				total_pb, log_pb)) {
 			LOGe("read sectors failed.\n");
 			return i;
 		}
 
-		if (test_bit_u32(LOG_RECORD_PADDING, &logh->record[i].flags)) {
+		if (test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
 			total_pb += log_pb;
 			continue;
 		}
 		/* Confirm checksum */
 		u32 csum = sector_array_checksum(
-			sect_ary, total_pb * pbs,
+			sect_ary,
+			(rec->lsid_local - header_pb) * pbs + rec->sub_offset * lbs,
 			log_lb * lbs, salt);
-		if (csum != logh->record[i].checksum) {
+		if (csum != rec->checksum) {
 			LOGe("log header checksum is invalid. %08x %08x\n",
-				csum, logh->record[i].checksum);
+				csum, rec->checksum);
 			return i;
 		}
 		total_pb += log_pb;
@@ -207,7 +245,8 @@ unsigned int read_logpack_data_from_wldev(
  * @fd file descriptor (opened, seeked)
  * @pbs physical block size [byte].
  * @salt checksum salt.
- * @logpack logpack to be filled. (allocated size must be physical_bs).
+ * @logpack logpack to be filled.
+ *   (allocated size must be max_logpack_header_size(pbs)).
  *
  * RETURN:
  *   true in success, or false.
@@ -216,10 +255,24 @@ bool read_logpack_header(
 	int fd, unsigned int pbs, u32 salt,
 	struct walb_logpack_header* logh)
 {
-	/* Read */
+	unsigned int n_pb;
+
+	/* Read the first block. */
 	if (!read_data(fd, (u8 *)logh, pbs)) {
 		return false;
 	}
+	if (!is_valid_logpack_header(logh)) {
+		return false;
+	}
+
+	/* Read the rest blocks. */
+	n_pb = get_logpack_header_pb(logh);
+	if (n_pb > max_n_logpack_header_pb(pbs)) {
+		return false;
+	}
+	if (n_pb > 1 && !read_data(fd, (u8 *)logh + pbs, (n_pb - 1) * pbs)) {
+		return false;
+	}
 
 	/* Check */
 	if (!is_valid_logpack_header_with_checksum(logh, pbs, salt)) {
@@ -268,14 +321,18 @@ bool read_logpack_data(
 		u32 csum;
 		const struct walb_log_record *rec = &logh->record[i];
 
-		if (test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
+		if (!log_record_has_data(rec)) {
 			continue;
 		}
-		idx_pb = rec->lsid_local - 1;
-		log_lb = rec->io_size;
-		log_pb = capacity_pb(pbs, log_lb);
-		/* Read data of the log record. */
-		if (!sector_array_read(fd, sect_ary, idx_pb, log_pb)) {
+		idx_pb = rec->lsid_local - get_logpack_header_pb(logh);
+		log_lb = log_record_data_lb(rec);
+		log_pb = log_record_n_pb(rec, pbs);
+		/* Read data of the log record.
+		   A packed record shares the physical block
+		   already read for the previous record. */
+		if (log_pb > 0 && !sector_array_read(
+				fd, sect_ary,
+				idx_pb + (rec->sub_offset > 0 ? 1 : 0), log_pb)) {
 			LOGe("read log data failed.\n");
 			return false;
 		}
@@ -287,7 +344,7 @@ bool read_logpack_data(
 		/* Confirm checksum. */
 		csum = sector_array_checksum(
 			sect_ary,
-			idx_pb * pbs,
+			idx_pb * pbs + rec->sub_offset * LOGICAL_BLOCK_SIZE,
 			log_lb * LOGICAL_BLOCK_SIZE, salt);
 		if (csum != rec->checksum) {
 			LOGe("log record[%d] checksum is invalid. %08x %08x\n",
@@ -326,19 +383,44 @@ bool redo_logpack(
 		unsigned int idx_lb, n_lb;
 		u64 off_lb;
 		const struct walb_log_record *rec = &logh->record[i];
+		const u32 flags = rec->flags;
 
-		if (test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
+		if (test_bit_u32(LOG_RECORD_PADDING, &flags)) {
 			continue;
 		}
 		off_lb = rec->offset;
-		idx_lb = addr_lb(sect_ary->sector_size, rec->lsid_local - 1);
+		idx_lb = addr_lb(sect_ary->sector_size,
+				rec->lsid_local - get_logpack_header_pb(logh))
+			+ rec->sub_offset;
 		n_lb = rec->io_size;
-		if (test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
+		if (test_bit_u32(LOG_RECORD_DISCARD, &flags)) {
 			/* If the data device supports discard request,
 			   you must issue discard requests. */
 			/* now editing */
 			continue;
 		}
+		if (test_bit_u32(LOG_RECORD_ZERO, &flags)) {
+			/* Zero records have no data in the log. */
+			if (!write_zero_lb(fd, off_lb, n_lb)) {
+				LOGe("write zero sectors failed.\n");
+				return false;
+			}
+			continue;
+		}
+		if (test_bit_u32(LOG_RECORD_WRITE_SAME, &flags)) {
+			/* The payload is repeated over the record range. */
+			const unsigned int pbs = sect_ary->sector_size;
+			const struct sector_data *sect =
+				get_sector_data_in_array_const(
+					sect_ary, addr_pb(pbs, idx_lb));
+			const u8 *payload = (const u8 *)sect->data
+				+ off_in_pb(pbs, idx_lb) * LOGICAL_BLOCK_SIZE;
+			if (!write_same_lb(fd, off_lb, n_lb, payload)) {
+				LOGe("write same sectors failed.\n");
+				return false;
+			}
+			continue;
+		}
 		if (!sector_array_pwrite_lb(fd, off_lb, sect_ary, idx_lb, n_lb)) {
 			LOGe("write sectors failed.\n");
 			return false;
@@ -434,9 +516,7 @@ void shrink_logpack_header(
 	logh->total_io_size = 0;
 	for (i = 0; i < invalid_idx; i++) {
 		const struct walb_log_record *rec = &logh->record[i];
-		if (!test_bit_u32(LOG_RECORD_DISCARD, &rec->flags)) {
-			logh->total_io_size += capacity_pb(pbs, rec->io_size);
-		}
+		logh->total_io_size += log_record_n_pb(rec, pbs);
 		if (test_bit_u32(LOG_RECORD_PADDING, &rec->flags)) {
 			logh->n_padding++;
 		}
@@ -444,7 +524,8 @@ void shrink_logpack_header(
 
 	/* Calculate checksum. */
 	logh->checksum = 0;
-	logh->checksum = checksum((const u8 *)logh, pbs, salt);
+	logh->checksum = checksum(
+		(const u8 *)logh, pbs * get_logpack_header_pb(logh), salt);
 	ASSERT(is_valid_logpack_header_with_checksum(logh, pbs, salt));
 }
 
@@ -495,7 +576,7 @@ struct logpack *alloc_logpack(
 	memset(pack, 0, sizeof(*pack));
 
 	/* Buffer for logpack header. */
-	pack->sectd = sector_alloc(pbs);
+	pack->sectd = sector_alloc(max_logpack_header_size(pbs));
 	if (!pack->sectd) { goto error1; }
 	pack->header = get_logpack_header(pack->sectd);
 
@@ -80,6 +80,132 @@ static void make_sorted_random_array_index(
 	}
 }
 
+struct checksum_impl
+{
+	const char *name;
+	checksum_partial_fn_t fn;
+};
+
+static const struct checksum_impl checksum_impls_[] = {
+	{ "generic", checksum_partial_generic },
+	{ "u64", checksum_partial_u64 },
+#ifdef WALB_CHECKSUM_X86_SIMD
+	{ "sse2", checksum_partial_sse2 },
+	{ "avx2", checksum_partial_avx2 },
+#endif
+	{ "selected", checksum_partial },
+};
+
+#define N_CHECKSUM_IMPLS (sizeof(checksum_impls_) / sizeof(checksum_impls_[0]))
+
+static int is_impl_supported(const struct checksum_impl *impl)
+{
+#ifdef WALB_CHECKSUM_X86_SIMD
+	__builtin_cpu_init();
+	if (impl->fn == checksum_partial_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (impl->fn == checksum_partial_sse2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
+
+/**
+ * All implementations must return the same value
+ * for any offset and size.
+ */
+static void test_checksum_impls(const u8 *buf, size_t size, u32 salt)
+{
+	size_t off, len, i;
+
+	for (off = 0; off < 64; off += sizeof(u32)) {
+		for (len = 0; len < 1024 && off + len <= size; len += sizeof(u32)) {
+			u32 csum0 = checksum_partial_generic(salt, buf + off, len);
+			for (i = 0; i < N_CHECKSUM_IMPLS; i++) {
+				if (!is_impl_supported(&checksum_impls_[i]))
+					continue;
+				if (checksum_impls_[i].fn(salt, buf + off, len) != csum0) {
+					printf("%s: mismatch (off %zu len %zu)\n",
+						checksum_impls_[i].name, off, len);
+					exit(1);
+				}
+			}
+		}
+	}
+	for (i = 0; i < N_CHECKSUM_IMPLS; i++) {
+		if (!is_impl_supported(&checksum_impls_[i]))
+			continue;
+		if (checksum_impls_[i].fn(salt, buf, size)
+			!= checksum_partial_generic(salt, buf, size)) {
+			printf("%s: mismatch (size %zu)\n",
+				checksum_impls_[i].name, size);
+			exit(1);
+		}
+	}
+	printf("all checksum implementations are equivalent.\n");
+}
+
+/**
+ * checksum_copy_partial() must copy the data
+ * and return the same value as checksum_partial().
+ */
+static void test_checksum_copy(const u8 *buf, size_t size, u32 salt)
+{
+	size_t off, len;
+	u8 *dst = alloc_buf(size);
+
+	for (off = 0; off < 64; off += sizeof(u32)) {
+		for (len = 0; len < 1024 && off + len <= size; len += sizeof(u32)) {
+			memset(dst, 0, len + sizeof(u32));
+			if (checksum_copy_partial(salt, dst, buf + off, len)
+				!= checksum_partial_generic(salt, buf + off, len)) {
+				printf("copy: checksum mismatch (off %zu len %zu)\n", off, len);
+				exit(1);
+			}
+			if (memcmp(dst, buf + off, len) != 0 ||
+				*(u32 *)(dst + len) != 0) {
+				printf("copy: data mismatch (off %zu len %zu)\n", off, len);
+				exit(1);
+			}
+		}
+	}
+	if (checksum_copy_partial(salt, dst, buf, size)
+		!= checksum_partial_generic(salt, buf, size) ||
+		memcmp(dst, buf, size) != 0) {
+		printf("copy: mismatch (size %zu)\n", size);
+		exit(1);
+	}
+	free_buf(dst);
+	printf("checksum_copy_partial is equivalent.\n");
+}
+
+/**
+ * Microbenchmark of each implementation.
+ */
+static void bench_checksum_impls(const u8 *buf, size_t size, u32 salt)
+{
+	const size_t n_loop = 64;
+	size_t i, j;
+	struct timeval tv;
+	double t0, t1;
+
+	for (i = 0; i < N_CHECKSUM_IMPLS; i++) {
+		const struct checksum_impl *impl = &checksum_impls_[i];
+		u32 csum = salt;
+
+		if (!is_impl_supported(impl)) {
+			printf("%-8s: not supported.\n", impl->name);
+			continue;
+		}
+		gettimeofday(&tv, 0); t0 = time_double(&tv);
+		for (j = 0; j < n_loop; j++)
+			csum = impl->fn(csum, buf, size);
+		gettimeofday(&tv, 0); t1 = time_double(&tv);
+		printf("%-8s: %08x %.3f MB/s\n", impl->name, csum,
+			(double)(size * n_loop) / (t1 - t0) / 1000000.0);
+	}
+}
+
 #define MID_SIZE 16
 
 int main()
@@ -138,6 +264,10 @@ int main()
 	ASSERT(csum1 == csum2);
 	ASSERT(csum1 == csum3);
 
+	test_checksum_impls(buf, size, salt);
+	test_checksum_copy(buf, size, salt);
+	bench_checksum_impls(buf, size, salt);
+
 #if 0
 	printf("copying...\n");
 	u8 *buf2 = alloc_buf(size);
@@ -33,9 +33,95 @@ void TEST_capacity_pb()
 	ASSERT(capacity_pb(4096, 25) == 4);
 }
 
+/**
+ * TEST of log_record_n_pb().
+ */
+void TEST_log_record_n_pb()
+{
+	struct walb_log_record rec;
+
+	log_record_init(&rec);
+	set_bit_u32(LOG_RECORD_EXIST, &rec.flags);
+
+	rec.io_size = 1;
+	ASSERT(log_record_n_pb(&rec, 512) == 1);
+	ASSERT(log_record_n_pb(&rec, 4096) == 1);
+	rec.io_size = 9;
+	ASSERT(log_record_n_pb(&rec, 4096) == 2);
+
+	/* Packed records share the first physical block. */
+	rec.sub_offset = 1;
+	rec.io_size = 7;
+	ASSERT(log_record_n_pb(&rec, 4096) == 0);
+	rec.sub_offset = 7;
+	rec.io_size = 2;
+	ASSERT(log_record_n_pb(&rec, 4096) == 1);
+
+	/* Discard records have no data. */
+	rec.sub_offset = 0;
+	set_bit_u32(LOG_RECORD_DISCARD, &rec.flags);
+	ASSERT(log_record_n_pb(&rec, 4096) == 0);
+
+	/* Zero records have no data also. */
+	clear_bit_u32(LOG_RECORD_DISCARD, &rec.flags);
+	set_bit_u32(LOG_RECORD_ZERO, &rec.flags);
+	rec.lsid_local = 1;
+	ASSERT(is_valid_log_record(&rec));
+	ASSERT(!log_record_has_data(&rec));
+	ASSERT(log_record_n_pb(&rec, 4096) == 0);
+	rec.sub_offset = 1;
+	ASSERT(!is_valid_log_record(&rec));
+	rec.sub_offset = 0;
+	set_bit_u32(LOG_RECORD_PADDING, &rec.flags);
+	ASSERT(!is_valid_log_record(&rec));
+
+	/* Write same records have only their payload. */
+	clear_bit_u32(LOG_RECORD_PADDING, &rec.flags);
+	clear_bit_u32(LOG_RECORD_ZERO, &rec.flags);
+	set_bit_u32(LOG_RECORD_WRITE_SAME, &rec.flags);
+	rec.io_size = 100;
+	ASSERT(is_valid_log_record(&rec));
+	ASSERT(log_record_data_lb(&rec) == 1);
+	ASSERT(log_record_n_pb(&rec, 512) == 1);
+	ASSERT(log_record_n_pb(&rec, 4096) == 1);
+	rec.sub_offset = 7;
+	ASSERT(is_valid_log_record(&rec));
+	ASSERT(log_record_n_pb(&rec, 4096) == 0);
+	set_bit_u32(LOG_RECORD_ZERO, &rec.flags);
+	ASSERT(!is_valid_log_record(&rec));
+}
+
+void TEST_logpack_header_pb()
+{
+	struct walb_logpack_header lhead;
+
+	ASSERT(max_logpack_header_size(512) == WALB_LOGPACK_HEADER_MAX_SIZE);
+	ASSERT(max_logpack_header_size(4096) == 4096);
+	ASSERT(max_logpack_header_size(8192) == 8192);
+	ASSERT(max_n_logpack_header_pb(512) == 8);
+	ASSERT(max_n_logpack_header_pb(4096) == 1);
+
+	ASSERT(max_n_log_record_in_header(512, 1) == max_n_log_record_in_sector(512));
+	ASSERT(max_n_log_record_in_header(512, 8) == max_n_log_record_in_sector(4096));
+
+	/* Zero means a single block for old logpack headers. */
+	memset(&lhead, 0, sizeof(lhead));
+	lhead.sector_type = SECTOR_TYPE_LOGPACK;
+	lhead.logpack_lsid = 100;
+	lhead.n_records = 1;
+	lhead.total_io_size = 3;
+	ASSERT(get_logpack_header_pb(&lhead) == 1);
+	ASSERT(get_next_lsid_unsafe(&lhead) == 104);
+	lhead.n_header_pb = 4;
+	ASSERT(get_logpack_header_pb(&lhead) == 4);
+	ASSERT(get_next_lsid_unsafe(&lhead) == 107);
+}
+
 int main()
 {
 	TEST_capacity_pb();
+	TEST_log_record_n_pb();
+	TEST_logpack_header_pb();
 
 	return 0;
 }
@@ -22,16 +22,17 @@
  * @pbs physical block size.
  * @n_snapshots number of snapshots to manage.
  */
-void test(int lbs, int pbs, u64 ddev_lb, u64 ldev_lb,
+void test(int lbs, int pbs, u64 ddev_lb, u64 ldev_lb, u16 version,
 	const char *name)
 {
 	struct sector_data *super_sect = sector_alloc(pbs);
 	ASSERT(super_sect);
 	init_super_sector(super_sect,
 			lbs, pbs,
-			ddev_lb, ldev_lb,
+			ddev_lb, ldev_lb, version,
 			name);
 	ASSERT_SUPER_SECTOR(super_sect);
+	ASSERT(get_super_sector(super_sect)->version == version);
 	print_super_sector(super_sect);
 
 	int fd = open(LOG_DEV_FILE, O_RDWR | O_CREAT | O_TRUNC, 00755);
@@ -54,10 +55,11 @@ int main()
 	int ddev_lb = DATA_DEV_SIZE / 512;
 	int ldev_lb = LOG_DEV_SIZE / 512;
 
-	test(512, 512, ddev_lb, ldev_lb, "");
-	test(512, 4096, ddev_lb, ldev_lb, NULL);
-	test(4096, 4096, ddev_lb, ldev_lb, "");
-	test(512, 512, ddev_lb, ldev_lb, "test_name");
+	test(512, 512, ddev_lb, ldev_lb, WALB_LOG_VERSION, "");
+	test(512, 4096, ddev_lb, ldev_lb, WALB_LOG_VERSION, NULL);
+	test(4096, 4096, ddev_lb, ldev_lb, WALB_LOG_VERSION, "");
+	test(512, 512, ddev_lb, ldev_lb, WALB_LOG_VERSION, "test_name");
+	test(512, 4096, ddev_lb, ldev_lb, WALB_LOG_VERSION_PACKED, NULL);
 
 	return 0;
 }
@@ -147,7 +147,7 @@ static inline bool is_valid_wlog_header(const struct walblog_header* wh)
 		LOGx("wlog header sector type is invalid.\n");
 		return false;
 	}
-	if (wh->version != WALB_LOG_VERSION) {
+	if (!is_valid_log_version(wh->version)) {
 		LOGx("wlog header version is invalid.\n");
 		return false;
 	}
@@ -290,6 +290,60 @@ bool sector_array_pwrite_lb(
 	return true;
 }
 
+/**
+ * Write the same data of a logical sector repeatedly at an offset.
+ * Logical block size is 512 bytes.
+ *
+ * @fd file descriptor of the target storage device.
+ * @offset_lb storage offset [logical block].
+ * @n_lb number of sectors to write [logical block].
+ * @payload data of a logical sector.
+ *
+ * RETURN:
+ *   true in success, or false.
+ */
+bool write_same_lb(int fd, u64 offset_lb, unsigned int n_lb, const u8 *payload)
+{
+	const unsigned int buf_lb = 1024 * 1024 / LOGICAL_BLOCK_SIZE;
+	struct sector_data *sect;
+	unsigned int i, w_lb = 0;
+	bool ret = true;
+
+	ASSERT(fd > 0);
+	ASSERT(payload);
+
+	sect = sector_alloc(buf_lb * LOGICAL_BLOCK_SIZE);
+	if (!sect) {
+		LOGe("sector_alloc failed.\n");
+		return false;
+	}
+	for (i = 0; i < buf_lb; i++) {
+		memcpy((u8 *)sect->data + i * LOGICAL_BLOCK_SIZE,
+			payload, LOGICAL_BLOCK_SIZE);
+	}
+	while (w_lb < n_lb) {
+		unsigned int tmp_lb = get_min_value(buf_lb, n_lb - w_lb);
+		if (!pwrite_all(fd, sect->data, tmp_lb * LOGICAL_BLOCK_SIZE,
+				(offset_lb + w_lb) * LOGICAL_BLOCK_SIZE)) {
+			ret = false;
+			break;
+		}
+		w_lb += tmp_lb;
+	}
+	sector_free(sect);
+	return ret;
+}
+
+/**
+ * Write zero data of multiple logical sectors at an offset.
+ */
+bool write_zero_lb(int fd, u64 offset_lb, unsigned int n_lb)
+{
+	static const u8 zero[LOGICAL_BLOCK_SIZE];
+
+	return write_same_lb(fd, offset_lb, n_lb, zero);
+}
+
 /**
  * Read multiple sectors.
  *
@@ -370,6 +424,8 @@ bool sector_array_write(
  * @pbs physical block size.
  * @ddev_lb device size [logical block].
  * @ldev_lb log device size [logical block]
+ * @version log format version.
+ *   WALB_LOG_VERSION or WALB_LOG_VERSION_PACKED.
  * @name name of the walb device, or NULL.
  *
  * RETURN:
@@ -378,7 +434,7 @@ bool sector_array_write(
 bool init_super_sector_raw(
 	struct walb_super_sector* super_sect,
 	unsigned int lbs, unsigned int pbs,
-	u64 ddev_lb, u64 ldev_lb,
+	u64 ddev_lb, u64 ldev_lb, u16 version,
 	const char *name)
 {
 	u32 salt;
@@ -390,6 +446,7 @@ bool init_super_sector_raw(
 	ASSERT(0 < pbs);
 	ASSERT(0 < ddev_lb);
 	ASSERT(0 < ldev_lb);
+	ASSERT(is_valid_log_version(version));
 
 	ASSERT(sizeof(struct walb_super_sector) <= (size_t)pbs);
 
@@ -398,7 +455,7 @@ bool init_super_sector_raw(
 	/* Set sector type. */
 	super_sect->sector_type = SECTOR_TYPE_SUPER;
 	/* Fill parameters. */
-	super_sect->version = WALB_LOG_VERSION;
+	super_sect->version = version;
 	super_sect->logical_bs = lbs;
 	super_sect->physical_bs = pbs;
 	super_sect->metadata_size = 0; /* currently fixed */
@@ -428,14 +485,14 @@ bool init_super_sector_raw(
 bool init_super_sector(
 	struct sector_data *sect,
 	unsigned int lbs, unsigned int pbs,
-	u64 ddev_lb, u64 ldev_lb,
+	u64 ddev_lb, u64 ldev_lb, u16 version,
 	const char *name)
 {
 	ASSERT_SECTOR_DATA(sect);
 	ASSERT(pbs == sect->size);
 
 	return init_super_sector_raw(
-		sect->data, lbs, pbs, ddev_lb, ldev_lb, name);
+		sect->data, lbs, pbs, ddev_lb, ldev_lb, version, name);
 }
 
 /**
@@ -44,6 +44,8 @@ bool sector_array_pwrite_lb(
 	int fd, u64 offset_lb,
 	const struct sector_data_array *sect_ary,
 	unsigned int idx_lb, unsigned int n_lb);
+bool write_same_lb(int fd, u64 offset_lb, unsigned int n_lb, const u8 *payload);
+bool write_zero_lb(int fd, u64 offset_lb, unsigned int n_lb);
 bool sector_array_read(
 	int fd,
 	struct sector_data_array *sect_ary,
@@ -57,7 +59,7 @@ bool sector_array_write(
 bool init_super_sector_raw(
 	struct walb_super_sector* super_sect,
 	unsigned int pbs, unsigned int lbs,
-	u64 ddev_lb, u64 ldev_lb,
+	u64 ddev_lb, u64 ldev_lb, u16 version,
 	const char *name);
 void print_super_sector_raw(const struct walb_super_sector* super_sect);
 bool write_super_sector_raw(
@@ -67,7 +69,7 @@ bool write_super_sector_raw(
 bool init_super_sector(
 	struct sector_data *sect,
 	unsigned int pbs, unsigned int lbs,
-	u64 ddev_lb, u64 ldev_lb,
+	u64 ddev_lb, u64 ldev_lb, u16 version,
 	const char *name);
 void print_super_sector(const struct sector_data *sect);
 bool read_super_sector(int fd, struct sector_data *sect);
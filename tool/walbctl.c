@@ -61,6 +61,9 @@ struct config
 	/* Discard flags. */
 	bool nodiscard;
 
+	/* Format the log device with WALB_LOG_VERSION_PACKED. */
+	bool is_packed;
+
 	char *wdev_name; /* walb device */
 	char *wldev_name;  /* walblog device */
 	u64 lsid; /* lsid */
@@ -98,6 +101,7 @@ struct map_str_to_fn
 static const char *helpstr_options_ =
 	"OPTIONS:\n"
 	"  DISCARD: --nodiscard\n"
+	"  PACK:   --pack (pack small log records inside physical blocks)\n"
 	"  SIZE:   --size [size of stuff]\n"
 	"  LRANGE: --lsid0 [from lsid] --lsid1 [to lsid]\n"
 	"  (NYI)TRANGE: --time0 [from time] --time1 [to time]\n"
@@ -130,7 +134,7 @@ struct cmdhelp
  * Help string.
  */
 static struct cmdhelp cmdhelps_[] = {
-	{ "format_ldev LDEV DDEV (NAME) (DISCARD)",
+	{ "format_ldev LDEV DDEV (NAME) (DISCARD) (PACK)",
 	  "Format log device." },
 	{ "create_wdev LDEV DDEV (NAME)"
 	  " (MAX_LOGPACK_KB) (MAX_PENDING_MB) (MIN_PENDING_MB)\n"
@@ -200,6 +204,7 @@ enum
 	OPT_LDEV = 1,
 	OPT_DDEV,
 	OPT_NODISCARD,
+	OPT_PACK,
 	OPT_WDEV,
 	OPT_WLDEV,
 	OPT_LSID,
@@ -231,7 +236,7 @@ static void init_config(struct config* cfg);
 static int parse_opt(int argc, char* const argv[], struct config *cfg);
 static bool init_walb_metadata(
 	int fd, unsigned int lbs, unsigned int pbs,
-	u64 ddev_lb, u64 ldev_lb, const char *name);
+	u64 ddev_lb, u64 ldev_lb, u16 version, const char *name);
 static bool invoke_ioctl(
 	const char *wdev_name, struct walb_ctl *ctl, int open_flag);
 static bool ioctl_and_print_bool(const char *wdev_name, int cmd);
@@ -382,6 +387,7 @@ static void init_config(struct config* cfg)
 	memset(cfg, 0, sizeof(struct config));
 
 	cfg->nodiscard = false;
+	cfg->is_packed = false;
 
 	cfg->lsid = (u64)(-1);
 	cfg->lsid0 = (u64)(-1);
@@ -410,6 +416,7 @@ static int parse_opt(int argc, char* const argv[], struct config *cfg)
 			{"ldev", 1, 0, OPT_LDEV}, /* log device */
 			{"ddev", 1, 0, OPT_DDEV}, /* data device */
 			{"nodiscard", 0, 0, OPT_NODISCARD},
+			{"pack", 0, 0, OPT_PACK},
 			{"wdev", 1, 0, OPT_WDEV}, /* walb device */
 			{"wldev", 1, 0, OPT_WLDEV}, /* walb log device */
 			{"lsid", 1, 0, OPT_LSID}, /* lsid */
@@ -445,6 +452,9 @@ static int parse_opt(int argc, char* const argv[], struct config *cfg)
 		case OPT_NODISCARD:
 			cfg->nodiscard = true;
 			break;
+		case OPT_PACK:
+			cfg->is_packed = true;
+			break;
 		case OPT_WDEV:
 			cfg->wdev_name = optarg;
 			break;
@@ -535,6 +545,7 @@ static int parse_opt(int argc, char* const argv[], struct config *cfg)
  * @pbs physical block size.
  * @ddev_lb device size [logical block].
  * @ldev_lb log device size [logical block]
+ * @version log format version.
  * @name name of the walb device, or NULL.
  *
  * RETURN:
@@ -542,7 +553,7 @@ static int parse_opt(int argc, char* const argv[], struct config *cfg)
  */
 static bool init_walb_metadata(
 	int fd, unsigned int lbs, unsigned int pbs,
-	u64 ddev_lb, u64 ldev_lb, const char *name)
+	u64 ddev_lb, u64 ldev_lb, u16 version, const char *name)
 {
 	struct sector_data *super_sect;
 
@@ -563,7 +574,7 @@ static bool init_walb_metadata(
 	/* Initialize super sector. */
 	if (!init_super_sector(
 			super_sect, lbs, pbs,
-			ddev_lb, ldev_lb, name)) {
+			ddev_lb, ldev_lb, version, name)) {
 		LOGe("init super sector faield.\n");
 		goto error1;
 	}
@@ -830,6 +841,7 @@ static bool do_format_ldev(const struct config *cfg)
 		fd, lbs, pbs,
 		ddev_info.size / lbs,
 		ldev_info.size / lbs,
+		cfg->is_packed ? WALB_LOG_VERSION_PACKED : WALB_LOG_VERSION,
 		cfg->name);
 	if (!retb) {
 		LOGe("initialize walb log device failed.\n");
@@ -1114,7 +1126,7 @@ static bool do_cat_wldev(const struct config *cfg)
 	wh->header_size = WALBLOG_HEADER_SIZE;
 	wh->sector_type = SECTOR_TYPE_WALBLOG_HEADER;
 	wh->checksum = 0;
-	wh->version = WALB_LOG_VERSION;
+	wh->version = super->version;
 	wh->log_checksum_salt = salt;
 	wh->logical_bs = wldev_info.lbs;
 	wh->physical_bs = pbs;
@@ -1161,7 +1173,7 @@ static bool do_cat_wldev(const struct config *cfg)
 		}
 
 		/* Write logpack header and data. */
-		retb = write_data(1, (u8 *)logh, pbs);
+		retb = write_logpack_header(1, pbs, logh);
 		if (!retb) {
 			LOGe("write logpack header failed.\n");
 			goto error3;
@@ -1175,7 +1187,7 @@ static bool do_cat_wldev(const struct config *cfg)
 		}
 
 		if (should_break) { break; }
-		lsid += logh->total_io_size + 1;
+		lsid += get_logpack_header_pb(logh) + logh->total_io_size;
 	}
 
 	/* Write termination block. */
@@ -1393,7 +1405,7 @@ static bool do_redo(const struct config *cfg)
 		}
 
 		if (should_break) { break; }
-		lsid += logh->total_io_size + 1;
+		lsid += get_logpack_header_pb(logh) + logh->total_io_size;
 	}
 
 	/* Set new written_lsid and sync down. */
@@ -1490,7 +1502,7 @@ static bool do_show_wlog(const struct config *cfg)
 			goto error2;
 		}
 
-		lsid += 1 + logh->total_io_size;
+		lsid += get_logpack_header_pb(logh) + logh->total_io_size;
 		total_padding_size += get_padding_size_in_logpack_header(logh, pbs);
 		n_packs++;
 	}
@@ -1573,7 +1585,8 @@ static bool do_show_wldev(const struct config *cfg)
 		if (!retb) { break; }
 		print_logpack_header(pack->header);
 
-		lsid += pack->header->total_io_size + 1;
+		lsid += get_logpack_header_pb(pack->header)
+			+ pack->header->total_io_size;
 		total_padding_size +=
 			get_padding_size_in_logpack_header(pack->header, pbs);
 		n_packs++;